@@ -0,0 +1,258 @@
+/**
+ * @file bench-hashring.c
+ * @author Fruerlund
+ * @brief Compares the placements of the hash ring: lookup time, memory, how evenly keys spread over the stores and how many
+ * keys move when a store joins or leaves.
+ * @version 0.1
+ * @date 2024-08-17
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ * 
+ * 
+*/
+
+#include "hashring.h"
+#include <time.h>
+#include <math.h>
+
+/*
+[**************************************************************************************************************************************************]
+                                                            GLOBAL VARIABLES AND DEFINES
+[**************************************************************************************************************************************************]
+*/
+
+#define BENCH_KEYS          1000000
+#define BENCH_ROUNDS        5                   /* Lookup passes over every key */
+#define BENCH_SERVERS       50
+#define BENCH_MAXSERVERS    4096
+
+
+/**
+ * @brief Describes a placement under test.
+ */
+typedef struct bench_placement_t {
+
+    const char *name;
+    uint8_t placement;                      /*      HASHRING_PLACEMENT_*                            */
+    uint32_t virtualnodes;
+
+} bench_placement_t;
+
+
+/* Descriptor stdout is saved to while the ring's own messages go to /dev/null */
+int bench_stdout = -1;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ * 
+ * @return uint64_t 
+ */
+uint64_t bench_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Silences stdout while servers are added and removed, the ring prints every change.
+ * 
+ * @param quiet 
+ */
+void bench_quiet(bool quiet) {
+
+    fflush(stdout);
+    if(quiet) {
+        bench_stdout = dup(STDOUT_FILENO);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    else {
+        dup2(bench_stdout, STDOUT_FILENO);
+        close(bench_stdout);
+    }
+}
+
+
+/**
+ * @brief Records the owner of every key.
+ * 
+ * @param r 
+ * @param hashes 
+ * @param owners 
+ */
+void bench_owners(hashring_t *r, uint64_t *hashes, ring_element_t **owners) {
+
+    for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+        owners[i] = hashring_owner(r, hashes[i]);
+    }
+}
+
+
+/**
+ * @brief Counts the keys whose owner changed.
+ * 
+ * @param r 
+ * @param hashes 
+ * @param owners 
+ * @return uint32_t 
+ */
+uint32_t bench_moved(hashring_t *r, uint64_t *hashes, ring_element_t **owners) {
+
+    uint32_t moved = 0;
+    for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+        moved += (hashring_owner(r, hashes[i]) != owners[i]);
+    }
+    return moved;
+}
+
+
+/**
+ * @brief Runs every measurement on one placement and prints its row.
+ * 
+ * @param p 
+ * @param servers 
+ * @param hashes 
+ * @param owners 
+ */
+void bench_run(bench_placement_t *p, uint32_t servers, uint64_t *hashes, ring_element_t **owners) {
+
+    char ip[32];
+    hashring_t *r = hashring_create_type(hash_wyhash, p->placement);
+
+    /* Every store joins one by one, then the same stores join a second ring in a single batch */
+    bench_quiet(true);
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < servers; i++) {
+        snprintf(ip, sizeof(ip), "10.0.%u.%u", i / 256, i % 256);
+        hashring_addserver(r, ip, 7000, p->virtualnodes);
+    }
+    uint64_t buildtime = bench_now() - start;
+    hashring_destroy(r);
+
+    r = hashring_create_type(hash_wyhash, p->placement);
+    start = bench_now();
+    hashring_begin(r);
+    for(uint32_t i = 0; i < servers; i++) {
+        snprintf(ip, sizeof(ip), "10.0.%u.%u", i / 256, i % 256);
+        hashring_addserver(r, ip, 7000, p->virtualnodes);
+    }
+    hashring_commit(r);
+    uint64_t batchtime = bench_now() - start;
+    bench_quiet(false);
+
+    /* Lookups */
+    uintptr_t sink = 0;
+    start = bench_now();
+    for(uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+            sink += (uintptr_t)hashring_owner(r, hashes[i]);
+        }
+    }
+    double ns = (double)(bench_now() - start) / ((double)BENCH_ROUNDS * BENCH_KEYS);
+
+    /* Spread of the keys, as the largest and smallest store relative to the mean and the standard deviation */
+    bench_owners(r, hashes, owners);
+    uint32_t counts[BENCH_MAXSERVERS] = { 0 };
+    for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+        for(uint32_t j = 0; j < r->numberofservers; j++) {
+            if(r->servers[j] == owners[i]) {
+                counts[j]++;
+                break;
+            }
+        }
+    }
+    double mean = (double)BENCH_KEYS / servers;
+    double variance = 0;
+    uint32_t most = 0;
+    uint32_t least = UINT32_MAX;
+    for(uint32_t j = 0; j < servers; j++) {
+        most = (counts[j] > most) ? counts[j] : most;
+        least = (counts[j] < least) ? counts[j] : least;
+        variance += ((double)counts[j] - mean) * ((double)counts[j] - mean);
+    }
+    double deviation = sqrt(variance / servers) / mean * 100.0;
+    size_t memory = hashring_memory(r);
+
+    /* A store joins, ideally 1/(n + 1) of the keys move, all of them to it */
+    bench_quiet(true);
+    hashring_addserver(r, "10.1.0.0", 7000, p->virtualnodes);
+    bench_quiet(false);
+    uint32_t added = bench_moved(r, hashes, owners);
+
+    /* A store from the middle leaves, ideally only its own keys move */
+    bench_owners(r, hashes, owners);
+    snprintf(ip, sizeof(ip), "10.0.%u.%u", (servers / 2) / 256, (servers / 2) % 256);
+    bench_quiet(true);
+    start = bench_now();
+    hashring_removeserver(r, ip, 7000);
+    uint64_t changetime = bench_now() - start;
+    bench_quiet(false);
+    uint32_t removed = bench_moved(r, hashes, owners);
+
+    printf("%-18s %9.1f %10.1f %8.3f %8.3f %7.2f%% %8.2f%% %8.2f%% %9.2f %9.2f %9.2f%s\n",
+    p->name, ns, memory / 1024.0, most / mean, least / mean, deviation,
+    added * 100.0 / BENCH_KEYS, removed * 100.0 / BENCH_KEYS,
+    buildtime / 1e6, batchtime / 1e6, changetime / 1e6, (sink == 1) ? "!" : "");
+
+    bench_quiet(true);
+    hashring_destroy(r);
+    bench_quiet(false);
+}
+
+
+int main(int argc, char **argv) {
+
+    uint32_t servers = (argc > 1) ? atoi(argv[1]) : BENCH_SERVERS;
+    if(servers < 2 || servers >= BENCH_MAXSERVERS) {
+        servers = BENCH_SERVERS;
+    }
+
+    uint64_t *hashes = malloc(sizeof(uint64_t) * BENCH_KEYS);
+    ring_element_t **owners = malloc(sizeof(ring_element_t *) * BENCH_KEYS);
+    if(hashes == NULL || owners == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    char key[64];
+    for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+        int len = snprintf(key, sizeof(key), "user:%u:cart", i);
+        hashes[i] = hash_wyhash(key, len, 0);
+    }
+
+    bench_placement_t placements[] = {
+        { "ring (10 vnodes)", HASHRING_PLACEMENT_RING, 10 },
+        { "ring (100 vnodes)", HASHRING_PLACEMENT_RING, 100 },
+        { "ring (1000 vnodes)", HASHRING_PLACEMENT_RING, 1000 },
+        { "jump", HASHRING_PLACEMENT_JUMP, 0 },
+        { "maglev", HASHRING_PLACEMENT_MAGLEV, 0 },
+        { "rendezvous", HASHRING_PLACEMENT_RENDEZVOUS, 0 },
+        { "multiprobe", HASHRING_PLACEMENT_MULTIPROBE, 0 },
+    };
+
+    printf("[+]: %u stores, %u keys. Ideal movement: %.2f%% when one joins, %.2f%% when one leaves\n",
+    servers, BENCH_KEYS, 100.0 / (servers + 1), 100.0 / (servers + 1));
+    printf("%-18s %9s %10s %8s %8s %8s %9s %9s %9s %9s %9s\n",
+    "placement", "ns/lookup", "memory(KB)", "max/avg", "min/avg", "stddev", "moved+1", "moved-1", "join(ms)", "batch(ms)",
+    "leave(ms)");
+
+    for(uint32_t i = 0; i < sizeof(placements) / sizeof(placements[0]); i++) {
+        bench_run(&placements[i], servers, hashes, owners);
+    }
+
+    free(hashes);
+    free(owners);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,776 @@
+/**
+ * @file bench-hashtable.c
+ * @author Fruerlund
+ * @brief Microbenchmark suite of hashtable.h. Compares the backends (chained and swiss) on insert, lookup hit, lookup miss and
+ * remove across table sizes, key length distributions, hash functions and load factors, reporting throughput, latency
+ * percentiles, allocations per operation and bytes per key, and the entry allocators under churn. Results can be saved as CSV
+ * and compared against a saved baseline.
+ * @version 0.1
+ * @date 2024-08-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ *
+ *
+*/
+
+#include "common-defines.h"
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+/* Every allocation the table makes is counted, hashtable.h is header only so its calls are redirected here */
+uint64_t bench_allocs = 0;
+
+void *bench_malloc(size_t size) { bench_allocs++; return malloc(size); }
+void *bench_calloc(size_t n, size_t size) { bench_allocs++; return calloc(n, size); }
+void *bench_realloc(void *ptr, size_t size) { bench_allocs++; return realloc(ptr, size); }
+int bench_posix_memalign(void **ptr, size_t align, size_t size) { bench_allocs++; return posix_memalign(ptr, align, size); }
+
+#define malloc(size)                    bench_malloc(size)
+#define calloc(n, size)                 bench_calloc(n, size)
+#define realloc(ptr, size)              bench_realloc(ptr, size)
+#define posix_memalign(ptr, a, size)    bench_posix_memalign(ptr, a, size)
+
+#include "hashtable.h"
+
+/*
+[**************************************************************************************************************************************************]
+                                                            GLOBAL VARIABLES AND DEFINES
+[**************************************************************************************************************************************************]
+*/
+
+#define BENCH_CHURNKEYS     200000
+#define BENCH_CHURNOPS      4000000
+#define BENCH_CHURNKEYSIZE  32
+
+#define BENCH_KEYS_FIXED    0x0         /* Every key is BENCH_KEYLEN_FIXED bytes                                    */
+#define BENCH_KEYS_UNIFORM  0x1         /* Key lengths uniform between BENCH_KEYLEN_MIN and BENCH_KEYLEN_UNIFORMMAX */
+#define BENCH_KEYS_ZIPF     0x2         /* Key lengths zipfian between BENCH_KEYLEN_MIN and BENCH_KEYLEN_ZIPFMAX, short keys most common */
+
+#define BENCH_KEYLEN_FIXED      16
+#define BENCH_KEYLEN_MIN        8
+#define BENCH_KEYLEN_UNIFORMMAX 64
+#define BENCH_KEYLEN_ZIPFMAX    256
+
+#define BENCH_LOADFACTOR_SLOTS  131072  /* Capacity of the presized tables of the load factor runs                  */
+#define BENCH_HASHRUN_KEYS      100000  /* Keys of the hash function runs                                           */
+
+#define BENCH_MAXROWS       512
+#define BENCH_ROWKEY        96
+
+/* File descriptor of the hardware cache miss counter, -1 if the kernel doesn't expose one */
+int perf_fd = -1;
+
+/* Nanoseconds clock_gettime itself takes, subtracted from every latency sample */
+uint64_t timer_overhead = 0;
+
+
+/**
+ * @brief Describes a set of benchmark keys, back to back in one buffer.
+ */
+typedef struct bench_keys_t {
+
+    char *buffer;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    uint32_t n;
+    uint64_t bytes;                         /*      Sum of the key lengths                          */
+
+} bench_keys_t;
+
+
+/**
+ * @brief Describes a hash function under test.
+ */
+typedef struct bench_hash_t {
+
+    char *name;
+    hashtable_hashmethod method;
+
+} bench_hash_t;
+
+
+/**
+ * @brief Describes a single result, a row of the report and of the CSV file.
+ */
+typedef struct bench_row_t {
+
+    char key[BENCH_ROWKEY];                 /*      section,backend,keys,hash,n,op: identifies the row across runs */
+    double nsop;
+    double p50;
+    double p99;
+    double p999;
+    double allocs;
+    double bytes;
+    double misses;                          /*      -1 if not available                             */
+
+} bench_row_t;
+
+
+/* Rows of this run, and of the baseline being compared against */
+bench_row_t rows[BENCH_MAXROWS];
+uint32_t nrows = 0;
+bench_row_t baseline[BENCH_MAXROWS];
+uint32_t nbaseline = 0;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ *
+ * @return uint64_t
+ */
+uint64_t bench_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Measures the cost of a timestamp, the smallest difference between two back to back calls.
+ *
+ */
+void bench_timeropen(void) {
+
+    uint64_t best = UINT64_MAX;
+    for(uint32_t i = 0; i < 100000; i++) {
+        uint64_t start = bench_now();
+        uint64_t ns = bench_now() - start;
+        if(ns < best) {
+            best = ns;
+        }
+    }
+    timer_overhead = best;
+}
+
+
+/**
+ * @brief Opens a counter for last level cache misses of this process.
+ *
+ */
+void bench_perfopen(void) {
+
+    struct perf_event_attr attr;
+    memset(&attr, '\x00', sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+void bench_perfstart(void) {
+
+    if(perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+int64_t bench_perfstop(void) {
+
+    uint64_t misses = 0;
+    if(perf_fd < 0) {
+        return -1;
+    }
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        return -1;
+    }
+    return misses;
+}
+
+
+/**
+ * @brief FNV-1a, a byte at a time hash to compare hashtable_hash against.
+ *
+ * @param key
+ * @param len
+ * @param seed
+ * @return uint64_t
+ */
+uint64_t bench_hash_fnv1a(const void *key, size_t len, uint64_t seed) {
+
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief Jenkins one at a time, the 32 bit hash the hash ring uses, without its debug output.
+ *
+ * @param key
+ * @param len
+ * @param seed
+ * @return uint64_t
+ */
+uint64_t bench_hash_oaat(const void *key, size_t len, uint64_t seed) {
+
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 1 ^ (uint32_t)seed;
+    for(size_t i = 0; i < len; i++) {
+        hash += p[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+
+/**
+ * @brief Generates n distinct keys. Every key starts with a tag and its number and is padded to a length drawn from the
+ * distribution.
+ *
+ * @param keys
+ * @param n
+ * @param dist BENCH_KEYS_*
+ * @param tag tells hit and miss keys apart
+ * @param seed
+ */
+void bench_keys_create(bench_keys_t *keys, uint32_t n, uint8_t dist, char tag, uint64_t seed) {
+
+    uint32_t maxlen = (dist == BENCH_KEYS_ZIPF) ? BENCH_KEYLEN_ZIPFMAX : BENCH_KEYLEN_UNIFORMMAX;
+    uint32_t nlengths = maxlen - BENCH_KEYLEN_MIN + 1;
+    double cdf[BENCH_KEYLEN_ZIPFMAX];
+
+    /* Zipf with exponent 1: the i-th shortest length is i times less likely than the shortest */
+    double sum = 0;
+    for(uint32_t i = 0; i < nlengths; i++) {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+
+    keys->n = n;
+    keys->bytes = 0;
+    keys->offsets = malloc(n * sizeof(uint32_t));
+    keys->lengths = malloc(n * sizeof(uint32_t));
+    keys->buffer = malloc((size_t)n * (maxlen + 1));
+    if(keys->offsets == NULL || keys->lengths == NULL || keys->buffer == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t offset = 0;
+    for(uint32_t i = 0; i < n; i++) {
+
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+
+        uint32_t len = BENCH_KEYLEN_FIXED;
+        if(dist == BENCH_KEYS_UNIFORM) {
+            len = BENCH_KEYLEN_MIN + (seed % nlengths);
+        }
+        else if(dist == BENCH_KEYS_ZIPF) {
+            double u = ((seed >> 11) * (1.0 / 9007199254740992.0)) * sum;
+            uint32_t lo = 0, hi = nlengths - 1;
+            while(lo < hi) {
+                uint32_t mid = (lo + hi) / 2;
+                if(cdf[mid] < u) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            len = BENCH_KEYLEN_MIN + lo;
+        }
+
+        char *key = &keys->buffer[offset];
+        uint32_t written = snprintf(key, maxlen + 1, "%c%u:", tag, i);
+        if(written < len) {
+            memset(key + written, 'x', len - written);
+            written = len;
+        }
+        key[written] = '\x00';
+
+        keys->offsets[i] = offset;
+        keys->lengths[i] = written;
+        keys->bytes += written;
+        offset += written + 1;
+    }
+}
+
+
+void bench_keys_destroy(bench_keys_t *keys) {
+
+    free(keys->buffer);
+    free(keys->offsets);
+    free(keys->lengths);
+}
+
+
+int bench_cmpu32(const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Looks a row up in the baseline.
+ *
+ * @param key
+ * @return bench_row_t* NULL if the baseline doesn't have it
+ */
+bench_row_t *bench_baseline(char *key) {
+
+    for(uint32_t i = 0; i < nbaseline; i++) {
+        if(strcmp(baseline[i].key, key) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Prints the header of the report.
+ *
+ */
+void bench_header(void) {
+
+    printf("%-48s %9s %8s %8s %8s %9s %9s %10s", "section,backend,keys,hash,n,op", "ns/op", "p50", "p99", "p99.9", "allocs/op",
+    "bytes/key", "llc-miss/op");
+    if(nbaseline > 0) {
+        printf(" %9s", "vs base");
+    }
+    printf("\n");
+}
+
+
+/**
+ * @brief Records a result and prints it, along with the change of ns/op against the baseline if one was loaded.
+ *
+ * @param row
+ */
+void bench_report(bench_row_t *row) {
+
+    printf("%-48s %9.1f %8.0f %8.0f %8.0f %9.3f %9.1f ", row->key, row->nsop, row->p50, row->p99, row->p999, row->allocs, row->bytes);
+    if(row->misses >= 0) {
+        printf("%10.2f", row->misses);
+    }
+    else {
+        printf("%10s", "n/a");
+    }
+
+    bench_row_t *base = bench_baseline(row->key);
+    if(base != NULL && base->nsop > 0) {
+        printf(" %+8.1f%%", (row->nsop - base->nsop) * 100.0 / base->nsop);
+    }
+    printf("\n");
+
+    if(nrows < BENCH_MAXROWS) {
+        rows[nrows++] = *row;
+    }
+}
+
+
+/**
+ * @brief Fills in the latency percentiles of a row from per operation samples.
+ *
+ * @param row
+ * @param samples
+ * @param n
+ */
+void bench_percentiles(bench_row_t *row, uint32_t *samples, uint32_t n) {
+
+    qsort(samples, n, sizeof(uint32_t), bench_cmpu32);
+    row->p50 = samples[(uint64_t)n * 50 / 100];
+    row->p99 = samples[(uint64_t)n * 99 / 100];
+    row->p999 = samples[(uint64_t)n * 999 / 1000];
+}
+
+
+/**
+ * @brief Runs a single operation on key i of a key set.
+ *
+ * @param table
+ * @param keys
+ * @param i
+ * @param op 0 insert, 1 lookup, 2 remove
+ * @return bool whether it succeeded
+ */
+static inline bool bench_op(hashtable_t *table, bench_keys_t *keys, uint32_t i, uint8_t op) {
+
+    char *key = &keys->buffer[keys->offsets[i]];
+    uint32_t keylen = keys->lengths[i];
+
+    switch(op) {
+        case 0:
+            return hashtable_insert(table, key, keylen, "value", 5);
+        case 1:
+            return hashtable_lookup(table, key, keylen) != NULL;
+        default:
+            return hashtable_remove(table, key, keylen);
+    }
+}
+
+
+/**
+ * @brief Runs insert, lookup hit, lookup miss and remove of n keys on a fresh table. The whole pass is timed for ns/op and every
+ * operation is timed on its own in a second pass for the latency percentiles, so the timer doesn't weigh on the throughput.
+ *
+ * @param section
+ * @param type
+ * @param hash
+ * @param keyname
+ * @param keys
+ * @param misskeys
+ * @param n
+ * @param size initial size of the table, keeps a presized table at a given load factor
+ */
+void bench_run(char *section, uint8_t type, bench_hash_t *hash, char *keyname, bench_keys_t *keys, bench_keys_t *misskeys, uint32_t n,
+    uint32_t size) {
+
+    char *backend = (type == HASHTABLE_TYPE_SWISS) ? "swiss" : "chained";
+    char *ops[] = { "insert", "lookup-hit", "lookup-miss", "remove" };
+    uint32_t *samples = malloc(n * sizeof(uint32_t));
+    bench_row_t results[4];
+    uint64_t bytes = 0;
+    volatile uint64_t found = 0;
+
+    if(samples == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memset(results, '\x00', sizeof(results));
+
+    for(uint32_t pass = 0; pass < 2; pass++) {
+
+        hashtable_t *table = hashtable_create_type(size, hash->method, type);
+
+        for(uint32_t o = 0; o < 4; o++) {
+
+            /* Lookups visit the keys in a different order than they were inserted */
+            bench_keys_t *set = (o == 2) ? misskeys : keys;
+            uint8_t op = (o == 0) ? 0 : ((o == 3) ? 2 : 1);
+            uint64_t allocs = bench_allocs;
+
+            if(pass == 0) {
+                bench_perfstart();
+                uint64_t start = bench_now();
+                for(uint32_t i = 0; i < n; i++) {
+                    uint32_t x = (op == 1) ? (uint32_t)(((uint64_t)i * 2654435761u) % n) : i;
+                    found += bench_op(table, set, x, op);
+                }
+                uint64_t ns = bench_now() - start;
+                int64_t misses = bench_perfstop();
+
+                results[o].nsop = (double)ns / n;
+                results[o].allocs = (double)(bench_allocs - allocs) / n;
+                results[o].misses = (misses < 0) ? -1 : (double)misses / n;
+                if(o == 0) {
+                    bytes = hashtable_memory(table);
+                }
+            }
+            else {
+                for(uint32_t i = 0; i < n; i++) {
+                    uint32_t x = (op == 1) ? (uint32_t)(((uint64_t)i * 2654435761u) % n) : i;
+                    uint64_t start = bench_now();
+                    found += bench_op(table, set, x, op);
+                    uint64_t ns = bench_now() - start;
+                    samples[i] = (ns > timer_overhead) ? ns - timer_overhead : 0;
+                }
+                bench_percentiles(&results[o], samples, n);
+            }
+        }
+
+        hashtable_delete(table);
+    }
+
+    for(uint32_t o = 0; o < 4; o++) {
+        snprintf(results[o].key, BENCH_ROWKEY, "%s,%s,%s,%s,%u,%s", section, backend, keyname, hash->name, n, ops[o]);
+        results[o].bytes = (double)bytes / n;
+        bench_report(&results[o]);
+    }
+
+    free(samples);
+}
+
+
+/**
+ * @brief Returns the resident set size of this process in kilobytes.
+ *
+ * @return uint64_t
+ */
+uint64_t bench_rss(void) {
+
+    unsigned long pages = 0, resident = 0;
+    FILE *fd = fopen("/proc/self/statm", "r");
+    if(fd == NULL) {
+        return 0;
+    }
+    if(fscanf(fd, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fd);
+    return (resident * sysconf(_SC_PAGESIZE)) / 1024;
+}
+
+
+/**
+ * @brief Churns a table with removes and inserts of random value sizes, reporting ns/op and how the resident set size moves.
+ *
+ * @param useslab
+ * @param keys
+ */
+void bench_churn(bool useslab, char *keys) {
+
+    char value[256];
+    memset(value, 'v', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\x00';
+
+    hashtable_t *table = hashtable_create_type(16, hashtable_hash, HASHTABLE_TYPE_CHAINED);
+    if(useslab) {
+        hashtable_enableslab(table);
+    }
+
+    uint64_t seed = 88172645463325252ull;
+    for(uint32_t i = 0; i < BENCH_CHURNKEYS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        uint32_t valuelen = seed % 200;
+        hashtable_insert(table, &keys[i * BENCH_CHURNKEYSIZE], strlen(&keys[i * BENCH_CHURNKEYSIZE]), &value[sizeof(value) - 1 - valuelen], valuelen);
+    }
+
+    uint64_t rssbefore = bench_rss();
+    uint64_t allocs = bench_allocs;
+    uint64_t start = bench_now();
+
+    /* Replace a random key with a value of a random size */
+    for(uint32_t i = 0; i < BENCH_CHURNOPS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        char *key = &keys[(seed % BENCH_CHURNKEYS) * BENCH_CHURNKEYSIZE];
+        uint32_t keylen = strlen(key);
+        uint32_t valuelen = (seed >> 32) % 200;
+        hashtable_remove(table, key, keylen);
+        hashtable_insert(table, key, keylen, &value[sizeof(value) - 1 - valuelen], valuelen);
+    }
+
+    uint64_t ns = bench_now() - start;
+    printf("%-8s %-12s %10u %10.1f %10.3f   rss %lu KB -> %lu KB\n", useslab ? "slab" : "malloc", "churn", BENCH_CHURNOPS, (double)ns / BENCH_CHURNOPS,
+    (double)(bench_allocs - allocs) / BENCH_CHURNOPS, rssbefore, bench_rss());
+
+    if(useslab) {
+        hashtable_slab_stats(table->slab, stdout);
+    }
+
+    hashtable_delete(table);
+}
+
+
+/**
+ * @brief Writes the results of this run as CSV.
+ *
+ * @param path
+ * @return true
+ * @return false
+ */
+bool bench_save(char *path) {
+
+    FILE *fd = fopen(path, "w");
+    if(fd == NULL) {
+        return false;
+    }
+    fprintf(fd, "section,backend,keys,hash,n,op,nsop,p50,p99,p999,allocs,bytes,misses\n");
+    for(uint32_t i = 0; i < nrows; i++) {
+        fprintf(fd, "%s,%.2f,%.0f,%.0f,%.0f,%.4f,%.2f,%.3f\n", rows[i].key, rows[i].nsop, rows[i].p50, rows[i].p99, rows[i].p999,
+        rows[i].allocs, rows[i].bytes, rows[i].misses);
+    }
+    fclose(fd);
+    return true;
+}
+
+
+/**
+ * @brief Loads a CSV file written by bench_save as the baseline.
+ *
+ * @param path
+ * @return true
+ * @return false
+ */
+bool bench_load(char *path) {
+
+    char line[512];
+    FILE *fd = fopen(path, "r");
+    if(fd == NULL) {
+        return false;
+    }
+
+    /* Skip the header */
+    if(fgets(line, sizeof(line), fd) == NULL) {
+        fclose(fd);
+        return false;
+    }
+
+    while(nbaseline < BENCH_MAXROWS && fgets(line, sizeof(line), fd) != NULL) {
+
+        /* The key is the first six fields */
+        char *p = line;
+        for(uint32_t i = 0; i < 6 && p != NULL; i++) {
+            p = strchr(p, ',');
+            p = (p != NULL) ? p + 1 : NULL;
+        }
+        if(p == NULL || p - line - 1 >= BENCH_ROWKEY) {
+            continue;
+        }
+
+        bench_row_t *row = &baseline[nbaseline];
+        memcpy(row->key, line, p - line - 1);
+        row->key[p - line - 1] = '\x00';
+        if(sscanf(p, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &row->nsop, &row->p50, &row->p99, &row->p999, &row->allocs, &row->bytes, &row->misses) == 7) {
+            nbaseline++;
+        }
+    }
+
+    fclose(fd);
+    return true;
+}
+
+
+void bench_usage(char *name) {
+
+    printf("Usage: %s [-o results.csv] [-c baseline.csv] [-q]\n", name);
+    printf("  -o  Save the results as CSV.\n");
+    printf("  -c  Compare ns/op against results saved earlier with -o.\n");
+    printf("  -q  Quick run, smaller tables only.\n");
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            MAIN
+[**************************************************************************************************************************************************]
+*/
+
+int main(int argc, char **argv) {
+
+    char *output = NULL;
+    bool quick = false;
+    int opt = 0;
+
+    while((opt = getopt(argc, argv, "o:c:qh")) != -1) {
+        switch(opt) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'c':
+                if(bench_load(optarg) == false) {
+                    printf("[!]: Failed to load baseline %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                quick = true;
+                break;
+            default:
+                bench_usage(argv[0]);
+        }
+    }
+
+    uint32_t sizes[] = { 10000, 100000, 1000000 };
+    uint32_t nsizes = quick ? 2 : sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t max = sizes[nsizes - 1];
+
+    uint8_t types[] = { HASHTABLE_TYPE_CHAINED, HASHTABLE_TYPE_SWISS };
+    char *distnames[] = { "fixed", "uniform", "zipf" };
+    bench_hash_t hashes[] = {
+        { "wyhash", hashtable_hash },
+        { "fnv1a", bench_hash_fnv1a },
+        { "oaat", bench_hash_oaat }
+    };
+
+    bench_perfopen();
+    if(perf_fd < 0) {
+        printf("[!]: Hardware cache miss counter not available, misses/op reported as n/a\n");
+    }
+    bench_timeropen();
+    printf("[+]: Timer overhead %lu ns, subtracted from the latency percentiles\n", timer_overhead);
+    if(nbaseline > 0) {
+        printf("[+]: Comparing against a baseline of %u results\n", nbaseline);
+    }
+
+    /* Sizes and key lengths, with the table's own hash */
+    printf("\n");
+    bench_header();
+    for(uint8_t dist = BENCH_KEYS_FIXED; dist <= BENCH_KEYS_ZIPF; dist++) {
+
+        bench_keys_t keys, misskeys;
+        bench_keys_create(&keys, max, dist, 'k', 88172645463325252ull);
+        bench_keys_create(&misskeys, max, dist, 'm', 2463534242ull);
+
+        for(uint32_t s = 0; s < nsizes; s++) {
+            for(uint32_t t = 0; t < sizeof(types); t++) {
+                bench_run("size", types[t], &hashes[0], distnames[dist], &keys, &misskeys, sizes[s], 16);
+            }
+        }
+
+        /* Hash functions, on a single size */
+        for(uint32_t h = 0; h < sizeof(hashes) / sizeof(hashes[0]); h++) {
+            for(uint32_t t = 0; t < sizeof(types); t++) {
+                bench_run("hash", types[t], &hashes[h], distnames[dist], &keys, &misskeys, BENCH_HASHRUN_KEYS, 16);
+            }
+        }
+
+        bench_keys_destroy(&keys);
+        bench_keys_destroy(&misskeys);
+    }
+
+    /* Load factors, a presized table filled to a fraction of its capacity so it never resizes */
+    bench_keys_t keys, misskeys;
+    bench_keys_create(&keys, BENCH_LOADFACTOR_SLOTS, BENCH_KEYS_FIXED, 'k', 88172645463325252ull);
+    bench_keys_create(&misskeys, BENCH_LOADFACTOR_SLOTS, BENCH_KEYS_FIXED, 'm', 2463534242ull);
+    uint32_t loadfactors[] = { 25, 50, 75, 85 };
+    for(uint32_t l = 0; l < sizeof(loadfactors) / sizeof(loadfactors[0]); l++) {
+        char section[16];
+        snprintf(section, sizeof(section), "load%u", loadfactors[l]);
+        for(uint32_t t = 0; t < sizeof(types); t++) {
+            bench_run(section, types[t], &hashes[0], distnames[BENCH_KEYS_FIXED], &keys, &misskeys,
+            (uint32_t)((uint64_t)BENCH_LOADFACTOR_SLOTS * loadfactors[l] / 100), BENCH_LOADFACTOR_SLOTS);
+        }
+    }
+    bench_keys_destroy(&keys);
+    bench_keys_destroy(&misskeys);
+
+    /* Allocator churn, run the slab first so the malloc run can't hand it a heap that is already fragmented */
+    char *churnkeys = malloc((size_t)BENCH_CHURNKEYS * BENCH_CHURNKEYSIZE);
+    if(churnkeys == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for(uint32_t i = 0; i < BENCH_CHURNKEYS; i++) {
+        snprintf(&churnkeys[i * BENCH_CHURNKEYSIZE], BENCH_CHURNKEYSIZE, "user:%u:cart", i);
+    }
+    printf("\n%-8s %-12s %10s %10s %10s\n", "alloc", "op", "n", "ns/op", "allocs/op");
+    bench_churn(true, churnkeys);
+    bench_churn(false, churnkeys);
+    free(churnkeys);
+
+    if(output != NULL) {
+        if(bench_save(output) == false) {
+            printf("[!]: Failed to save results to %s\n", output);
+            exit(EXIT_FAILURE);
+        }
+        printf("[+]: Saved %u results to %s\n", nrows, output);
+    }
+
+    return EXIT_SUCCESS;
+}
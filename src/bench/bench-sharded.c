@@ -0,0 +1,223 @@
+/**
+ * @file bench-sharded.c
+ * @author Fruerlund
+ * @brief Measures GET throughput of the sharded store table from 1 to N threads, with lookups taking the shard's read lock
+ * versus the lock free path, on a read only and a 95% GET / 5% SET workload.
+ * @version 0.1
+ * @date 2024-08-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ *
+ *
+*/
+
+#include "hashtable.h"
+#include <time.h>
+
+/*
+[**************************************************************************************************************************************************]
+                                                            GLOBAL VARIABLES AND DEFINES
+[**************************************************************************************************************************************************]
+*/
+
+#define BENCH_KEYSIZE       32
+#define BENCH_KEYS          100000
+#define BENCH_SHARDS        64
+#define BENCH_DURATION      1000000000ull       /* Nanoseconds every run lasts */
+#define BENCH_MAXTHREADS    64
+
+#define BENCH_READ_LOCKED   0x0
+#define BENCH_READ_LOCKFREE 0x1
+
+
+/**
+ * @brief Describes the work of a single benchmark thread.
+ */
+typedef struct bench_thread_t {
+
+    hashtable_sharded_t *st;
+    char *keys;
+    uint8_t reader;                         /*      BENCH_READ_LOCKED or BENCH_READ_LOCKFREE        */
+    uint32_t writepct;                      /*      Percentage of operations that are SETs          */
+    uint32_t seed;
+    volatile bool *stop;
+    uint64_t gets;                          /*      Result: GETs completed                          */
+
+} __attribute__((aligned(64))) bench_thread_t;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ *
+ * @return uint64_t
+ */
+uint64_t bench_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/**
+ * @brief GET through the shard's read lock, the way the store worked before lookups went lock free.
+ *
+ * @param st
+ * @param key
+ * @param valuelen
+ * @return char*
+ */
+char *bench_lockedget(hashtable_sharded_t *st, char *key, uint32_t *valuelen) {
+
+    uint32_t keylen = strlen(key);
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+    char *value = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    hashtable_bucket_item *n1 = hashtable_find(shard->table, key, keylen, (uint32_t)hash);
+    if(n1 != NULL) {
+        value = (char *)malloc(n1->valuelen + 1);
+        memcpy(value, HASHTABLE_ITEM_VALUE(n1), n1->valuelen + 1);
+        *valuelen = n1->valuelen;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+
+/**
+ * @brief Benchmark thread, runs GETs (and SETs) on random keys until told to stop. Passes a quiescent state every few operations
+ * like a store worker does between requests.
+ *
+ * @param data
+ * @return void*
+ */
+void *bench_thread(void *data) {
+
+    bench_thread_t *t = (bench_thread_t *)data;
+    int32_t epochid = hashtable_epoch_register(t->st->epoch);
+    uint32_t x = t->seed;
+    uint32_t valuelen = 0;
+
+    while(*t->stop == false) {
+
+        for(uint32_t i = 0; i < 64; i++) {
+
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            char *key = &t->keys[(x % BENCH_KEYS) * BENCH_KEYSIZE];
+
+            if((x >> 24) % 100 < t->writepct) {
+                hashtable_sharded_upsert(t->st, key, strlen(key), "updated-value", 13, 0);
+                continue;
+            }
+
+            char *value = (t->reader == BENCH_READ_LOCKFREE) ? hashtable_sharded_get(t->st, key, strlen(key), &valuelen) : bench_lockedget(t->st, key, &valuelen);
+            free(value);
+            t->gets++;
+        }
+
+        hashtable_epoch_quiescent(t->st->epoch, epochid);
+    }
+
+    hashtable_epoch_unregister(t->st->epoch, epochid);
+    return NULL;
+}
+
+
+/**
+ * @brief Runs a number of threads for BENCH_DURATION and prints the GET throughput.
+ *
+ * @param st
+ * @param keys
+ * @param reader
+ * @param writepct
+ * @param nthreads
+ */
+void bench_run(hashtable_sharded_t *st, char *keys, uint8_t reader, uint32_t writepct, uint32_t nthreads) {
+
+    bench_thread_t threads[BENCH_MAXTHREADS];
+    pthread_t tids[BENCH_MAXTHREADS];
+    volatile bool stop = false;
+
+    for(uint32_t i = 0; i < nthreads; i++) {
+        memset(&threads[i], '\x00', sizeof(bench_thread_t));
+        threads[i].st = st;
+        threads[i].keys = keys;
+        threads[i].reader = reader;
+        threads[i].writepct = writepct;
+        threads[i].seed = 2463534242u + i * 7919;
+        threads[i].stop = &stop;
+    }
+
+    uint64_t start = bench_now();
+    for(uint32_t i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+
+    struct timespec duration = { BENCH_DURATION / 1000000000ull, BENCH_DURATION % 1000000000ull };
+    nanosleep(&duration, NULL);
+    stop = true;
+
+    uint64_t gets = 0;
+    for(uint32_t i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        gets += threads[i].gets;
+    }
+    uint64_t ns = bench_now() - start;
+
+    printf("%-10s %6u%% %8u %14.2f\n", (reader == BENCH_READ_LOCKFREE) ? "lockfree" : "rwlock", writepct, nthreads, (double)gets * 1000.0 / ns);
+}
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            MAIN
+[**************************************************************************************************************************************************]
+*/
+
+int main(int argc, char **argv) {
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t maxthreads = (argc > 1) ? atoi(argv[1]) : ((cpus < 1) ? 1 : cpus);
+    if(maxthreads == 0 || maxthreads > BENCH_MAXTHREADS) {
+        maxthreads = BENCH_MAXTHREADS;
+    }
+
+    char *keys = malloc((size_t)BENCH_KEYS * BENCH_KEYSIZE);
+    if(keys == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    hashtable_sharded_t *st = hashtable_sharded_create(BENCH_SHARDS, BENCH_KEYS, hashtable_hash, HASHTABLE_TYPE_CHAINED);
+    hashtable_sharded_enableslab(st);
+    for(uint32_t i = 0; i < BENCH_KEYS; i++) {
+        snprintf(&keys[i * BENCH_KEYSIZE], BENCH_KEYSIZE, "user:%u:cart", i);
+        hashtable_sharded_upsert(st, &keys[i * BENCH_KEYSIZE], strlen(&keys[i * BENCH_KEYSIZE]), "value", 5, 0);
+    }
+
+    printf("[+]: %ld CPUs online, running up to %u threads\n", cpus, maxthreads);
+    printf("%-10s %7s %8s %14s\n", "reader", "writes", "threads", "Mgets/s");
+
+    uint32_t writepcts[] = { 0, 5 };
+    for(uint32_t w = 0; w < sizeof(writepcts) / sizeof(writepcts[0]); w++) {
+        for(uint32_t n = 1; n <= maxthreads; n = (n * 2 > maxthreads && n != maxthreads) ? maxthreads : n * 2) {
+            bench_run(st, keys, BENCH_READ_LOCKED, writepcts[w], n);
+            bench_run(st, keys, BENCH_READ_LOCKFREE, writepcts[w], n);
+        }
+    }
+
+    hashtable_sharded_delete(st);
+    free(keys);
+
+    return EXIT_SUCCESS;
+}
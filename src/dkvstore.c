@@ -26,12 +26,67 @@ uint8_t serverType = SERVER_TYPE_STORE;
 /* Holds requests to be processed. */
 queue_requests_t *http_queue = NULL;
 
-/* A store for holding key value pairs */
-hashtable_t *store = NULL;
+/* A store for holding key value pairs, sharded so request workers can use it concurrently */
+hashtable_sharded_t *store = NULL;
+
+/* Hash table backend used by the store (HASHTABLE_TYPE_CHAINED or HASHTABLE_TYPE_SWISS) */
+uint8_t storeBackend = HASHTABLE_TYPE_CHAINED;
+
+/* Releases large values and flushed tables in the background, so REM and FLUSHALL never wait for free */
+hashtable_lazyfree_t *storeLazyfree = NULL;
+
+/* Number of request workers, defaults to one per online CPU */
+uint32_t numberOfWorkers = 0;
+
+/* Memory limit of the store in bytes, 0 for no limit, and what to evict when it is reached (HASHTABLE_EVICT_*) */
+uint64_t storeMaxMemory = 0;
+uint8_t storeEvictionPolicy = HASHTABLE_EVICT_LRU;
+
+/* Ordered index of the keys of every shard of the store for SCAN, NULL unless started with --index. Shard locks are taken before
+   index locks, writers to different shards never wait on each other's index */
+store_index_t *storeIndex = NULL;
+bool storeIndexEnabled = false;
+
+/* Snapshot file a store loads on startup and SAVE writes to, NULL for none */
+char *storeSnapshotPath = NULL;
+
+/* Only one snapshot is written at a time. The lock guards the state below and is never held while writing one */
+pthread_mutex_t storeSnapshotLock = PTHREAD_MUTEX_INITIALIZER;
+bool storeSaving = false;
+pid_t storeSaveChild = 0;
+store_save_t storeLastSave;
+
+/* Log every SET, REM and FLUSHALL is appended to, NULL unless started with --appendonly, and when it is synced to disk */
+aof_t *storeLog = NULL;
+char *storeLogPath = NULL;
+aof_fsync_t storeLogPolicy = AOF_FSYNC_INTERVAL;
+uint32_t storeLogInterval = STORE_LOG_INTERVAL;
+
+/* Segment files of a store that keeps its values on disk, NULL unless started with --bitcask. The table then only holds where
+   each value is, and a cache of this many bytes keeps values that are read often in memory */
+bitcask_t *storeBitcask = NULL;
+char *storeBitcaskPath = NULL;
+uint64_t storeCacheBytes = 0;
+
+/* Values at least this long are compressed by SET, 0 to store every value as it is. Entries carry their own flag (see compress.h)
+   so a store can change the threshold between restarts */
+uint64_t storeCompressThreshold = 0;
+compress_stats_t storeCompress;
 
 /* A hash ring using consistent hashing */
 hashring_t *ring = NULL;
 
+/* A stateless coordinator routes every key by the ring's tokens alone and keeps no directory of the keys it has seen */
+bool coordinatorStateless = false;
+
+/* How the ring places keys on stores (HASHRING_PLACEMENT_*) and the weight of the stores given on the command line */
+uint8_t coordinatorPlacement = HASHRING_PLACEMENT_RING;
+uint32_t coordinatorVirtualNodes = COORDINATOR_VIRTUALNODES;
+
+/* Moves keys to their new stores after the stores of the ring changed, at most coordinatorMigrateRate bytes per second */
+coordinator_migration_t coordinatorMigration;
+uint64_t coordinatorMigrateRate = COORDINATOR_MIGRATE_RATE;
+
 /* Flag for threads to signal program exit*/
 bool program_doexit = false;
 
@@ -42,6 +97,21 @@ void help(void) {
     printf("  -t, --type   Specify the type of server.\n");
     printf("  -s, --store  Specify the stores to be used. (e.g. 127.0.0.1:5555,127.0.0.1:6666).\n");
     printf("  -p, --port   Local port to run server on.\n");
+    printf("  -b, --backend  Hash table backend used by a store: chained (default) or swiss.\n");
+    printf("  -w, --workers  Number of request workers of a store (default: one per CPU, max %d).\n", MAX_WORKERS);
+    printf("  -m, --maxmemory  Memory limit of a store, e.g. 512mb (default: no limit).\n");
+    printf("  -e, --maxmemory-policy  What a store evicts at the limit: lru (default), lfu or noeviction.\n");
+    printf("  -i, --index  Keep an ordered index of the keys of a store, needed by SCAN.\n");
+    printf("  -f, --snapshot  Snapshot file a store loads on startup and SAVE writes to.\n");
+    printf("  -a, --appendonly  Log file every write of a store is appended to and replayed from on startup.\n");
+    printf("  -y, --fsync  When the log is synced: always, never or every N milliseconds (default: %d).\n", STORE_LOG_INTERVAL);
+    printf("  -k, --bitcask  Directory a store keeps its values in, only keys stay in memory.\n");
+    printf("  -c, --cache  Memory a --bitcask store caches values that are read in, e.g. 256mb (default: none).\n");
+    printf("  -z, --compress  Values a store compresses are at least this long, e.g. 1kb (default: none are).\n");
+    printf("  -l, --stateless  Route keys of a coordinator by the hash ring alone, without keeping a directory of keys.\n");
+    printf("  -r, --placement  How a coordinator places keys: ring (default), jump, maglev, rendezvous or multiprobe.\n");
+    printf("  -n, --vnodes  Virtual nodes of every store given with -s (default: %d, at most %d).\n", COORDINATOR_VIRTUALNODES, HASHRING_MAXVIRTUALNODES);
+    printf("  -g, --migrate-rate  Bytes per second a coordinator moves between stores after ADD or DEL, e.g. 10mb, 0 for no limit (default: 64mb).\n");
     printf("  -h, --help   Show this help message.\n");
     exit(EXIT_SUCCESS);
 
@@ -100,6 +170,16 @@ uint32_t sendHTTPCode(int fd, int code) {
             break;
     
 
+        case 202:
+            snprintf(reply, MAX_BUFFER_SIZE,
+            "HTTP/1.1 202 Accepted\r\n"
+            "Content-Type: text/plain\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "HTTP 202 Accepted"
+            "\r\n\r\n");
+            break;
+
         case 404:
             snprintf(reply, MAX_BUFFER_SIZE,
             "HTTP/1.1 404 Not Found\r\n"
@@ -110,6 +190,16 @@ uint32_t sendHTTPCode(int fd, int code) {
             "\r\n\r\n");
             break;
 
+        case 409:
+            snprintf(reply, MAX_BUFFER_SIZE,
+            "HTTP/1.1 409 Conflict\r\n"
+            "Content-Type: text/plain\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "HTTP 409 Conflict"
+            "\r\n\r\n");
+            break;
+
         case 501:
             snprintf(reply, MAX_BUFFER_SIZE,
             "HTTP/1.1 501 Not Implemented\r\n"
@@ -120,6 +210,16 @@ uint32_t sendHTTPCode(int fd, int code) {
             "\r\n\r\n");
             break;
 
+        case 507:
+            snprintf(reply, MAX_BUFFER_SIZE,
+            "HTTP/1.1 507 Insufficient Storage\r\n"
+            "Content-Type: text/plain\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "HTTP 507 Insufficient Storage"
+            "\r\n\r\n");
+            break;
+
         default:
             break;
 
@@ -135,255 +235,1493 @@ uint32_t sendHTTPCode(int fd, int code) {
 
 
 /*****************************************************************************************************************************************************************************/
-
-
 /**
- * @brief Parses a buffer containing a HTTP Request into a HTTP Structure by reading headers, HTTP data.
+ * @brief Replies with the memory accounting, eviction and expiry counters of the store, one field:value per line.
  * 
- * @param h 
- * @param buffer 
- * @param size 
+ * @param fd 
  * @return uint32_t 
  */
-uint32_t requestParseHeaders(http_packet_t *h, char *buffer, size_t size) {
-
-    /* Initialize packet*/
-    h->headers = (http_header_t **)malloc( MAX_HEADERS * sizeof(http_header_t *));
-    
-    memset(h->headers, '\x00', sizeof(http_header_t *) * MAX_HEADERS);
-    /* Create Header Table */
-    h->headers_table = hashtable_create(MAX_HEADERS, hashtable_hash);
-
-    /* Parse HTTP Headers */
-    char *header = strtok(buffer, "\r\n");
-    http_header_t *head = NULL;
-    while(header != NULL) {
-
-        head = (http_header_t *)malloc(sizeof(struct http_header_t));
-        size_t len = strlen(header) + 2; // 2 to adjust for \r\n
-        char temp[len];
-
-        memset(temp, '\x00', sizeof(char) * len);
-        strncpy(temp, header, len - 2);
-        strncat(&temp[strlen(header)], "\r\n", 2);
-
-        head->header = strdup(temp);
-        head->header_size = len;
-        h->headers[h->numberofheaders] = head;
-        h->numberofheaders++;
+uint32_t sendStats(int fd) {
+
+    hashtable_stats_t stats;
+    hashtable_sharded_stats(store, &stats);
+
+    char *policies[] = { "noeviction", "allkeys-lru", "allkeys-lfu" };
+    char body[4096];
+    int bodylen = snprintf(body, sizeof(body),
+    "keys:%lu\r\n"
+    "used_memory:%lu\r\n"
+    "maxmemory:%lu\r\n"
+    "maxmemory_policy:%s\r\n"
+    "evicted_keys:%lu\r\n"
+    "expires:%lu\r\n"
+    "expired_keys:%lu\r\n"
+    "key_bytes:%lu\r\n"
+    "value_bytes:%lu\r\n"
+    "entry_bytes:%lu\r\n",
+    stats.keys, stats.memory, stats.maxmemory, policies[stats.policy], stats.evicted, stats.expires, stats.expired, stats.keybytes,
+    stats.valuebytes, stats.itembytes);
+
+    if(storeLazyfree != NULL) {
+        pthread_mutex_lock(&storeLazyfree->lock);
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "lazyfree_pending:%lu\r\n"
+        "lazyfree_pending_bytes:%lu\r\n"
+        "lazyfree_freed:%lu\r\n"
+        "lazyfree_freed_bytes:%lu\r\n",
+        storeLazyfree->pendingcount, storeLazyfree->pendingbytes, storeLazyfree->freed, storeLazyfree->freedbytes);
+        pthread_mutex_unlock(&storeLazyfree->lock);
+    }
 
-        if(h->numberofheaders == MAX_HEADERS) {
-            break;
+    if(storeIndex != NULL) {
+        uint64_t indexkeys = 0, indexbytes = 0;
+        for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+            pthread_rwlock_rdlock(&storeIndex[i].lock);
+            indexkeys += storeIndex[i].tree->size;
+            indexbytes += storeIndex[i].tree->memory;
+            pthread_rwlock_unlock(&storeIndex[i].lock);
         }
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "index_keys:%lu\r\n"
+        "index_bytes:%lu\r\n"
+        "index_bytes_per_key:%.1f\r\n",
+        indexkeys, indexbytes, (indexkeys == 0) ? 0.0 : (double)indexbytes / indexkeys);
+    }
 
-        h->headersize += head->header_size; 
+    if(storeSnapshotPath != NULL) {
+        pthread_mutex_lock(&storeSnapshotLock);
+        store_save_t last = storeLastSave;
+        bool saving = storeSaving || storeSaveChild != 0;
+        pthread_mutex_unlock(&storeSnapshotLock);
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "save_in_progress:%d\r\n"
+        "last_save_status:%s\r\n"
+        "last_save_type:%s\r\n"
+        "last_save_keys:%ld\r\n"
+        "last_save_bytes:%lu\r\n"
+        "last_save_ms:%lu\r\n"
+        "last_fork_ms:%lu\r\n"
+        "last_save_cow_bytes:%lu\r\n",
+        saving, !last.done ? "none" : ((last.keys < 0) ? "err" : "ok"), last.background ? "bgsave" : "save",
+        last.done ? last.keys : 0, last.bytes, last.ms, last.forkms, last.cowbytes);
+    }
 
-        /* Check to see if we found end of headers */
-        char pattern[4] = {0x00, 0x0A, 0x0D, 0x0A};
-        if(memcmp( &header[len - 2], pattern, 4) == 0) {
-            h->headersize = h->headersize + 2;
-            break;
+    if(storeBitcask != NULL) {
+        bitcask_stats_t disk;
+        hashtable_stats_t cache;
+        memset(&cache, '\x00', sizeof(hashtable_stats_t));
+        bitcask_stats(storeBitcask, &disk);
+        if(storeBitcask->cache != NULL) {
+            hashtable_sharded_stats(storeBitcask->cache, &cache);
         }
+        uint64_t hits = __atomic_load_n(&storeBitcask->cachehits, __ATOMIC_RELAXED);
+        uint64_t reads = __atomic_load_n(&storeBitcask->reads, __ATOMIC_RELAXED);
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "disk_segments:%u\r\n"
+        "disk_bytes:%lu\r\n"
+        "disk_live_bytes:%lu\r\n"
+        "disk_reads:%lu\r\n"
+        "disk_compactions:%lu\r\n"
+        "disk_reclaimed_bytes:%lu\r\n"
+        "cache_keys:%lu\r\n"
+        "cache_memory:%lu\r\n"
+        "cache_maxmemory:%lu\r\n"
+        "cache_hits:%lu\r\n"
+        "cache_hit_ratio:%.3f\r\n",
+        disk.segments, disk.bytes, disk.live, reads, __atomic_load_n(&storeBitcask->compactions, __ATOMIC_RELAXED),
+        __atomic_load_n(&storeBitcask->reclaimed, __ATOMIC_RELAXED), cache.keys, cache.memory, cache.maxmemory, hits,
+        (hits + reads == 0) ? 0.0 : (double)hits / (hits + reads));
+    }
 
-        header = strtok(NULL, "\r\n");
+    /* Also shown without --compress once values compressed by an earlier run are read */
+    uint64_t decompressed = __atomic_load_n(&storeCompress.decompressed, __ATOMIC_RELAXED);
+    if(storeCompressThreshold != 0 || decompressed != 0) {
+        uint64_t rawbytes = __atomic_load_n(&storeCompress.rawbytes, __ATOMIC_RELAXED);
+        uint64_t storedbytes = __atomic_load_n(&storeCompress.storedbytes, __ATOMIC_RELAXED);
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "compress_threshold:%lu\r\n"
+        "compressed_values:%lu\r\n"
+        "compress_skipped:%lu\r\n"
+        "compress_bytes_in:%lu\r\n"
+        "compress_bytes_out:%lu\r\n"
+        "compress_bytes_saved:%lu\r\n"
+        "compress_ratio:%.2f\r\n"
+        "compress_cpu_us:%lu\r\n"
+        "decompressed_values:%lu\r\n"
+        "decompress_cpu_us:%lu\r\n",
+        storeCompressThreshold, __atomic_load_n(&storeCompress.compressed, __ATOMIC_RELAXED),
+        __atomic_load_n(&storeCompress.skipped, __ATOMIC_RELAXED), rawbytes, storedbytes, rawbytes - storedbytes,
+        (storedbytes == 0) ? 0.0 : (double)rawbytes / storedbytes, __atomic_load_n(&storeCompress.compressns, __ATOMIC_RELAXED) / 1000,
+        decompressed, __atomic_load_n(&storeCompress.decompressns, __ATOMIC_RELAXED) / 1000);
     }
 
-    return h->numberofheaders;
+    if(storeLog != NULL) {
+        char *fsyncs[] = { "always", "interval", "never" };
+        pthread_mutex_lock(&storeLog->lock);
+        bodylen += snprintf(body + bodylen, sizeof(body) - bodylen,
+        "log_fsync:%s\r\n"
+        "log_status:%s\r\n"
+        "log_bytes:%lu\r\n"
+        "log_records:%lu\r\n"
+        "log_syncs:%lu\r\n"
+        "log_records_per_sync:%.1f\r\n"
+        "log_rewrite_in_progress:%d\r\n"
+        "log_rewrites:%lu\r\n"
+        "log_last_rewrite_ms:%lu\r\n",
+        fsyncs[storeLog->policy], storeLog->failed ? "err" : "ok", storeLog->size, storeLog->records, storeLog->syncs,
+        (storeLog->syncs == 0) ? 0.0 : (double)storeLog->records / storeLog->syncs, storeLog->rewritestatus == -1,
+        storeLog->rewrites, storeLog->rewritems);
+        pthread_mutex_unlock(&storeLog->lock);
+    }
 
+    char reply[256];
+    int len = snprintf(reply, sizeof(reply),
+    "HTTP/1.1 200 Ok\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %d\r\n"
+    "Connection: close\r\n"
+    "\r\n", bodylen);
+
+    struct iovec iov[2] = {
+        { reply, len },
+        { body, bodylen }
+    };
+    return writev(fd, iov, 2);
 }
 
 
+
 /*****************************************************************************************************************************************************************************/
 /**
- * @brief Parses the header structures and inserts them into a hash table for easy manipulation.
+ * @brief Replies with the stores of a coordinator and the progress of the running or last migration of keys, one field:value
+ * per line.
  * 
- * @param h 
+ * @param fd 
  * @return uint32_t 
  */
-uint32_t requestHeadersParseTable(http_packet_t *h) {
+uint32_t sendCoordinatorStats(int fd) {
+
+    coordinator_migration_t *m = &coordinatorMigration;
+    char *placements[] = { "ring", "jump", "maglev", "rendezvous", "multiprobe" };
+
+    pthread_mutex_lock(&m->lock);
+    bool running = m->running;
+    uint64_t migrations = m->migrations;
+    uint64_t started = m->started;
+    uint64_t finished = m->finished;
+    pthread_mutex_unlock(&m->lock);
+
+    uint64_t ms = (started == 0) ? 0 : (((finished != 0) ? finished : ratelimiter_now()) - started) / 1000000;
+    uint64_t moved = __atomic_load_n(&m->moved, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+
+    char body[2048];
+    int bodylen = snprintf(body, sizeof(body),
+    "stores:%zu\r\n"
+    "placement:%s\r\n"
+    "migration_in_progress:%d\r\n"
+    "migrations:%lu\r\n"
+    "migration_stores:%u\r\n"
+    "migration_stores_done:%u\r\n"
+    "migration_keys_read:%lu\r\n"
+    "migration_keys_moved:%lu\r\n"
+    "migration_keys_newer:%lu\r\n"
+    "migration_keys_failed:%lu\r\n"
+    "migration_bytes:%lu\r\n"
+    "migration_ms:%lu\r\n"
+    "migration_bytes_per_sec:%lu\r\n"
+    "migration_rate_limit:%lu\r\n"
+    "migration_throttled_ms:%lu\r\n",
+    ring->numberofservers, placements[ring->placement], running, migrations, __atomic_load_n(&m->stores, __ATOMIC_RELAXED),
+    __atomic_load_n(&m->storesdone, __ATOMIC_RELAXED), __atomic_load_n(&m->scanned, __ATOMIC_RELAXED), moved,
+    __atomic_load_n(&m->skipped, __ATOMIC_RELAXED), __atomic_load_n(&m->failed, __ATOMIC_RELAXED), bytes, ms,
+    (ms == 0) ? 0 : bytes * 1000 / ms, m->rate, __atomic_load_n(&m->bucket.waited, __ATOMIC_RELAXED) / 1000000);
+
+    char reply[256];
+    int len = snprintf(reply, sizeof(reply),
+    "HTTP/1.1 200 Ok\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %d\r\n"
+    "Connection: close\r\n"
+    "\r\n", bodylen);
+
+    struct iovec iov[2] = {
+        { reply, len },
+        { body, bodylen }
+    };
+    return writev(fd, iov, 2);
+}
 
-    for(uint32_t i = 1; i < h->numberofheaders; i++) {
 
-        char *header= strdup(h->headers[i]->header);
 
-        char *key = strtok(header, ":");
-        char *value = strtok(NULL, ":");
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Parses a number of bytes with an optional kb, mb or gb suffix (powers of 1024), e.g. 512mb.
+ * 
+ * @param s 
+ * @return uint64_t the number of bytes, 0 if the string isn't valid
+ */
+uint64_t parseMemory(char *s) {
 
-        if(key != NULL && value != NULL) {
-            hashtable_insert(h->headers_table, key, value);
-        }
+    char *end = NULL;
+    uint64_t bytes = strtoull(s, &end, 10);
+    if(end == s) {
+        return 0;
     }
 
-    return EXIT_SUCCESS;
+    if(strcasecmp(end, "k") == 0 || strcasecmp(end, "kb") == 0) {
+        return bytes * 1024;
+    }
+    if(strcasecmp(end, "m") == 0 || strcasecmp(end, "mb") == 0) {
+        return bytes * 1024 * 1024;
+    }
+    if(strcasecmp(end, "g") == 0 || strcasecmp(end, "gb") == 0) {
+        return bytes * 1024 * 1024 * 1024;
+    }
+    if(*end != '\x00') {
+        return 0;
+    }
+    return bytes;
 }
 
 
+
 /*****************************************************************************************************************************************************************************/
 /**
- * @brief Generic method responsible for parsing.
+ * @brief Returns a copy of the value of a key, read from disk (or its cache) in a --bitcask store and decompressed if it was
+ * stored compressed. The caller must be online in the store's epoch domain and free the copy.
  * 
- * @param h 
- * @param buffer 
- * @param size 
- * @return uint32_t 
+ * @param key 
+ * @param keylen 
+ * @param valuelen set to the length of the value
+ * @return char* the value or NULL if the key doesn't exist
  */
-uint32_t requestParse(http_packet_t *h, char *buffer, size_t size) {
-    
-    /* Parse Headers */
-    requestParseHeaders(h, buffer, size);
-
-    /* Split headers into table */
-    requestHeadersParseTable(h);
-
-    /* Parse request type */
-    http_header_t *head = h->headers[0];
-    char *method = strtok(head->header, " ");
+char *storeGet(char *key, uint32_t keylen, uint32_t *valuelen) {
 
-   /* If request is POST, parse the POST data */
-    if(strcmp(method, "POST") == 0) {
+    char *value = NULL;
+    if(storeBitcask != NULL) {
+        value = bitcask_get(storeBitcask, key, keylen, valuelen);
+    }
+    else {
+        value = hashtable_sharded_get(store, key, keylen, valuelen);
+    }
 
-        h->datasize = size - h->headersize;
+    if(value != NULL && compress_isencoded(value, *valuelen)) {
+        char *raw = compress_decodevalue(&storeCompress, value, *valuelen);
+        if(raw == NULL) {
+            printf("[!]: Failed to decompress the value of %.*s\n", (int)keylen, key);
+        }
+        else {
+            *valuelen = compress_rawlen(value);
+        }
+        free(value);
+        value = raw;
+    }
+    return value;
+}
 
-        h->httpData = (char *)malloc(h->datasize);
 
-        memcpy(h->httpData, &buffer[h->headersize], h->datasize);
 
-        h->type = HTTP_POST;
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Key hook of a shard of the store table, keeps the shard's ordered index in step with it. Keys are indexed with their
+ * terminator so no key is a prefix of another.
+ * 
+ * @param data store_index_t of the shard
+ * @param key 
+ * @param keylen 
+ * @param linked 
+ */
+void storeIndexHook(void *data, char *key, uint32_t keylen, bool linked) {
 
-    }
+    store_index_t *index = (store_index_t *)data;
 
-    else if(strcmp(method, "GET") == 0) {
-        h->type = HTTP_GET;
+    /* The shard's write lock is held, the index lock only waits for SCANs of this shard */
+    pthread_rwlock_wrlock(&index->lock);
+    if(linked) {
+        if(art_insert(index->tree, (uint8_t *)key, keylen + 1) < 0) {
+            printf("[!]: Failed to index key %s\n", key);
+        }
     }
-
     else {
-        h->type == HTTP_UNKNOWN;    
+        art_delete(index->tree, (uint8_t *)key, keylen + 1);
     }
+    pthread_rwlock_unlock(&index->lock);
+}
+
 
-    return EXIT_SUCCESS;
 
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Release method of an index handed to the lazy free thread.
+ * 
+ * @param index art_tree_t
+ */
+void storeIndexFree(void *index) {
+    art_destroy((art_tree_t *)index);
 }
 
 
-uint32_t requestToBuffer(http_packet_t *h, char *buffer, size_t maxsize) {
 
-    memset(buffer, '\x00', maxsize);
-    int offset = 0;
-    for(uint32_t i = 0; i < h->numberofheaders; i++) {
-        memcpy(buffer+offset, h->headers[i]->header, h->headers[i]->header_size);
-        offset += h->headers[i]->header_size;
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Flush hook of the store table, swaps the ordered index of every shard for an empty one while every shard is locked.
+ * The old indexes are released by the lazy free thread.
+ * 
+ * @param data 
+ */
+void storeFlushHook(void *data) {
+
+    for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+
+        art_tree_t *tree = art_create();
+        if(tree == NULL) {
+            printf("[!]: Failed to create an empty key index, SCAN skips the flushed keys\n");
+            return;
+        }
+
+        pthread_rwlock_wrlock(&storeIndex[i].lock);
+        art_tree_t *old = storeIndex[i].tree;
+        storeIndex[i].tree = tree;
+        pthread_rwlock_unlock(&storeIndex[i].lock);
+
+        if(storeLazyfree == NULL || hashtable_lazyfree_push(storeLazyfree, NULL, old, storeIndexFree, old->memory) == false) {
+            art_destroy(old);
+        }
     }
+}
 
-    char delim[2] = {0x0D, 0x0A};
-    memcpy(buffer + offset, delim, 2);
-    offset += 2;
 
-    memcpy(buffer + offset, h->httpData, h->datasize);
 
-    offset += h->datasize;
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Finds a name=value field in request data.
+ * 
+ * @param data request data, fields separated by &
+ * @param name 
+ * @param len set to the length of the value
+ * @return char* the value, not terminated, NULL if the field isn't there
+ */
+char *requestParam(char *data, char *name, size_t *len) {
 
-    return offset;
+    size_t namelen = strlen(name);
+    char *field = data;
 
+    while(field != NULL && *field != '\x00') {
+        char *next = strchr(field, '&');
+        if(strncmp(field, name, namelen) == 0 && field[namelen] == '=') {
+            char *value = field + namelen + 1;
+            *len = (next != NULL) ? (size_t)(next - value) : strlen(value);
+            return value;
+        }
+        field = (next != NULL) ? next + 1 : NULL;
+    }
+    return NULL;
 }
 
-/*****************************************************************************************************************************************************************************/
 
+
+/*****************************************************************************************************************************************************************************/
 /**
- * @brief Responsible for executing instructions as per the HTTP request.
+ * @brief Index callback of SCAN, collects keys until the limit or the first key past the prefix or the end.
  * 
- * @param h 
- * @return uint32_t 
+ * @param data 
+ * @param key 
+ * @param keylen 
+ * @return int 0 to continue, 1 to stop
  */
-uint32_t requestHandle(http_packet_t *h) {
+int storeScanCollect(void *data, const uint8_t *key, uint32_t keylen) {
 
-    /* Perform operation */
-    
-    switch(h->type) {
+    store_scan_t *scan = (store_scan_t *)data;
 
-        case HTTP_POST:
-        
-            char *http_data_copy = strdup(h->httpData);
+    /* Drop the terminator the index keeps */
+    keylen--;
 
-            /* Get command and command data */
-            char *op = strtok(http_data_copy, "&");
-            char *opdata = strtok(NULL, "&");
+    /* The walk starts at or after the prefix, so the first key without it is past every key with it */
+    if(scan->prefix != NULL && (keylen < scan->prefixlen || memcmp(key, scan->prefix, scan->prefixlen) != 0)) {
+        return 1;
+    }
+    if(scan->end != NULL && art_keycmp(key, keylen, (uint8_t *)scan->end, scan->endlen) >= 0) {
+        return 1;
+    }
 
-            if(op == NULL || opdata == NULL) {
-                sendHTTPCode(h->clientfd, 400);
-            }
+    if(scan->used + keylen + 1 > scan->capacity) {
+        size_t capacity = (scan->capacity == 0) ? 4096 : scan->capacity * 2;
+        while(capacity < scan->used + keylen + 1) {
+            capacity *= 2;
+        }
+        char *keys = realloc(scan->keys, capacity);
+        if(keys == NULL) {
+            return 1;
+        }
+        scan->keys = keys;
+        scan->capacity = capacity;
+    }
+    memcpy(scan->keys + scan->used, key, keylen + 1);
+    scan->used += keylen + 1;
 
-            /* Split op into fields fields*/
-            char *op_field = strtok(op, "=");
-            char *op_value = strtok(NULL, "=");
+    return (++scan->count >= scan->limit) ? 1 : 0;
+}
 
-            if(op_field == NULL || op_value == NULL) {
-                sendHTTPCode(h->clientfd, 400);
-            }
 
-            /* Split op data into fields */
-            char *op_datafield = strtok(opdata, "=");
-            char *op_datavalue = strtok(NULL, "=");
 
-            if(op_datafield == NULL || op_datavalue == NULL) {
-                sendHTTPCode(h->clientfd, 400);
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Appends to the SCAN reply buffer, writing it to the client whenever it fills up.
+ * 
+ * @param fd 
+ * @param buffer 
+ * @param used 
+ * @param data 
+ * @param len 
+ * @return bool false if the client went away
+ */
+bool scanWrite(int fd, char *buffer, size_t *used, char *data, size_t len) {
+
+    while(len > 0) {
+        size_t n = ART_MIN(len, STORE_SCAN_BUFFER - *used);
+        memcpy(buffer + *used, data, n);
+        *used += n;
+        data += n;
+        len -= n;
+
+        if(*used == STORE_SCAN_BUFFER) {
+            if(write(fd, buffer, *used) != (ssize_t)*used) {
+                return false;
             }
+            *used = 0;
+        }
+    }
+    return true;
+}
 
 
-            if(strcmp(op_value, "GET") == 0) {
-                
-                if(serverType == SERVER_TYPE_STORE) {
-                    hashtable_bucket_item *r = NULL;
-                    if ( ( r = hashtable_lookup(store, op_datavalue)) == NULL) {
-                        sendHTTPCode(h->clientfd, 404);
-                    }
-                    else {
-                        char reply[4096];
-                        memset(reply, '\x00', sizeof(char) * 4096);
-                        snprintf(reply, 4096,
-                        "HTTP/1.1 200 Ok\r\n"
-                        "Content-Type: text/plain\r\n"
-                        "Content-Length: %d\r\n"
-                        "Connection: close\r\n"
-                        "\r\n"
-                        "%s=%s", ( strlen(r->key) + 1 + strlen(r->value)), r->key, r->value);
-                        write(h->clientfd, reply, strlen(reply));
-                    }
-                }
 
-                if(serverType == SERVER_TYPE_COORDINATOR) {
-                    ring_element_t *e = hashring_lookupkey(ring, op_datavalue);
-                    if(e == NULL) {
-                        sendHTTPCode(h->clientfd, 404);
-                    }
-                    else {
-                        coordinator_requestForward(e, h);
-                    }    
-                }
-                break;                
-            }
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Replies to a SCAN with key=value lines in key order. Keys are collected from the index of every shard under its read
+ * lock, up to the limit from each, and merged. Values are read afterwards so writers only wait for the walk, not for the client.
+ * A key removed in between is left out.
+ * 
+ * @param fd 
+ * @param data request data
+ * @return uint32_t 
+ */
+uint32_t sendScan(int fd, char *data) {
 
-            if(strcmp(op_value, "SET") == 0) {
+    if(storeIndex == NULL) {
+        return sendHTTPCode(fd, 501);
+    }
 
-                if(serverType == SERVER_TYPE_STORE) {
-                    if ( hashtable_insert(store, op_datafield, op_datavalue) == true) {
-                        sendHTTPCode(h->clientfd, 200);
-                    }
-                    else {
-                        sendHTTPCode(h->clientfd, 400);
-                    }
-                }
-                else {
+    store_scan_t scan;
+    memset(&scan, '\x00', sizeof(store_scan_t));
+    scan.limit = STORE_SCAN_DEFAULTLIMIT;
+
+    size_t startlen = 0, afterlen = 0, limitlen = 0;
+    char *start = requestParam(data, "start", &startlen);
+    char *after = requestParam(data, "after", &afterlen);
+    char *limit = requestParam(data, "limit", &limitlen);
+    scan.prefix = requestParam(data, "prefix", &scan.prefixlen);
+    scan.end = requestParam(data, "end", &scan.endlen);
+
+    if(limit != NULL) {
+        char *end = NULL;
+        unsigned long n = strtoul(limit, &end, 10);
+        if(n == 0 || end != limit + limitlen) {
+            return sendHTTPCode(fd, 400);
+        }
+        scan.limit = (n > STORE_SCAN_MAXLIMIT) ? STORE_SCAN_MAXLIMIT : n;
+    }
 
-                    /* Insert key into hashring*/
-                    ring_element_t *e = NULL;
-                    e = hashring_addkey(ring, op_datafield);
-                    if(e == NULL) {
-                        sendHTTPCode(h->clientfd, 404);
-                        break;
-                    }
+    if(scan.prefixlen > MAX_INPUT_BUFFER || startlen > MAX_INPUT_BUFFER || afterlen > MAX_INPUT_BUFFER) {
+        return sendHTTPCode(fd, 400);
+    }
 
-                    /* Forward key, value to calculated store */
-                    coordinator_requestForward(e, h);
+    /* Start at the largest lower bound. Past "after" means past it and every key it is a prefix of is fair game, so two
+    terminators put the bound right behind its index entry */
+    char lo[MAX_INPUT_BUFFER + 2];
+    size_t lolen = 0;
+    if(scan.prefix != NULL) {
+        memcpy(lo, scan.prefix, scan.prefixlen);
+        lolen = scan.prefixlen;
+    }
+    if(start != NULL && art_keycmp((uint8_t *)start, startlen, (uint8_t *)lo, lolen) > 0) {
+        memcpy(lo, start, startlen);
+        lolen = startlen;
+    }
+    if(after != NULL && art_keycmp((uint8_t *)after, afterlen, (uint8_t *)lo, lolen) >= 0) {
+        memcpy(lo, after, afterlen);
+        lo[afterlen] = '\x00';
+        lo[afterlen + 1] = '\x00';
+        lolen = afterlen + 2;
+    }
+
+    /* Every shard's index gives its first keys from the bound on, the reply merges them */
+    store_scan_t shards[STORE_TABLESHARDS];
+    size_t offsets[STORE_TABLESHARDS];
+    for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+        shards[i] = scan;
+        offsets[i] = 0;
+        pthread_rwlock_rdlock(&storeIndex[i].lock);
+        art_scan(storeIndex[i].tree, (uint8_t *)lo, lolen, storeScanCollect, &shards[i]);
+        pthread_rwlock_unlock(&storeIndex[i].lock);
+    }
+
+    char *buffer = malloc(STORE_SCAN_BUFFER);
+    if(buffer == NULL) {
+        for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+            free(shards[i].keys);
+        }
+        return sendHTTPCode(fd, 500);
+    }
+
+    /* The number of lines isn't known until every value has been read, so the reply ends when the connection closes */
+    size_t used = snprintf(buffer, STORE_SCAN_BUFFER,
+    "HTTP/1.1 200 Ok\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n"
+    "\r\n");
+
+    bool ok = true;
+    for(uint32_t n = 0; ok && n < scan.limit; n++) {
+
+        /* The smallest key left at the head of any shard's keys comes next */
+        int32_t next = -1;
+        for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+            if(offsets[i] < shards[i].used &&
+               (next < 0 || strcmp(shards[i].keys + offsets[i], shards[next].keys + offsets[next]) < 0)) {
+                next = i;
+            }
+        }
+        if(next < 0) {
+            break;
+        }
+
+        char *key = shards[next].keys + offsets[next];
+        uint32_t keylen = strlen(key);
+        uint32_t valuelen = 0;
+        offsets[next] += keylen + 1;
+
+        char *value = storeGet(key, keylen, &valuelen);
+        if(value == NULL) {
+            continue;
+        }
+        ok = scanWrite(fd, buffer, &used, key, keylen) && scanWrite(fd, buffer, &used, "=", 1) &&
+             scanWrite(fd, buffer, &used, value, valuelen) && scanWrite(fd, buffer, &used, "\n", 1);
+        free(value);
+    }
+    if(ok && used > 0) {
+        write(fd, buffer, used);
+    }
+
+    free(buffer);
+    for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+        free(shards[i].keys);
+    }
+    return EXIT_SUCCESS;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Returns a monotonic timestamp in milliseconds.
+ * 
+ * @return uint64_t 
+ */
+uint64_t storeClock(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Returns the memory this process doesn't share with any other. In a BGSAVE child that is the pages the store changed
+ * since the fork, which the kernel had to copy, plus what the child allocated itself.
+ * 
+ * @return uint64_t bytes, 0 if the kernel doesn't tell
+ */
+uint64_t storeCowBytes(void) {
+
+    char line[256];
+    uint64_t kb = 0, total = 0;
+
+    FILE *fd = fopen("/proc/self/smaps_rollup", "r");
+    if(fd == NULL) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), fd) != NULL) {
+        if(sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+            total += kb;
+        }
+    }
+    fclose(fd);
+    return total * 1024;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Replies to a SAVE by writing a snapshot of the store to its snapshot file. Writers are held off one shard at a time,
+ * see snapshot_save.
+ * 
+ * @param fd 
+ * @return uint32_t 
+ */
+uint32_t sendSave(int fd) {
+
+    if(storeSnapshotPath == NULL) {
+        return sendHTTPCode(fd, 501);
+    }
+
+    pthread_mutex_lock(&storeSnapshotLock);
+    if(storeSaving || storeSaveChild != 0) {
+        pthread_mutex_unlock(&storeSnapshotLock);
+        return sendHTTPCode(fd, 409);
+    }
+    storeSaving = true;
+    pthread_mutex_unlock(&storeSnapshotLock);
+
+    store_save_t result;
+    memset(&result, '\x00', sizeof(store_save_t));
+    uint64_t start = storeClock();
+    result.keys = snapshot_save(store, storeSnapshotPath, true, &result.bytes);
+    result.ms = storeClock() - start;
+    result.done = true;
+
+    pthread_mutex_lock(&storeSnapshotLock);
+    storeLastSave = result;
+    storeSaving = false;
+    pthread_mutex_unlock(&storeSnapshotLock);
+
+    if(result.keys < 0) {
+        printf("[!]: Failed to save snapshot to %s\n", storeSnapshotPath);
+        return sendHTTPCode(fd, 500);
+    }
+    printf("[+]: Saved %ld keys (%lu bytes) to %s in %lu ms\n", result.keys, result.bytes, storeSnapshotPath, result.ms);
+    return sendHTTPCode(fd, 200);
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Runs in the BGSAVE child. Its copy of the store is frozen at the fork, so it is written without taking a single lock,
+ * then the outcome goes to the store through the pipe. Never returns.
+ * 
+ * @param fd write end of the pipe
+ */
+void storeBgsaveChild(int fd) {
+
+    /* Keep nothing but the pipe open, client connections must close when the store closes them and not when the child exits */
+    if(dup2(fd, 3) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if(syscall(SYS_close_range, 4, ~0U, 0) != 0) {
+        for(long i = 4; i < sysconf(_SC_OPEN_MAX); i++) {
+            close(i);
+        }
+    }
+
+    store_save_t result;
+    memset(&result, '\x00', sizeof(store_save_t));
+    uint64_t start = storeClock();
+    result.keys = snapshot_save(store, storeSnapshotPath, false, &result.bytes);
+    result.ms = storeClock() - start;
+    result.cowbytes = storeCowBytes();
+
+    /* _exit, the store's stdio buffers and atexit handlers are not the child's to run */
+    if(write(3, &result, sizeof(store_save_t)) != sizeof(store_save_t)) {
+        _exit(EXIT_FAILURE);
+    }
+    _exit((result.keys < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Waits for a BGSAVE child and records how its snapshot went.
+ * 
+ * @param data store_bgsave_t, freed here
+ * @return void* 
+ */
+void *storeBgsaveWait(void *data) {
+
+    store_bgsave_t *bgsave = (store_bgsave_t *)data;
+    store_save_t result;
+    int status = 0;
+
+    if(read(bgsave->fd, &result, sizeof(store_save_t)) != sizeof(store_save_t)) {
+        memset(&result, '\x00', sizeof(store_save_t));
+        result.keys = -1;
+    }
+    close(bgsave->fd);
+
+    if(waitpid(bgsave->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        result.keys = -1;
+    }
+    result.forkms = bgsave->forkms;
+    result.background = true;
+    result.done = true;
+
+    pthread_mutex_lock(&storeSnapshotLock);
+    storeLastSave = result;
+    storeSaveChild = 0;
+    pthread_mutex_unlock(&storeSnapshotLock);
+
+    if(result.keys < 0) {
+        printf("[!]: Background save to %s failed\n", storeSnapshotPath);
+    }
+    else {
+        printf("[+]: Background saved %ld keys (%lu bytes) to %s in %lu ms, fork %lu ms, %lu bytes copied on write\n", result.keys,
+        result.bytes, storeSnapshotPath, result.ms, result.forkms, result.cowbytes);
+    }
+
+    free(bgsave);
+    return NULL;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Replies to a BGSAVE by forking a child that writes a point in time snapshot. Every shard is write locked across the fork
+ * so no write is half done in the child's copy. That and the fork itself are the only pause, it grows with the size of the page
+ * tables (about 10 ms per GB). Afterwards the store and the child share the memory copy on write: every page the store changes
+ * while the child runs is copied once, which is the extra memory a BGSAVE costs (at most the size of the store, reported as
+ * last_save_cow_bytes).
+ * 
+ * @param fd 
+ * @return uint32_t 
+ */
+uint32_t sendBgsave(int fd) {
+
+    if(storeSnapshotPath == NULL) {
+        return sendHTTPCode(fd, 501);
+    }
+
+    pthread_mutex_lock(&storeSnapshotLock);
+    if(storeSaving || storeSaveChild != 0) {
+        pthread_mutex_unlock(&storeSnapshotLock);
+        return sendHTTPCode(fd, 409);
+    }
+
+    store_bgsave_t *bgsave = (store_bgsave_t *)malloc(sizeof(store_bgsave_t));
+    int fds[2];
+    if(bgsave == NULL || pipe(fds) != 0) {
+        pthread_mutex_unlock(&storeSnapshotLock);
+        free(bgsave);
+        return sendHTTPCode(fd, 500);
+    }
+
+    uint64_t start = storeClock();
+    for(uint32_t i = 0; i < store->nshards; i++) {
+        pthread_rwlock_wrlock(&store->shards[i].lock);
+    }
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(fds[0]);
+        storeBgsaveChild(fds[1]);
+    }
+
+    for(uint32_t i = 0; i < store->nshards; i++) {
+        pthread_rwlock_unlock(&store->shards[i].lock);
+    }
+    close(fds[1]);
+
+    if(pid < 0) {
+        pthread_mutex_unlock(&storeSnapshotLock);
+        close(fds[0]);
+        free(bgsave);
+        return sendHTTPCode(fd, 500);
+    }
+
+    bgsave->pid = pid;
+    bgsave->fd = fds[0];
+    bgsave->forkms = storeClock() - start;
+
+    pthread_t waiter;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&waiter, &attr, storeBgsaveWait, bgsave) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        pthread_attr_destroy(&attr);
+        pthread_mutex_unlock(&storeSnapshotLock);
+        close(fds[0]);
+        free(bgsave);
+        return sendHTTPCode(fd, 500);
+    }
+    pthread_attr_destroy(&attr);
+
+    storeSaveChild = pid;
+    pthread_mutex_unlock(&storeSnapshotLock);
+
+    printf("[+]: Background save started by child %d, fork took %lu ms\n", pid, bgsave->forkms);
+    return sendHTTPCode(fd, 202);
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Replies to a FLUSHALL by removing every key. The tables, the index and in a --bitcask store the segments are swapped
+ * for empty ones and released in the background, the store is only locked for the swap. With a log every stripe is held, so
+ * the FLUSH record lands between the writes that came before and after it.
+ * 
+ * @param fd 
+ * @return uint32_t 
+ */
+uint32_t sendFlush(int fd) {
+
+    if(storeBitcask != NULL) {
+        return sendHTTPCode(fd, bitcask_flush(storeBitcask) ? 200 : 500);
+    }
+
+    if(storeLog != NULL) {
+        aof_lockall(storeLog);
+    }
+    bool ok = hashtable_sharded_flush(store);
+    uint64_t position = 0;
+    if(storeLog != NULL) {
+        if(ok) {
+            position = aof_append(storeLog, AOF_OP_FLUSH, "", 0, NULL, 0, 0);
+        }
+        aof_unlockall(storeLog);
+    }
+
+    if(ok == false || (storeLog != NULL && aof_wait(storeLog, position) == false)) {
+        return sendHTTPCode(fd, 500);
+    }
+    return sendHTTPCode(fd, 200);
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Stores a 32 bit integer little endian.
+ * 
+ * @param buffer 
+ * @param v 
+ */
+void storePut32(char *buffer, uint32_t v) {
+
+    for(uint32_t i = 0; i < 4; i++) {
+        buffer[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Reads a 32 bit integer stored little endian.
+ * 
+ * @param buffer 
+ * @return uint32_t 
+ */
+uint32_t storeGet32(char *buffer) {
+
+    uint32_t v = 0;
+    for(uint32_t i = 0; i < 4; i++) {
+        v |= (uint32_t)(uint8_t)buffer[i] << (8 * i);
+    }
+    return v;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Makes room for size more bytes at the end of a SYNC reply body.
+ * 
+ * @param sync 
+ * @param size 
+ * @return true 
+ * @return false if the body couldn't grow, the SYNC then fails
+ */
+bool storeSyncReserve(store_sync_t *sync, size_t size) {
+
+    if(sync->used + size <= sync->capacity) {
+        return true;
+    }
+
+    size_t capacity = sync->capacity * 2;
+    while(capacity < sync->used + size) {
+        capacity *= 2;
+    }
+    char *body = realloc(sync->body, capacity);
+    if(body == NULL) {
+        sync->failed = true;
+        return false;
+    }
+    sync->body = body;
+    sync->capacity = capacity;
+    return true;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Scan callback of SYNC, appends an entry to the reply body. Runs with the shard's read lock held.
+ * 
+ * @param data 
+ * @param n1 
+ */
+void storeSyncCollect(void *data, hashtable_bucket_item *n1) {
+
+    store_sync_t *sync = (store_sync_t *)data;
+    bitcask_locator_t loc;
+    uint32_t valuelen = n1->valuelen;
+    uint32_t header = (sync->ttl) ? 12 : 8;
+
+    /* An expired entry is gone to every reader, it only waits to be removed */
+    if(sync->failed || (n1->expire != 0 && n1->expire <= sync->now)) {
+        return;
+    }
+
+    /* The entries of a --bitcask store point at their values on disk */
+    if(storeBitcask != NULL) {
+        memcpy(&loc, HASHTABLE_ITEM_VALUE(n1), sizeof(bitcask_locator_t));
+        valuelen = loc.valuelen;
+    }
+    if(storeSyncReserve(sync, header + n1->keylen + valuelen) == false) {
+        return;
+    }
+
+    char *p = sync->body + sync->used;
+    storePut32(p, n1->keylen);
+    if(sync->ttl) {
+        storePut32(p + 8, (n1->expire == 0) ? 0 : n1->expire - sync->now);
+    }
+    memcpy(p + header, n1->key, n1->keylen);
+    if(storeBitcask == NULL) {
+        memcpy(p + header + n1->keylen, HASHTABLE_ITEM_VALUE(n1), valuelen);
+    }
+    else if(bitcask_read(storeBitcask, &loc, p + header + n1->keylen) == false) {
+
+        /* The shard is read locked, the entry can't be pointed at another segment, so its segment is still there */
+        sync->failed = true;
+        return;
+    }
+
+    /* Compressed values go out the way they were sent */
+    if(compress_isencoded(p + header + n1->keylen, valuelen)) {
+        uint32_t rawlen = compress_rawlen(p + header + n1->keylen);
+        char *raw = compress_decodevalue(&storeCompress, p + header + n1->keylen, valuelen);
+        if(raw == NULL || storeSyncReserve(sync, header + n1->keylen + rawlen) == false) {
+            sync->failed = true;
+            free(raw);
+            return;
+        }
+        p = sync->body + sync->used;
+        memcpy(p + header + n1->keylen, raw, rawlen);
+        valuelen = rawlen;
+        free(raw);
+    }
+    storePut32(p + 4, valuelen);
+
+    sync->used += header + n1->keylen + valuelen;
+    sync->count++;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Replies to a SYNC with the next batch of a cursor scan over the store, see the protocol description in dkvstore.h.
+ * 
+ * @param fd 
+ * @param data request data
+ * @return uint32_t 
+ */
+uint32_t sendSync(int fd, char *data) {
+
+    uint64_t cursor = 0;
+    uint32_t count = STORE_SYNC_DEFAULTCOUNT;
+    size_t len = 0;
+    char *end = NULL;
+
+    char *field = requestParam(data, "cursor", &len);
+    if(field != NULL) {
+        cursor = strtoull(field, &end, 10);
+        if(end == field || end != field + len) {
+            return sendHTTPCode(fd, 400);
+        }
+    }
+
+    field = requestParam(data, "count", &len);
+    if(field != NULL) {
+        unsigned long n = strtoul(field, &end, 10);
+        if(n == 0 || end != field + len) {
+            return sendHTTPCode(fd, 400);
+        }
+        count = (n > STORE_SYNC_MAXCOUNT) ? STORE_SYNC_MAXCOUNT : n;
+    }
+
+    store_sync_t sync;
+    memset(&sync, '\x00', sizeof(store_sync_t));
+    field = requestParam(data, "ttl", &len);
+    if(field != NULL) {
+        if(len != 1 || (field[0] != '0' && field[0] != '1')) {
+            return sendHTTPCode(fd, 400);
+        }
+        sync.ttl = (field[0] == '1');
+    }
+    sync.now = hashtable_time();
+    sync.capacity = 4096;
+    sync.used = 12;
+    sync.body = malloc(sync.capacity);
+    if(sync.body == NULL) {
+        return sendHTTPCode(fd, 500);
+    }
+
+    cursor = hashtable_sharded_scan(store, cursor, count, storeSyncCollect, &sync);
+    if(sync.failed) {
+        free(sync.body);
+        return sendHTTPCode(fd, 500);
+    }
+
+    storePut32(sync.body, (uint32_t)cursor);
+    storePut32(sync.body + 4, (uint32_t)(cursor >> 32));
+    storePut32(sync.body + 8, sync.count);
+
+    char reply[256];
+    int replylen = snprintf(reply, sizeof(reply),
+    "HTTP/1.1 200 Ok\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n", sync.used);
+
+    struct iovec iov[2] = {
+        { reply, replylen },
+        { sync.body, sync.used }
+    };
+    uint32_t r = writev(fd, iov, 2);
+
+    free(sync.body);
+    return r;
+}
+
+
+
+/*****************************************************************************************************************************************************************************/
+
+
+/**
+ * @brief Parses a buffer containing a HTTP Request into a HTTP Structure by reading headers, HTTP data.
+ * 
+ * @param h 
+ * @param buffer 
+ * @param size 
+ * @return uint32_t 
+ */
+uint32_t requestParseHeaders(http_packet_t *h, char *buffer, size_t size) {
+
+    /* Initialize packet*/
+    h->headers = (http_header_t **)malloc( MAX_HEADERS * sizeof(http_header_t *));
+    
+    memset(h->headers, '\x00', sizeof(http_header_t *) * MAX_HEADERS);
+    /* Header table lives in the packet, it only points at the header lines */
+    headermap_init(&h->headers_table);
+
+    /* Parse HTTP Headers, strtok_r since requests are parsed on several threads at once */
+    char *saveptr = NULL;
+    char *header = strtok_r(buffer, "\r\n", &saveptr);
+    http_header_t *head = NULL;
+    while(header != NULL) {
+
+        head = (http_header_t *)malloc(sizeof(struct http_header_t));
+        size_t len = strlen(header) + 2; // 2 to adjust for \r\n
+        char temp[len + 1];
+
+        memset(temp, '\x00', sizeof(char) * (len + 1));
+        strncpy(temp, header, len - 2);
+        strncat(&temp[strlen(header)], "\r\n", 2);
+
+        head->header = strdup(temp);
+        head->header_size = len;
+        h->headers[h->numberofheaders] = head;
+        h->numberofheaders++;
+
+        if(h->numberofheaders == MAX_HEADERS) {
+            break;
+        }
+
+        h->headersize += head->header_size; 
+
+        /* Check to see if we found end of headers */
+        char pattern[4] = {0x00, 0x0A, 0x0D, 0x0A};
+        if(memcmp( &header[len - 2], pattern, 4) == 0) {
+            h->headersize = h->headersize + 2;
+            break;
+        }
+
+        header = strtok_r(NULL, "\r\n", &saveptr);
+    }
+
+    return h->numberofheaders;
+
+}
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Parses the header structures and inserts them into a hash table for easy manipulation.
+ * 
+ * @param h 
+ * @return uint32_t 
+ */
+uint32_t requestHeadersParseTable(http_packet_t *h) {
+
+    for(uint32_t i = 1; i < h->numberofheaders; i++) {
+        headermap_putline(&h->headers_table, h->headers[i]->header, h->headers[i]->header_size);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Generic method responsible for parsing.
+ * 
+ * @param h 
+ * @param buffer 
+ * @param size 
+ * @return uint32_t 
+ */
+uint32_t requestParse(http_packet_t *h, char *buffer, size_t size) {
+    
+    /* Parse Headers */
+    requestParseHeaders(h, buffer, size);
+
+    /* Split headers into table */
+    requestHeadersParseTable(h);
+
+    /* Parse request type */
+    http_header_t *head = h->headers[0];
+    char *saveptr = NULL;
+    char *method = strtok_r(head->header, " ", &saveptr);
+
+   /* If request is POST, parse the POST data */
+    if(strcmp(method, "POST") == 0) {
+
+        h->datasize = size - h->headersize;
+
+        /* The body is what Content-Length announces, bytes sent after it aren't part of the request */
+        hashmap_str_t *length = headermap_find(&h->headers_table, "Content-Length");
+        if(length != NULL) {
+            size_t announced = strtoul(length->s, NULL, 10);
+            if(announced < h->datasize) {
+                h->datasize = announced;
+            }
+        }
+
+        /* Request data is parsed as a string, terminate it */
+        h->httpData = (char *)malloc(h->datasize + 1);
+
+        memcpy(h->httpData, &buffer[h->headersize], h->datasize);
+        h->httpData[h->datasize] = '\x00';
+
+        h->type = HTTP_POST;
+
+    }
+
+    else if(strcmp(method, "GET") == 0) {
+        h->type = HTTP_GET;
+    }
+
+    else {
+        h->type == HTTP_UNKNOWN;    
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+
+uint32_t requestToBuffer(http_packet_t *h, char *buffer, size_t maxsize) {
+
+    memset(buffer, '\x00', maxsize);
+    int offset = 0;
+    for(uint32_t i = 0; i < h->numberofheaders; i++) {
+        memcpy(buffer+offset, h->headers[i]->header, h->headers[i]->header_size);
+        offset += h->headers[i]->header_size;
+    }
+
+    char delim[2] = {0x0D, 0x0A};
+    memcpy(buffer + offset, delim, 2);
+    offset += 2;
+
+    memcpy(buffer + offset, h->httpData, h->datasize);
+
+    offset += h->datasize;
+
+    return offset;
+
+}
+
+/*****************************************************************************************************************************************************************************/
+
+/**
+ * @brief Responsible for executing instructions as per the HTTP request.
+ * 
+ * @param h 
+ * @return uint32_t 
+ */
+uint32_t requestHandle(http_packet_t *h) {
+
+    /* Perform operation */
+    
+    switch(h->type) {
+
+        case HTTP_POST:
+        
+            char *http_data_copy = strdup(h->httpData);
+            char *saveptr = NULL;
+
+            /* Get command and command data */
+            char *op = strtok_r(http_data_copy, "&", &saveptr);
+            char *opdata = strtok_r(NULL, "&", &saveptr);
+
+            /* STATS, SAVE, BGSAVE, REWRITE, FLUSHALL, SCAN and SYNC may come without command data */
+            if(op != NULL && strcmp(op, "cmd=STATS") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendStats(h->clientfd);
+                }
+                else {
+                    sendCoordinatorStats(h->clientfd);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=SAVE") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendSave(h->clientfd);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=BGSAVE") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendBgsave(h->clientfd);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=REWRITE") == 0) {
+                if(serverType == SERVER_TYPE_STORE && storeLog != NULL) {
+                    sendHTTPCode(h->clientfd, aof_rewrite_start(storeLog) ? 202 : 409);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=FLUSHALL") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendFlush(h->clientfd);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=SYNC") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendSync(h->clientfd, h->httpData);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op != NULL && strcmp(op, "cmd=SCAN") == 0) {
+                if(serverType == SERVER_TYPE_STORE) {
+                    sendScan(h->clientfd, h->httpData);
+                }
+                else {
+                    sendHTTPCode(h->clientfd, 501);
+                }
+                break;
+            }
+
+            if(op == NULL || opdata == NULL) {
+                sendHTTPCode(h->clientfd, 400);
+                break;
+            }
+
+            /* Split op into fields fields*/
+            char *op_field = strtok_r(op, "=", &saveptr);
+            char *op_value = strtok_r(NULL, "=", &saveptr);
+
+            if(op_field == NULL || op_value == NULL) {
+                sendHTTPCode(h->clientfd, 400);
+                break;
+            }
+
+            /* Split op data into fields */
+            char *op_datafield = strtok_r(opdata, "=", &saveptr);
+            char *op_datavalue = strtok_r(NULL, "=", &saveptr);
+
+            if(op_datafield == NULL || op_datavalue == NULL) {
+                sendHTTPCode(h->clientfd, 400);
+                break;
+            }
+
+
+            if(strcmp(op_value, "GET") == 0) {
+                
+                if(serverType == SERVER_TYPE_STORE) {
+                    uint32_t valuelen = 0;
+                    char *value = NULL;
+                    if ( ( value = storeGet(op_datavalue, strlen(op_datavalue), &valuelen)) == NULL) {
+                        sendHTTPCode(h->clientfd, 404);
+                    }
+                    else {
+                        char reply[256];
+                        size_t keylen = strlen(op_datavalue);
+                        int len = snprintf(reply, sizeof(reply),
+                        "HTTP/1.1 200 Ok\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n"
+                        "\r\n", ( keylen + 1 + valuelen));
+
+                        /* The value is a private copy, send headers and key=value in a single call */
+                        struct iovec iov[4] = {
+                            { reply, len },
+                            { op_datavalue, keylen },
+                            { "=", 1 },
+                            { value, valuelen }
+                        };
+                        writev(h->clientfd, iov, 4);
+                        free(value);
+                    }
+                }
+
+                if(serverType == SERVER_TYPE_COORDINATOR) {
+                    ring_element_t *s = coordinatorFindStore(op_datavalue, false);
+                    if(s == NULL) {
+                        sendHTTPCode(h->clientfd, 404);
+                    }
+                    else if(coordinatorForwardMigrating(s, h, op_datavalue, false) < 0) {
+                        sendHTTPCode(h->clientfd, 500);
+                    }
+                }
+                break;                
+            }
+
+            if(strcmp(op_value, "SET") == 0) {
+
+                if(serverType == SERVER_TYPE_STORE) {
+
+                    /* Optional fields after the key give it a time to live in seconds and only set a key that doesn't exist yet:
+                       cmd=SET&key=value&ttl=60&nx=1 */
+                    uint32_t expire = 0;
+                    bool nx = false;
+                    bool valid = true;
+                    size_t parsed = (op_datavalue - http_data_copy) + strlen(op_datavalue);
+                    char *field = (parsed < strlen(h->httpData)) ? http_data_copy + parsed + 1 : NULL;
+                    while(field != NULL && valid) {
+                        char *end = field;
+                        if(strncmp(field, "ttl=", 4) == 0) {
+                            unsigned long seconds = strtoul(field + 4, &end, 10);
+                            uint32_t now = hashtable_time();
+                            valid = (seconds != 0 && seconds <= UINT32_MAX - now);
+                            expire = now + seconds;
+                        }
+                        else if(strncmp(field, "nx=1", 4) == 0) {
+                            nx = true;
+                            end = field + 4;
+                        }
+                        valid = valid && end != field && (*end == '\x00' || *end == '&');
+                        field = (valid && *end == '&') ? end + 1 : NULL;
+                    }
+                    if(valid == false) {
+                        sendHTTPCode(h->clientfd, 400);
+                        break;
+                    }
+
+                    /* Long values are compressed before any lock is taken, the table, the log and the disk all hold them compressed */
+                    uint32_t valuelen = 0;
+                    char *value = compress_value(&storeCompress, storeCompressThreshold, op_datavalue, strlen(op_datavalue), &valuelen);
+
+                    /* With a log, the key's stripe keeps the table and the log in the same order for concurrent writes of the key */
+                    pthread_mutex_t *stripe = (storeLog != NULL) ? aof_lock(storeLog, op_datafield, strlen(op_datafield)) : NULL;
+
+                    /* Inserts new keys and overwrites existing ones in a single probe, a SET without ttl clears any expiry */
+                    int8_t r = 0;
+                    if(storeBitcask != NULL) {
+                        r = (nx) ? bitcask_insert(storeBitcask, op_datafield, strlen(op_datafield), value, valuelen, expire) :
+                        bitcask_put(storeBitcask, op_datafield, strlen(op_datafield), value, valuelen, expire);
+                    }
+                    else {
+                        r = (nx) ? hashtable_sharded_insert(store, op_datafield, strlen(op_datafield), value, valuelen, expire) :
+                        hashtable_sharded_upsert(store, op_datafield, strlen(op_datafield), value, valuelen, expire);
+                    }
+                    uint64_t position = 0;
+                    if(stripe != NULL) {
+                        if(r >= 0) {
+                            position = aof_append(storeLog, AOF_OP_SET, op_datafield, strlen(op_datafield), value, valuelen, expire);
+                        }
+                        pthread_mutex_unlock(stripe);
+                    }
+                    if(value != op_datavalue) {
+                        free(value);
+                    }
+
+                    /* The reply waits for the log, outside the stripe so the whole batch can pile up behind one sync */
+                    if(r >= 0 && stripe != NULL && aof_wait(storeLog, position) == false) {
+                        sendHTTPCode(h->clientfd, 500);
+                    }
+                    else if (r >= 0) {
+                        sendHTTPCode(h->clientfd, 200);
+                    }
+                    else if (r == HASHTABLE_UPSERT_FULL) {
+                        sendHTTPCode(h->clientfd, 507);
+                    }
+                    else if (r == HASHTABLE_UPSERT_EXISTS) {
+                        sendHTTPCode(h->clientfd, 409);
+                    }
+                    else {
+                        sendHTTPCode(h->clientfd, 400);
+                    }
+                }
+                else {
+
+                    /* Insert key into hashring*/
+                    ring_element_t *s = coordinatorFindStore(op_datafield, true);
+                    if(s == NULL) {
+                        sendHTTPCode(h->clientfd, 404);
+                        break;
+                    }
+
+                    /* Forward key, value to calculated store */
+                    if(coordinator_requestForward(s, h) < 0) {
+                        sendHTTPCode(h->clientfd, 500);
+                    }
                 }
                 break;
             }
@@ -391,39 +1729,95 @@ uint32_t requestHandle(http_packet_t *h) {
             if(strcmp(op_value, "REM") == 0) {
 
                 if(serverType == SERVER_TYPE_STORE) {
+                    pthread_mutex_t *stripe = (storeLog != NULL) ? aof_lock(storeLog, op_datavalue, strlen(op_datavalue)) : NULL;
                     bool r = false;
-                    if ( ( r = hashtable_remove(store, op_datavalue)) == false) {
+                    if(storeBitcask != NULL) {
+                        r = bitcask_remove(storeBitcask, op_datavalue, strlen(op_datavalue));
+                    }
+                    else {
+                        r = hashtable_sharded_remove(store, op_datavalue, strlen(op_datavalue));
+                    }
+                    uint64_t position = 0;
+                    if(stripe != NULL) {
+                        if(r) {
+                            position = aof_append(storeLog, AOF_OP_REM, op_datavalue, strlen(op_datavalue), NULL, 0, 0);
+                        }
+                        pthread_mutex_unlock(stripe);
+                    }
+
+                    if (r == false) {
                         sendHTTPCode(h->clientfd, 404);
                     }
+                    else if(stripe != NULL && aof_wait(storeLog, position) == false) {
+                        sendHTTPCode(h->clientfd, 500);
+                    }
                     else {
                         sendHTTPCode(h->clientfd, 200);
                     }
                 }
                 else {
-                    sendHTTPCode(h->clientfd, 501);
+                    ring_element_t *s = coordinatorFindStore(op_datavalue, false);
+                    if(s == NULL) {
+                        sendHTTPCode(h->clientfd, 404);
+                        break;
+                    }
+
+                    /* The store answers whether it had the key, the directory forgets it either way. While keys move, the key
+                       is removed from its old store as well */
+                    if(coordinatorForwardMigrating(s, h, op_datavalue, true) < 0) {
+                        sendHTTPCode(h->clientfd, 500);
+                    }
+                    if(coordinatorStateless == false) {
+                        hashring_removekey(ring, op_datavalue);
+                    }
                 }
                 break;
             }
 
             if(strcmp(op_value, "ADD") == 0) {
 
+                if(serverType == SERVER_TYPE_COORDINATOR && strcmp(op_datafield, "servers") == 0) {
+
+                    /* cmd=ADD&servers=ip:port,ip:port&weight=10, the weight is optional */
+                    unsigned long weight = coordinatorVirtualNodes;
+                    size_t parsed = (op_datavalue - http_data_copy) + strlen(op_datavalue);
+                    if(parsed < strlen(h->httpData)) {
+                        char *rest = http_data_copy + parsed + 1;
+                        char *end = NULL;
+                        if(strncmp(rest, "weight=", 7) != 0 || (weight = strtoul(rest + 7, &end, 10)) > HASHRING_MAXVIRTUALNODES ||
+                        end == rest + 7 || (*end != '\x00' && *end != '&')) {
+                            sendHTTPCode(h->clientfd, 400);
+                            break;
+                        }
+                    }
+                    sendHTTPCode(h->clientfd, coordinatorMembership(op_datavalue, weight, true));
+                    break;
+                }
+
                 if(serverType == SERVER_TYPE_COORDINATOR) {
 
                     ring_element_t *e = NULL;
 
                     /* IP in op_datavalue */
 
-                    char *port = strtok( (op_datavalue + (strlen(op_datavalue) + 1)), "&");
-                    char *weight = strtok(NULL, "&");
+                    char *port = strtok_r( (op_datavalue + (strlen(op_datavalue) + 1)), "&", &saveptr);
+                    char *weight = strtok_r(NULL, "&", &saveptr);
 
-                    char *port_value = strtok(port, "=");
-                    port_value = strtok(NULL, "=");
+                    char *port_value = strtok_r(port, "=", &saveptr);
+                    port_value = strtok_r(NULL, "=", &saveptr);
 
-                    char *weight_value = strtok(weight, "=");
-                    weight_value = strtok(NULL, "=");
+                    char *weight_value = strtok_r(weight, "=", &saveptr);
+                    weight_value = strtok_r(NULL, "=", &saveptr);
 
                     if(port_value != NULL || weight_value != NULL || op_datavalue != NULL ) {
-                        if ( ( e = hashring_addserver(ring, op_datavalue, atoi(port_value), atoi(weight_value)) ) == NULL) {
+                        int code = coordinatorMigrateBegin();
+                        if(code != 200) {
+                            sendHTTPCode(h->clientfd, code);
+                            break;
+                        }
+                        e = hashring_addserver(ring, op_datavalue, atoi(port_value), atoi(weight_value));
+                        coordinatorMigrateStart(e != NULL);
+                        if (e == NULL) {
                             sendHTTPCode(h->clientfd, 400);
                             break;
                         }
@@ -437,141 +1831,721 @@ uint32_t requestHandle(http_packet_t *h) {
                 }
             }
 
-            if(strcmp(op_value, "DEL") == 0) {
+            if(strcmp(op_value, "DEL") == 0) {
+
+                if(serverType == SERVER_TYPE_COORDINATOR && strcmp(op_datafield, "servers") == 0) {
+                    sendHTTPCode(h->clientfd, coordinatorMembership(op_datavalue, 0, false));
+                    break;
+                }
+
+                 if(serverType == SERVER_TYPE_COORDINATOR) {
+
+                    /* IP in op_datavalue */
+
+                    char *port = strtok_r( (op_datavalue + (strlen(op_datavalue) + 1)), "&", &saveptr);
+                    char *port_value = strtok_r(port, "=", &saveptr);
+                    port_value = strtok_r(NULL, "=", &saveptr);
+
+                    if(port_value != NULL || op_datavalue != NULL ) {
+
+                        int code = coordinatorMigrateBegin();
+                        if(code != 200) {
+                            sendHTTPCode(h->clientfd, code);
+                            break;
+                        }
+                        uint32_t removed = hashring_removeserver(ring, op_datavalue, atoi(port_value));
+                        coordinatorMigrateStart(removed == EXIT_SUCCESS);
+                        if (removed != EXIT_SUCCESS)  {
+                            sendHTTPCode(h->clientfd, 404);
+                            break;
+                        }
+                        else {
+                            sendHTTPCode(h->clientfd, 200);
+                            break;
+                        }
+                    }
+                    sendHTTPCode(h->clientfd, 501);
+                    break;
+                }
+            }
+
+            sendHTTPCode(h->clientfd, 400);
+            break;
+
+        case HTTP_GET:
+            sendHTTPCode(h->clientfd, 200);
+            break;
+
+        case HTTP_UNKNOWN:
+            sendHTTPCode(h->clientfd, 501);
+            break;
+    }
+
+    return EXIT_SUCCESS;
+
+}
+
+
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Cleans up a HTTP Request structure by freeing allocated memory.
+ * 
+ * @param h 
+ * @return uint32_t 
+ */
+uint32_t requestDestroy(http_packet_t *h) {
+
+    /* Destroy headers */
+    for(uint32_t i = 0; i < MAX_HEADERS; i++) {
+        if(h->headers[i] != NULL) {
+            free(h->headers[i]->header);
+            free(h->headers[i]);
+        }
+    }
+
+    free(h->originalRequest);
+    free(h->headers);   
+    free(h);
+
+    return EXIT_SUCCESS;
+
+}
+
+/**
+ * @brief Finds the store a key is forwarded to. A stateless coordinator asks the ring, otherwise the key's entry in the
+ * directory names the store, and a key that isn't there yet is added to it when add is set.
+ * 
+ * @param key 
+ * @param add 
+ * @return ring_element_t* the store, NULL if there is none or the key is unknown
+ */
+ring_element_t *coordinatorFindStore(char *key, bool add) {
+
+    if(coordinatorStateless) {
+        return hashring_route(ring, key);
+    }
+
+    ring_element_t *e = (add) ? hashring_addkey(ring, key) : hashring_lookupkey(ring, key);
+    if(e == NULL) {
+        return NULL;
+    }
+
+    return hashring_lookupserver(ring, e->element.data->store, e->element.data->port);
+}
+
+
+
+/**
+ * @brief Adds or removes a list of stores (ip:port,ip:port) as one change of the ring: its tokens are rebuilt and the keys
+ * pointed at their stores once for the whole list. The list is checked first, so either every store joins or leaves or
+ * none does.
+ * 
+ * @param list 
+ * @param weight virtual nodes of every store that joins
+ * @param add 
+ * @return int the HTTP status to reply with
+ */
+int coordinatorMembership(char *list, uint32_t weight, bool add) {
+
+    char *ips[MAX_SERVERS];
+    int ports[MAX_SERVERS];
+    size_t n = 0;
+    char *saveptr = NULL;
+
+    for(char *entry = strtok_r(list, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)) {
+
+        char *colon = strrchr(entry, ':');
+        if(colon == NULL || n == MAX_SERVERS) {
+            return 400;
+        }
+        *colon = '\x00';
+        ips[n] = entry;
+        ports[n] = atoi(colon + 1);
+        if(ports[n] <= 0 || ports[n] > 65535) {
+            return 400;
+        }
+
+        /* Every store once, one that joins must not be in the ring yet and one that leaves must be */
+        for(size_t j = 0; j < n; j++) {
+            if(ports[j] == ports[n] && strcmp(ips[j], ips[n]) == 0) {
+                return 400;
+            }
+        }
+        if((hashring_lookupserver(ring, ips[n], ports[n]) != NULL) == add) {
+            return (add) ? 400 : 404;
+        }
+        n++;
+    }
+
+    if(n == 0) {
+        return 400;
+    }
+
+    int code = coordinatorMigrateBegin();
+    if(code != 200) {
+        return code;
+    }
+
+    hashring_begin(ring);
+    for(size_t i = 0; i < n; i++) {
+        if(add) {
+            hashring_addserver(ring, ips[i], ports[i], weight);
+        }
+        else {
+            hashring_removeserver(ring, ips[i], ports[i]);
+        }
+    }
+
+    code = (hashring_commit(ring) == EXIT_SUCCESS) ? 200 : 500;
+    coordinatorMigrateStart(code == 200);
+    return code;
+}
+
+
+
+/**
+ * @brief Forwards a request to a store and relays the store's reply to the client.
+ * 
+ * @param server 
+ * @param h 
+ * @return int32_t 0, or -1 if the store couldn't be reached
+ */
+int32_t coordinator_requestForward(ring_element_t *server, http_packet_t *h) {
+
+    char *ip = server->element.server->ip;
+    int port = server->element.server->port;
+    struct sockaddr_in serv_addr;
+    socklen_t addr_size;
+
+    if(port < 0 || ip == NULL) {
+        return -1;
+    }
+    
+
+    /* Open a connection to store */
+    int socketfd = -1;
+    if ((socketfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        printf("[-]: Socket creation error \n");
+        return -1;
+    }
+
+    /* If connection fails return a HTTP 500 */
+    
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+
+    // Convert IPv4 and IPv6 addresses from text to binary
+    // form
+    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr)
+        <= 0) {
+        printf("\nInvalid address/ Address not supported \n");
+        close(socketfd);
+        return -1;
+    }
+    addr_size = sizeof(serv_addr);
+    int result = connect(socketfd, (struct sockaddr*)&serv_addr, addr_size);
+    if(result < 0) {
+        close(socketfd);
+        return -1;
+    }
+
+    /* Write */
+    int bytesWritten = write(socketfd, h->originalRequest, h->originalRequestSize);
+
+    /* Read */
+    char buffer[MAX_INPUT_BUFFER] = { 0 };
+    int bytesRead = read(socketfd, buffer, MAX_INPUT_BUFFER);
+
+    /* Return */
+    size_t bytesReturned = write(h->clientfd, buffer, bytesRead);
+
+    /* Close */
+    close(socketfd);
+
+    /* Return */
+    return 0;
+
+}
+
+
+/**
+ * @brief Sends a request to a store and reads its whole reply, for replies the coordinator looks at before the client does.
+ * Every store closes the connection after its reply, so the reply is complete when the connection is.
+ * 
+ * @param server 
+ * @param request the whole HTTP request
+ * @param size 
+ * @param reply set to the reply, headers included and NUL terminated, which the caller frees
+ * @param replylen 
+ * @return int32_t the HTTP status of the reply, -1 if the store couldn't be reached or didn't answer in time
+ */
+int32_t coordinatorExchange(ring_element_t *server, char *request, size_t size, char **reply, size_t *replylen) {
+
+    struct sockaddr_in addr;
+    memset(&addr, '\x00', sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->element.server->port);
+    if(inet_pton(AF_INET, server->element.server->ip, &addr.sin_addr) <= 0) {
+        return -1;
+    }
+
+    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketfd < 0) {
+        return -1;
+    }
+
+    /* A store that hangs mustn't hang the coordinator with it */
+    struct timeval timeout = { COORDINATOR_MIGRATE_TIMEOUT, 0 };
+    setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+    setsockopt(socketfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval));
+    if(connect(socketfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+        close(socketfd);
+        return -1;
+    }
+
+    for(size_t written = 0; written < size; ) {
+        ssize_t n = send(socketfd, request + written, size - written, MSG_NOSIGNAL);
+        if(n <= 0) {
+            close(socketfd);
+            return -1;
+        }
+        written += n;
+    }
+
+    size_t capacity = MAX_INPUT_BUFFER;
+    size_t used = 0;
+    char *buffer = (char *)malloc(capacity + 1);
+    while(buffer != NULL) {
+        if(used == capacity) {
+            char *grown = (char *)realloc(buffer, capacity * 2 + 1);
+            if(grown == NULL) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(socketfd, buffer + used, capacity - used);
+        if(n == 0) {
+            break;
+        }
+        if(n < 0) {
+            free(buffer);
+            buffer = NULL;
+            break;
+        }
+        used += n;
+    }
+    close(socketfd);
+
+    int status = 0;
+    if(buffer == NULL) {
+        return -1;
+    }
+    buffer[used] = '\x00';
+    if(sscanf(buffer, "HTTP/1.1 %d", &status) != 1) {
+        free(buffer);
+        return -1;
+    }
+
+    *reply = buffer;
+    *replylen = used;
+    return status;
+}
+
+
+
+/**
+ * @brief Sends request data, e.g. cmd=GET&key=k, to a store as a POST and reads its reply, see coordinatorExchange.
+ * 
+ * @param server 
+ * @param data 
+ * @param datalen 
+ * @param reply 
+ * @param replylen 
+ * @return int32_t the HTTP status of the reply, -1 on failure
+ */
+int32_t coordinatorRequest(ring_element_t *server, char *data, size_t datalen, char **reply, size_t *replylen) {
+
+    char headers[256];
+    int len = snprintf(headers, sizeof(headers),
+    "POST / HTTP/1.1\r\n"
+    "Host: %s:%d\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n"
+    "\r\n", server->element.server->ip, server->element.server->port, datalen);
+
+    char *request = (char *)malloc(len + datalen);
+    if(request == NULL) {
+        return -1;
+    }
+    memcpy(request, headers, len);
+    memcpy(request + len, data, datalen);
+
+    int32_t status = coordinatorExchange(server, request, len + datalen, reply, replylen);
+    free(request);
+    return status;
+}
+
+
+
+/**
+ * @brief Returns where the body of a reply read by coordinatorExchange starts.
+ * 
+ * @param reply 
+ * @param replylen 
+ * @param bodylen set to the length of the body
+ * @return char* NULL if the reply has no end of headers
+ */
+char *coordinatorReplyBody(char *reply, size_t replylen, size_t *bodylen) {
+
+    /* The headers hold no NUL, the search ends within them even if the body is binary */
+    char *body = strstr(reply, "\r\n\r\n");
+    if(body == NULL) {
+        return NULL;
+    }
+    body += 4;
+    *bodylen = replylen - (body - reply);
+    return body;
+}
+
+
+
+/**
+ * @brief Returns true if two ring elements, possibly of different rings, are the same store.
+ * 
+ * @param a 
+ * @param b 
+ * @return true 
+ * @return false 
+ */
+bool coordinatorSameStore(ring_element_t *a, ring_element_t *b) {
+    return a->element.server->port == b->element.server->port && strcmp(a->element.server->ip, b->element.server->ip) == 0;
+}
+
+
+
+/**
+ * @brief Forwards a request for a key and relays the reply, like coordinator_requestForward. While keys move to new stores,
+ * a key the new store doesn't have yet is asked of the store the ring named before the change. With both set the request
+ * goes to both stores anyway, e.g. a REM, which must not leave the key behind on the old store for the migration to copy.
+ * 
+ * @param server store the ring names now
+ * @param h 
+ * @param key 
+ * @param both 
+ * @return int32_t 0, or -1 if no store could be reached
+ */
+int32_t coordinatorForwardMigrating(ring_element_t *server, http_packet_t *h, char *key, bool both) {
+
+    coordinator_migration_t *m = &coordinatorMigration;
+
+    pthread_rwlock_rdlock(&m->ringlock);
+    ring_element_t *old = (m->previous != NULL) ? hashring_route(m->previous, key) : NULL;
+    if(old == NULL || coordinatorSameStore(old, server)) {
+        pthread_rwlock_unlock(&m->ringlock);
+        return coordinator_requestForward(server, h);
+    }
+
+    char *reply = NULL;
+    size_t replylen = 0;
+    int32_t status = coordinatorExchange(server, h->originalRequest, h->originalRequestSize, &reply, &replylen);
+    if(both || status != 200) {
+        char *oldreply = NULL;
+        size_t oldreplylen = 0;
+        int32_t oldstatus = coordinatorExchange(old, h->originalRequest, h->originalRequestSize, &oldreply, &oldreplylen);
+
+        /* The key hasn't moved yet, the old store answers for it */
+        if(oldstatus == 200 && status != 200) {
+            free(reply);
+            reply = oldreply;
+            replylen = oldreplylen;
+            status = oldstatus;
+        }
+        else if(oldstatus >= 0) {
+            free(oldreply);
+        }
+    }
+    pthread_rwlock_unlock(&m->ringlock);
+
+    if(status < 0) {
+        return -1;
+    }
+    write(h->clientfd, reply, replylen);
+    free(reply);
+    return 0;
+}
 
-                 if(serverType == SERVER_TYPE_COORDINATOR) {
 
-                    /* IP in op_datavalue */
 
-                    char *port = strtok( (op_datavalue + (strlen(op_datavalue) + 1)), "&");
-                    char *port_value = strtok(port, "=");
-                    port_value = strtok(NULL, "=");
+/**
+ * @brief Moves one key fetched from a store to the store the ring names now, if that is another one. The copy is sent with
+ * nx=1, so a value clients wrote to the new store since the change wins over the old one, and the key is then removed from
+ * the old store. If the old store no longer had it, a client removed the key after it was fetched and the copy is removed too.
+ * 
+ * @param source 
+ * @param key NUL terminated
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param ttl seconds the key has left to live, 0 if it never expires
+ */
+void coordinatorMigrateKey(ring_element_t *source, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t ttl) {
 
-                    if(port_value != NULL || op_datavalue != NULL ) {
-                        
-                        if ( ( hashring_removeserver(ring, op_datavalue, atoi(port_value)) ) != EXIT_SUCCESS)  {
-                            sendHTTPCode(h->clientfd, 404);
-                            break;
-                        }
-                        else {
-                            sendHTTPCode(h->clientfd, 200);
-                            break;
-                        }
-                    }
-                    sendHTTPCode(h->clientfd, 501);
-                    break;
-                }
-            }
+    coordinator_migration_t *m = &coordinatorMigration;
+    __atomic_add_fetch(&m->scanned, 1, __ATOMIC_RELAXED);
 
-            if(strcmp(op_value, "SYNC") == 0) {
-                /* Return all keys */
-            }
+    ring_element_t *target = hashring_route(ring, key);
+    if(target == NULL || coordinatorSameStore(target, source)) {
+        return;
+    }
 
+    /* cmd=SET&key=value&ttl=60&nx=1 */
+    char *data = (char *)malloc(keylen + valuelen + 64);
+    if(data == NULL) {
+        __atomic_add_fetch(&m->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t len = snprintf(data, keylen + 64, "cmd=SET&%s=", key);
+    memcpy(data + len, value, valuelen);
+    len += valuelen;
+    if(ttl != 0) {
+        len += snprintf(data + len, 64, "&ttl=%u", ttl);
+    }
+    len += snprintf(data + len, 64, "&nx=1");
+
+    char *reply = NULL;
+    size_t replylen = 0;
+    ratelimiter_wait(&m->bucket, len);
+    __atomic_add_fetch(&m->bytes, len, __ATOMIC_RELAXED);
+    int32_t status = coordinatorRequest(target, data, len, &reply, &replylen);
+    if(status >= 0) {
+        free(reply);
+    }
+    if(status != 200 && status != 409) {
+        __atomic_add_fetch(&m->failed, 1, __ATOMIC_RELAXED);
+        free(data);
+        return;
+    }
 
-            sendHTTPCode(h->clientfd, 400);
-            break;
+    len = snprintf(data, keylen + 64, "cmd=REM&key=%s", key);
+    int32_t removed = coordinatorRequest(source, data, len, &reply, &replylen);
+    if(removed >= 0) {
+        free(reply);
+    }
+    if(status == 200 && removed == 404 && coordinatorRequest(target, data, len, &reply, &replylen) >= 0) {
+        free(reply);
+    }
+    free(data);
 
-        case HTTP_GET:
-            sendHTTPCode(h->clientfd, 200);
-            break;
+    __atomic_add_fetch((status == 200) ? &m->moved : &m->skipped, 1, __ATOMIC_RELAXED);
+}
 
-        case HTTP_UNKNOWN:
-            sendHTTPCode(h->clientfd, 501);
-            break;
-    }
 
-    return EXIT_SUCCESS;
 
+/**
+ * @brief Moves the keys of a store the ring no longer places there, reading the store one SYNC batch at a time.
+ * 
+ * @param source 
+ * @return true 
+ * @return false if the store couldn't be read, keys not read yet stay on it
+ */
+bool coordinatorMigrateStore(ring_element_t *source) {
+
+    coordinator_migration_t *m = &coordinatorMigration;
+    uint64_t cursor = 0;
+    char data[128];
+
+    do {
+
+        char *reply = NULL;
+        size_t replylen = 0;
+        size_t bodylen = 0;
+        int len = snprintf(data, sizeof(data), "cmd=SYNC&cursor=%lu&count=%u&ttl=1", cursor, COORDINATOR_MIGRATE_BATCH);
+        int32_t status = coordinatorRequest(source, data, len, &reply, &replylen);
+        char *body = (status == 200) ? coordinatorReplyBody(reply, replylen, &bodylen) : NULL;
+        if(body == NULL || bodylen < 12) {
+            if(status >= 0) {
+                free(reply);
+            }
+            return false;
+        }
+        ratelimiter_wait(&m->bucket, replylen);
+        __atomic_add_fetch(&m->bytes, replylen, __ATOMIC_RELAXED);
+
+        /* [ next cursor u64 | entries u32 ] followed by entries of [ keylen u32 | valuelen u32 | ttl u32 | key | value ] */
+        cursor = (uint64_t)storeGet32(body) | (uint64_t)storeGet32(body + 4) << 32;
+        uint32_t entries = storeGet32(body + 8);
+        char *p = body + 12;
+        char *end = body + bodylen;
+        for(uint32_t i = 0; i < entries && end - p >= 12; i++) {
+
+            uint32_t keylen = storeGet32(p);
+            uint32_t valuelen = storeGet32(p + 4);
+            uint32_t ttl = storeGet32(p + 8);
+            if((uint64_t)(end - p) < 12ull + keylen + valuelen) {
+                break;
+            }
+
+            char *key = strndup(p + 12, keylen);
+            if(key == NULL) {
+                __atomic_add_fetch(&m->failed, 1, __ATOMIC_RELAXED);
+            }
+            else {
+                coordinatorMigrateKey(source, key, keylen, p + 12 + keylen, valuelen, ttl);
+                free(key);
+            }
+            p += 12 + keylen + valuelen;
+        }
+        free(reply);
+
+    } while(cursor != 0);
+
+    return true;
 }
 
 
-/*****************************************************************************************************************************************************************************/
+
 /**
- * @brief Cleans up a HTTP Request structure by freeing allocated memory.
+ * @brief Migration thread: moves every key the ring places on another store than before the change, then drops the ring from
+ * before the change, which ends the reads from old stores.
  * 
- * @param h 
- * @return uint32_t 
+ * @param data 
+ * @return void* 
  */
-uint32_t requestDestroy(http_packet_t *h) {
+void *coordinatorMigrateWorker(void *data) {
 
-    /* Destroy hash table */
-    hashtable_delete(h->headers_table);
+    coordinator_migration_t *m = &coordinatorMigration;
+    hashring_t *previous = m->previous;
 
-    /* Destroy headers */
-    for(uint32_t i = 0; i < MAX_HEADERS; i++) {
-        if(h->headers[i] != NULL) {
-            free(h->headers[i]->header);
-            free(h->headers[i]);
+    /* With ring, rendezvous and multiprobe placement a store keeps all its keys when others leave, only the keys of the
+       stores that left move. Any other change can move keys of every store */
+    bool joined = false;
+    for(size_t i = 0; i < ring->numberofservers; i++) {
+        ring_element_server_t *s = ring->servers[i]->element.server;
+        joined = joined || hashring_lookupserver(previous, s->ip, s->port) == NULL;
+    }
+    bool keep = (joined == false && ring->placement != HASHRING_PLACEMENT_JUMP && ring->placement != HASHRING_PLACEMENT_MAGLEV);
+
+    ring_element_t **sources = (ring_element_t **)calloc(previous->numberofservers + 1, sizeof(ring_element_t *));
+    uint32_t n = 0;
+    for(size_t i = 0; sources != NULL && i < previous->numberofservers; i++) {
+        ring_element_server_t *s = previous->servers[i]->element.server;
+        if(keep == false || hashring_lookupserver(ring, s->ip, s->port) == NULL) {
+            sources[n++] = previous->servers[i];
         }
     }
+    __atomic_store_n(&m->stores, n, __ATOMIC_RELAXED);
+    printf("[+]: Migration started: %u stores to read, at most %lu bytes/s\n", n, m->rate);
 
-    free(h->originalRequest);
-    free(h->headers);   
-    free(h);
+    for(uint32_t i = 0; i < n; i++) {
+        if(coordinatorMigrateStore(sources[i]) == false) {
+            printf("[!]: Migration couldn't read store %s:%d, its remaining keys stay there\n", sources[i]->element.server->ip,
+            sources[i]->element.server->port);
+        }
+        __atomic_add_fetch(&m->storesdone, 1, __ATOMIC_RELAXED);
+    }
+    free(sources);
 
-    return EXIT_SUCCESS;
+    pthread_rwlock_wrlock(&m->ringlock);
+    m->previous = NULL;
+    pthread_rwlock_unlock(&m->ringlock);
+    hashring_destroy(previous);
 
-}
+    pthread_mutex_lock(&m->lock);
+    m->finished = ratelimiter_now();
+    m->migrations++;
+    m->running = false;
+    pthread_mutex_unlock(&m->lock);
 
-int32_t coordinator_requestForward(ring_element_t *e, http_packet_t *h) {
+    printf("[+]: Migration done in %lu ms: %lu keys read, %lu moved, %lu newer on their new store, %lu failed, %lu bytes\n",
+    (m->finished - m->started) / 1000000, m->scanned, m->moved, m->skipped, m->failed, m->bytes);
 
-    /* Find store object */
-    ring_element_t *server = hashring_lookupserver(ring, e->element.data->store, e->element.data->port);
-    if(server == NULL) {
-        return -1;
-    }
+    return NULL;
+}
 
-    /* Remove -(virtualnodeindicator) if exists */
-    char *ip = strtok(server->element.server->ip, "-");
-    int port = server->element.server->port;
-    struct sockaddr_in serv_addr;
-    socklen_t addr_size;
 
-    if(port < 0 || ip == NULL) {
-        return -1;
-    }
-    
 
-    /* Open a connection to store */
-    int socketfd = -1;
-    if ((socketfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        printf("[-]: Socket creation error \n");
-        return -1;
-    }
+/**
+ * @brief Called before the stores of the ring change. Keeps a copy of the ring as it is, which tells where keys are until they
+ * have moved. Only one change migrates at a time.
+ * 
+ * @return int HTTP status: 200, 409 while a migration runs, 500 if the ring couldn't be copied
+ */
+int coordinatorMigrateBegin(void) {
 
-    /* If connection fails return a HTTP 500 */
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
+    coordinator_migration_t *m = &coordinatorMigration;
 
-    // Convert IPv4 and IPv6 addresses from text to binary
-    // form
-    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr)
-        <= 0) {
-        printf("\nInvalid address/ Address not supported \n");
-        return -1;;
+    pthread_mutex_lock(&m->lock);
+    if(m->running) {
+        pthread_mutex_unlock(&m->lock);
+        return 409;
     }
-    addr_size = sizeof(serv_addr);
-    int result = connect(socketfd, (struct sockaddr*)&serv_addr, addr_size);
-    if(result < 0) {
-        return -1;
+    m->running = true;
+    pthread_mutex_unlock(&m->lock);
+
+    hashring_t *previous = hashring_copy(ring);
+    if(previous == NULL) {
+        pthread_mutex_lock(&m->lock);
+        m->running = false;
+        pthread_mutex_unlock(&m->lock);
+        return 500;
     }
 
-    /* Write */
-    int bytesWritten = write(socketfd, h->originalRequest, h->originalRequestSize);
+    m->started = ratelimiter_now();
+    m->finished = 0;
+    m->stores = 0;
+    m->storesdone = 0;
+    m->scanned = 0;
+    m->moved = 0;
+    m->skipped = 0;
+    m->failed = 0;
+    m->bytes = 0;
+    pthread_mutex_lock(&m->bucket.lock);
+    m->bucket.waited = 0;
+    pthread_mutex_unlock(&m->bucket.lock);
+
+    pthread_rwlock_wrlock(&m->ringlock);
+    m->previous = previous;
+    pthread_rwlock_unlock(&m->ringlock);
+
+    return 200;
+}
 
-    /* Read */
-    char buffer[MAX_INPUT_BUFFER] = { 0 };
-    int bytesRead = read(socketfd, buffer, MAX_INPUT_BUFFER);
 
-    /* Return */
-    size_t bytesReturned = write(h->clientfd, buffer, bytesRead);
 
-    /* Close */
-    close(socketfd);
+/**
+ * @brief Called after the stores of the ring changed, or failed to. Starts moving keys if they did.
+ * 
+ * @param changed 
+ */
+void coordinatorMigrateStart(bool changed) {
 
-    /* Return */
+    coordinator_migration_t *m = &coordinatorMigration;
+
+    if(changed == false) {
+        pthread_rwlock_wrlock(&m->ringlock);
+        hashring_t *previous = m->previous;
+        m->previous = NULL;
+        pthread_rwlock_unlock(&m->ringlock);
+        hashring_destroy(previous);
+
+        pthread_mutex_lock(&m->lock);
+        m->running = false;
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, coordinatorMigrateWorker, NULL) != 0) {
 
+        /* Keys still have to move, the request that changed the ring waits for them instead */
+        coordinatorMigrateWorker(NULL);
+        return;
+    }
+    pthread_detach(thread);
 }
 
 
@@ -585,6 +2559,9 @@ int32_t coordinator_requestForward(ring_element_t *e, http_packet_t *h) {
 void *requestWorker(void *data) {
 
     printf("[+]: HTTP Handler Created (TID: %d)\n", gettid());
+
+    /* Slot in the store's epoch domain, registered on the first request since workers are started before the store exists */
+    int32_t epochid = -1;
     
     while(true) {
 
@@ -595,7 +2572,19 @@ void *requestWorker(void *data) {
         else {
             
             struct queue_entry_t *h = NULL;
-            pthread_mutex_lock(&http_queue->read_lock);
+
+            /* Between requests the worker holds no references into the store, stay offline while waiting for the next one so
+               writers can reclaim memory retired in the meantime */
+            if(epochid >= 0) {
+                hashtable_epoch_offline(store->epoch, epochid);
+            }
+
+            pthread_mutex_lock(&http_queue->lock);
+
+            /* Sleep until there is a request, workers must not spin on the lock the producers need */
+            while (TAILQ_EMPTY(&http_queue->queue) && program_doexit == false) {
+                pthread_cond_wait(&http_queue->notempty, &http_queue->lock);
+            }
 
             /* Extract a request to handle from the queue */
             if (!TAILQ_EMPTY(&http_queue->queue)) {
@@ -605,7 +2594,14 @@ void *requestWorker(void *data) {
                     TAILQ_REMOVE(&http_queue->queue, h, entries);
                 }
             }
-            pthread_mutex_unlock(&http_queue->read_lock);
+            pthread_mutex_unlock(&http_queue->lock);
+
+            if(epochid >= 0) {
+                hashtable_epoch_online(store->epoch, epochid);
+            }
+            else if(store != NULL) {
+                epochid = hashtable_epoch_register(store->epoch);
+            }
 
             if(h != NULL) {
                 /* Handle request */
@@ -632,18 +2628,28 @@ void *requestWorker(void *data) {
  */
 uint32_t serverHandleRequest(int socketfd) {
 
-    char *buffer = (char *)malloc(sizeof(char) * MAX_INPUT_BUFFER);
-    memset(buffer, '\x00', sizeof(char) * MAX_INPUT_BUFFER);
+    size_t capacity = MAX_INPUT_BUFFER;
+    char *buffer = (char *)malloc(sizeof(char) * (capacity + 1));
+    if(buffer == NULL) {
+        return 0;
+    }
 
-    size_t bytesRead = 0;
     size_t totalRead = 0;
-    uint32_t i = 2;
 
-    /* Read */
+    /* Read until the headers and as much data as they announce are in, values can be much larger than one buffer */
     while(true) {
 
-        /* To do: Handle large reads */
-        bytesRead = read(socketfd, buffer + bytesRead, MAX_INPUT_BUFFER);
+        if(totalRead == capacity) {
+            char *newBuffer = realloc(buffer, capacity * 2 + 1);
+            if(newBuffer == NULL) {
+                perror("Failed to allocate larger buffer\n");
+                break;
+            }
+            buffer = newBuffer;
+            capacity *= 2;
+        }
+
+        ssize_t bytesRead = read(socketfd, buffer + totalRead, capacity - totalRead);
 
         if(bytesRead < 0) {
             perror("Error in reading!\n");
@@ -655,26 +2661,25 @@ uint32_t serverHandleRequest(int socketfd) {
             break;
         }
 
-        else {
-            totalRead += bytesRead;
-            if(totalRead == MAX_INPUT_BUFFER) {
-                i = i + 2;
-                char *newBuffer = realloc(buffer, MAX_INPUT_BUFFER * i);
-                if(newBuffer != NULL) {
-                    buffer = newBuffer;
-                    continue;
-                }
-                else {
-                    perror("Failed to allocate larger buffer\n");
+        totalRead += bytesRead;
+        buffer[totalRead] = '\x00';
+
+        char *end = strstr(buffer, "\r\n\r\n");
+        if(end != NULL) {
+            size_t headers = (end - buffer) + 4;
+            size_t length = 0;
+            for(char *line = strstr(buffer, "\r\n"); line != NULL && line < end; line = strstr(line + 2, "\r\n")) {
+                if(strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                    length = strtoul(line + 17, NULL, 10);
                     break;
                 }
             }
-            else {
+            if(totalRead >= headers + length) {
                 break;
             }
         }
-    
     }
+    buffer[totalRead] = '\x00';
 
     /* Allocate */
     http_packet_t *packet = (http_packet_t *) malloc(sizeof(struct http_packet_t));
@@ -691,7 +2696,7 @@ uint32_t serverHandleRequest(int socketfd) {
     packet->originalRequestSize = totalRead;
 
     /* Transform to HTTP Protocol */
-    requestParse(packet, buffer, bytesRead);
+    requestParse(packet, buffer, totalRead);
 
     /* Enqueue request for handling */
     queue_entry_t *entry = (queue_entry_t *)malloc(sizeof(queue_entry_t));
@@ -701,10 +2706,11 @@ uint32_t serverHandleRequest(int socketfd) {
     }
 
     entry->packet = packet;
-    pthread_mutex_lock(&http_queue->write_lock);
+    pthread_mutex_lock(&http_queue->lock);
     TAILQ_INSERT_HEAD(&http_queue->queue, entry, entries);
     http_queue->size++;
-    pthread_mutex_unlock(&http_queue->write_lock);
+    pthread_cond_signal(&http_queue->notempty);
+    pthread_mutex_unlock(&http_queue->lock);
 
     /* Cleanup */
     free(buffer);
@@ -725,7 +2731,7 @@ void *serverHandleAccept(void *data) {
 
     printf("[+]: Accept Handler Created (TID: %d)\n", gettid());
 
-    int clientfd = * (( int* )data);
+    int clientfd = (int)(intptr_t)data;
     serverHandleRequest(clientfd);
 
     printf("[+]: Accept Handler  Finished (TID: %d)\n", gettid());
@@ -753,7 +2759,8 @@ void serverAcceptLoop(int socketfd) {
         pthread_t thread;
 
         /* Spawn new thread for handling the new connection */
-        pthread_create(&thread, NULL, serverHandleAccept, &clientfd);
+        /* The descriptor is passed by value, the next accept would overwrite it before the thread reads it */
+        pthread_create(&thread, NULL, serverHandleAccept, (void *)(intptr_t)clientfd);
         pthread_detach(thread);
 
     }
@@ -812,6 +2819,37 @@ uint32_t serverListen(int port) {
 }
 
 
+/*****************************************************************************************************************************************************************************/
+/**
+ * @brief Active expiry, advances the timing wheels of the store every STORE_EXPIRE_INTERVAL microseconds and removes the keys
+ * that expired. Keys that are looked up are expired on access as well, this reclaims the ones nobody asks for anymore.
+ * 
+ * @param data 
+ * @return void* 
+ */
+void *storeExpireWorker(void *data) {
+
+    /* Expiry peeks at the shard tables without locks, a FLUSHALL may retire them meanwhile */
+    int32_t epochid = hashtable_epoch_register(store->epoch);
+    if(epochid < 0) {
+        printf("[!]: Failed to register the expiry worker, expired keys are only removed when accessed\n");
+        return NULL;
+    }
+
+    while(program_doexit == false) {
+        hashtable_sharded_expire(store, hashtable_time());
+        if(storeBitcask != NULL && storeBitcask->cache != NULL) {
+            hashtable_sharded_expire(storeBitcask->cache, hashtable_time());
+        }
+        hashtable_epoch_offline(store->epoch, epochid);
+        usleep(STORE_EXPIRE_INTERVAL);
+        hashtable_epoch_online(store->epoch, epochid);
+    }
+    hashtable_epoch_unregister(store->epoch, epochid);
+    return NULL;
+}
+
+
 /*****************************************************************************************************************************************************************************/
 /**
  * @brief Transforms the server into a store responsible for insertion, extraction and deletion of data.
@@ -830,7 +2868,103 @@ uint32_t serverBecomeStore(int port) {
     printf("[+]: Started KVP Store server: (%d)\n", gettid());
 
     /* Create and initialize hash table */
-    store = hashtable_create(STORE_TABLEMAXSIZE, hashtable_hash);
+    store = hashtable_sharded_create(STORE_TABLESHARDS, STORE_TABLEINITSIZE, hashtable_hash, storeBackend);
+    if(store == NULL) {
+        printf("[!]: Failed to allocate memory for the store\n");
+        exit(EXIT_FAILURE);
+    }
+    hashtable_sharded_enableslab(store);
+
+    storeLazyfree = hashtable_lazyfree_create();
+    if(storeLazyfree == NULL) {
+        printf("[!]: Failed to start the lazy free thread\n");
+        exit(EXIT_FAILURE);
+    }
+    hashtable_sharded_setlazyfree(store, storeLazyfree);
+
+    if(storeMaxMemory != 0) {
+        hashtable_sharded_setmaxmemory(store, storeMaxMemory, storeEvictionPolicy);
+        printf("[+]: Memory limit %lu bytes\n", storeMaxMemory);
+    }
+
+    /* Seed the hash per process, so a set of keys that collides on one store doesn't collide on any other */
+    hashtable_sharded_setseed(store, hash_randomseed());
+
+    if(storeIndexEnabled) {
+        /* An index per shard, so writers only share an index lock with writers of their own shard */
+        storeIndex = (store_index_t *)calloc(STORE_TABLESHARDS, sizeof(store_index_t));
+        for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+            if(storeIndex == NULL || (storeIndex[i].tree = art_create()) == NULL ||
+               hashtable_setkeyhook(store->shards[i].table, storeIndexHook, &storeIndex[i]) == false) {
+                printf("[!]: Failed to create the key index\n");
+                exit(EXIT_FAILURE);
+            }
+            pthread_rwlock_init(&storeIndex[i].lock, NULL);
+        }
+        hashtable_sharded_setflushhook(store, storeFlushHook, NULL);
+        printf("[+]: Keeping an ordered key index for SCAN\n");
+    }
+
+    /* The segments of a --bitcask store are its log and its snapshot */
+    if(storeBitcaskPath != NULL) {
+        if(storeSnapshotPath != NULL || storeLogPath != NULL) {
+            printf("[!]: A --bitcask store keeps its values in its segments, it can't use --snapshot or --appendonly\n");
+            exit(EXIT_FAILURE);
+        }
+        int64_t replayed = 0;
+        uint64_t dropped = 0;
+        uint64_t start = storeClock();
+        storeBitcask = bitcask_open(store, storeBitcaskPath, storeCacheBytes, &replayed, &dropped);
+        if(storeBitcask == NULL) {
+            printf("[!]: Failed to open the segments in %s\n", storeBitcaskPath);
+            exit(EXIT_FAILURE);
+        }
+        if(dropped != 0) {
+            printf("[!]: Truncated %lu bytes of damaged records in %s\n", dropped, storeBitcaskPath);
+        }
+        printf("[+]: Replayed %ld records from %s in %lu ms\n", replayed, storeBitcaskPath, storeClock() - start);
+    }
+
+    /* The log has every write, a snapshot is only loaded if there is none. A rewrite then adds the snapshot's keys to it */
+    bool replay = (storeLogPath != NULL && access(storeLogPath, F_OK) == 0);
+
+    /* Come back with the keys of the last snapshot. A snapshot that can't be read stops the store, a SAVE would overwrite it */
+    if(replay == false && storeSnapshotPath != NULL && access(storeSnapshotPath, F_OK) == 0) {
+        uint64_t start = storeClock();
+        int64_t loaded = snapshot_load(store, storeSnapshotPath);
+        if(loaded < 0) {
+            printf("[!]: Snapshot %s is damaged or of another version\n", storeSnapshotPath);
+            exit(EXIT_FAILURE);
+        }
+        printf("[+]: Loaded %ld keys from %s in %lu ms\n", loaded, storeSnapshotPath, storeClock() - start);
+    }
+
+    if(storeLogPath != NULL) {
+        int64_t replayed = 0;
+        uint64_t dropped = 0;
+        uint64_t start = storeClock();
+        storeLog = aof_open(store, storeLogPath, storeLogPolicy, storeLogInterval, &replayed, &dropped);
+        if(storeLog == NULL) {
+            printf("[!]: Log %s can't be opened or is of another version\n", storeLogPath);
+            exit(EXIT_FAILURE);
+        }
+        if(dropped != 0) {
+            printf("[!]: Truncated %lu bytes of damaged records at the end of %s\n", dropped, storeLogPath);
+        }
+        printf("[+]: Replayed %ld records from %s in %lu ms\n", replayed, storeLogPath, storeClock() - start);
+
+        /* Compact a log holding more records than there are keys, or a new one that lacks the keys of a snapshot */
+        hashtable_stats_t stats;
+        hashtable_sharded_stats(store, &stats);
+        if((uint64_t)replayed > stats.keys || (replay == false && stats.keys != 0)) {
+            aof_rewrite_start(storeLog);
+        }
+    }
+
+    pthread_t expireWorker;
+    if(pthread_create(&expireWorker, NULL, storeExpireWorker, NULL) != 0) {
+        printf("[!]: Failed to start the expiry worker, expired keys are only removed when accessed\n");
+    }
 
     while(true) {
 
@@ -860,7 +2994,17 @@ uint32_t serverBecomeCoordinator(int port, char *stores) {
     printf("[+]: Started KVP Coordinator server: (%d)\n", gettid());
 
     /* Create and intialize hash ring */
-    ring = hashring_create(4000000, hashring_hash_jenkins);
+    ring = hashring_create_type(hash_wyhash, coordinatorPlacement);
+
+    /* Keys move after ADD and DEL, up to a second of the rate may go out at once */
+    memset(&coordinatorMigration, '\x00', sizeof(coordinator_migration_t));
+    pthread_mutex_init(&coordinatorMigration.lock, NULL);
+    pthread_rwlock_init(&coordinatorMigration.ringlock, NULL);
+    coordinatorMigration.rate = coordinatorMigrateRate;
+    ratelimiter_init(&coordinatorMigration.bucket, (double)coordinatorMigrateRate, (double)coordinatorMigrateRate);
+    if(coordinatorStateless) {
+        printf("[+]: Stateless routing, no directory of keys is kept\n");
+    }
 
     /* Add store servers */
     char *storeline= NULL;
@@ -883,19 +3027,22 @@ uint32_t serverBecomeCoordinator(int port, char *stores) {
     }
 
 
+    /* The ring is built once for all of them */
+    hashring_begin(ring);
     for(uint32_t i = 0; i < size; i++) {
         
         storeip = strtok(servers[i], ":");
         storeport = strtok(NULL, ":");
     
         if (storeip != NULL && storeport != NULL) {
-            hashring_addserver(ring, storeip, atoi(storeport), 10);
+            hashring_addserver(ring, storeip, atoi(storeport), coordinatorVirtualNodes);
         } else {
             fprintf(stderr, "Invalid format in list\n");
         }
         
         free(servers[i]);
     }
+    hashring_commit(ring);
 
     while(true) {
 
@@ -915,15 +3062,26 @@ uint32_t serverBecomeCoordinator(int port, char *stores) {
 void exit_cleanup(void) {
 
     /*
-    Empty queue
-    */
-    free(http_queue);
-
-    /*
-    Destroy key, value store.
+    Destroy key, value store. Whatever still waits for the lazy free thread goes first, it may belong to the store.
     */
+    if(storeLazyfree != NULL) {
+        hashtable_lazyfree_destroy(storeLazyfree);
+    }
     if(store != NULL) {
-        hashtable_delete(store);
+        hashtable_sharded_delete(store);
+    }
+    if(storeIndex != NULL) {
+        for(uint32_t i = 0; i < STORE_TABLESHARDS; i++) {
+            art_destroy(storeIndex[i].tree);
+            pthread_rwlock_destroy(&storeIndex[i].lock);
+        }
+        free(storeIndex);
+    }
+    if(storeLog != NULL) {
+        aof_close(storeLog);
+    }
+    if(storeBitcask != NULL) {
+        bitcask_close(storeBitcask);
     }
 
     if(ring != NULL) {
@@ -931,8 +3089,13 @@ void exit_cleanup(void) {
     }
 
     /* Destory locks */
-    pthread_mutex_destroy(&http_queue->write_lock);
-    pthread_mutex_destroy(&http_queue->read_lock);
+    pthread_mutex_destroy(&http_queue->lock);
+    pthread_cond_destroy(&http_queue->notempty);
+
+    /*
+    Empty queue
+    */
+    free(http_queue);
 
 
 }
@@ -952,9 +3115,11 @@ uint8_t init_httprequestqueue(void) {
         return EXIT_FAILURE;
     }
 
-    /* Setup locks */
-    pthread_mutex_init(&http_queue->write_lock, NULL);
-    pthread_mutex_init(&http_queue->read_lock, NULL);
+    /* Setup queue and locks */
+    TAILQ_INIT(&http_queue->queue);
+    http_queue->size = 0;
+    pthread_mutex_init(&http_queue->lock, NULL);
+    pthread_cond_init(&http_queue->notempty, NULL);
 
     return EXIT_SUCCESS;
 
@@ -987,10 +3152,25 @@ int main(int argc, char **argv) {
         {"store", required_argument, NULL, 's'},
         {"type",  required_argument, NULL, 't'},
         {"port",  required_argument, NULL, 'p'},
+        {"backend", required_argument, NULL, 'b'},
+        {"workers", required_argument, NULL, 'w'},
+        {"maxmemory", required_argument, NULL, 'm'},
+        {"maxmemory-policy", required_argument, NULL, 'e'},
+        {"index", no_argument,       NULL, 'i'},
+        {"snapshot", required_argument, NULL, 'f'},
+        {"appendonly", required_argument, NULL, 'a'},
+        {"fsync", required_argument, NULL, 'y'},
+        {"bitcask", required_argument, NULL, 'k'},
+        {"cache", required_argument, NULL, 'c'},
+        {"compress", required_argument, NULL, 'z'},
+        {"stateless", no_argument,   NULL, 'l'},
+        {"placement", required_argument, NULL, 'r'},
+        {"vnodes", required_argument, NULL, 'n'},
+        {"migrate-rate", required_argument, NULL, 'g'},
         {NULL,    0,                 NULL,  0 }
     };
 
-    while( (opt = getopt_long(argc, argv, "t:s:p:h?", long_options, NULL)) != -1) {
+    while( (opt = getopt_long(argc, argv, "t:s:p:b:w:m:e:if:a:y:k:c:z:lr:n:g:h?", long_options, NULL)) != -1) {
 
         switch(opt) {
             case 't':
@@ -1002,6 +3182,117 @@ int main(int argc, char **argv) {
             case 'p':
                 port = atoi(strdup(optarg));
                 break;
+            case 'b':
+                if(strcmp(optarg, "swiss") == 0) {
+                    storeBackend = HASHTABLE_TYPE_SWISS;
+                }
+                else if(strcmp(optarg, "chained") == 0) {
+                    storeBackend = HASHTABLE_TYPE_CHAINED;
+                }
+                else {
+                    help();
+                }
+                break;
+            case 'w':
+                numberOfWorkers = atoi(optarg);
+                if(numberOfWorkers == 0 || numberOfWorkers > MAX_WORKERS) {
+                    help();
+                }
+                break;
+            case 'm':
+                storeMaxMemory = parseMemory(optarg);
+                if(storeMaxMemory == 0) {
+                    help();
+                }
+                break;
+            case 'e':
+                if(strcmp(optarg, "lru") == 0) {
+                    storeEvictionPolicy = HASHTABLE_EVICT_LRU;
+                }
+                else if(strcmp(optarg, "lfu") == 0) {
+                    storeEvictionPolicy = HASHTABLE_EVICT_LFU;
+                }
+                else if(strcmp(optarg, "noeviction") == 0) {
+                    storeEvictionPolicy = HASHTABLE_EVICT_NONE;
+                }
+                else {
+                    help();
+                }
+                break;
+            case 'i':
+                storeIndexEnabled = true;
+                break;
+            case 'f':
+                storeSnapshotPath = strdup(optarg);
+                break;
+            case 'a':
+                storeLogPath = strdup(optarg);
+                break;
+            case 'y':
+                if(strcmp(optarg, "always") == 0) {
+                    storeLogPolicy = AOF_FSYNC_ALWAYS;
+                }
+                else if(strcmp(optarg, "never") == 0) {
+                    storeLogPolicy = AOF_FSYNC_NEVER;
+                }
+                else {
+                    storeLogPolicy = AOF_FSYNC_INTERVAL;
+                    storeLogInterval = atoi(optarg);
+                    if(storeLogInterval == 0) {
+                        help();
+                    }
+                }
+                break;
+            case 'k':
+                storeBitcaskPath = strdup(optarg);
+                break;
+            case 'c':
+                storeCacheBytes = parseMemory(optarg);
+                if(storeCacheBytes == 0) {
+                    help();
+                }
+                break;
+            case 'z':
+                storeCompressThreshold = parseMemory(optarg);
+                if(storeCompressThreshold == 0) {
+                    help();
+                }
+                break;
+            case 'l':
+                coordinatorStateless = true;
+                break;
+            case 'r':
+                if(strcmp(optarg, "ring") == 0) {
+                    coordinatorPlacement = HASHRING_PLACEMENT_RING;
+                }
+                else if(strcmp(optarg, "jump") == 0) {
+                    coordinatorPlacement = HASHRING_PLACEMENT_JUMP;
+                }
+                else if(strcmp(optarg, "maglev") == 0) {
+                    coordinatorPlacement = HASHRING_PLACEMENT_MAGLEV;
+                }
+                else if(strcmp(optarg, "rendezvous") == 0) {
+                    coordinatorPlacement = HASHRING_PLACEMENT_RENDEZVOUS;
+                }
+                else if(strcmp(optarg, "multiprobe") == 0) {
+                    coordinatorPlacement = HASHRING_PLACEMENT_MULTIPROBE;
+                }
+                else {
+                    help();
+                }
+                break;
+            case 'n':
+                coordinatorVirtualNodes = atoi(optarg);
+                if(coordinatorVirtualNodes > HASHRING_MAXVIRTUALNODES) {
+                    help();
+                }
+                break;
+            case 'g':
+                coordinatorMigrateRate = parseMemory(optarg);
+                if(coordinatorMigrateRate == 0 && strcmp(optarg, "0") != 0) {
+                    help();
+                }
+                break;
             case '?':
                 printf("Bad option: %c\n", optopt); 
                 help();
@@ -1033,10 +3324,19 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    /* The store table is sharded and safe to use from every worker, the coordinator's hash ring is not */
+    if(serverType == SERVER_TYPE_COORDINATOR) {
+        numberOfWorkers = 1;
+    }
+    else if(numberOfWorkers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numberOfWorkers = (cpus < 1) ? 1 : ((cpus > MAX_WORKERS) ? MAX_WORKERS : cpus);
+    }
+
     /* Setup request handling workers */
-    printf("[+]: Creating request handlers\n");
+    printf("[+]: Creating %u request handlers\n", numberOfWorkers);
     pthread_t workers[MAX_WORKERS] = { 0 };
-    for(uint32_t i = 0; i < MAX_WORKERS; i++) {
+    for(uint32_t i = 0; i < numberOfWorkers; i++) {
         pthread_create(&workers[i], NULL, requestWorker, NULL);
     }
 
@@ -1057,7 +3357,7 @@ int main(int argc, char **argv) {
     }
 
      /* Wait for workers to finish */
-    for(uint32_t i = 0; i < MAX_WORKERS; i++) {
+    for(uint32_t i = 0; i < numberOfWorkers; i++) {
         void *ret;
         pthread_join(workers[i], &ret);
     }
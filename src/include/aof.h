@@ -0,0 +1,850 @@
+/**
+ * @file aof.h
+ * @author Fruerlund
+ * @brief Append only log of the writes to a sharded store table, with group commit, replay and background rewrites.
+ * @version 0.1
+ * @date 2024-08-10
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef AOF_H
+#define AOF_H
+
+#include "common-defines.h"
+#include "hashtable.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+
+#define AOF_MAGIC                   "DKVAOF"    /*      First bytes of every log, NUL included                              */
+#define AOF_VERSION                 1
+#define AOF_BYTEORDER               0x01020304  /*      Reads back differently on a machine of the other byte order         */
+#define AOF_CHECKSUMSEED            0x6170706c6f67ull   /* Seed of the wyhash checksums                                 */
+#define AOF_STRIPES                 1024        /*      Locks ordering writes to the same key, see aof_lock                 */
+#define AOF_BUFFERSIZE              (256 * 1024)    /* Initial size of the append buffers                               */
+#define AOF_REWRITE_BATCH           1024        /*      Entries copied per scan batch while rewriting                       */
+#define AOF_REWRITE_MINSIZE         (64ull * 1024 * 1024)   /* A log is rewritten once it is at least this big ...      */
+#define AOF_REWRITE_GROWTH          2           /*      ... and this many times its size after the last rewrite             */
+
+#define AOF_OP_SET                  1
+#define AOF_OP_REM                  2
+#define AOF_OP_FLUSH                3           /*      Every key was removed, the record has no key    */
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief When a log is synced to disk.
+ */
+typedef enum aof_fsync_t {
+
+    AOF_FSYNC_ALWAYS,                       /*      Before a write is acknowledged, shared by every write of a batch */
+    AOF_FSYNC_INTERVAL,                     /*      Every interval milliseconds, a crash loses at most that much */
+    AOF_FSYNC_NEVER                         /*      When the kernel gets to it */
+
+} aof_fsync_t;
+
+
+/**
+ * @brief Describes a log file. All integers are in the byte order of the machine that wrote it:
+ * 
+ * [ HEADER | RECORD | RECORD ... ]
+ * 
+ * A record is an aof_record_t followed by the key and, for a SET, the value. Records are replayed front to back, so the last
+ * record of a key decides its value.
+ */
+typedef struct aof_header_t {
+
+    char magic[8];                          /*      AOF_MAGIC                                       */
+    uint32_t version;                       /*      AOF_VERSION                                     */
+    uint32_t byteorder;                     /*      AOF_BYTEORDER                                   */
+
+} aof_header_t;
+
+
+/**
+ * @brief Describes a record, followed by keylen bytes of key and valuelen bytes of value.
+ */
+typedef struct aof_record_t {
+
+    uint8_t op;                             /*      AOF_OP_SET, AOF_OP_REM or AOF_OP_FLUSH          */
+    uint8_t reserved[3];
+    uint32_t keylen;
+    uint32_t valuelen;
+    uint32_t expire;                        /*      Unix time in seconds the key expires at, 0 if it never does */
+    uint64_t checksum;                      /*      Of the fields above, the key and the value      */
+
+} aof_record_t;
+
+
+/**
+ * @brief A growable buffer of serialized records.
+ */
+typedef struct aof_buffer_t {
+
+    char *data;
+    size_t used;
+    size_t capacity;
+
+} aof_buffer_t;
+
+
+/**
+ * @brief Describes an open log. Writers serialize their records into the buffer and a single flusher thread writes and syncs
+ * whatever has accumulated while it was busy with the previous batch, so any number of writers share one fsync.
+ * 
+ * Positions are counted in bytes appended since the log was opened: a writer gets the position behind its record and is durable
+ * once synced reaches it.
+ */
+typedef struct aof_t {
+
+    int fd;
+    char *path;
+    aof_fsync_t policy;
+    uint32_t interval;                      /*      AOF_FSYNC_INTERVAL: Milliseconds between syncs  */
+    hashtable_sharded_t *table;             /*      Table the log is rewritten from                 */
+
+    pthread_mutex_t lock;                   /*      Guards everything below                         */
+    pthread_cond_t pending;                 /*      Signals the flusher that there is work          */
+    pthread_cond_t durable;                 /*      Signals writers that synced moved               */
+    aof_buffer_t buffer;                    /*      Records appended but not yet written            */
+    uint64_t appended;                      /*      Position behind the last record appended        */
+    uint64_t written;                       /*      Position behind the last record written         */
+    uint64_t synced;                        /*      Position behind the last record synced          */
+    uint64_t size;                          /*      Bytes in the file                               */
+    uint64_t basesize;                      /*      Bytes in the file after the last rewrite        */
+    bool failed;                            /*      A write or sync failed, nothing is acknowledged anymore */
+    bool stop;
+
+    bool rewriting;                         /*      Records are also appended to rewritebuf         */
+    bool rewritedone;                       /*      The rewriter is done, the flusher swaps the files */
+    int rewritefd;                          /*      The log being rewritten                         */
+    int rewritestatus;                      /*      -1 while running, then 0 or 1 if it succeeded   */
+    aof_buffer_t rewritebuf;
+    pthread_cond_t rewritten;               /*      Signals the rewriter that the files were swapped */
+
+    uint64_t records;                       /*      Stats: Records appended                         */
+    uint64_t syncs;                         /*      Stats: Syncs, with records appended per sync that is the batch size */
+    uint64_t rewrites;                      /*      Stats: Completed rewrites                       */
+    uint64_t rewritems;                     /*      Stats: Duration of the last rewrite             */
+
+    pthread_t flusher;
+    pthread_mutex_t stripes[AOF_STRIPES];
+
+} aof_t;
+
+
+/**
+ * @brief Describes a rewrite while the table is copied into the new log.
+ */
+typedef struct aof_rewriter_t {
+
+    aof_buffer_t buffer;
+    uint32_t now;                           /*      Expired keys are left out                       */
+    bool failed;                            /*      Set if the buffer couldn't grow                 */
+
+} aof_rewriter_t;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Returns a monotonic timestamp in milliseconds.
+ * 
+ * @return uint64_t 
+ */
+uint64_t aof_clock(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+/**
+ * @brief Makes sure a buffer has room for size more bytes.
+ * 
+ * @param b 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool aof_reserve(aof_buffer_t *b, size_t size) {
+
+    if(b->used + size <= b->capacity) {
+        return true;
+    }
+
+    size_t capacity = (b->capacity == 0) ? AOF_BUFFERSIZE : b->capacity * 2;
+    while(capacity < b->used + size) {
+        capacity *= 2;
+    }
+    char *data = realloc(b->data, capacity);
+    if(data == NULL) {
+        return false;
+    }
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+
+
+/**
+ * @brief Computes the checksum of a record.
+ * 
+ * @param record 
+ * @param key 
+ * @param value 
+ * @return uint64_t 
+ */
+uint64_t aof_checksum(aof_record_t *record, char *key, char *value) {
+
+    uint64_t checksum = hash_wyhash(record, offsetof(aof_record_t, checksum), AOF_CHECKSUMSEED);
+    checksum = hash_wyhash(key, record->keylen, checksum);
+    return hash_wyhash(value, record->valuelen, checksum);
+}
+
+
+
+/**
+ * @brief Serializes a record to the end of a buffer.
+ * 
+ * @param b 
+ * @param op 
+ * @param key 
+ * @param keylen 
+ * @param value NULL for a REM
+ * @param valuelen 
+ * @param expire 
+ * @return true 
+ * @return false if the buffer couldn't grow
+ */
+bool aof_serialize(aof_buffer_t *b, uint8_t op, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+
+    if(aof_reserve(b, sizeof(aof_record_t) + keylen + valuelen) == false) {
+        return false;
+    }
+
+    aof_record_t record;
+    memset(&record, '\x00', sizeof(aof_record_t));
+    record.op = op;
+    record.keylen = keylen;
+    record.valuelen = valuelen;
+    record.expire = expire;
+    record.checksum = aof_checksum(&record, key, value);
+
+    memcpy(b->data + b->used, &record, sizeof(aof_record_t));
+    memcpy(b->data + b->used + sizeof(aof_record_t), key, keylen);
+    if(valuelen != 0) {
+        memcpy(b->data + b->used + sizeof(aof_record_t) + keylen, value, valuelen);
+    }
+    b->used += sizeof(aof_record_t) + keylen + valuelen;
+    return true;
+}
+
+
+
+/**
+ * @brief Writes a whole buffer to a file.
+ * 
+ * @param fd 
+ * @param buffer 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool aof_writeall(int fd, char *buffer, size_t size) {
+
+    while(size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if(n < 0) {
+            return false;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Returns the lock a write to a key has to hold while it changes the table and appends its record. Two writes of the
+ * same key thereby reach the log in the order they reached the table, writes of other keys rarely share a lock.
+ * 
+ * @param aof 
+ * @param key 
+ * @param keylen 
+ * @return pthread_mutex_t* locked
+ */
+pthread_mutex_t *aof_lock(aof_t *aof, char *key, uint32_t keylen) {
+
+    pthread_mutex_t *stripe = &aof->stripes[hash_wyhash(key, keylen, AOF_CHECKSUMSEED) % AOF_STRIPES];
+    pthread_mutex_lock(stripe);
+    return stripe;
+}
+
+
+
+/**
+ * @brief Locks every stripe, for a write that changes every key (a flush). Stripes are taken in order, so two such writes don't
+ * deadlock.
+ * 
+ * @param aof 
+ */
+void aof_lockall(aof_t *aof) {
+
+    for(uint32_t i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_lock(&aof->stripes[i]);
+    }
+}
+
+
+
+/**
+ * @brief Unlocks every stripe, see aof_lockall.
+ * 
+ * @param aof 
+ */
+void aof_unlockall(aof_t *aof) {
+
+    for(uint32_t i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_unlock(&aof->stripes[i]);
+    }
+}
+
+
+
+/**
+ * @brief Appends a record to the log. The record is only buffered, see aof_wait.
+ * 
+ * @param aof 
+ * @param op AOF_OP_SET, AOF_OP_REM or AOF_OP_FLUSH
+ * @param key empty for a FLUSH
+ * @param keylen 
+ * @param value NULL for a REM or a FLUSH
+ * @param valuelen 
+ * @param expire 
+ * @return uint64_t position behind the record, 0 on failure
+ */
+uint64_t aof_append(aof_t *aof, uint8_t op, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+
+    pthread_mutex_lock(&aof->lock);
+
+    if(aof->failed || aof_serialize(&aof->buffer, op, key, keylen, value, valuelen, expire) == false) {
+        aof->failed = true;
+        pthread_mutex_unlock(&aof->lock);
+        return 0;
+    }
+
+    /* A rewrite takes the table as it is now, whatever changes from here on has to follow it into the new log */
+    if(aof->rewriting && aof_serialize(&aof->rewritebuf, op, key, keylen, value, valuelen, expire) == false) {
+        aof->rewriting = false;
+    }
+
+    aof->appended += sizeof(aof_record_t) + keylen + valuelen;
+    aof->records++;
+    uint64_t position = aof->appended;
+
+    pthread_cond_signal(&aof->pending);
+    pthread_mutex_unlock(&aof->lock);
+    return position;
+}
+
+
+
+/**
+ * @brief Waits until a record is as durable as the log's policy asks for. Only AOF_FSYNC_ALWAYS waits for the disk, while the
+ * flusher syncs one batch the next one fills up, so every writer of that batch is acknowledged by the same fsync.
+ * 
+ * @param aof 
+ * @param position returned by aof_append
+ * @return true 
+ * @return false if the record is not and won't be durable
+ */
+bool aof_wait(aof_t *aof, uint64_t position) {
+
+    if(position == 0) {
+        return false;
+    }
+    if(aof->policy != AOF_FSYNC_ALWAYS) {
+        return true;
+    }
+
+    pthread_mutex_lock(&aof->lock);
+    while(aof->synced < position && aof->failed == false) {
+        pthread_cond_wait(&aof->durable, &aof->lock);
+    }
+    bool ok = (aof->synced >= position);
+    pthread_mutex_unlock(&aof->lock);
+    return ok;
+}
+
+
+
+/**
+ * @brief Finishes a rewrite, called by the flusher with the log locked. The records appended since the rewrite began are added
+ * to the new log, which is synced and renamed over the old one. Everything appended so far is then in the new log, so records
+ * waiting in the buffer are dropped and count as synced.
+ * 
+ * @param aof 
+ */
+void aof_rewrite_swap(aof_t *aof) {
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.rewrite", aof->path);
+
+    bool ok = aof->rewriting && aof_writeall(aof->rewritefd, aof->rewritebuf.data, aof->rewritebuf.used);
+    ok = ok && (fsync(aof->rewritefd) == 0) && (rename(tmp, aof->path) == 0);
+
+    if(ok) {
+        struct stat st;
+        close(aof->fd);
+        aof->fd = aof->rewritefd;
+        aof->size = (fstat(aof->fd, &st) == 0) ? (uint64_t)st.st_size : 0;
+        aof->basesize = aof->size;
+        aof->buffer.used = 0;
+        aof->written = aof->appended;
+        aof->synced = aof->appended;
+        aof->rewrites++;
+        pthread_cond_broadcast(&aof->durable);
+    }
+    else {
+        close(aof->rewritefd);
+        unlink(tmp);
+    }
+
+    aof->rewritefd = -1;
+    aof->rewriting = false;
+    aof->rewritedone = false;
+    aof->rewritebuf.used = 0;
+    aof->rewritestatus = ok;
+    pthread_cond_broadcast(&aof->rewritten);
+}
+
+
+
+/**
+ * @brief Scan callback, serializes an entry as a SET.
+ * 
+ * @param data 
+ * @param n1 
+ */
+void aof_rewrite_collect(void *data, hashtable_bucket_item *n1) {
+
+    aof_rewriter_t *r = (aof_rewriter_t *)data;
+    if(r->failed || (n1->expire != 0 && n1->expire <= r->now)) {
+        return;
+    }
+    if(aof_serialize(&r->buffer, AOF_OP_SET, n1->key, n1->keylen, HASHTABLE_ITEM_VALUE(n1), n1->valuelen, n1->expire) == false) {
+        r->failed = true;
+    }
+}
+
+
+
+/**
+ * @brief Rewrites the log as one SET per key of the table, dropping every overwritten and removed key. The table is scanned in
+ * batches, one shard read locked at a time, while writers keep going: what they change from the start on is collected by
+ * aof_append and written after the scan, so the new log ends up with the same keys and values as the table. Runs in its own
+ * thread, see aof_rewrite_start.
+ * 
+ * @param data aof_t
+ * @return void* 
+ */
+void *aof_rewrite(void *data) {
+
+    aof_t *aof = (aof_t *)data;
+    uint64_t start = aof_clock();
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.rewrite", aof->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    aof_header_t header;
+    memset(&header, '\x00', sizeof(aof_header_t));
+    memcpy(header.magic, AOF_MAGIC, sizeof(AOF_MAGIC));
+    header.version = AOF_VERSION;
+    header.byteorder = AOF_BYTEORDER;
+
+    aof_rewriter_t r;
+    memset(&r, '\x00', sizeof(aof_rewriter_t));
+    r.now = hashtable_time();
+    bool ok = (fd >= 0) && aof_writeall(fd, (char *)&header, sizeof(aof_header_t));
+
+    pthread_mutex_lock(&aof->lock);
+    aof->rewritefd = fd;
+    aof->rewriting = ok;
+    pthread_mutex_unlock(&aof->lock);
+
+    uint64_t cursor = 0;
+    do {
+        cursor = hashtable_sharded_scan(aof->table, cursor, AOF_REWRITE_BATCH, aof_rewrite_collect, &r);
+        if(r.buffer.used >= AOF_BUFFERSIZE || cursor == 0) {
+            ok = ok && (r.failed == false) && aof_writeall(fd, r.buffer.data, r.buffer.used);
+            r.buffer.used = 0;
+
+            /* Move over what writers appended in the meantime, so the flusher has little left to do with the log locked */
+            pthread_mutex_lock(&aof->lock);
+            aof_buffer_t pending = aof->rewritebuf;
+            aof->rewritebuf = r.buffer;
+            ok = ok && aof->rewriting;
+            pthread_mutex_unlock(&aof->lock);
+            ok = ok && aof_writeall(fd, pending.data, pending.used);
+            pending.used = 0;
+            r.buffer = pending;
+        }
+    } while(ok && cursor != 0);
+    free(r.buffer.data);
+
+    /* The flusher swaps the files, it is the only thread writing to the log */
+    pthread_mutex_lock(&aof->lock);
+    aof->rewritestatus = -1;
+    if(ok) {
+        aof->rewritedone = true;
+        pthread_cond_signal(&aof->pending);
+        while(aof->rewritestatus == -1) {
+            pthread_cond_wait(&aof->rewritten, &aof->lock);
+        }
+        ok = aof->rewritestatus;
+    }
+    else {
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        aof->rewritefd = -1;
+        aof->rewriting = false;
+        aof->rewritebuf.used = 0;
+        aof->rewritestatus = 0;
+        pthread_cond_signal(&aof->pending);
+    }
+    aof->rewritems = aof_clock() - start;
+
+    /* Still locked, aof_close waits for the rewrite and frees the log right after */
+    if(ok) {
+        printf("[+]: Rewrote log %s to %lu bytes in %lu ms\n", aof->path, aof->basesize, aof->rewritems);
+    }
+    else {
+        printf("[!]: Failed to rewrite log %s\n", aof->path);
+    }
+    pthread_mutex_unlock(&aof->lock);
+    return NULL;
+}
+
+
+
+/**
+ * @brief Starts a rewrite in the background, unless one is running already.
+ * 
+ * @param aof 
+ * @return true 
+ * @return false if a rewrite is running or the thread couldn't be started
+ */
+bool aof_rewrite_start(aof_t *aof) {
+
+    pthread_mutex_lock(&aof->lock);
+    if(aof->rewriting || aof->rewritestatus == -1) {
+        pthread_mutex_unlock(&aof->lock);
+        return false;
+    }
+    aof->rewritestatus = -1;
+    pthread_mutex_unlock(&aof->lock);
+
+    pthread_t rewriter;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bool ok = (pthread_create(&rewriter, &attr, aof_rewrite, aof) == 0);
+    pthread_attr_destroy(&attr);
+
+    if(ok == false) {
+        pthread_mutex_lock(&aof->lock);
+        aof->rewritestatus = 0;
+        pthread_mutex_unlock(&aof->lock);
+    }
+    return ok;
+}
+
+
+
+/**
+ * @brief Writes and syncs the log. Takes whatever writers appended, writes it with the log unlocked and syncs it as the policy
+ * asks for. Writers appending meanwhile fill the next batch. Also swaps in a finished rewrite and starts one once the log grew
+ * past AOF_REWRITE_MINSIZE and AOF_REWRITE_GROWTH times its size after the last one.
+ * 
+ * @param data aof_t
+ * @return void* 
+ */
+void *aof_flusher(void *data) {
+
+    aof_t *aof = (aof_t *)data;
+    aof_buffer_t batch;
+    memset(&batch, '\x00', sizeof(aof_buffer_t));
+    uint64_t lastsync = aof_clock();
+
+    pthread_mutex_lock(&aof->lock);
+    while(aof->stop == false || aof->buffer.used != 0 || aof->rewritestatus == -1) {
+
+        if(aof->rewritedone) {
+            aof_rewrite_swap(aof);
+            continue;
+        }
+
+        bool due = (aof->policy == AOF_FSYNC_INTERVAL && aof->synced < aof->written && aof_clock() - lastsync >= aof->interval);
+        if(aof->buffer.used == 0 && due == false) {
+            if(aof->stop && aof->rewritestatus != -1) {
+                break;
+            }
+            if(aof->policy == AOF_FSYNC_INTERVAL && aof->synced < aof->written) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += (long)aof->interval * 1000000;
+                ts.tv_sec += ts.tv_nsec / 1000000000;
+                ts.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&aof->pending, &aof->lock, &ts);
+            }
+            else {
+                pthread_cond_wait(&aof->pending, &aof->lock);
+            }
+            continue;
+        }
+
+        /* Take the batch, writers go on with an empty buffer */
+        aof_buffer_t swap = aof->buffer;
+        aof->buffer = batch;
+        batch = swap;
+        uint64_t position = aof->appended;
+        int fd = aof->fd;
+        pthread_mutex_unlock(&aof->lock);
+
+        bool ok = aof_writeall(fd, batch.data, batch.used);
+        uint64_t bytes = batch.used;
+        batch.used = 0;
+
+        bool sync = (aof->policy == AOF_FSYNC_ALWAYS) || (aof->policy == AOF_FSYNC_INTERVAL && aof_clock() - lastsync >= aof->interval);
+        if(ok && sync) {
+            ok = (fdatasync(fd) == 0);
+            lastsync = aof_clock();
+        }
+
+        pthread_mutex_lock(&aof->lock);
+        if(ok == false) {
+            printf("[!]: Failed to write log %s, writes are refused from now on\n", aof->path);
+            aof->failed = true;
+            pthread_cond_broadcast(&aof->durable);
+            break;
+        }
+        aof->size += bytes;
+        aof->written = position;
+        if(sync) {
+            aof->synced = position;
+            aof->syncs++;
+            pthread_cond_broadcast(&aof->durable);
+        }
+
+        if(aof->size >= AOF_REWRITE_MINSIZE && aof->size >= aof->basesize * AOF_REWRITE_GROWTH && aof->rewritestatus != -1) {
+            pthread_mutex_unlock(&aof->lock);
+            aof_rewrite_start(aof);
+            pthread_mutex_lock(&aof->lock);
+        }
+    }
+    pthread_mutex_unlock(&aof->lock);
+
+    free(batch.data);
+    return NULL;
+}
+
+
+
+/**
+ * @brief Replays a log into a table, SETs and REMs are applied in order. SETs that have expired in the meantime remove the key.
+ * A record that is cut short or fails its checksum ends the log: it is what a crash in the middle of a write leaves behind, so
+ * the file is truncated to the records before it. Must be called before any other thread uses the table.
+ * 
+ * @param st 
+ * @param fd open for reading and writing
+ * @param size size of the file
+ * @param dropped set to the bytes truncated
+ * @return int64_t number of records replayed, -1 if the file is no log of this version
+ */
+int64_t aof_replay(hashtable_sharded_t *st, int fd, uint64_t size, uint64_t *dropped) {
+
+    *dropped = 0;
+    if(size < sizeof(aof_header_t)) {
+        return -1;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    aof_header_t *header = (aof_header_t *)map;
+    if(memcmp(header->magic, AOF_MAGIC, sizeof(AOF_MAGIC)) != 0 || header->version != AOF_VERSION || header->byteorder != AOF_BYTEORDER) {
+        munmap(map, size);
+        return -1;
+    }
+
+    int64_t replayed = 0;
+    uint32_t now = hashtable_time();
+    uint64_t offset = sizeof(aof_header_t);
+
+    while(offset + sizeof(aof_record_t) <= size) {
+
+        aof_record_t record;
+        memcpy(&record, map + offset, sizeof(aof_record_t));
+        uint64_t length = sizeof(aof_record_t) + (uint64_t)record.keylen + record.valuelen;
+        if(length > size - offset) {
+            break;
+        }
+
+        char *key = map + offset + sizeof(aof_record_t);
+        char *value = key + record.keylen;
+        if(aof_checksum(&record, key, value) != record.checksum) {
+            break;
+        }
+
+        if(record.op == AOF_OP_FLUSH) {
+            hashtable_sharded_flush(st);
+        }
+        else if(record.op == AOF_OP_SET && (record.expire == 0 || record.expire > now)) {
+            hashtable_sharded_upsert(st, key, record.keylen, value, record.valuelen, record.expire);
+        }
+        else {
+            hashtable_sharded_remove(st, key, record.keylen);
+        }
+        offset += length;
+        replayed++;
+    }
+    munmap(map, size);
+
+    if(offset < size) {
+        *dropped = size - offset;
+        if(ftruncate(fd, offset) != 0) {
+            return -1;
+        }
+    }
+    return replayed;
+}
+
+
+
+/**
+ * @brief Opens a log, creating it if it doesn't exist, replays it into the table and starts the flusher. Writes must then go
+ * through aof_lock, aof_append and aof_wait. Must be called before any other thread uses the table.
+ * 
+ * @param st 
+ * @param path 
+ * @param policy 
+ * @param interval milliseconds between syncs with AOF_FSYNC_INTERVAL
+ * @param replayed set to the number of records replayed
+ * @param dropped set to the bytes of a damaged tail that were truncated
+ * @return aof_t* NULL if the file can't be opened or is no log of this version
+ */
+aof_t *aof_open(hashtable_sharded_t *st, char *path, aof_fsync_t policy, uint32_t interval, int64_t *replayed, uint64_t *dropped) {
+
+    aof_t *aof = (aof_t *)calloc(1, sizeof(aof_t));
+    if(aof == NULL) {
+        return NULL;
+    }
+
+    aof->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat fs;
+    if(aof->fd < 0 || fstat(aof->fd, &fs) != 0) {
+        goto fail;
+    }
+
+    *replayed = 0;
+    *dropped = 0;
+    if(fs.st_size == 0) {
+        aof_header_t header;
+        memset(&header, '\x00', sizeof(aof_header_t));
+        memcpy(header.magic, AOF_MAGIC, sizeof(AOF_MAGIC));
+        header.version = AOF_VERSION;
+        header.byteorder = AOF_BYTEORDER;
+        if(aof_writeall(aof->fd, (char *)&header, sizeof(aof_header_t)) == false || fsync(aof->fd) != 0) {
+            goto fail;
+        }
+        aof->size = sizeof(aof_header_t);
+    }
+    else {
+        *replayed = aof_replay(st, aof->fd, fs.st_size, dropped);
+        if(*replayed < 0) {
+            goto fail;
+        }
+        aof->size = fs.st_size - *dropped;
+    }
+
+    aof->path = strdup(path);
+    aof->policy = policy;
+    aof->interval = (interval == 0) ? 1 : interval;
+    aof->table = st;
+    aof->basesize = aof->size;
+    aof->rewritefd = -1;
+    pthread_mutex_init(&aof->lock, NULL);
+    pthread_cond_init(&aof->pending, NULL);
+    pthread_cond_init(&aof->durable, NULL);
+    pthread_cond_init(&aof->rewritten, NULL);
+    for(uint32_t i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_init(&aof->stripes[i], NULL);
+    }
+
+    if(aof->path == NULL || pthread_create(&aof->flusher, NULL, aof_flusher, aof) != 0) {
+        free(aof->path);
+        goto fail;
+    }
+    return aof;
+
+fail:
+    if(aof->fd >= 0) {
+        close(aof->fd);
+    }
+    free(aof);
+    return NULL;
+}
+
+
+
+/**
+ * @brief Writes and syncs what is left in the buffer and closes the log. A running rewrite is given up and waited for.
+ * 
+ * @param aof 
+ */
+void aof_close(aof_t *aof) {
+
+    pthread_mutex_lock(&aof->lock);
+    aof->stop = true;
+    aof->rewriting = false;
+    pthread_cond_signal(&aof->pending);
+    pthread_mutex_unlock(&aof->lock);
+    pthread_join(aof->flusher, NULL);
+
+    fsync(aof->fd);
+    close(aof->fd);
+    free(aof->buffer.data);
+    free(aof->rewritebuf.data);
+    free(aof->path);
+    free(aof);
+}
+
+
+
+#endif
@@ -0,0 +1,1004 @@
+/**
+ * @file art.h
+ * @author Fruerlund
+ * @brief Adaptive radix tree (ART), an ordered set of byte strings used as a secondary index for prefix and range scans.
+ * @version 0.1
+ * @date 2024-08-03
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef ART_H
+#define ART_H
+
+#include "common-defines.h"
+
+#define ART_NODE4                   0x1     /*      Up to 4 children, keys sorted                                       */
+#define ART_NODE16                  0x2     /*      Up to 16 children, keys sorted                                      */
+#define ART_NODE48                  0x3     /*      Up to 48 children, indexed through a 256 byte map                   */
+#define ART_NODE256                 0x4     /*      One child per byte                                                  */
+
+#define ART_MAXPREFIX               10      /*      Prefix bytes stored in a node, longer prefixes are checked at a leaf */
+
+/* Leaves are told apart from nodes by the lowest bit of the pointer */
+#define ART_ISLEAF(p)               (((uintptr_t)(p)) & 1)
+#define ART_SETLEAF(p)              ((art_node_t *)(((uintptr_t)(p)) | 1))
+#define ART_LEAF(p)                 ((art_leaf_t *)(((uintptr_t)(p)) & ~(uintptr_t)1))
+
+#define ART_MIN(a, b)               (((a) < (b)) ? (a) : (b))
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Describes the header every inner node starts with. The prefix holds the bytes that every key below the node shares
+ * (path compression), only the first ART_MAXPREFIX of them are stored.
+ */
+typedef struct art_node_t {
+
+    uint8_t type;                           /*      ART_NODE4, ART_NODE16, ART_NODE48 or ART_NODE256 */
+    uint16_t numberofchildren;
+    uint32_t prefixlen;                     /*      Length of the full prefix                       */
+    uint8_t prefix[ART_MAXPREFIX];
+
+} art_node_t;
+
+
+typedef struct art_node4_t {
+
+    art_node_t n;
+    uint8_t keys[4];
+    art_node_t *children[4];
+
+} art_node4_t;
+
+
+typedef struct art_node16_t {
+
+    art_node_t n;
+    uint8_t keys[16];
+    art_node_t *children[16];
+
+} art_node16_t;
+
+
+typedef struct art_node48_t {
+
+    art_node_t n;
+    uint8_t index[256];                     /*      Byte -> slot in children + 1, 0 if there is no child */
+    art_node_t *children[48];
+
+} art_node48_t;
+
+
+typedef struct art_node256_t {
+
+    art_node_t n;
+    art_node_t *children[256];
+
+} art_node256_t;
+
+
+
+/**
+ * @brief Describes a leaf, a single key.
+ */
+typedef struct art_leaf_t {
+
+    uint32_t keylen;
+    uint8_t key[];
+
+} art_leaf_t;
+
+
+
+/**
+ * @brief Describes an adaptive radix tree. Inner nodes grow from 4 to 16, 48 and 256 children and shrink back as keys are
+ * removed, so a node is never much larger than the children it holds.
+ * 
+ * TREE:
+ *      NODE4 "user:" -> '1' NODE4 -> '\0' LEAF "user:1"
+ *                                 -> '2' LEAF "user:12"
+ *                    -> '9' LEAF "user:9"
+ * 
+ * Keys are compared as bytes, so an in order walk returns them sorted. No key may be a prefix of another key, callers indexing
+ * strings include the NUL terminator in the key.
+ */
+typedef struct art_tree_t {
+
+    art_node_t *root;
+    uint64_t size;                          /*      Number of keys                                  */
+    uint64_t memory;                        /*      Bytes of every node and leaf                    */
+
+} art_tree_t;
+
+
+
+/**
+ * @brief Function prototype for scan callbacks. Returning non zero stops the scan.
+ */
+typedef int (*art_callback)(void *data, const uint8_t *key, uint32_t keylen);
+
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Returns the size of a node of a given type.
+ * 
+ * @param type 
+ * @return size_t 
+ */
+size_t art_nodesize(uint8_t type) {
+
+    switch(type) {
+        case ART_NODE4:     return sizeof(art_node4_t);
+        case ART_NODE16:    return sizeof(art_node16_t);
+        case ART_NODE48:    return sizeof(art_node48_t);
+        default:            return sizeof(art_node256_t);
+    }
+}
+
+
+
+/**
+ * @brief Allocates an empty inner node.
+ * 
+ * @param tree 
+ * @param type 
+ * @return art_node_t* 
+ */
+art_node_t *art_node_create(art_tree_t *tree, uint8_t type) {
+
+    art_node_t *n = (art_node_t *)calloc(1, art_nodesize(type));
+    if(n == NULL) {
+        return NULL;
+    }
+    n->type = type;
+    tree->memory += art_nodesize(type);
+    return n;
+}
+
+
+
+/**
+ * @brief Frees an inner node, not its children.
+ * 
+ * @param tree 
+ * @param n 
+ */
+void art_node_free(art_tree_t *tree, art_node_t *n) {
+
+    tree->memory -= art_nodesize(n->type);
+    free(n);
+}
+
+
+
+/**
+ * @brief Allocates a leaf holding a copy of the key.
+ * 
+ * @param tree 
+ * @param key 
+ * @param keylen 
+ * @return art_leaf_t* 
+ */
+art_leaf_t *art_leaf_create(art_tree_t *tree, const uint8_t *key, uint32_t keylen) {
+
+    art_leaf_t *l = (art_leaf_t *)malloc(sizeof(art_leaf_t) + keylen);
+    if(l == NULL) {
+        return NULL;
+    }
+    l->keylen = keylen;
+    memcpy(l->key, key, keylen);
+    tree->memory += sizeof(art_leaf_t) + keylen;
+    return l;
+}
+
+
+
+/**
+ * @brief Frees a leaf.
+ * 
+ * @param tree 
+ * @param l 
+ */
+void art_leaf_free(art_tree_t *tree, art_leaf_t *l) {
+
+    tree->memory -= sizeof(art_leaf_t) + l->keylen;
+    free(l);
+}
+
+
+
+/**
+ * @brief Creates an empty tree.
+ * 
+ * @return art_tree_t* 
+ */
+art_tree_t *art_create(void) {
+
+    art_tree_t *tree = (art_tree_t *)calloc(1, sizeof(art_tree_t));
+    if(tree == NULL) {
+        return NULL;
+    }
+    tree->memory = sizeof(art_tree_t);
+    return tree;
+}
+
+
+
+/**
+ * @brief Frees a node or leaf and everything below it.
+ * 
+ * @param tree 
+ * @param n 
+ */
+void art_destroy_node(art_tree_t *tree, art_node_t *n) {
+
+    if(n == NULL) {
+        return;
+    }
+    if(ART_ISLEAF(n)) {
+        art_leaf_free(tree, ART_LEAF(n));
+        return;
+    }
+
+    switch(n->type) {
+        case ART_NODE4:
+            for(uint32_t i = 0; i < n->numberofchildren; i++) {
+                art_destroy_node(tree, ((art_node4_t *)n)->children[i]);
+            }
+            break;
+        case ART_NODE16:
+            for(uint32_t i = 0; i < n->numberofchildren; i++) {
+                art_destroy_node(tree, ((art_node16_t *)n)->children[i]);
+            }
+            break;
+        case ART_NODE48:
+            for(uint32_t i = 0; i < 48; i++) {
+                art_destroy_node(tree, ((art_node48_t *)n)->children[i]);
+            }
+            break;
+        default:
+            for(uint32_t i = 0; i < 256; i++) {
+                art_destroy_node(tree, ((art_node256_t *)n)->children[i]);
+            }
+            break;
+    }
+    art_node_free(tree, n);
+}
+
+
+
+/**
+ * @brief Frees every node and leaf and the tree itself.
+ * 
+ * @param tree 
+ */
+void art_destroy(art_tree_t *tree) {
+
+    art_destroy_node(tree, tree->root);
+    free(tree);
+}
+
+
+
+/**
+ * @brief Returns the slot holding the child of a node for a byte, NULL if there is none.
+ * 
+ * @param n 
+ * @param c 
+ * @return art_node_t** 
+ */
+art_node_t **art_findchild(art_node_t *n, uint8_t c) {
+
+    switch(n->type) {
+
+        case ART_NODE4: {
+            art_node4_t *n4 = (art_node4_t *)n;
+            for(uint32_t i = 0; i < n->numberofchildren; i++) {
+                if(n4->keys[i] == c) {
+                    return &n4->children[i];
+                }
+            }
+            return NULL;
+        }
+
+        case ART_NODE16: {
+            art_node16_t *n16 = (art_node16_t *)n;
+            for(uint32_t i = 0; i < n->numberofchildren; i++) {
+                if(n16->keys[i] == c) {
+                    return &n16->children[i];
+                }
+            }
+            return NULL;
+        }
+
+        case ART_NODE48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            return (n48->index[c] != 0) ? &n48->children[n48->index[c] - 1] : NULL;
+        }
+
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            return (n256->children[c] != NULL) ? &n256->children[c] : NULL;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Returns the leaf with the smallest key below a node.
+ * 
+ * @param n 
+ * @return art_leaf_t* 
+ */
+art_leaf_t *art_minimum(art_node_t *n) {
+
+    while(n != NULL && !ART_ISLEAF(n)) {
+
+        switch(n->type) {
+            case ART_NODE4:
+                n = ((art_node4_t *)n)->children[0];
+                break;
+            case ART_NODE16:
+                n = ((art_node16_t *)n)->children[0];
+                break;
+            case ART_NODE48: {
+                art_node48_t *n48 = (art_node48_t *)n;
+                uint32_t i = 0;
+                while(n48->index[i] == 0) {
+                    i++;
+                }
+                n = n48->children[n48->index[i] - 1];
+                break;
+            }
+            default: {
+                art_node256_t *n256 = (art_node256_t *)n;
+                uint32_t i = 0;
+                while(n256->children[i] == NULL) {
+                    i++;
+                }
+                n = n256->children[i];
+                break;
+            }
+        }
+    }
+
+    return (n != NULL) ? ART_LEAF(n) : NULL;
+}
+
+
+
+/**
+ * @brief Compares two byte strings, a string sorts before every longer string it is a prefix of.
+ * 
+ * @param a 
+ * @param alen 
+ * @param b 
+ * @param blen 
+ * @return int 
+ */
+int art_keycmp(const uint8_t *a, uint32_t alen, const uint8_t *b, uint32_t blen) {
+
+    int r = memcmp(a, b, ART_MIN(alen, blen));
+    if(r != 0) {
+        return r;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+
+
+/**
+ * @brief Returns the number of prefix bytes of a node that match the key from depth on. Prefixes longer than ART_MAXPREFIX are
+ * compared against the smallest leaf below the node.
+ * 
+ * @param n 
+ * @param key 
+ * @param keylen 
+ * @param depth 
+ * @return uint32_t 
+ */
+uint32_t art_prefixmismatch(art_node_t *n, const uint8_t *key, uint32_t keylen, uint32_t depth) {
+
+    uint32_t max = ART_MIN(ART_MIN(ART_MAXPREFIX, n->prefixlen), keylen - depth);
+    uint32_t i = 0;
+    for(; i < max; i++) {
+        if(n->prefix[i] != key[depth + i]) {
+            return i;
+        }
+    }
+
+    if(n->prefixlen > ART_MAXPREFIX) {
+        art_leaf_t *l = art_minimum(n);
+        max = ART_MIN(l->keylen, keylen) - depth;
+        for(; i < max; i++) {
+            if(l->key[depth + i] != key[depth + i]) {
+                return i;
+            }
+        }
+    }
+    return i;
+}
+
+
+
+/**
+ * @brief Copies the header of a node into the node replacing it.
+ * 
+ * @param dst 
+ * @param src 
+ */
+void art_copyheader(art_node_t *dst, art_node_t *src) {
+
+    dst->numberofchildren = src->numberofchildren;
+    dst->prefixlen = src->prefixlen;
+    memcpy(dst->prefix, src->prefix, ART_MIN(ART_MAXPREFIX, src->prefixlen));
+}
+
+
+
+/**
+ * @brief Adds a child to a node for a byte that has no child yet. A full node is replaced by the next larger type, ref is where
+ * the node is linked from and gets the replacement.
+ * 
+ * @param tree 
+ * @param n 
+ * @param ref 
+ * @param c 
+ * @param child 
+ * @return true 
+ * @return false 
+ */
+bool art_addchild(art_tree_t *tree, art_node_t *n, art_node_t **ref, uint8_t c, art_node_t *child) {
+
+    switch(n->type) {
+
+        case ART_NODE4: {
+            art_node4_t *n4 = (art_node4_t *)n;
+            if(n->numberofchildren < 4) {
+                uint32_t i = 0;
+                while(i < n->numberofchildren && n4->keys[i] < c) {
+                    i++;
+                }
+                memmove(&n4->keys[i + 1], &n4->keys[i], n->numberofchildren - i);
+                memmove(&n4->children[i + 1], &n4->children[i], (n->numberofchildren - i) * sizeof(art_node_t *));
+                n4->keys[i] = c;
+                n4->children[i] = child;
+                n->numberofchildren++;
+                return true;
+            }
+
+            art_node16_t *n16 = (art_node16_t *)art_node_create(tree, ART_NODE16);
+            if(n16 == NULL) {
+                return false;
+            }
+            art_copyheader(&n16->n, n);
+            memcpy(n16->keys, n4->keys, 4);
+            memcpy(n16->children, n4->children, 4 * sizeof(art_node_t *));
+            *ref = &n16->n;
+            art_node_free(tree, n);
+            return art_addchild(tree, &n16->n, ref, c, child);
+        }
+
+        case ART_NODE16: {
+            art_node16_t *n16 = (art_node16_t *)n;
+            if(n->numberofchildren < 16) {
+                uint32_t i = 0;
+                while(i < n->numberofchildren && n16->keys[i] < c) {
+                    i++;
+                }
+                memmove(&n16->keys[i + 1], &n16->keys[i], n->numberofchildren - i);
+                memmove(&n16->children[i + 1], &n16->children[i], (n->numberofchildren - i) * sizeof(art_node_t *));
+                n16->keys[i] = c;
+                n16->children[i] = child;
+                n->numberofchildren++;
+                return true;
+            }
+
+            art_node48_t *n48 = (art_node48_t *)art_node_create(tree, ART_NODE48);
+            if(n48 == NULL) {
+                return false;
+            }
+            art_copyheader(&n48->n, n);
+            for(uint32_t i = 0; i < 16; i++) {
+                n48->children[i] = n16->children[i];
+                n48->index[n16->keys[i]] = i + 1;
+            }
+            *ref = &n48->n;
+            art_node_free(tree, n);
+            return art_addchild(tree, &n48->n, ref, c, child);
+        }
+
+        case ART_NODE48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            if(n->numberofchildren < 48) {
+                uint32_t slot = 0;
+                while(n48->children[slot] != NULL) {
+                    slot++;
+                }
+                n48->children[slot] = child;
+                n48->index[c] = slot + 1;
+                n->numberofchildren++;
+                return true;
+            }
+
+            art_node256_t *n256 = (art_node256_t *)art_node_create(tree, ART_NODE256);
+            if(n256 == NULL) {
+                return false;
+            }
+            art_copyheader(&n256->n, n);
+            for(uint32_t i = 0; i < 256; i++) {
+                if(n48->index[i] != 0) {
+                    n256->children[i] = n48->children[n48->index[i] - 1];
+                }
+            }
+            *ref = &n256->n;
+            art_node_free(tree, n);
+            return art_addchild(tree, &n256->n, ref, c, child);
+        }
+
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            n256->children[c] = child;
+            n->numberofchildren++;
+            return true;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Removes the child of a node for a byte. A node that got too sparse is replaced by the next smaller type, a node4 left
+ * with a single child is replaced by that child, its prefix prepended to the child's.
+ * 
+ * @param tree 
+ * @param n 
+ * @param ref 
+ * @param c 
+ * @param slot the slot holding the child, from art_findchild
+ */
+void art_removechild(art_tree_t *tree, art_node_t *n, art_node_t **ref, uint8_t c, art_node_t **slot) {
+
+    switch(n->type) {
+
+        case ART_NODE4: {
+            art_node4_t *n4 = (art_node4_t *)n;
+            uint32_t i = slot - n4->children;
+            memmove(&n4->keys[i], &n4->keys[i + 1], n->numberofchildren - 1 - i);
+            memmove(&n4->children[i], &n4->children[i + 1], (n->numberofchildren - 1 - i) * sizeof(art_node_t *));
+            n->numberofchildren--;
+
+            if(n->numberofchildren == 1) {
+                art_node_t *child = n4->children[0];
+                if(!ART_ISLEAF(child)) {
+                    /* The child's prefix becomes node prefix + key byte + child prefix */
+                    uint32_t prefixlen = n->prefixlen;
+                    uint8_t prefix[ART_MAXPREFIX];
+                    memcpy(prefix, n->prefix, ART_MIN(prefixlen, ART_MAXPREFIX));
+                    if(prefixlen < ART_MAXPREFIX) {
+                        prefix[prefixlen] = n4->keys[0];
+                        prefixlen++;
+                    }
+                    if(prefixlen < ART_MAXPREFIX) {
+                        uint32_t sub = ART_MIN(child->prefixlen, ART_MAXPREFIX - prefixlen);
+                        memcpy(&prefix[prefixlen], child->prefix, sub);
+                        prefixlen += sub;
+                    }
+                    memcpy(child->prefix, prefix, ART_MIN(prefixlen, ART_MAXPREFIX));
+                    child->prefixlen += n->prefixlen + 1;
+                }
+                *ref = child;
+                art_node_free(tree, n);
+            }
+            return;
+        }
+
+        case ART_NODE16: {
+            art_node16_t *n16 = (art_node16_t *)n;
+            uint32_t i = slot - n16->children;
+            memmove(&n16->keys[i], &n16->keys[i + 1], n->numberofchildren - 1 - i);
+            memmove(&n16->children[i], &n16->children[i + 1], (n->numberofchildren - 1 - i) * sizeof(art_node_t *));
+            n->numberofchildren--;
+
+            if(n->numberofchildren == 3) {
+                art_node4_t *n4 = (art_node4_t *)art_node_create(tree, ART_NODE4);
+                if(n4 == NULL) {
+                    return;
+                }
+                art_copyheader(&n4->n, n);
+                memcpy(n4->keys, n16->keys, 3);
+                memcpy(n4->children, n16->children, 3 * sizeof(art_node_t *));
+                *ref = &n4->n;
+                art_node_free(tree, n);
+            }
+            return;
+        }
+
+        case ART_NODE48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            n48->children[n48->index[c] - 1] = NULL;
+            n48->index[c] = 0;
+            n->numberofchildren--;
+
+            if(n->numberofchildren == 12) {
+                art_node16_t *n16 = (art_node16_t *)art_node_create(tree, ART_NODE16);
+                if(n16 == NULL) {
+                    return;
+                }
+                art_copyheader(&n16->n, n);
+                uint32_t j = 0;
+                for(uint32_t i = 0; i < 256; i++) {
+                    if(n48->index[i] != 0) {
+                        n16->keys[j] = i;
+                        n16->children[j] = n48->children[n48->index[i] - 1];
+                        j++;
+                    }
+                }
+                *ref = &n16->n;
+                art_node_free(tree, n);
+            }
+            return;
+        }
+
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            n256->children[c] = NULL;
+            n->numberofchildren--;
+
+            if(n->numberofchildren == 37) {
+                art_node48_t *n48 = (art_node48_t *)art_node_create(tree, ART_NODE48);
+                if(n48 == NULL) {
+                    return;
+                }
+                art_copyheader(&n48->n, n);
+                uint32_t j = 0;
+                for(uint32_t i = 0; i < 256; i++) {
+                    if(n256->children[i] != NULL) {
+                        n48->children[j] = n256->children[i];
+                        n48->index[i] = j + 1;
+                        j++;
+                    }
+                }
+                *ref = &n48->n;
+                art_node_free(tree, n);
+            }
+            return;
+        }
+    }
+}
+
+
+
+/**
+ * @brief Inserts a key below a node. See art_insert.
+ * 
+ * @param tree 
+ * @param n 
+ * @param ref where n is linked from
+ * @param key 
+ * @param keylen 
+ * @param depth 
+ * @return int8_t 1 if inserted, 0 if the key exists, -1 on failure
+ */
+int8_t art_insert_recursive(art_tree_t *tree, art_node_t *n, art_node_t **ref, const uint8_t *key, uint32_t keylen, uint32_t depth) {
+
+    /* Empty tree */
+    if(n == NULL) {
+        art_leaf_t *l = art_leaf_create(tree, key, keylen);
+        if(l == NULL) {
+            return -1;
+        }
+        *ref = ART_SETLEAF(l);
+        return 1;
+    }
+
+    /* Reached a leaf, split it into a node4 holding both keys below their common prefix */
+    if(ART_ISLEAF(n)) {
+
+        art_leaf_t *l1 = ART_LEAF(n);
+        if(art_keycmp(l1->key, l1->keylen, key, keylen) == 0) {
+            return 0;
+        }
+
+        art_node_t *split = art_node_create(tree, ART_NODE4);
+        art_leaf_t *l2 = art_leaf_create(tree, key, keylen);
+        if(split == NULL || l2 == NULL) {
+            if(split != NULL) {
+                art_node_free(tree, split);
+            }
+            return -1;
+        }
+
+        uint32_t common = 0;
+        uint32_t max = ART_MIN(l1->keylen, keylen) - depth;
+        while(common < max && l1->key[depth + common] == key[depth + common]) {
+            common++;
+        }
+
+        /* One key is a prefix of the other, there is no byte to tell them apart by */
+        if(common == max) {
+            art_node_free(tree, split);
+            art_leaf_free(tree, l2);
+            return -1;
+        }
+
+        split->prefixlen = common;
+        memcpy(split->prefix, &key[depth], ART_MIN(ART_MAXPREFIX, common));
+        art_addchild(tree, split, ref, l1->key[depth + common], n);
+        art_addchild(tree, split, ref, key[depth + common], ART_SETLEAF(l2));
+        *ref = split;
+        return 1;
+    }
+
+    /* The key leaves the node's prefix, split the prefix with a node4 at the point they differ */
+    if(n->prefixlen > 0) {
+
+        uint32_t mismatch = art_prefixmismatch(n, key, keylen, depth);
+        if(mismatch < n->prefixlen) {
+
+            art_node_t *split = art_node_create(tree, ART_NODE4);
+            art_leaf_t *l = art_leaf_create(tree, key, keylen);
+            if(split == NULL || l == NULL) {
+                if(split != NULL) {
+                    art_node_free(tree, split);
+                }
+                return -1;
+            }
+
+            split->prefixlen = mismatch;
+            memcpy(split->prefix, n->prefix, ART_MIN(ART_MAXPREFIX, mismatch));
+
+            /* What follows the mismatch stays the prefix of the old node, read from a leaf if it wasn't stored */
+            if(n->prefixlen <= ART_MAXPREFIX) {
+                art_addchild(tree, split, ref, n->prefix[mismatch], n);
+                n->prefixlen -= mismatch + 1;
+                memmove(n->prefix, &n->prefix[mismatch + 1], ART_MIN(ART_MAXPREFIX, n->prefixlen));
+            }
+            else {
+                art_leaf_t *min = art_minimum(n);
+                n->prefixlen -= mismatch + 1;
+                art_addchild(tree, split, ref, min->key[depth + mismatch], n);
+                memcpy(n->prefix, &min->key[depth + mismatch + 1], ART_MIN(ART_MAXPREFIX, n->prefixlen));
+            }
+
+            art_addchild(tree, split, ref, key[depth + mismatch], ART_SETLEAF(l));
+            *ref = split;
+            return 1;
+        }
+        depth += n->prefixlen;
+    }
+
+    art_node_t **child = art_findchild(n, key[depth]);
+    if(child != NULL) {
+        return art_insert_recursive(tree, *child, child, key, keylen, depth + 1);
+    }
+
+    art_leaf_t *l = art_leaf_create(tree, key, keylen);
+    if(l == NULL) {
+        return -1;
+    }
+    if(art_addchild(tree, n, ref, key[depth], ART_SETLEAF(l)) == false) {
+        art_leaf_free(tree, l);
+        return -1;
+    }
+    return 1;
+}
+
+
+
+/**
+ * @brief Inserts a key. No key may be a prefix of another.
+ * 
+ * @param tree 
+ * @param key 
+ * @param keylen 
+ * @return int8_t 1 if inserted, 0 if the key exists, -1 on failure
+ */
+int8_t art_insert(art_tree_t *tree, const uint8_t *key, uint32_t keylen) {
+
+    int8_t r = art_insert_recursive(tree, tree->root, &tree->root, key, keylen, 0);
+    if(r == 1) {
+        tree->size++;
+    }
+    return r;
+}
+
+
+
+/**
+ * @brief Removes a key.
+ * 
+ * @param tree 
+ * @param key 
+ * @param keylen 
+ * @return true 
+ * @return false if the key doesn't exist
+ */
+bool art_delete(art_tree_t *tree, const uint8_t *key, uint32_t keylen) {
+
+    art_node_t **ref = &tree->root;
+    art_node_t *n = tree->root;
+    uint32_t depth = 0;
+
+    while(n != NULL) {
+
+        if(ART_ISLEAF(n)) {
+            /* Only the root can be a leaf here, every other leaf is removed through its parent */
+            art_leaf_t *l = ART_LEAF(n);
+            if(art_keycmp(l->key, l->keylen, key, keylen) != 0) {
+                return false;
+            }
+            *ref = NULL;
+            art_leaf_free(tree, l);
+            tree->size--;
+            return true;
+        }
+
+        if(n->prefixlen > 0) {
+            if(art_prefixmismatch(n, key, keylen, depth) < ART_MIN(ART_MAXPREFIX, n->prefixlen)) {
+                return false;
+            }
+            depth += n->prefixlen;
+        }
+        if(depth >= keylen) {
+            return false;
+        }
+
+        art_node_t **child = art_findchild(n, key[depth]);
+        if(child == NULL) {
+            return false;
+        }
+
+        if(ART_ISLEAF(*child)) {
+            art_leaf_t *l = ART_LEAF(*child);
+            if(art_keycmp(l->key, l->keylen, key, keylen) != 0) {
+                return false;
+            }
+            art_removechild(tree, n, ref, key[depth], child);
+            art_leaf_free(tree, l);
+            tree->size--;
+            return true;
+        }
+
+        ref = child;
+        n = *child;
+        depth++;
+    }
+
+    return false;
+}
+
+
+
+/**
+ * @brief Walks the keys below a node in order, skipping the keys that sort before a lower bound. See art_scan.
+ * 
+ * @param n 
+ * @param depth 
+ * @param lo 
+ * @param lolen 
+ * @param bounded false once every key below n is known to be at or above the bound
+ * @param cb 
+ * @param data 
+ * @return int non zero if the callback stopped the scan
+ */
+int art_scan_recursive(art_node_t *n, uint32_t depth, const uint8_t *lo, uint32_t lolen, bool bounded, art_callback cb, void *data) {
+
+    if(n == NULL) {
+        return 0;
+    }
+
+    if(ART_ISLEAF(n)) {
+        art_leaf_t *l = ART_LEAF(n);
+        if(bounded && art_keycmp(l->key, l->keylen, lo, lolen) < 0) {
+            return 0;
+        }
+        return cb(data, l->key, l->keylen);
+    }
+
+    /* Compare the whole prefix against the bound, a subtree whose prefix sorts before it is skipped */
+    if(bounded && n->prefixlen > 0) {
+        const uint8_t *prefix = (n->prefixlen > ART_MAXPREFIX) ? &art_minimum(n)->key[depth] : n->prefix;
+        for(uint32_t i = 0; i < n->prefixlen && bounded; i++) {
+            if(depth + i >= lolen || prefix[i] > lo[depth + i]) {
+                bounded = false;
+            }
+            else if(prefix[i] < lo[depth + i]) {
+                return 0;
+            }
+        }
+    }
+    depth += n->prefixlen;
+    if(depth >= lolen) {
+        bounded = false;
+    }
+
+    /* Children are visited in byte order, only the child on the bound's own path stays bounded */
+    switch(n->type) {
+
+        case ART_NODE4:
+        case ART_NODE16: {
+            uint8_t *keys = (n->type == ART_NODE4) ? ((art_node4_t *)n)->keys : ((art_node16_t *)n)->keys;
+            art_node_t **children = (n->type == ART_NODE4) ? ((art_node4_t *)n)->children : ((art_node16_t *)n)->children;
+            for(uint32_t i = 0; i < n->numberofchildren; i++) {
+                if(bounded && keys[i] < lo[depth]) {
+                    continue;
+                }
+                int r = art_scan_recursive(children[i], depth + 1, lo, lolen, bounded && keys[i] == lo[depth], cb, data);
+                if(r != 0) {
+                    return r;
+                }
+            }
+            break;
+        }
+
+        case ART_NODE48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            for(uint32_t c = bounded ? lo[depth] : 0; c < 256; c++) {
+                if(n48->index[c] == 0) {
+                    continue;
+                }
+                int r = art_scan_recursive(n48->children[n48->index[c] - 1], depth + 1, lo, lolen, bounded && c == lo[depth], cb, data);
+                if(r != 0) {
+                    return r;
+                }
+            }
+            break;
+        }
+
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            for(uint32_t c = bounded ? lo[depth] : 0; c < 256; c++) {
+                if(n256->children[c] == NULL) {
+                    continue;
+                }
+                int r = art_scan_recursive(n256->children[c], depth + 1, lo, lolen, bounded && c == lo[depth], cb, data);
+                if(r != 0) {
+                    return r;
+                }
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * @brief Calls cb for every key at or above a lower bound, in order, until it returns non zero. Subtrees sorting entirely before
+ * the bound are never visited, so a scan costs the depth of the tree plus the keys it returns.
+ * 
+ * @param tree 
+ * @param lo lower bound, NULL to start at the smallest key
+ * @param lolen 
+ * @param cb 
+ * @param data 
+ * @return int non zero if the callback stopped the scan
+ */
+int art_scan(art_tree_t *tree, const uint8_t *lo, uint32_t lolen, art_callback cb, void *data) {
+
+    return art_scan_recursive(tree->root, 0, lo, lolen, lo != NULL && lolen > 0, cb, data);
+}
+
+
+
+#endif
@@ -0,0 +1,1012 @@
+/**
+ * @file bitcask.h
+ * @author Fruerlund
+ * @brief Log structured value storage for a sharded store table: keys stay in memory, values live in segment files on disk.
+ * @version 0.1
+ * @date 2024-08-17
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef BITCASK_H
+#define BITCASK_H
+
+#include "common-defines.h"
+#include "hashtable.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+
+#define BITCASK_SEGMENTSIZE         (64ull * 1024 * 1024)   /* The active segment is sealed once it grows past this     */
+#define BITCASK_STRIPES             1024        /*      Locks ordering writes to the same key, see bitcask_lock             */
+#define BITCASK_COMPACTRATIO        0.5         /*      Sealed segments with less live data than this are compacted         */
+#define BITCASK_COMPACTINTERVAL     1000        /*      Milliseconds between compactor passes, the active segment is synced on each */
+#define BITCASK_CHECKSUMSEED        0x6269746361736bull     /* Seed of the wyhash checksums                             */
+#define BITCASK_TOMBSTONE           0x01        /*      Record flag: the key was removed                                    */
+#define BITCASK_FLUSH               0x02        /*      Record flag: every key was removed, first record of its segment, no key */
+#define BITCASK_READRETRIES         4           /*      Lookups of a key whose segment keeps being compacted under a reader */
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Describes a record in a segment file, followed by keylen bytes of key and valuelen bytes of value. Integers are in the
+ * byte order of the machine that wrote it. Segments are named by their id and replayed in id order, records within a segment
+ * front to back, so the last record of a key decides its value.
+ */
+typedef struct bitcask_record_t {
+
+    uint64_t checksum;                      /*      Of the fields below, the key and the value      */
+    uint32_t keylen;
+    uint32_t valuelen;
+    uint32_t expire;                        /*      Unix time in seconds the key expires at, 0 if it never does */
+    uint32_t flags;                         /*      BITCASK_TOMBSTONE or BITCASK_FLUSH              */
+
+} bitcask_record_t;
+
+
+/**
+ * @brief What the table keeps as the value of a key: where on disk the value is.
+ */
+typedef struct bitcask_locator_t {
+
+    uint64_t offset;                        /*      Of the value in the segment                     */
+    uint32_t segment;                       /*      Id of the segment                               */
+    uint32_t valuelen;
+    uint32_t expire;
+    uint32_t reserved;
+
+} bitcask_locator_t;
+
+
+/**
+ * @brief Describes a segment file. Only the active segment is appended to, a sealed segment is only read until it is compacted.
+ */
+typedef struct bitcask_segment_t {
+
+    uint32_t id;
+    int fd;
+    uint64_t size;                          /*      Bytes appended, or reserved by appends in flight */
+    uint64_t live;                          /*      Bytes of records the table still points at      */
+    uint32_t writers;                       /*      Appends in flight, a segment is not compacted before they are done */
+
+} bitcask_segment_t;
+
+
+/**
+ * @brief Describes the value storage of a table. The table holds a bitcask_locator_t per key, every write appends a record to the
+ * active segment before the locator changes. Segments are looked up by id, an id is never reused.
+ */
+typedef struct bitcask_t {
+
+    char *dir;
+    hashtable_sharded_t *keydir;            /*      The table, key -> bitcask_locator_t             */
+    hashtable_sharded_t *cache;             /*      Recently read values, NULL for none             */
+
+    pthread_rwlock_t lock;                  /*      Guards the segment array, read locked while a value is read */
+    bitcask_segment_t **segments;           /*      Indexed by id, NULL once compacted              */
+    uint32_t capacity;
+
+    pthread_mutex_t appendlock;             /*      Guards the active segment                       */
+    bitcask_segment_t *active;
+    uint32_t flushed;                       /*      Id of the segment starting with the last flush, 0 for none. Older ones are dead */
+
+    uint64_t reads;                         /*      Stats: Values read from disk                    */
+    uint64_t cachehits;                     /*      Stats: Values found in the cache                */
+    uint64_t compactions;                   /*      Stats: Segments compacted                       */
+    uint64_t reclaimed;                     /*      Stats: Bytes of disk given back by compactions  */
+
+    bool stop;
+    pthread_t compactor;
+    pthread_mutex_t stripes[BITCASK_STRIPES];
+
+} bitcask_t;
+
+
+/**
+ * @brief Describes the disk usage of a value storage.
+ */
+typedef struct bitcask_stats_t {
+
+    uint32_t segments;
+    uint64_t bytes;                         /*      Bytes in every segment                          */
+    uint64_t live;                          /*      Bytes of records the table still points at      */
+
+} bitcask_stats_t;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Computes the checksum of a record.
+ * 
+ * @param record 
+ * @param key 
+ * @param value 
+ * @return uint64_t 
+ */
+uint64_t bitcask_checksum(bitcask_record_t *record, char *key, char *value) {
+
+    uint64_t checksum = hash_wyhash(&record->keylen, sizeof(bitcask_record_t) - offsetof(bitcask_record_t, keylen), BITCASK_CHECKSUMSEED);
+    checksum = hash_wyhash(key, record->keylen, checksum);
+    return hash_wyhash(value, record->valuelen, checksum);
+}
+
+
+
+/**
+ * @brief Returns the lock a write to a key has to hold while it appends its record and changes the locator. Two writes of the
+ * same key thereby reach the disk in the order they reach the table.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @return pthread_mutex_t* locked
+ */
+pthread_mutex_t *bitcask_lock(bitcask_t *bc, char *key, uint32_t keylen) {
+
+    pthread_mutex_t *stripe = &bc->stripes[hash_wyhash(key, keylen, BITCASK_CHECKSUMSEED) % BITCASK_STRIPES];
+    pthread_mutex_lock(stripe);
+    return stripe;
+}
+
+
+
+/**
+ * @brief Returns the segment with an id. The segment array must be locked.
+ * 
+ * @param bc 
+ * @param id 
+ * @return bitcask_segment_t* NULL if it was compacted
+ */
+bitcask_segment_t *bitcask_segment(bitcask_t *bc, uint32_t id) {
+    return (id < bc->capacity) ? bc->segments[id] : NULL;
+}
+
+
+
+/**
+ * @brief Opens a segment file, creating it if it doesn't exist, and adds it to the segment array.
+ * 
+ * @param bc 
+ * @param id 
+ * @return bitcask_segment_t* 
+ */
+bitcask_segment_t *bitcask_segment_open(bitcask_t *bc, uint32_t id) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08u.seg", bc->dir, id);
+
+    bitcask_segment_t *seg = (bitcask_segment_t *)calloc(1, sizeof(bitcask_segment_t));
+    if(seg == NULL) {
+        return NULL;
+    }
+    struct stat fs;
+    seg->id = id;
+    seg->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(seg->fd < 0 || fstat(seg->fd, &fs) != 0) {
+        if(seg->fd >= 0) {
+            close(seg->fd);
+        }
+        free(seg);
+        return NULL;
+    }
+    seg->size = fs.st_size;
+
+    pthread_rwlock_wrlock(&bc->lock);
+    if(id >= bc->capacity) {
+        uint32_t capacity = (bc->capacity == 0) ? 64 : bc->capacity;
+        while(capacity <= id) {
+            capacity *= 2;
+        }
+        bitcask_segment_t **segments = realloc(bc->segments, capacity * sizeof(bitcask_segment_t *));
+        if(segments == NULL) {
+            pthread_rwlock_unlock(&bc->lock);
+            close(seg->fd);
+            free(seg);
+            return NULL;
+        }
+        memset(segments + bc->capacity, '\x00', (capacity - bc->capacity) * sizeof(bitcask_segment_t *));
+        bc->segments = segments;
+        bc->capacity = capacity;
+    }
+    bc->segments[id] = seg;
+    pthread_rwlock_unlock(&bc->lock);
+
+    return seg;
+}
+
+
+
+/**
+ * @brief Appends a record to the active segment, sealing it first if it is full. Only the space is reserved with the active
+ * segment locked, appends write their records concurrently.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire 
+ * @param flags 
+ * @param loc set to where the value went
+ * @return bitcask_segment_t* the segment, its writers count must be dropped once the locator is in the table. NULL on failure
+ */
+bitcask_segment_t *bitcask_append(bitcask_t *bc, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire,
+uint32_t flags, bitcask_locator_t *loc) {
+
+    bitcask_record_t record;
+    memset(&record, '\x00', sizeof(bitcask_record_t));
+    record.keylen = keylen;
+    record.valuelen = valuelen;
+    record.expire = expire;
+    record.flags = flags;
+    record.checksum = bitcask_checksum(&record, key, value);
+    uint64_t size = sizeof(bitcask_record_t) + keylen + valuelen;
+
+    pthread_mutex_lock(&bc->appendlock);
+    bitcask_segment_t *seg = bc->active;
+    if(seg->size != 0 && seg->size + size > BITCASK_SEGMENTSIZE) {
+        bitcask_segment_t *next = bitcask_segment_open(bc, seg->id + 1);
+        if(next != NULL) {
+            bc->active = next;
+            seg = next;
+        }
+    }
+    uint64_t offset = seg->size;
+    seg->size += size;
+    __atomic_add_fetch(&seg->writers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bc->appendlock);
+
+    struct iovec iov[3] = {
+        { &record, sizeof(bitcask_record_t) },
+        { key, keylen },
+        { value, valuelen }
+    };
+    if(pwritev(seg->fd, iov, (valuelen != 0) ? 3 : 2, offset) != (ssize_t)size) {
+        __atomic_sub_fetch(&seg->writers, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    loc->segment = seg->id;
+    loc->offset = offset + sizeof(bitcask_record_t) + keylen;
+    loc->valuelen = valuelen;
+    loc->expire = expire;
+    loc->reserved = 0;
+    return seg;
+}
+
+
+
+/**
+ * @brief Reads the locator of a key with its shard read locked. For threads outside the table's epoch domain.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param loc 
+ * @return true 
+ * @return false if the key doesn't exist
+ */
+bool bitcask_locate(bitcask_t *bc, char *key, uint32_t keylen, bitcask_locator_t *loc) {
+
+    hashtable_sharded_t *st = bc->keydir;
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    hashtable_bucket_item *n1 = hashtable_find(shard->table, key, keylen, (uint32_t)hash);
+    bool found = (n1 != NULL && hashtable_item_expired(n1) == false && n1->valuelen == sizeof(bitcask_locator_t));
+    if(found) {
+        memcpy(loc, HASHTABLE_ITEM_VALUE(n1), sizeof(bitcask_locator_t));
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+
+
+/**
+ * @brief Takes the record a locator points at off its segment's live bytes.
+ * 
+ * @param bc 
+ * @param loc 
+ * @param keylen 
+ */
+void bitcask_release(bitcask_t *bc, bitcask_locator_t *loc, uint32_t keylen) {
+
+    pthread_rwlock_rdlock(&bc->lock);
+    bitcask_segment_t *seg = bitcask_segment(bc, loc->segment);
+    if(seg != NULL) {
+        __atomic_sub_fetch(&seg->live, sizeof(bitcask_record_t) + keylen + loc->valuelen, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&bc->lock);
+}
+
+
+
+/**
+ * @brief Reads the value a locator points at.
+ * 
+ * @param bc 
+ * @param loc 
+ * @param buffer at least loc->valuelen bytes
+ * @return true 
+ * @return false if the segment is gone, compacted after the locator was read
+ */
+bool bitcask_read(bitcask_t *bc, bitcask_locator_t *loc, char *buffer) {
+
+    pthread_rwlock_rdlock(&bc->lock);
+    bitcask_segment_t *seg = bitcask_segment(bc, loc->segment);
+    bool ok = (seg != NULL) && (pread(seg->fd, buffer, loc->valuelen, loc->offset) == (ssize_t)loc->valuelen);
+    pthread_rwlock_unlock(&bc->lock);
+
+    __atomic_add_fetch(&bc->reads, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+
+
+/**
+ * @brief Sets a key: appends the value to the active segment and points the table at it. A key the table refuses (over its
+ * memory limit) is removed on disk as well, so the segments never hold a value the table doesn't.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire 
+ * @param nx only set a key that doesn't exist, checked under the key's stripe
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_UPDATED, HASHTABLE_UPSERT_EXISTS, HASHTABLE_UPSERT_FULL or -1 on
+ * failure
+ */
+static int8_t bitcask_write(bitcask_t *bc, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire, bool nx) {
+
+    bitcask_locator_t loc, old;
+    pthread_mutex_t *stripe = bitcask_lock(bc, key, keylen);
+
+    if(nx && bitcask_locate(bc, key, keylen, &old)) {
+        pthread_mutex_unlock(stripe);
+        return HASHTABLE_UPSERT_EXISTS;
+    }
+
+    bitcask_segment_t *seg = bitcask_append(bc, key, keylen, value, valuelen, expire, 0, &loc);
+    if(seg == NULL) {
+        pthread_mutex_unlock(stripe);
+        return -1;
+    }
+
+    bool existed = bitcask_locate(bc, key, keylen, &old);
+    int8_t r = hashtable_sharded_upsert(bc->keydir, key, keylen, (char *)&loc, sizeof(bitcask_locator_t), expire);
+    if(r >= 0) {
+        __atomic_add_fetch(&seg->live, sizeof(bitcask_record_t) + keylen + valuelen, __ATOMIC_RELAXED);
+        if(existed) {
+            bitcask_release(bc, &old, keylen);
+        }
+    }
+    else {
+        bitcask_locator_t tomb;
+        bitcask_segment_t *tseg = bitcask_append(bc, key, keylen, NULL, 0, 0, BITCASK_TOMBSTONE, &tomb);
+        if(tseg != NULL) {
+            __atomic_sub_fetch(&tseg->writers, 1, __ATOMIC_RELAXED);
+        }
+        if(existed && hashtable_sharded_remove(bc->keydir, key, keylen)) {
+            bitcask_release(bc, &old, keylen);
+        }
+    }
+    __atomic_sub_fetch(&seg->writers, 1, __ATOMIC_RELAXED);
+
+    /* The next read fills the cache again, with the value as it is now */
+    if(bc->cache != NULL) {
+        hashtable_sharded_remove(bc->cache, key, keylen);
+    }
+    pthread_mutex_unlock(stripe);
+    return r;
+}
+
+
+
+/**
+ * @brief Sets a key, see bitcask_write.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire 
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_UPDATED, HASHTABLE_UPSERT_FULL or -1 on failure
+ */
+int8_t bitcask_put(bitcask_t *bc, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+    return bitcask_write(bc, key, keylen, value, valuelen, expire, false);
+}
+
+
+
+/**
+ * @brief Sets a key only if it doesn't exist or has expired, see bitcask_write.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire 
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_EXISTS, HASHTABLE_UPSERT_FULL or -1 on failure
+ */
+int8_t bitcask_insert(bitcask_t *bc, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+    return bitcask_write(bc, key, keylen, value, valuelen, expire, true);
+}
+
+
+
+/**
+ * @brief Removes a key: appends a tombstone, so the key stays removed when the segments are replayed.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @return true 
+ * @return false if the key doesn't exist or the tombstone couldn't be written
+ */
+bool bitcask_remove(bitcask_t *bc, char *key, uint32_t keylen) {
+
+    bitcask_locator_t loc, old;
+    pthread_mutex_t *stripe = bitcask_lock(bc, key, keylen);
+
+    if(bitcask_locate(bc, key, keylen, &old) == false) {
+        pthread_mutex_unlock(stripe);
+        return false;
+    }
+
+    bitcask_segment_t *seg = bitcask_append(bc, key, keylen, NULL, 0, 0, BITCASK_TOMBSTONE, &loc);
+    bool removed = (seg != NULL) && hashtable_sharded_remove(bc->keydir, key, keylen);
+    if(seg != NULL) {
+        __atomic_sub_fetch(&seg->writers, 1, __ATOMIC_RELAXED);
+    }
+    if(removed) {
+        bitcask_release(bc, &old, keylen);
+    }
+
+    if(bc->cache != NULL) {
+        hashtable_sharded_remove(bc->cache, key, keylen);
+    }
+    pthread_mutex_unlock(stripe);
+    return removed;
+}
+
+
+
+/**
+ * @brief Returns a copy of the value of a key, from the cache if it is there and otherwise from disk. A value read from disk is
+ * put in the cache, unless the key was written in the meantime. The calling thread must be registered with the table's epoch
+ * domain and online, see hashtable_sharded_get. The copy must be freed by the caller.
+ * 
+ * @param bc 
+ * @param key 
+ * @param keylen 
+ * @param valuelen set to the length of the value
+ * @return char* the value or NULL if the key doesn't exist
+ */
+char *bitcask_get(bitcask_t *bc, char *key, uint32_t keylen, uint32_t *valuelen) {
+
+    if(bc->cache != NULL) {
+        char *value = hashtable_sharded_get(bc->cache, key, keylen, valuelen);
+        if(value != NULL) {
+            __atomic_add_fetch(&bc->cachehits, 1, __ATOMIC_RELAXED);
+            return value;
+        }
+    }
+
+    /* A locator of a segment that is compacted meanwhile is stale, the table points somewhere else by then */
+    for(uint32_t attempt = 0; attempt < BITCASK_READRETRIES; attempt++) {
+
+        uint32_t len = 0;
+        bitcask_locator_t *loc = (bitcask_locator_t *)hashtable_sharded_get(bc->keydir, key, keylen, &len);
+        if(loc == NULL || len != sizeof(bitcask_locator_t)) {
+            free(loc);
+            return NULL;
+        }
+
+        char *value = (char *)malloc(loc->valuelen + 1);
+        if(value == NULL) {
+            free(loc);
+            return NULL;
+        }
+        if(bitcask_read(bc, loc, value) == false) {
+            free(value);
+            free(loc);
+            continue;
+        }
+        value[loc->valuelen] = '\x00';
+        *valuelen = loc->valuelen;
+
+        if(bc->cache != NULL) {
+            bitcask_locator_t now;
+            pthread_mutex_t *stripe = bitcask_lock(bc, key, keylen);
+            if(bitcask_locate(bc, key, keylen, &now) && memcmp(&now, loc, sizeof(bitcask_locator_t)) == 0) {
+                hashtable_sharded_upsert(bc->cache, key, keylen, value, loc->valuelen, loc->expire);
+            }
+            pthread_mutex_unlock(stripe);
+        }
+
+        free(loc);
+        return value;
+    }
+    return NULL;
+}
+
+
+
+/**
+ * @brief Makes a segment the one the last flush started: it and every later segment are alive, every older one is dead and
+ * left to the compactor.
+ * 
+ * @param bc 
+ * @param id 
+ */
+void bitcask_bury(bitcask_t *bc, uint32_t id) {
+
+    pthread_rwlock_rdlock(&bc->lock);
+    __atomic_store_n(&bc->flushed, id, __ATOMIC_RELAXED);
+    for(uint32_t i = 0; i < id && i < bc->capacity; i++) {
+        if(bc->segments[i] != NULL) {
+            __atomic_store_n(&bc->segments[i]->live, 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&bc->lock);
+}
+
+
+
+/**
+ * @brief Removes every key. The flush record starts a new segment and buries every older one, the compactor deletes them in the
+ * background. The table and the cache are swapped for empty ones, see hashtable_sharded_flush. Every stripe is held meanwhile,
+ * so no write of a key is split by the flush.
+ * 
+ * @param bc 
+ * @return true 
+ * @return false if the flush record couldn't be written, the keys are left as they are
+ */
+bool bitcask_flush(bitcask_t *bc) {
+
+    for(uint32_t i = 0; i < BITCASK_STRIPES; i++) {
+        pthread_mutex_lock(&bc->stripes[i]);
+    }
+
+    /* Every append holds a stripe, so none is in flight and the record can go first into a segment of its own */
+    pthread_mutex_lock(&bc->appendlock);
+    if(bc->active->size != 0) {
+        bitcask_segment_t *next = bitcask_segment_open(bc, bc->active->id + 1);
+        if(next != NULL) {
+            bc->active = next;
+        }
+    }
+    bool ok = (bc->active->size == 0);
+    pthread_mutex_unlock(&bc->appendlock);
+
+    bitcask_locator_t loc;
+    bitcask_segment_t *seg = ok ? bitcask_append(bc, "", 0, NULL, 0, 0, BITCASK_FLUSH, &loc) : NULL;
+    ok = (seg != NULL) && (fdatasync(seg->fd) == 0);
+    if(seg != NULL) {
+        __atomic_sub_fetch(&seg->writers, 1, __ATOMIC_RELAXED);
+    }
+
+    if(ok) {
+        bitcask_bury(bc, seg->id);
+        hashtable_sharded_flush(bc->keydir);
+        if(bc->cache != NULL) {
+            hashtable_sharded_flush(bc->cache);
+        }
+    }
+
+    for(uint32_t i = 0; i < BITCASK_STRIPES; i++) {
+        pthread_mutex_unlock(&bc->stripes[i]);
+    }
+    return ok;
+}
+
+
+
+/**
+ * @brief Sums the disk usage over every segment.
+ * 
+ * @param bc 
+ * @param stats 
+ */
+void bitcask_stats(bitcask_t *bc, bitcask_stats_t *stats) {
+
+    memset(stats, '\x00', sizeof(bitcask_stats_t));
+    pthread_rwlock_rdlock(&bc->lock);
+    for(uint32_t i = 0; i < bc->capacity; i++) {
+        if(bc->segments[i] != NULL) {
+            stats->segments++;
+            stats->bytes += bc->segments[i]->size;
+            stats->live += __atomic_load_n(&bc->segments[i]->live, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&bc->lock);
+}
+
+
+
+/**
+ * @brief Compacts a sealed segment. Records the table still points at are appended to the active segment and the table is pointed
+ * at the copies, everything else is dropped. A tombstone, or a record that expired, still hides older records of its key and is
+ * carried over as a tombstone while an older segment exists and the key has no value again. The segment is then deleted. Readers
+ * that still hold one of its locators find it gone and look the key up again.
+ * 
+ * @param bc 
+ * @param seg 
+ * @return true 
+ * @return false if a copy couldn't be written or pointed at, the segment is kept
+ */
+bool bitcask_compact(bitcask_t *bc, bitcask_segment_t *seg) {
+
+    /* Nothing in a segment older than the last flush is alive, not even its tombstones */
+    uint64_t size = (seg->id < __atomic_load_n(&bc->flushed, __ATOMIC_RELAXED)) ? 0 : seg->size;
+
+    char *map = NULL;
+    if(size != 0) {
+        map = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+        if(map == MAP_FAILED) {
+            return false;
+        }
+        madvise(map, seg->size, MADV_SEQUENTIAL);
+    }
+
+    bool older = false;
+    pthread_rwlock_rdlock(&bc->lock);
+    for(uint32_t i = 0; i < seg->id && older == false; i++) {
+        older = (bc->segments[i] != NULL);
+    }
+    pthread_rwlock_unlock(&bc->lock);
+
+    bool ok = true;
+    uint32_t now = hashtable_time();
+    uint64_t offset = 0;
+    while(ok && offset + sizeof(bitcask_record_t) <= size) {
+
+        /* Records are packed, read the header out of the mapping */
+        bitcask_record_t record;
+        memcpy(&record, map + offset, sizeof(bitcask_record_t));
+        char *key = map + offset + sizeof(bitcask_record_t);
+        uint64_t valueoffset = offset + sizeof(bitcask_record_t) + record.keylen;
+        if(valueoffset + record.valuelen > size) {
+            break;
+        }
+        offset = valueoffset + record.valuelen;
+
+        /* Only segments after the flush are left, see bitcask_compactor */
+        if(record.flags & BITCASK_FLUSH) {
+            continue;
+        }
+
+        bitcask_locator_t loc, copy;
+        pthread_mutex_t *stripe = bitcask_lock(bc, key, record.keylen);
+        bool located = bitcask_locate(bc, key, record.keylen, &loc);
+        bool current = located && loc.segment == seg->id && loc.offset == valueoffset;
+        bool expired = (record.expire != 0 && record.expire <= now);
+
+        if(current && expired == false) {
+            bitcask_segment_t *to = bitcask_append(bc, key, record.keylen, map + valueoffset, record.valuelen, record.expire, 0, &copy);
+            if(to == NULL) {
+                ok = false;
+            }
+            else {
+                /* The key's stripe is held, so the entry is still there and only its locator changes */
+                ok = (hashtable_sharded_upsert(bc->keydir, key, record.keylen, (char *)&copy, sizeof(bitcask_locator_t), record.expire) >= 0);
+                if(ok) {
+                    __atomic_add_fetch(&to->live, sizeof(bitcask_record_t) + record.keylen + record.valuelen, __ATOMIC_RELAXED);
+                }
+                __atomic_sub_fetch(&to->writers, 1, __ATOMIC_RELAXED);
+            }
+        }
+        else if(older && located == false && ((record.flags & BITCASK_TOMBSTONE) || expired)) {
+            /* The copy is replayed after every record of the key, so only a key without a value gets one */
+            bitcask_segment_t *to = bitcask_append(bc, key, record.keylen, NULL, 0, 0, BITCASK_TOMBSTONE, &copy);
+            if(to == NULL) {
+                ok = false;
+            }
+            else {
+                __atomic_sub_fetch(&to->writers, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(stripe);
+    }
+
+    if(map != NULL) {
+        munmap(map, size);
+    }
+    if(ok == false || fdatasync(bc->active->fd) != 0) {
+        return false;
+    }
+
+    /* Wait for readers of the segment, from here on they find it gone */
+    pthread_rwlock_wrlock(&bc->lock);
+    bc->segments[seg->id] = NULL;
+    pthread_rwlock_unlock(&bc->lock);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08u.seg", bc->dir, seg->id);
+    unlink(path);
+    close(seg->fd);
+
+    __atomic_add_fetch(&bc->compactions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bc->reclaimed, seg->size, __ATOMIC_RELAXED);
+    free(seg);
+    return true;
+}
+
+
+
+/**
+ * @brief Syncs the active segment every BITCASK_COMPACTINTERVAL and compacts sealed segments that are mostly dead data, and every
+ * segment older than the last flush. Segments are compacted oldest first and a pass stops at a failure, so the segment starting
+ * with the flush record is only compacted, and the record dropped, once no older segment is left.
+ * 
+ * @param data bitcask_t
+ * @return void* 
+ */
+void *bitcask_compactor(void *data) {
+
+    bitcask_t *bc = (bitcask_t *)data;
+
+    while(__atomic_load_n(&bc->stop, __ATOMIC_RELAXED) == false) {
+
+        usleep(BITCASK_COMPACTINTERVAL * 1000);
+
+        pthread_mutex_lock(&bc->appendlock);
+        bitcask_segment_t *active = bc->active;
+        pthread_mutex_unlock(&bc->appendlock);
+        fdatasync(active->fd);
+
+        for(uint32_t id = 0; id < active->id && __atomic_load_n(&bc->stop, __ATOMIC_RELAXED) == false; id++) {
+
+            pthread_rwlock_rdlock(&bc->lock);
+            bitcask_segment_t *seg = bitcask_segment(bc, id);
+            bool compact = (seg != NULL && __atomic_load_n(&seg->writers, __ATOMIC_ACQUIRE) == 0 &&
+            (id < __atomic_load_n(&bc->flushed, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&seg->live, __ATOMIC_RELAXED) < seg->size * BITCASK_COMPACTRATIO));
+            pthread_rwlock_unlock(&bc->lock);
+
+            if(compact && bitcask_compact(bc, seg) == false) {
+                printf("[!]: Failed to compact segment %u of %s\n", id, bc->dir);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+
+/**
+ * @brief Replays a segment into the table. A record that is cut short or fails its checksum ends the segment: it is what a crash
+ * in the middle of a write leaves behind, so the file is truncated to the records before it.
+ * 
+ * @param bc 
+ * @param seg 
+ * @param dropped incremented by the bytes truncated
+ * @return int64_t number of records replayed, -1 on failure
+ */
+int64_t bitcask_replay(bitcask_t *bc, bitcask_segment_t *seg, uint64_t *dropped) {
+
+    if(seg->size == 0) {
+        return 0;
+    }
+    char *map = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, seg->size, MADV_SEQUENTIAL);
+
+    int64_t replayed = 0;
+    uint32_t now = hashtable_time();
+    uint64_t offset = 0;
+
+    while(offset + sizeof(bitcask_record_t) <= seg->size) {
+
+        bitcask_record_t record;
+        memcpy(&record, map + offset, sizeof(bitcask_record_t));
+        uint64_t length = sizeof(bitcask_record_t) + (uint64_t)record.keylen + record.valuelen;
+        char *key = map + offset + sizeof(bitcask_record_t);
+        if(length > seg->size - offset || bitcask_checksum(&record, key, key + record.keylen) != record.checksum) {
+            break;
+        }
+
+        if(record.flags & BITCASK_FLUSH) {
+            hashtable_sharded_flush(bc->keydir);
+            bitcask_bury(bc, seg->id);
+            offset += length;
+            replayed++;
+            continue;
+        }
+
+        bitcask_locator_t loc, old;
+        bool existed = bitcask_locate(bc, key, record.keylen, &old);
+        if((record.flags & BITCASK_TOMBSTONE) || (record.expire != 0 && record.expire <= now)) {
+            hashtable_sharded_remove(bc->keydir, key, record.keylen);
+        }
+        else {
+            loc.segment = seg->id;
+            loc.offset = offset + sizeof(bitcask_record_t) + record.keylen;
+            loc.valuelen = record.valuelen;
+            loc.expire = record.expire;
+            loc.reserved = 0;
+            if(hashtable_sharded_upsert(bc->keydir, key, record.keylen, (char *)&loc, sizeof(bitcask_locator_t), record.expire) >= 0) {
+                seg->live += length;
+            }
+        }
+        if(existed) {
+            bitcask_release(bc, &old, record.keylen);
+        }
+        offset += length;
+        replayed++;
+    }
+    munmap(map, seg->size);
+
+    if(offset < seg->size) {
+        *dropped += seg->size - offset;
+        if(ftruncate(seg->fd, offset) != 0) {
+            return -1;
+        }
+        seg->size = offset;
+    }
+    return replayed;
+}
+
+
+
+/**
+ * @brief Compares segment ids, for qsort.
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+int bitcask_idcmp(const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * @brief Opens the value storage in a directory, creating it if it doesn't exist, replays every segment into the table and
+ * starts the compactor. Writes start a new segment. The cache uses the lazy free thread of the table. Must be called before any
+ * other thread uses the table.
+ * 
+ * @param keydir the table, empty
+ * @param dir 
+ * @param cachebytes memory of the cache of recently read values, 0 for none
+ * @param replayed set to the number of records replayed
+ * @param dropped set to the bytes of damaged records that were truncated
+ * @return bitcask_t* NULL on failure
+ */
+bitcask_t *bitcask_open(hashtable_sharded_t *keydir, char *dir, uint64_t cachebytes, int64_t *replayed, uint64_t *dropped) {
+
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    DIR *d = opendir(dir);
+    if(d == NULL) {
+        return NULL;
+    }
+
+    bitcask_t *bc = (bitcask_t *)calloc(1, sizeof(bitcask_t));
+    if(bc == NULL) {
+        closedir(d);
+        return NULL;
+    }
+    bc->dir = strdup(dir);
+    bc->keydir = keydir;
+    pthread_rwlock_init(&bc->lock, NULL);
+    pthread_mutex_init(&bc->appendlock, NULL);
+    for(uint32_t i = 0; i < BITCASK_STRIPES; i++) {
+        pthread_mutex_init(&bc->stripes[i], NULL);
+    }
+
+    /* Collect the segment ids, they are replayed oldest first */
+    uint32_t *ids = NULL;
+    uint32_t nids = 0, capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        char *end = NULL;
+        unsigned long id = strtoul(entry->d_name, &end, 10);
+        if(end == entry->d_name || strcmp(end, ".seg") != 0 || id >= UINT32_MAX) {
+            continue;
+        }
+        if(nids == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            uint32_t *grown = realloc(ids, capacity * sizeof(uint32_t));
+            if(grown == NULL) {
+                break;
+            }
+            ids = grown;
+        }
+        ids[nids++] = (uint32_t)id;
+    }
+    closedir(d);
+    if(nids != 0) {
+        qsort(ids, nids, sizeof(uint32_t), bitcask_idcmp);
+    }
+
+    *replayed = 0;
+    *dropped = 0;
+    bool ok = true;
+    for(uint32_t i = 0; ok && i < nids; i++) {
+        bitcask_segment_t *seg = bitcask_segment_open(bc, ids[i]);
+        int64_t n = (seg == NULL) ? -1 : bitcask_replay(bc, seg, dropped);
+        ok = (n >= 0);
+        *replayed += (n > 0) ? n : 0;
+    }
+
+    /* Never append to a segment of an earlier run, it may end in a truncated record */
+    bc->active = ok ? bitcask_segment_open(bc, (nids == 0) ? 0 : ids[nids - 1] + 1) : NULL;
+    free(ids);
+
+    if(cachebytes != 0 && bc->active != NULL) {
+        bc->cache = hashtable_sharded_create(keydir->nshards, HASHTABLE_MIN_SIZE * keydir->nshards, keydir->hashmethod, HASHTABLE_TYPE_CHAINED);
+        if(bc->cache == NULL || hashtable_sharded_shareepoch(bc->cache, keydir) == false ||
+        hashtable_sharded_enableslab(bc->cache) == false || hashtable_sharded_setseed(bc->cache, keydir->seed) == false ||
+        hashtable_sharded_setmaxmemory(bc->cache, cachebytes, HASHTABLE_EVICT_LRU) == false) {
+            ok = false;
+        }
+        else {
+            hashtable_sharded_setlazyfree(bc->cache, keydir->lazyfree);
+        }
+    }
+
+    if(ok == false || bc->active == NULL || pthread_create(&bc->compactor, NULL, bitcask_compactor, bc) != 0) {
+        return NULL;
+    }
+    return bc;
+}
+
+
+
+/**
+ * @brief Stops the compactor, syncs the active segment and closes every segment. The table is left as it is.
+ * 
+ * @param bc 
+ */
+void bitcask_close(bitcask_t *bc) {
+
+    __atomic_store_n(&bc->stop, true, __ATOMIC_RELAXED);
+    pthread_join(bc->compactor, NULL);
+
+    fdatasync(bc->active->fd);
+    for(uint32_t i = 0; i < bc->capacity; i++) {
+        if(bc->segments[i] != NULL) {
+            close(bc->segments[i]->fd);
+            free(bc->segments[i]);
+        }
+    }
+    if(bc->cache != NULL) {
+        hashtable_sharded_delete(bc->cache);
+    }
+    free(bc->segments);
+    free(bc->dir);
+    free(bc);
+}
+
+
+
+#endif
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <unistd.h> 
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <getopt.h>
 
 #define gettid() syscall(SYS_gettid)
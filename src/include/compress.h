@@ -0,0 +1,425 @@
+/**
+ * @file compress.h
+ * @author Fruerlund
+ * @brief LZ77 block codec writing the LZ4 block format, and the framing a store uses to keep compressed values next to plain ones.
+ * @version 0.1
+ * @date 2024-08-14
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "common-defines.h"
+#include <time.h>
+
+#define COMPRESS_MARKER             '\x00'      /*      First byte of a compressed value, values sent to a store are text and never start with it */
+#define COMPRESS_HEADERSIZE         5           /*      Marker followed by the uncompressed length as a little endian u32   */
+#define COMPRESS_HASHBITS           12          /*      Positions remembered by the match finder, 2^12 of them               */
+#define COMPRESS_MINMATCH           4           /*      Shortest match a sequence can hold                                  */
+#define COMPRESS_MFLIMIT            12          /*      The last match starts at least this many bytes before the end ...   */
+#define COMPRESS_LASTLITERALS       5           /*      ... and ends at least this many bytes before it                     */
+#define COMPRESS_MAXOFFSET          65535       /*      Farthest back a match can point                                     */
+#define COMPRESS_SKIPTRIGGER        6           /*      Every 2^6 misses in a row the match finder steps one byte further   */
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Counters of the values a store compressed and decompressed. Updated with relaxed atomics by every request worker.
+ */
+typedef struct compress_stats_t {
+
+    uint64_t compressed;                    /*      Values stored compressed                        */
+    uint64_t skipped;                       /*      Values above the threshold that didn't shrink enough and were stored as they are */
+    uint64_t rawbytes;                      /*      Bytes of the compressed values before ...       */
+    uint64_t storedbytes;                   /*      ... and after compression, header included      */
+    uint64_t compressns;                    /*      CPU time spent compressing, skipped values included */
+    uint64_t decompressed;                  /*      Values decompressed for a read                  */
+    uint64_t decompressns;                  /*      CPU time spent decompressing                    */
+
+} compress_stats_t;
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Returns the CPU time the calling thread has used.
+ * 
+ * @return uint64_t nanoseconds
+ */
+uint64_t compress_cputime(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+
+/**
+ * @brief Returns the most bytes compress_encode can produce for an input, for incompressible data.
+ * 
+ * @param srclen 
+ * @return size_t 
+ */
+size_t compress_bound(size_t srclen) {
+    return srclen + (srclen / 255) + 16;
+}
+
+
+
+/**
+ * @brief Writes the length of a run that didn't fit its token nibble, as bytes of 255 followed by the rest.
+ * 
+ * @param dst 
+ * @param op position in dst, advanced
+ * @param len length minus the 15 stored in the token
+ */
+void compress_putlength(uint8_t *dst, size_t *op, size_t len) {
+
+    while(len >= 255) {
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    dst[(*op)++] = (uint8_t)len;
+}
+
+
+
+/**
+ * @brief Appends a sequence to an encoded block: a token, literals and, unless it is the last sequence, a match.
+ * 
+ * @param dst 
+ * @param dstcap 
+ * @param op position in dst, advanced
+ * @param literals 
+ * @param nliterals 
+ * @param offset distance back to the match, 0 for the last sequence
+ * @param matchlen 
+ * @return true 
+ * @return false if the sequence doesn't fit dst
+ */
+bool compress_sequence(uint8_t *dst, size_t dstcap, size_t *op, const uint8_t *literals, size_t nliterals, uint32_t offset,
+                       size_t matchlen) {
+
+    size_t need = 1 + (nliterals / 255) + 1 + nliterals + ((offset != 0) ? 2 + (matchlen / 255) + 1 : 0);
+    if(*op + need > dstcap) {
+        return false;
+    }
+
+    size_t extra = (offset != 0) ? matchlen - COMPRESS_MINMATCH : 0;
+    uint8_t *token = &dst[(*op)++];
+    *token = (uint8_t)(((nliterals < 15) ? nliterals : 15) << 4) | (uint8_t)((extra < 15) ? extra : 15);
+
+    if(nliterals >= 15) {
+        compress_putlength(dst, op, nliterals - 15);
+    }
+    memcpy(dst + *op, literals, nliterals);
+    *op += nliterals;
+
+    if(offset == 0) {
+        return true;
+    }
+    dst[(*op)++] = offset & 0xFF;
+    dst[(*op)++] = (offset >> 8) & 0xFF;
+    if(extra >= 15) {
+        compress_putlength(dst, op, extra - 15);
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Compresses a buffer into an LZ4 block: greedy matching against the last position every 4 byte sequence hashed to.
+ * 
+ * @param src 
+ * @param srclen 
+ * @param dst 
+ * @param dstcap 
+ * @return size_t bytes written to dst, 0 if they wouldn't fit
+ */
+size_t compress_encode(const char *src, size_t srclen, char *dst, size_t dstcap) {
+
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    uint32_t table[1 << COMPRESS_HASHBITS];
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if(srclen > UINT32_MAX) {
+        return 0;
+    }
+
+    if(srclen > COMPRESS_MFLIMIT) {
+
+        size_t limit = srclen - COMPRESS_MFLIMIT;
+        size_t matchlimit = srclen - COMPRESS_LASTLITERALS;
+        size_t ip = 1;
+        uint32_t misses = 0;
+        memset(table, '\x00', sizeof(table));
+
+        while(ip < limit) {
+
+            uint32_t sequence;
+            memcpy(&sequence, in + ip, sizeof(uint32_t));
+            uint32_t h = (sequence * 2654435761u) >> (32 - COMPRESS_HASHBITS);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            uint32_t candidate;
+            memcpy(&candidate, in + ref, sizeof(uint32_t));
+            if(ip - ref > COMPRESS_MAXOFFSET || candidate != sequence) {
+                ip += 1 + (misses++ >> COMPRESS_SKIPTRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            /* Grow the match backwards into the pending literals, then forwards */
+            while(ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t matchlen = COMPRESS_MINMATCH;
+            while(ip + matchlen < matchlimit && in[ref + matchlen] == in[ip + matchlen]) {
+                matchlen++;
+            }
+
+            if(compress_sequence(out, dstcap, &op, in + anchor, ip - anchor, (uint32_t)(ip - ref), matchlen) == false) {
+                return 0;
+            }
+            ip += matchlen;
+            anchor = ip;
+
+            /* Remember a position inside the match, runs of similar records then keep finding each other */
+            if(ip - 2 < limit) {
+                memcpy(&sequence, in + ip - 2, sizeof(uint32_t));
+                table[(sequence * 2654435761u) >> (32 - COMPRESS_HASHBITS)] = (uint32_t)(ip - 2);
+            }
+        }
+    }
+
+    /* The rest goes out as literals */
+    if(compress_sequence(out, dstcap, &op, in + anchor, srclen - anchor, 0, 0) == false) {
+        return 0;
+    }
+    return op;
+}
+
+
+
+/**
+ * @brief Reads the length of a run that didn't fit its token nibble.
+ * 
+ * @param src 
+ * @param srclen 
+ * @param ip position in src, advanced
+ * @param len length so far, increased
+ * @return true 
+ * @return false if the block ends in the middle of it
+ */
+bool compress_getlength(const uint8_t *src, size_t srclen, size_t *ip, size_t *len) {
+
+    uint8_t b = 255;
+    while(b == 255) {
+        if(*ip >= srclen) {
+            return false;
+        }
+        b = src[(*ip)++];
+        *len += b;
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Decompresses an LZ4 block. Never reads or writes out of bounds, whatever the block holds.
+ * 
+ * @param src 
+ * @param srclen 
+ * @param dst 
+ * @param dstlen exact length of the decompressed data
+ * @return true 
+ * @return false if the block is malformed or doesn't decompress to exactly dstlen bytes
+ */
+bool compress_decode(const char *src, size_t srclen, char *dst, size_t dstlen) {
+
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while(ip < srclen) {
+
+        uint8_t token = in[ip++];
+
+        size_t nliterals = token >> 4;
+        if(nliterals == 15 && compress_getlength(in, srclen, &ip, &nliterals) == false) {
+            return false;
+        }
+        if(nliterals > srclen - ip || nliterals > dstlen - op) {
+            return false;
+        }
+        memcpy(out + op, in + ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+
+        /* The last sequence has no match */
+        if(ip == srclen) {
+            break;
+        }
+
+        if(srclen - ip < 2) {
+            return false;
+        }
+        size_t offset = in[ip] | ((size_t)in[ip + 1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op) {
+            return false;
+        }
+
+        size_t matchlen = token & 0x0F;
+        if(matchlen == 15 && compress_getlength(in, srclen, &ip, &matchlen) == false) {
+            return false;
+        }
+        matchlen += COMPRESS_MINMATCH;
+        if(matchlen > dstlen - op) {
+            return false;
+        }
+
+        /* A match may overlap the bytes it produces, copy it byte by byte then */
+        uint8_t *match = out + op - offset;
+        if(offset >= matchlen) {
+            memcpy(out + op, match, matchlen);
+        }
+        else {
+            for(size_t i = 0; i < matchlen; i++) {
+                out[op + i] = match[i];
+            }
+        }
+        op += matchlen;
+    }
+
+    return op == dstlen;
+}
+
+
+
+/**
+ * @brief Tells if a stored value is compressed.
+ * 
+ * @param value 
+ * @param valuelen 
+ * @return true 
+ * @return false 
+ */
+bool compress_isencoded(const char *value, uint32_t valuelen) {
+    return valuelen >= COMPRESS_HEADERSIZE && value[0] == COMPRESS_MARKER;
+}
+
+
+
+/**
+ * @brief Returns the length a compressed value decompresses to.
+ * 
+ * @param value a value compress_isencoded is true for
+ * @return uint32_t 
+ */
+uint32_t compress_rawlen(const char *value) {
+
+    const uint8_t *p = (const uint8_t *)value + 1;
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+
+/**
+ * @brief Compresses a value for storing if it is at least threshold bytes and shrinks by at least an eighth.
+ * 
+ * @param stats 
+ * @param threshold 0 to never compress
+ * @param value 
+ * @param valuelen 
+ * @param storedlen length of the returned value
+ * @return char* a new allocation holding the compressed value, or value itself when it is stored as it is
+ */
+char *compress_value(compress_stats_t *stats, uint64_t threshold, char *value, uint32_t valuelen, uint32_t *storedlen) {
+
+    *storedlen = valuelen;
+    if(threshold == 0 || valuelen < threshold || valuelen < COMPRESS_HEADERSIZE) {
+        return value;
+    }
+
+    uint64_t start = compress_cputime();
+    size_t cap = COMPRESS_HEADERSIZE + (valuelen - valuelen / 8);
+    char *stored = malloc(cap);
+    size_t len = 0;
+    if(stored != NULL) {
+        len = compress_encode(value, valuelen, stored + COMPRESS_HEADERSIZE, cap - COMPRESS_HEADERSIZE);
+    }
+    __atomic_add_fetch(&stats->compressns, compress_cputime() - start, __ATOMIC_RELAXED);
+
+    if(len == 0) {
+        free(stored);
+        __atomic_add_fetch(&stats->skipped, 1, __ATOMIC_RELAXED);
+        return value;
+    }
+
+    stored[0] = COMPRESS_MARKER;
+    for(uint32_t i = 0; i < 4; i++) {
+        stored[1 + i] = (valuelen >> (8 * i)) & 0xFF;
+    }
+    *storedlen = COMPRESS_HEADERSIZE + len;
+
+    __atomic_add_fetch(&stats->compressed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->rawbytes, valuelen, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->storedbytes, *storedlen, __ATOMIC_RELAXED);
+    return stored;
+}
+
+
+
+/**
+ * @brief Decompresses a stored value into a buffer of its own, with a terminator.
+ * 
+ * @param stats 
+ * @param value a value compress_isencoded is true for
+ * @param valuelen 
+ * @return char* a new allocation, NULL if it couldn't be made or the value is corrupt
+ */
+char *compress_decodevalue(compress_stats_t *stats, const char *value, uint32_t valuelen) {
+
+    uint32_t rawlen = compress_rawlen(value);
+    char *raw = malloc((size_t)rawlen + 1);
+    if(raw == NULL) {
+        return NULL;
+    }
+
+    uint64_t start = compress_cputime();
+    bool ok = compress_decode(value + COMPRESS_HEADERSIZE, valuelen - COMPRESS_HEADERSIZE, raw, rawlen);
+    __atomic_add_fetch(&stats->decompressns, compress_cputime() - start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->decompressed, 1, __ATOMIC_RELAXED);
+
+    if(ok == false) {
+        free(raw);
+        return NULL;
+    }
+    raw[rawlen] = '\x00';
+    return raw;
+}
+
+#endif
@@ -17,6 +17,14 @@
 #include "common-defines.h"
 #include "./hashtable.h"
 #include "./hashring.h"
+#include "./art.h"
+#include "./snapshot.h"
+#include "./aof.h"
+#include "./bitcask.h"
+#include "./compress.h"
+#include "./hashmap.h"
+#include "./ratelimiter.h"
+#include <sys/wait.h>
 /* 
 [**************************************************************************************************************************************************]
                                                             KEY, VALUE STORE 
@@ -38,7 +46,12 @@
 #define SERVER_TYPE_STORE            0x20
 #define SERVER_TYPE_COORDINATOR     0x21
 
-#define MAX_WORKERS 1
+#define COORDINATOR_VIRTUALNODES    10          /* Virtual nodes of every store given on the command line */
+#define COORDINATOR_MIGRATE_BATCH   1000        /* Entries a migration fetches from a store per SYNC */
+#define COORDINATOR_MIGRATE_RATE    (64ull * 1024 * 1024)   /* Bytes per second a migration moves unless --migrate-rate says otherwise */
+#define COORDINATOR_MIGRATE_TIMEOUT 5           /* Seconds a migration waits for a store to answer */
+
+#define MAX_WORKERS 64
 #define MAX_INPUT_BUFFER 4096
 #define MAX_HEADERS 25
 
@@ -47,7 +60,15 @@
 #define HTTP_GET                    0x32
 #define HTTP_UNKNOWN                0x33
 
-#define STORE_TABLEMAXSIZE          1024
+#define STORE_TABLEINITSIZE         1024        /* Initial number of buckets, the store table grows and shrinks from here */
+#define STORE_TABLESHARDS           64          /* Number of independently locked shards the store table is split into */
+#define STORE_EXPIRE_INTERVAL       100000      /* Microseconds between active expiry passes over the store */
+#define STORE_SCAN_DEFAULTLIMIT     100         /* Keys a SCAN returns when it doesn't ask for a limit */
+#define STORE_SCAN_MAXLIMIT         10000       /* Most keys a single SCAN returns, clients page through the rest */
+#define STORE_SCAN_BUFFER           65536       /* Bytes of SCAN reply collected before they are written to the client */
+#define STORE_SYNC_DEFAULTCOUNT     100         /* Entries a SYNC batch aims for when it doesn't ask for a count */
+#define STORE_SYNC_MAXCOUNT         10000       /* Most entries a SYNC batch aims for */
+#define STORE_LOG_INTERVAL          1000        /* Milliseconds between syncs of the log unless --fsync says otherwise */
 
 #define MAX_SERVERS                 100
 
@@ -67,11 +88,37 @@ cmd=SET&key=value
 
 /*
 Supported CMDs:
-SET: Inserts a key, value pair into the store.              Takes key=value parameter.
+SET: Inserts a key, value pair or overwrites the value.     Takes key=value parameter and optionally ttl (seconds).
+     With nx=1 only a key that doesn't exist is set, an existing one is left as it is and the reply is 409.
 GET: Gets a value from a given key from the store.          Takes key parameter.
 REM: Removes a value from a given key from the store.       Takes key parameter.
+     A coordinator forwards GET, SET and REM to the store owning the key. Started with --stateless it finds that store from
+     the hash ring alone, otherwise from its directory of the keys SET through it.
 ADD: Adds a new data server into the hash ring.             Takes ip parameter, port parameter and weight.
 DEL: Deletes a data server from the hash ring.              Takes ip parameter and port parameter.
+     Both also take a list, cmd=ADD&servers=ip:port,ip:port&weight=10 and cmd=DEL&servers=ip:port,ip:port, applied as one
+     change: the ring is rebuilt and the keys moved once, and if any store in the list is invalid none is applied.
+     Afterwards the coordinator moves keys whose store changed in the background, reads fall back to the old store until it
+     is done. Another ADD or DEL meanwhile gets 409.
+STATS: Memory accounting and eviction counters of a store, progress of the migration of keys on a coordinator. Takes no
+       parameters (cmd=STATS).
+SCAN: Streams key=value lines in key order from a store started with --index. Takes optional prefix, start (inclusive),
+      end (exclusive), after (exclusive, the last key of the previous page) and limit parameters, e.g.
+      cmd=SCAN&prefix=user:&after=user:42&limit=100. The reply has no Content-Length, it ends when the connection closes.
+SAVE: Writes a snapshot of a store started with --snapshot to its snapshot file. Takes no parameters (cmd=SAVE).
+BGSAVE: Like SAVE, but a forked child writes a point in time snapshot while the store keeps serving. Replies 202 once the child
+        runs. STATS reports how the last snapshot went. Takes no parameters (cmd=BGSAVE).
+FLUSHALL: Removes every key of a store. The old tables are released in the background, the store is only locked while they are
+          swapped for empty ones. Takes no parameters (cmd=FLUSHALL).
+REWRITE: Rewrites the log of a store started with --appendonly in the background, leaving one SET per key. Replies 202 once
+         the rewrite runs, 409 if one is running already. Takes no parameters (cmd=REWRITE).
+SYNC: Returns the next batch of a full scan of a store. Takes optional cursor (0 or missing to start) and count parameters,
+      e.g. cmd=SYNC&cursor=0&count=1000. Writers are only held up for a batch, never for the whole scan. A key present for the
+      whole scan is returned at least once, possibly more than once. The reply is application/octet-stream, integers are
+      little endian:
+      [ next cursor u64 | entries u32 ] followed by entries of [ keylen u32 | valuelen u32 | key | value ]
+      The scan is complete when the next cursor is 0. With ttl=1 every entry also carries the seconds the key has left to live,
+      0 if it never expires: [ keylen u32 | valuelen u32 | ttl u32 | key | value ]. Expired keys are left out.
 */
 
 
@@ -93,7 +140,7 @@ typedef struct http_header_t {
 typedef struct http_packet_t {
 
     struct http_header_t **headers;         /* Maximum support of MAX_NUMBER_HEADERS headers */
-    hashtable_t *headers_table;             /* Hash table containing key -> header mappings */
+    headermap_t headers_table;              /* Header name -> value, pointing into headers */
     uint8_t type;                           /* Method, GET, POST etc. */
     size_t numberofheaders;                 /* Number of parsed headers */
     size_t headersize;                      /* Total size of headers in bytes */
@@ -107,6 +154,108 @@ typedef struct http_packet_t {
 } http_packet_t;
 
 
+/**
+ * @brief Describes the ordered key index of one shard of the store table. Writers of the shard already hold its write lock, so
+ * the index lock only keeps them apart from SCANs and from the swap of a flush.
+ */
+typedef struct store_index_t {
+
+    art_tree_t *tree;
+    pthread_rwlock_t lock;
+
+} store_index_t;
+
+
+/**
+ * @brief Describes a SCAN while it walks the index: where it stops and the keys collected so far, each with its terminator.
+ */
+typedef struct store_scan_t {
+
+    char *prefix;                           /* Only keys starting with prefix, NULL for any */
+    size_t prefixlen;
+    char *end;                              /* Only keys sorting before end, NULL for no upper bound */
+    size_t endlen;
+    uint32_t limit;                         /* Most keys to collect */
+    uint32_t count;                         /* Keys collected */
+    char *keys;                             /* Collected keys, back to back */
+    size_t used;
+    size_t capacity;
+
+} store_scan_t;
+
+
+/**
+ * @brief Describes the reply of a SYNC batch while it is collected.
+ */
+typedef struct store_sync_t {
+
+    char *body;                             /* Reply body, starting with room for the cursor and the number of entries */
+    size_t used;
+    size_t capacity;
+    uint32_t count;                         /* Entries collected */
+    bool failed;                            /* Set if the body couldn't grow */
+    bool ttl;                               /* Entries carry the seconds they have left to live */
+    uint32_t now;                           /* Entries that expired by then are left out */
+
+} store_sync_t;
+
+
+/**
+ * @brief Describes how a snapshot went. A BGSAVE child sends it to the store through a pipe when it is done.
+ */
+typedef struct store_save_t {
+
+    int64_t keys;                           /* Keys written, -1 if the snapshot failed */
+    uint64_t bytes;                         /* Size of the snapshot file */
+    uint64_t ms;                            /* Time it took to write the snapshot */
+    uint64_t forkms;                        /* BGSAVE: Time requests were held off while forking */
+    uint64_t cowbytes;                      /* BGSAVE: Memory the child ended up owning, mostly pages copied on write */
+    bool background;
+    bool done;                              /* Set once a snapshot has finished */
+
+} store_save_t;
+
+
+/**
+ * @brief Describes a running BGSAVE child, handed to the thread waiting for it.
+ */
+typedef struct store_bgsave_t {
+
+    pid_t pid;
+    int fd;                                 /* Read end of the pipe the child reports through */
+    uint64_t forkms;
+
+} store_bgsave_t;
+
+
+/**
+ * @brief Describes the migration of keys after the stores of the ring changed. The ring before the change is kept until every
+ * key has moved to the store the ring now names, reads miss on the new store fall back to the old one until then.
+ */
+typedef struct coordinator_migration_t {
+
+    pthread_mutex_t lock;                   /* Guards running, only one membership change migrates at a time */
+    bool running;
+    pthread_rwlock_t ringlock;              /* Guards previous, readers hold it while they ask the old store */
+    hashring_t *previous;                   /* Ring before the change, NULL when no migration runs */
+    ratelimiter_bucket_t bucket;            /* Bytes fetched from and sent to stores */
+    uint64_t rate;                          /* Bytes per second, 0 for no limit */
+
+    /* Progress of the running or last migration, updated by the migration thread and read by STATS */
+    uint64_t migrations;                    /* Migrations finished */
+    uint64_t started;                       /* Monotonic ns */
+    uint64_t finished;
+    uint32_t stores;                        /* Stores that may hold keys that move */
+    uint32_t storesdone;
+    uint64_t scanned;                       /* Keys fetched from the stores */
+    uint64_t moved;                         /* Keys copied to their new store and removed from the old one */
+    uint64_t skipped;                       /* Keys the new store already had a newer value of */
+    uint64_t failed;                        /* Keys left on the old store because a store didn't answer */
+    uint64_t bytes;                         /* Bytes fetched and sent */
+
+} coordinator_migration_t;
+
+
 /* 
 [**************************************************************************************************************************************************]
                                                             QUEUE
@@ -121,8 +270,8 @@ typedef struct queue_entry_t {
 
 typedef struct queue_requests_t {
 
-    pthread_mutex_t read_lock;                          /*  Mutex for synchronization    */
-    pthread_mutex_t write_lock;                         /*  Mutex for synchronization    */
+    pthread_mutex_t lock;                               /*  Mutex for synchronization    */
+    pthread_cond_t notempty;                            /*  Signalled when a request is enqueued */
     TAILQ_HEAD(queue, queue_entry_t) queue;             /*  Queue holding requests       */
     size_t size;
 
@@ -130,6 +279,13 @@ typedef struct queue_requests_t {
 
 
 
+ring_element_t *coordinatorFindStore(char *key, bool add);
+int coordinatorMembership(char *list, uint32_t weight, bool add);
 int32_t coordinator_requestForward(ring_element_t *, http_packet_t *h);
+int32_t coordinatorExchange(ring_element_t *server, char *request, size_t size, char **reply, size_t *replylen);
+int32_t coordinatorRequest(ring_element_t *server, char *data, size_t datalen, char **reply, size_t *replylen);
+int32_t coordinatorForwardMigrating(ring_element_t *server, http_packet_t *h, char *key, bool both);
+int coordinatorMigrateBegin(void);
+void coordinatorMigrateStart(bool changed);
 
 #endif /* DKVSTORE_H */
\ No newline at end of file
@@ -0,0 +1,175 @@
+/**
+ * @file hash.h
+ * @author Fruerlund
+ * @brief Seeded, binary safe 64 bit hashing (wyhash) shared by the hash table and the hash ring.
+ * @version 0.1
+ * @date 2024-08-03
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "common-defines.h"
+#include <sys/random.h>
+#include <time.h>
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Function prototype for hashing methods. Keys are binary safe, the length is given explicitly. The seed selects one of
+ * a family of hash functions, a table seeded at random can't be flooded with keys precomputed to collide.
+ */
+typedef uint64_t (*hash_method_t)(const void *key, size_t len, uint64_t seed);
+
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/* Default secret of wyhash */
+static const uint64_t hash_wysecret[4] = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
+
+
+
+/**
+ * @brief Multiplies two 64 bit words into a 128 bit product, returning the low half in a and the high half in b.
+ * 
+ * @param a 
+ * @param b 
+ */
+void hash_wymum(uint64_t *a, uint64_t *b) {
+
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+
+
+/**
+ * @brief Folds the 128 bit product of two words into 64 bits.
+ * 
+ * @param a 
+ * @param b 
+ * @return uint64_t 
+ */
+uint64_t hash_wymix(uint64_t a, uint64_t b) {
+
+    hash_wymum(&a, &b);
+    return a ^ b;
+}
+
+
+
+/* Unaligned little endian reads */
+uint64_t hash_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hash_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hash_read3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+
+
+/**
+ * @brief wyhash (final version 4), see https://github.com/wangyi-fudan/wyhash. Reads 16 to 48 bytes per round and mixes them
+ * with 64x64->128 bit multiplies, keys up to 16 bytes are hashed without a loop.
+ * 
+ * @param key 
+ * @param len 
+ * @param seed 
+ * @return uint64_t 
+ */
+uint64_t hash_wyhash(const void *key, size_t len, uint64_t seed) {
+
+    const uint8_t *p = (const uint8_t *)key;
+    const uint64_t *secret = hash_wysecret;
+    uint64_t a = 0, b = 0;
+
+    seed ^= hash_wymix(seed ^ secret[0], secret[1]);
+
+    if(__builtin_expect(len <= 16, 1)) {
+        if(__builtin_expect(len >= 4, 1)) {
+            a = (hash_read4(p) << 32) | hash_read4(p + ((len >> 3) << 2));
+            b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(__builtin_expect(len > 0, 1)) {
+            a = hash_read3(p, len);
+            b = 0;
+        }
+    }
+    else {
+        size_t i = len;
+        if(__builtin_expect(i >= 48, 0)) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_wymix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+                see1 = hash_wymix(hash_read8(p + 16) ^ secret[2], hash_read8(p + 24) ^ see1);
+                see2 = hash_wymix(hash_read8(p + 32) ^ secret[3], hash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(__builtin_expect(i >= 48, 1));
+            seed ^= see1 ^ see2;
+        }
+        while(__builtin_expect(i > 16, 0)) {
+            seed = hash_wymix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    hash_wymum(&a, &b);
+
+    return hash_wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+
+
+/**
+ * @brief Returns a random seed from the kernel, falling back to the clock and pid if the kernel won't give us one.
+ * 
+ * @return uint64_t 
+ */
+uint64_t hash_randomseed(void) {
+
+    uint64_t seed = 0;
+    if(getrandom(&seed, sizeof(seed), 0) == sizeof(seed)) {
+        return seed;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return hash_wymix((uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32), (uint64_t)getpid() ^ hash_wysecret[2]);
+}
+
+
+
+#endif
@@ -0,0 +1,426 @@
+/**
+ * @file hashmap.h
+ * @author Fruerlund
+ * @brief Open addressing hash maps generated per key and value type, in the spirit of sys/queue.h. Key type, hash and equality
+ * are fixed at compile time, so small integer keyed maps need no string formatting, no copies of their keys and no calls
+ * through function pointers.
+ * @version 0.1
+ * @date 2024-08-15
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "common-defines.h"
+#include <strings.h>
+
+#define HASHMAP_SLOT_EMPTY          0
+#define HASHMAP_SLOT_FULL           1
+#define HASHMAP_SLOT_DELETED        2           /*      Removed, probes keep going past it                                  */
+#define HASHMAP_MINCAPACITY         8
+#define HASHMAP_HEADERCAPACITY      64          /*      Slots of a header map, at most 3/4 of them are used                 */
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief A string that isn't terminated, pointing into memory owned by someone else. Keys and values of header maps.
+ */
+typedef struct hashmap_str_t {
+
+    const char *s;
+    uint32_t len;
+
+} hashmap_str_t;
+
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            HASH AND EQUALITY
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Hashes a 32 bit key with the murmur3 finalizer, every input bit affects every output bit.
+ * 
+ * @param key 
+ * @return uint32_t 
+ */
+static inline uint32_t hashmap_hash_u32(uint32_t key) {
+
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+
+
+/**
+ * @brief Hashes a 64 bit key with the splitmix64 finalizer.
+ * 
+ * @param key 
+ * @return uint32_t 
+ */
+static inline uint32_t hashmap_hash_u64(uint64_t key) {
+
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return (uint32_t)key;
+}
+
+
+
+/**
+ * @brief Hashes a string ignoring case (FNV-1a), header names are case insensitive.
+ * 
+ * @param key 
+ * @return uint32_t 
+ */
+static inline uint32_t hashmap_hash_nocase(hashmap_str_t key) {
+
+    uint32_t h = 2166136261u;
+    for(uint32_t i = 0; i < key.len; i++) {
+        uint8_t c = (uint8_t)key.s[i];
+        h ^= (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+
+/**
+ * @brief Hashes a string (FNV-1a).
+ * 
+ * @param key 
+ * @return uint32_t 
+ */
+static inline uint32_t hashmap_hash_str(hashmap_str_t key) {
+
+    uint32_t h = 2166136261u;
+    for(uint32_t i = 0; i < key.len; i++) {
+        h ^= (uint8_t)key.s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+
+/**
+ * @brief Equality of integer keys.
+ */
+#define hashmap_eq_int(a, b)        ((a) == (b))
+
+
+
+/**
+ * @brief Compares strings ignoring case.
+ * 
+ * @param a 
+ * @param b 
+ * @return true 
+ * @return false 
+ */
+static inline bool hashmap_eq_nocase(hashmap_str_t a, hashmap_str_t b) {
+    return a.len == b.len && strncasecmp(a.s, b.s, a.len) == 0;
+}
+
+
+
+/**
+ * @brief Compares strings byte for byte.
+ * 
+ * @param a 
+ * @param b 
+ * @return true 
+ * @return false 
+ */
+static inline bool hashmap_eq_str(hashmap_str_t a, hashmap_str_t b) {
+    return a.len == b.len && memcmp(a.s, b.s, a.len) == 0;
+}
+
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            GENERATORS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Declares a growable map from keytype to valuetype named name##_t, with name##_create, name##_destroy, name##_get,
+ * name##_put and name##_remove. hashfn(key) returns a uint32_t, eqfn(a, b) compares two keys. Slots are probed linearly, the
+ * table doubles once 3/4 of its slots are full or deleted.
+ */
+#define HASHMAP_DECLARE(name, keytype, valuetype, hashfn, eqfn)                                                                 \
+                                                                                                                                \
+typedef struct name##_t {                                                                                                       \
+                                                                                                                                \
+    keytype *keys;                                                                                                              \
+    valuetype *values;                                                                                                          \
+    uint8_t *states;                        /*      HASHMAP_SLOT_* of every slot                    */                          \
+    uint32_t capacity;                      /*      Number of slots, a power of two                 */                          \
+    uint32_t count;                         /*      Full slots                                      */                          \
+    uint32_t deleted;                       /*      Deleted slots                                   */                          \
+                                                                                                                                \
+} name##_t;                                                                                                                     \
+                                                                                                                                \
+static inline bool name##_alloc(name##_t *m, uint32_t capacity) {                                                               \
+                                                                                                                                \
+    m->keys = malloc(sizeof(keytype) * capacity);                                                                               \
+    m->values = malloc(sizeof(valuetype) * capacity);                                                                           \
+    m->states = calloc(capacity, sizeof(uint8_t));                                                                              \
+    if(m->keys == NULL || m->values == NULL || m->states == NULL) {                                                             \
+        free(m->keys);                                                                                                          \
+        free(m->values);                                                                                                        \
+        free(m->states);                                                                                                        \
+        return false;                                                                                                           \
+    }                                                                                                                           \
+    m->capacity = capacity;                                                                                                     \
+    m->count = 0;                                                                                                               \
+    m->deleted = 0;                                                                                                             \
+    return true;                                                                                                                \
+}                                                                                                                               \
+                                                                                                                                \
+static inline name##_t *name##_create(uint32_t capacity) {                                                                      \
+                                                                                                                                \
+    uint32_t size = HASHMAP_MINCAPACITY;                                                                                        \
+    while(size < capacity && size < (1u << 31)) {                                                                               \
+        size <<= 1;                                                                                                             \
+    }                                                                                                                           \
+    name##_t *m = malloc(sizeof(name##_t));                                                                                     \
+    if(m == NULL) {                                                                                                             \
+        return NULL;                                                                                                            \
+    }                                                                                                                           \
+    if(name##_alloc(m, size) == false) {                                                                                        \
+        free(m);                                                                                                                \
+        return NULL;                                                                                                            \
+    }                                                                                                                           \
+    return m;                                                                                                                   \
+}                                                                                                                               \
+                                                                                                                                \
+static inline void name##_destroy(name##_t *m) {                                                                                \
+                                                                                                                                \
+    if(m == NULL) {                                                                                                             \
+        return;                                                                                                                 \
+    }                                                                                                                           \
+    free(m->keys);                                                                                                              \
+    free(m->values);                                                                                                            \
+    free(m->states);                                                                                                            \
+    free(m);                                                                                                                    \
+}                                                                                                                               \
+                                                                                                                                \
+static inline int64_t name##_find(name##_t *m, keytype key) {                                                                   \
+                                                                                                                                \
+    uint32_t mask = m->capacity - 1;                                                                                            \
+    for(uint32_t i = hashfn(key) & mask, n = 0; n < m->capacity; i = (i + 1) & mask, n++) {                                     \
+        if(m->states[i] == HASHMAP_SLOT_EMPTY) {                                                                                \
+            return -1;                                                                                                          \
+        }                                                                                                                       \
+        if(m->states[i] == HASHMAP_SLOT_FULL && eqfn(m->keys[i], key)) {                                                        \
+            return i;                                                                                                           \
+        }                                                                                                                       \
+    }                                                                                                                           \
+    return -1;                                                                                                                  \
+}                                                                                                                               \
+                                                                                                                                \
+static inline valuetype *name##_get(name##_t *m, keytype key) {                                                                 \
+                                                                                                                                \
+    int64_t i = name##_find(m, key);                                                                                            \
+    return (i < 0) ? NULL : &m->values[i];                                                                                      \
+}                                                                                                                               \
+                                                                                                                                \
+static inline void name##_place(name##_t *m, keytype key, valuetype value) {                                                    \
+                                                                                                                                \
+    uint32_t mask = m->capacity - 1;                                                                                            \
+    uint32_t i = hashfn(key) & mask;                                                                                            \
+    while(m->states[i] == HASHMAP_SLOT_FULL) {                                                                                  \
+        i = (i + 1) & mask;                                                                                                     \
+    }                                                                                                                           \
+    m->deleted -= (m->states[i] == HASHMAP_SLOT_DELETED);                                                                       \
+    m->states[i] = HASHMAP_SLOT_FULL;                                                                                           \
+    m->keys[i] = key;                                                                                                           \
+    m->values[i] = value;                                                                                                       \
+    m->count++;                                                                                                                 \
+}                                                                                                                               \
+                                                                                                                                \
+static inline bool name##_put(name##_t *m, keytype key, valuetype value) {                                                      \
+                                                                                                                                \
+    int64_t i = name##_find(m, key);                                                                                            \
+    if(i >= 0) {                                                                                                                \
+        m->values[i] = value;                                                                                                   \
+        return true;                                                                                                            \
+    }                                                                                                                           \
+                                                                                                                                \
+    /* Rebuild at twice the size, or the same size if deleted slots are most of the load */                                     \
+    if((uint64_t)(m->count + m->deleted + 1) * 4 > (uint64_t)m->capacity * 3) {                                                 \
+        name##_t old = *m;                                                                                                      \
+        uint32_t capacity = ((m->count + 1) * 2 > m->capacity) ? m->capacity * 2 : m->capacity;                                 \
+        if(name##_alloc(m, capacity) == false) {                                                                                \
+            *m = old;                                                                                                           \
+            return false;                                                                                                       \
+        }                                                                                                                       \
+        for(uint32_t j = 0; j < old.capacity; j++) {                                                                            \
+            if(old.states[j] == HASHMAP_SLOT_FULL) {                                                                            \
+                name##_place(m, old.keys[j], old.values[j]);                                                                    \
+            }                                                                                                                   \
+        }                                                                                                                       \
+        free(old.keys);                                                                                                         \
+        free(old.values);                                                                                                       \
+        free(old.states);                                                                                                       \
+    }                                                                                                                           \
+                                                                                                                                \
+    name##_place(m, key, value);                                                                                                \
+    return true;                                                                                                                \
+}                                                                                                                               \
+                                                                                                                                \
+static inline bool name##_remove(name##_t *m, keytype key, valuetype *value) {                                                  \
+                                                                                                                                \
+    int64_t i = name##_find(m, key);                                                                                            \
+    if(i < 0) {                                                                                                                 \
+        return false;                                                                                                           \
+    }                                                                                                                           \
+    if(value != NULL) {                                                                                                         \
+        *value = m->values[i];                                                                                                  \
+    }                                                                                                                           \
+    m->states[i] = HASHMAP_SLOT_DELETED;                                                                                        \
+    m->count--;                                                                                                                 \
+    m->deleted++;                                                                                                               \
+    return true;                                                                                                                \
+}
+
+
+
+/**
+ * @brief Declares a map of at most 3/4 of capacity entries (a power of two) named name##_t, with name##_init, name##_get and
+ * name##_put. Its slots are part of the struct, so it lives on the stack or inside another struct without any allocation and
+ * is thrown away with it. Entries can't be removed.
+ */
+#define HASHMAP_FIXED_DECLARE(name, keytype, valuetype, capacity, hashfn, eqfn)                                                 \
+                                                                                                                                \
+typedef struct name##_t {                                                                                                       \
+                                                                                                                                \
+    keytype keys[capacity];                                                                                                     \
+    valuetype values[capacity];                                                                                                 \
+    uint8_t states[capacity];               /*      HASHMAP_SLOT_EMPTY or HASHMAP_SLOT_FULL         */                          \
+    uint32_t count;                                                                                                             \
+                                                                                                                                \
+} name##_t;                                                                                                                     \
+                                                                                                                                \
+static inline void name##_init(name##_t *m) {                                                                                   \
+                                                                                                                                \
+    memset(m->states, HASHMAP_SLOT_EMPTY, sizeof(m->states));                                                                   \
+    m->count = 0;                                                                                                               \
+}                                                                                                                               \
+                                                                                                                                \
+static inline valuetype *name##_get(name##_t *m, keytype key) {                                                                 \
+                                                                                                                                \
+    for(uint32_t i = hashfn(key) & ((capacity) - 1); m->states[i] == HASHMAP_SLOT_FULL; i = (i + 1) & ((capacity) - 1)) {       \
+        if(eqfn(m->keys[i], key)) {                                                                                             \
+            return &m->values[i];                                                                                               \
+        }                                                                                                                       \
+    }                                                                                                                           \
+    return NULL;                                                                                                                \
+}                                                                                                                               \
+                                                                                                                                \
+static inline bool name##_put(name##_t *m, keytype key, valuetype value) {                                                      \
+                                                                                                                                \
+    uint32_t i = hashfn(key) & ((capacity) - 1);                                                                                \
+    for(; m->states[i] == HASHMAP_SLOT_FULL; i = (i + 1) & ((capacity) - 1)) {                                                  \
+        if(eqfn(m->keys[i], key)) {                                                                                             \
+            m->values[i] = value;                                                                                               \
+            return true;                                                                                                        \
+        }                                                                                                                       \
+    }                                                                                                                           \
+    if((m->count + 1) * 4 > (capacity) * 3) {                                                                                   \
+        return false;                                                                                                           \
+    }                                                                                                                           \
+    m->states[i] = HASHMAP_SLOT_FULL;                                                                                           \
+    m->keys[i] = key;                                                                                                           \
+    m->values[i] = value;                                                                                                       \
+    m->count++;                                                                                                                 \
+    return true;                                                                                                                \
+}
+
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            HEADER MAPS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/* Header name to value of a single HTTP message, both pointing into the message's own header lines */
+HASHMAP_FIXED_DECLARE(headermap, hashmap_str_t, hashmap_str_t, HASHMAP_HEADERCAPACITY, hashmap_hash_nocase, hashmap_eq_nocase)
+
+
+
+/**
+ * @brief Adds a "Name: value" header line to a header map. The map points into the line, which must outlive it. Whitespace
+ * around the value and a trailing CRLF are left out.
+ * 
+ * @param m 
+ * @param line 
+ * @param len 
+ * @return true 
+ * @return false if the line isn't a header or the map is full
+ */
+static inline bool headermap_putline(headermap_t *m, const char *line, size_t len) {
+
+    const char *colon = memchr(line, ':', len);
+    if(colon == NULL || colon == line) {
+        return false;
+    }
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while(value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while(end > value && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    hashmap_str_t k = { line, (uint32_t)(colon - line) };
+    hashmap_str_t v = { value, (uint32_t)(end - value) };
+    return headermap_put(m, k, v);
+}
+
+
+
+/**
+ * @brief Looks up a header by name, ignoring case.
+ * 
+ * @param m 
+ * @param name 
+ * @return hashmap_str_t* the value or NULL if the message doesn't have the header
+ */
+static inline hashmap_str_t *headermap_find(headermap_t *m, const char *name) {
+
+    hashmap_str_t k = { name, (uint32_t)strlen(name) };
+    return headermap_get(m, k);
+}
+
+#endif
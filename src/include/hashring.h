@@ -13,27 +13,38 @@
 #define HASHRING_H
 
 #include "common-defines.h"
+#include "hash.h"
+#include "hashmap.h"
 
 
-/* 
+/*
 [**************************************************************************************************************************************************]
                                                             STRUCTUES AND PROTOTYPES
 [**************************************************************************************************************************************************]
 */
 
 #define ELEMENT_SERVER  0x1
-#define ELEMENT_EMPTY   0x2
 #define ELEMENT_KEY     0x3
 
-#define OP_NODEINSERT   0x4
-#define OP_NODEDEL      0x5
+#define HASHRING_MAXVIRTUALNODES    1024        /*      Tokens a server can place on the ring besides its own           */
+#define HASHRING_KEYSCAPACITY       1024        /*      Initial slots of the key directory                              */
+
+#define HASHRING_PLACEMENT_RING         0x0     /*      Tokens of every server and its virtual nodes on a ring          */
+#define HASHRING_PLACEMENT_JUMP         0x1     /*      Jump consistent hash over the servers in the order they joined  */
+#define HASHRING_PLACEMENT_MAGLEV       0x2     /*      Maglev lookup table, one load per lookup                        */
+#define HASHRING_PLACEMENT_RENDEZVOUS   0x3     /*      Highest random weight, every server scored for every key        */
+#define HASHRING_PLACEMENT_MULTIPROBE   0x4     /*      One token per server, the nearest of several probes wins        */
+
+#define HASHRING_MAGLEV_SIZE            65537   /*      Entries of the Maglev table, a prime well above 100 per server  */
+#define HASHRING_MAGLEV_EMPTY           0xffff
+#define HASHRING_MULTIPROBE_PROBES      21      /*      Probes per key, the paper's choice for a peak to average of 1.05 */
 
 /**
  * @brief Describes a element in the hash ring that holds a key, value pair.
  */
 typedef struct ring_element_key_t {
 
-    char *key;                  
+    char *key;
     char *store;
     int port;
 
@@ -49,63 +60,98 @@ typedef struct ring_element_server_t {
     int port;                           /* PORT */
     size_t size;                        /* Number of key, value pairs in hash store.  */
     size_t maxsize;                     /* Maximum number of kvp in a hash store. */
-    uint32_t rangestart;                /* Start of key ranges */
-    uint32_t rangeend;                  /* End of key ranges */
     uint32_t numberofvirtualnodes;      /* Number of virtual nodes */
-    bool isvirtualnode;                 /* Virtual node indicator */
+    uint64_t *tokens;                   /* Its own token and one per virtual node, hashed once when it joins */
+    uint64_t owned;                     /* Length of the arcs of the ring that end in one of its tokens */
 
 } ring_element_server_t;
 
-/**
- * @brief Describes a empty element in the hash ring.
- */
-typedef struct ring_element_empty_t {
-
-} ring_element_empty_t;
-
 
 
 /**
- * @brief Describes a chunk of the hash ring that either represents a empty spot, data store or key, value, pair
+ * @brief Describes a server or a key of the hash ring. Its hash is the position on the ring, the key's hash or the server's
+ * first token.
  */
 typedef struct ring_element_t {
 
-    uint32_t hash;
-    struct ring_element_t *left;            /* Pointer to left slice */
-    struct ring_element_t *right;           /* Pointer to right slice*/
-    struct ring_element_t *parent;
-    uint8_t type;                           /* Used to indicate the type(empty, data or server) that his slice holds */
+    uint64_t hash;
+    uint8_t type;                           /* Used to indicate the type(key or server) that his slice holds */
 
     union element {
         ring_element_server_t *server;
         ring_element_key_t *data;
-        ring_element_empty_t *empty;
     } element;
 
 } ring_element_t;
 
 
+
 /**
- * @brief Describes a hash ring using consistent hashing.
+ * @brief A token of a server, the ring is built by sorting these.
  */
+typedef struct ring_token_t {
 
-typedef uint32_t (*hashring_hash_t)(char *key);
+    uint64_t token;
+    ring_element_t *owner;
+
+} ring_token_t;
+
+
+
+/* Key name to its element, the name points into the element's own copy of the key */
+HASHMAP_DECLARE(ringkeymap, hashmap_str_t, ring_element_t *, hashmap_hash_str, hashmap_eq_str)
+
+
+
+/**
+ * @brief Describes a hash ring using consistent hashing. Every server places a token and one per virtual node on the full 64
+ * bit hash space, and a key belongs to the server of the first token at or after its hash, wrapping around past the last one.
+ * The tokens are kept in Eytzinger order (the layout of a binary heap, the children of k at 2k and 2k + 1) so the search is
+ * a branch free walk down the array whose first levels share cache lines. The size of the ring depends only on the number of
+ * tokens, not on the hash space.
+ * 
+ * The placement decides how a key's hash picks its server, behind the same API (HASHRING_PLACEMENT_*):
+ * 
+ * ring:        as above, the weight of a server is its number of virtual nodes.
+ * jump:        jump consistent hash (Lamping and Veach) picks a server number from the hash, no memory beyond the servers.
+ *              A server that leaves hands its number to the last one, so keys of both of them move.
+ * maglev:      every server fills slots of a table of HASHRING_MAGLEV_SIZE entries in turn, following its own permutation,
+ *              and a lookup is one load. A server takes one slot per turn for each token it would have on the ring.
+ * rendezvous:  the server with the highest score hash(key, server) wins. Perfectly even and minimal movement, but every
+ *              lookup scores every server.
+ * multiprobe:  one token per server, the key is hashed HASHRING_MULTIPROBE_PROBES times and the token closest after any of
+ *              them wins (Appleton and O'Reilly), the balance of many virtual nodes with a token array of one per server.
+ * 
+ * Only ring and maglev use the weight.
+ */
+
+typedef hash_method_t hashring_hash_t;
 
 typedef struct hashring_t {
 
-    size_t size;                        /*  Size of the hash ring            */
-    size_t count;                       /*  Current elemenets in hash ring   */
-    struct ring_element_t **elements;
-    struct ring_element_t *tree;        /*  Binary search tree representation of hash values of servers */
-    uint32_t *servers;                  /*  Pointer to an array of hash values of servers */
+    size_t count;                       /*  Current keys in hash ring   */
+    ring_element_t **servers;           /*  Servers, in the order they were added */
     size_t numberofservers;             /*  Number of servers in hash ring */
+    size_t serverscapacity;
+    uint64_t *tokens;                   /*  Tokens in Eytzinger order from index 1, 64 byte aligned */
+    ring_element_t **owners;            /*  Server of each token, owners[0] holds the server of the smallest token */
+    size_t numberoftokens;
+    uint16_t *maglev;                   /*  Maglev table of indexes into servers, NULL for other placements */
+    uint8_t placement;                  /*  HASHRING_PLACEMENT_* */
+    bool batch;                         /*  Between hashring_begin and hashring_commit, changes aren't applied yet */
+    bool dirty;                         /*  Servers changed since the tokens were built */
+    ring_element_t **removed;           /*  Servers that left, lookups may still find them until the next commit */
+    size_t numberofremoved;
+    size_t removedcapacity;
+    ringkeymap_t *keys;                 /*  Key directory */
     hashring_hash_t fn;                 /*  Pointer to the method responsible for hashing   */
+    uint64_t seed;                      /*  Seed passed to the hash method, every coordinator must use the same */
 
 } hashring_t;
 
 
 
-/* 
+/*
 [**************************************************************************************************************************************************]
                                                             METHODS / FUNCTIONS
 [**************************************************************************************************************************************************]
@@ -115,241 +161,164 @@ uint32_t hashring_deleteelement(ring_element_t *e);
 ring_element_t * hashring_addserver(hashring_t *r, char *ip, int port, uint32_t virtualNodes);
 uint32_t hashring_removeserver(hashring_t *r, char *ip, int port);
 void hashring_destroy(hashring_t *r);
-hashring_t * hashring_create(size_t size, hashring_hash_t fn);
+hashring_t * hashring_create(hashring_hash_t fn);
+hashring_t * hashring_create_type(hashring_hash_t fn, uint8_t placement);
+hashring_t * hashring_copy(hashring_t *r);
+size_t hashring_memory(hashring_t *r);
+uint64_t hashring_position(hashring_t *r, char *key);
+uint64_t hashring_token(hashring_t *r, ring_element_t *s, uint32_t i);
+uint32_t hashring_build(hashring_t *r);
+void hashring_begin(hashring_t *r);
+uint32_t hashring_commit(hashring_t *r);
+uint32_t hashring_remapkeys(hashring_t *r);
 ring_element_t * hashring_lookupkey(hashring_t *r, char *key );
-uint32_t hashring_generatenodesarray(hashring_t *r);
-uint32_t hashring_serverfindrange(hashring_t *r, uint32_t start);
-uint32_t hashring_addvirtualnodes(hashring_t *r, char *ip, int port, uint32_t i);
-uint32_t hashring_updateranges(hashring_t *r);
-uint32_t hashring_remapkeys_add(hashring_t *r, ring_element_t *e);
-uint32_t hashring_remapkeys_del(hashring_t *r, ring_element_t *e);
+ring_element_t * hashring_route(hashring_t *r, char *key);
 ring_element_t *hashring_lookupserver(hashring_t *r, char *ip, int port);
-uint32_t hashring_deleteelement(ring_element_t *e);
-bool hashring_objectexists(hashring_t *r, uint32_t index, uint8_t type);
-uint32_t hashring_addstore_iterative(hashring_t *r, ring_element_t *e);
-uint32_t hashring_addstore_bst(hashring_t *r, ring_element_t *e);
 ring_element_t * hashring_addkey(hashring_t *r, char *key);
 uint32_t hashring_removekey(hashring_t *r, char *key);
 void hashring_showranges(hashring_t *r);
 
 
+
 /**
- * @brief Finds the smallest node in a tree.
+ * @brief Creates a hashring with a given placement (HASHRING_PLACEMENT_*).
  * 
- * @param node 
- * @return node_t* 
+ * @param fn 
+ * @param placement 
+ * @return hashring_t* 
  */
-ring_element_t * bst_findmin(ring_element_t *e) {
+hashring_t * hashring_create_type(hashring_hash_t fn, uint8_t placement) {
 
-    ring_element_t *current = e;
+    if(placement > HASHRING_PLACEMENT_MULTIPROBE) {
+        return NULL;
+    }
 
-    while(true) {
+    hashring_t *r = (hashring_t *) calloc(1, sizeof(hashring_t));
+    if(r == NULL) {
+        perror("malloc\n");
+        return NULL;
+    }
 
-        if( current->left != NULL ) {
-            current = current->left;
-            continue;
-        }
-        else {
-            break;
-        }
+    r->fn = fn;
+    r->seed = 0;
+    r->placement = placement;
+    r->keys = ringkeymap_create(HASHRING_KEYSCAPACITY);
+    if(r->keys == NULL) {
+        perror("malloc\n");
+        free(r);
+        return NULL;
     }
 
-    return current;
+    return r;
+
 }
 
 
 
 /**
- * @brief Logic for inserting a node into a tree
+ * @brief Creates a hashring of tokens and virtual nodes.
  * 
- * @param tree 
- * @param hash 
- * @param data 
- * @return node_t* 
+ * @param fn 
+ * @return hashring_t* 
  */
-uint32_t bst_insert(hashring_t *r, ring_element_t *e) {
-
-    /* Inserting into an empty tree */
-
-    if(r->tree == NULL) {
-        r->tree = e;
-        e->parent = NULL;
-        e->right = NULL;
-        e->left = NULL;
-    }
+hashring_t * hashring_create(hashring_hash_t fn) {
+    return hashring_create_type(fn, HASHRING_PLACEMENT_RING);
+}
 
-    else {
-            
-        /* Traverse tree and insert */
-        ring_element_t *current = r->tree;
 
-        while(true) {
 
-            if(e->hash > current->hash) {
-                /* Check if we should traverse right */
-                if(current->right != NULL) {
-                    current = current->right;
-                    continue;
-                }
-                /* Insert right */
-                else {
-                    current->right = e;
-                    e->parent = current;
-                    break;
-                }
-            }
+/**
+ * @brief Copies the servers of a ring, in the same order and with the same tokens, into a new ring that places keys exactly
+ * like it. The key directory isn't copied. Pending changes of a batch are copied as if they were committed.
+ * 
+ * @param r 
+ * @return hashring_t* NULL on failure
+ */
+hashring_t * hashring_copy(hashring_t *r) {
 
-            if(e->hash < current->hash) {
-                /* Check if we should traverse left */
-                if(current->left != NULL) {
-                    current = current->left;
-                    continue;
-                }
-                /* Insert left */
-                else {
-                    current->left = e;
-                    e->parent = current;
-                    break;
-                }
-            }
-            
-            /* Should never hit */
-            break;
-        }
+    hashring_t *c = hashring_create_type(r->fn, r->placement);
+    if(c == NULL) {
+        return NULL;
     }
+    c->seed = r->seed;
 
-
-    return EXIT_SUCCESS;
-
-}
-
-uint32_t bst_remove(hashring_t *r, ring_element_t *e) {
-
-    ring_element_t *current = e;
-    ring_element_t *s = NULL;
-    
-    /**
-     * Case 1: Node has no children.
-     */
-    if( current->left == NULL && current->right == NULL) {
-        if(current->parent != NULL) {
-            if( current->parent->left == current) {
-                current->parent->left = NULL;
-            }
-            
-            if(current->parent->right == current) {
-                current->parent->right = NULL;
-            }
-        }
-        else {
-            r->tree = NULL;
-        }
+    c->servers = (ring_element_t **)calloc(r->numberofservers + 1, sizeof(ring_element_t *));
+    if(c->servers == NULL) {
+        perror("malloc\n");
+        hashring_destroy(c);
+        return NULL;
     }
-    
-    /*
-     * Case 2: Node has a two children.
-     */
-    else if(current->left != NULL && current->right != NULL) {
-
-        /* Find minimum node of the right subtree */
-        s = bst_findmin(current->right);
-        s->parent->left = NULL;
-        s->parent = NULL;
-        
-        /* If our node has a parent, we need to update that one*/
-        if(current->parent != NULL) {
-
-            s->parent = current->parent;
-
-            if(current->left != NULL) {
-                s->left = current->left;
-                current->left->parent = s;
-            }
-            if(current->right != NULL) {
-                s->right = current->right;
-                current->right->parent = s;
-            }
-
+    c->serverscapacity = r->numberofservers + 1;
+
+    for(size_t i = 0; i < r->numberofservers; i++) {
+
+        ring_element_server_t *from = r->servers[i]->element.server;
+        ring_element_t *e = (ring_element_t *)malloc(sizeof(ring_element_t));
+        ring_element_server_t *server = (ring_element_server_t *)calloc(1, sizeof(ring_element_server_t));
+        uint64_t *tokens = (uint64_t *)malloc(sizeof(uint64_t) * (from->numberofvirtualnodes + 1));
+        char *ip = strdup(from->ip);
+        if(e == NULL || server == NULL || tokens == NULL || ip == NULL) {
+            perror("malloc\n");
+            free(e);
+            free(server);
+            free(tokens);
+            free(ip);
+            hashring_destroy(c);
+            return NULL;
         }
-        else {
-
-            /* If node doesn't have a parent we are deleting the top root*/
-            s->right = r->tree->right;
-            s->right->parent = s;
-
-            if(r->tree->left != NULL) {
-                s->left = r->tree->left;
-                r->tree->left->parent = s;
-            }
-
-            r->tree = s;
 
-        }
+        memcpy(server, from, sizeof(ring_element_server_t));
+        memcpy(tokens, from->tokens, sizeof(uint64_t) * (from->numberofvirtualnodes + 1));
+        server->ip = ip;
+        server->tokens = tokens;
+        e->type = ELEMENT_SERVER;
+        e->hash = r->servers[i]->hash;
+        e->element.server = server;
+        c->servers[i] = e;
+        c->numberofservers++;
     }
 
-    
-    /*
-    * Case 3: Node has a single child. 
-    */
-    else {
+    if(hashring_build(c) != EXIT_SUCCESS) {
+        hashring_destroy(c);
+        return NULL;
+    }
 
-        ring_element_t *child;
+    return c;
+}
 
-        if(current->left != NULL) {
-            child = current->left;
-        }
-        else {
-            child = current->right;
-        }
 
-        /* If current has no parent, we are deleting top root */
-        if(current->parent == NULL) {
-            child->parent = NULL;
-            r->tree = child;
-            return EXIT_SUCCESS;
-        }
-        else {
-            if (current->parent->left == current) {
-                current->parent->left = child;
-            } else {  
-                current->parent->right = child;
-            }
-            child->parent = current->parent;
-        }
-    }
 
-    return EXIT_SUCCESS;
+/**
+ * @brief Maps a key onto the hash ring, positions span the whole 64 bit range of the hash method.
+ * 
+ * @param r 
+ * @param key 
+ * @return uint64_t 
+ */
+uint64_t hashring_position(hashring_t *r, char *key) {
+    return r->fn(key, strlen(key), r->seed);
 }
 
 
 
 /**
- * @brief Creates a hashring.
+ * @brief Computes token i of a server, token 0 is its own and token i > 0 belongs to its virtual node i - 1.
  * 
- * @param size 
- * @param fn 
- * @return hashring_t* 
+ * @param r 
+ * @param s 
+ * @param i 
+ * @return uint64_t 
  */
-hashring_t * hashring_create(size_t size, hashring_hash_t fn) {
+uint64_t hashring_token(hashring_t *r, ring_element_t *s, uint32_t i) {
 
-    if(size < 0 || size == 0) {
-        perror("size\n");
-        return NULL;
+    char buffer[4096] = { 0 };
+    if(i == 0) {
+        snprintf(buffer, sizeof(buffer), "%s-%u", s->element.server->ip, s->element.server->port);
     }
-
-    hashring_t *r = (hashring_t *) malloc(sizeof(hashring_t));
-    if(r == NULL) {
-        perror("malloc\n");
-        return NULL;
+    else {
+        snprintf(buffer, sizeof(buffer), "%s-%u-%u", s->element.server->ip, s->element.server->port, i - 1);
     }
-
-    r->size = size;
-    r->fn = fn;
-    r->elements = malloc(size * sizeof(ring_element_t *));
-    memset(r->elements, '\x00', size * sizeof(ring_element_t *));
-
-    return r;
-
+    return hashring_position(r, buffer);
 }
 
 
@@ -360,14 +329,24 @@ hashring_t * hashring_create(size_t size, hashring_hash_t fn) {
  */
 void hashring_destroy(hashring_t *r) {
 
-    for(uint32_t i = 0; i < r->size; i++) {
-        if(r->elements[i] != NULL) {
-            hashring_deleteelement(r->elements[i]);
+    for(uint32_t i = 0; i < r->keys->capacity; i++) {
+        if(r->keys->states[i] == HASHMAP_SLOT_FULL) {
+            hashring_deleteelement(r->keys->values[i]);
         }
     }
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        hashring_deleteelement(r->servers[i]);
+    }
+    for(size_t i = 0; i < r->numberofremoved; i++) {
+        hashring_deleteelement(r->removed[i]);
+    }
 
-    free(r->elements);
+    ringkeymap_destroy(r->keys);
     free(r->servers);
+    free(r->removed);
+    free(r->tokens);
+    free(r->owners);
+    free(r->maglev);
     free(r);
 
 }
@@ -387,268 +366,471 @@ uint32_t hashring_deleteelement(ring_element_t *e) {
     }
 
     switch(e->type) {
-        case ELEMENT_EMPTY:
-            break;
         case ELEMENT_KEY:
-            printf("[*]: Deleting (key: %s) (store: %s)\n", e->element.data->key, e->element.data->store);
             free(e->element.data->key);
             free(e->element.data->store);
+            free(e->element.data);
             break;
         case ELEMENT_SERVER:
             printf("[*]: Deleting (server: %s)\n", e->element.server->ip);
             free(e->element.server->ip);
+            free(e->element.server->tokens);
+            free(e->element.server);
             break;
     }
 
     free(e);
+    return EXIT_SUCCESS;
 }
 
 
 
+/**
+ * @brief Mixes a 64 bit value with the splitmix64 finalizer, probes and scores are derived from a key's hash with it.
+ * 
+ * @param x 
+ * @return uint64_t 
+ */
+static inline uint64_t hashring_mix(uint64_t x) {
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+
 
 /**
- * @brief Looks up a given key in the hash ring and returns it if it exists.
+ * @brief Finds the first token at or after a position of the ring. Every level of the search is a compare and a shift, with
+ * no branch to mispredict, and the line four levels below is prefetched while the current one is compared.
  * 
  * @param r 
- * @param key 
- * @return ring_element_t* 
+ * @param hash 
+ * @return size_t Eytzinger index of the token, 0 when the position is past the last token. Slot 0 holds the smallest token
  */
-ring_element_t * hashring_lookupkey(hashring_t *r, char *key ) {
+static inline size_t hashring_search(hashring_t *r, uint64_t hash) {
 
-    if(r == NULL || key == NULL) {
-        return NULL;
+    const uint64_t *tokens = r->tokens;
+    size_t n = r->numberoftokens;
+    size_t k = 1;
+
+    while(k <= n) {
+        __builtin_prefetch(tokens + 16 * k);
+        k = 2 * k + (tokens[k] < hash);
     }
 
-    uint32_t hash = r->fn(key);
+    /* Climb back past every right turn, ending at the last left turn (the first token >= hash) or at 0 when there was none */
+    return k >> __builtin_ffsll(~k);
+}
 
-    if(r->elements[hash] != NULL) {
-        
-        if(r->elements[hash]->type == ELEMENT_KEY) {
-            return r->elements[hash];
-        }
+
+
+/**
+ * @brief Jump consistent hash, maps a hash onto one of n buckets. Growing n to n + 1 moves 1/(n + 1) of the keys, all of them
+ * to the new bucket.
+ * 
+ * @param hash 
+ * @param n 
+ * @return uint32_t 
+ */
+static inline uint32_t hashring_jump(uint64_t hash, uint32_t n) {
+
+    int64_t b = -1;
+    int64_t j = 0;
+
+    while(j < (int64_t)n) {
+        b = j;
+        hash = hash * 2862933555777941757ull + 1;
+        j = (int64_t)((double)(b + 1) * ((double)(1ll << 31) / (double)((hash >> 33) + 1)));
     }
 
-    return NULL;
+    return (uint32_t)b;
 }
 
 
 
 /**
- * @brief Dynamically generates a sorted array of all the nodes/stores in the hash ring.
+ * @brief Finds the server owning a position of the ring.
  * 
  * @param r 
- * @return uint32_t 
+ * @param hash 
+ * @return ring_element_t* NULL when the ring has no servers
  */
-uint32_t hashring_generatenodesarray(hashring_t *r) {
+static inline ring_element_t * hashring_owner(hashring_t *r, uint64_t hash) {
 
-    if(r->servers != NULL) {
-        free(r->servers);
+    if(r->numberofservers == 0) {
+        return NULL;
     }
 
-    r->servers = (uint32_t *)malloc( sizeof(uint32_t) * r->numberofservers);
-    uint32_t index = 0;
-    for(uint32_t i = 0; i < r->size; i++) {
-        if(r->elements[i] != NULL && r->elements[i]->type == ELEMENT_SERVER) {
-            r->servers[index] = r->elements[i]->hash;
-            index++;
+    switch(r->placement) {
+
+        case HASHRING_PLACEMENT_JUMP:
+            return r->servers[hashring_jump(hash, r->numberofservers)];
+
+        case HASHRING_PLACEMENT_MAGLEV:
+            return r->servers[r->maglev[hash % HASHRING_MAGLEV_SIZE]];
+
+        case HASHRING_PLACEMENT_RENDEZVOUS: {
+            ring_element_t *best = r->servers[0];
+            uint64_t top = hashring_mix(hash ^ best->hash);
+            for(size_t i = 1; i < r->numberofservers; i++) {
+                uint64_t score = hashring_mix(hash ^ r->servers[i]->hash);
+                if(score > top) {
+                    top = score;
+                    best = r->servers[i];
+                }
+            }
+            return best;
         }
+
+        case HASHRING_PLACEMENT_MULTIPROBE: {
+            size_t best = 0;
+            uint64_t nearest = UINT64_MAX;
+            for(uint32_t i = 0; i < HASHRING_MULTIPROBE_PROBES; i++) {
+                uint64_t probe = hashring_mix(hash + i * 0x9e3779b97f4a7c15ull);
+                size_t k = hashring_search(r, probe);
+                uint64_t distance = r->tokens[k] - probe;
+                if(distance < nearest) {
+                    nearest = distance;
+                    best = k;
+                }
+            }
+            return r->owners[best];
+        }
+
+        default:
+            return r->owners[hashring_search(r, hash)];
     }
+}
 
+/**
+ * @brief Finds the server that owns a key from the tokens alone, whether or not the key was ever added.
+ * 
+ * @param r 
+ * @param key 
+ * @return ring_element_t* NULL when the ring has no servers
+ */
+ring_element_t * hashring_route(hashring_t *r, char *key) {
+
+    if(r == NULL || key == NULL) {
+        return NULL;
+    }
+
+    return hashring_owner(r, hashring_position(r, key));
 }
 
 
 
 /**
- * @brief Responsible for creating a virtual node of a node by prepending a suffix to the server ip.
+ * @brief Looks up a given key in the hash ring and returns it if it exists.
  * 
+ * @param r 
+ * @param key 
+ * @return ring_element_t* 
  */
-uint32_t hashring_addvirtualnodes(hashring_t *r, char *ip, int port, uint32_t i) {
+ring_element_t * hashring_lookupkey(hashring_t *r, char *key ) {
+
+    if(r == NULL || key == NULL) {
+        return NULL;
+    }
 
-    /* Suffix: 127.0.0.1 -> 127.0.0.1-1 */
+    hashmap_str_t name = { key, (uint32_t)strlen(key) };
+    ring_element_t **e = ringkeymap_get(r->keys, name);
 
-    char buffer[4096] = { 0 };
-    snprintf(buffer, ((size_t)4096), "%s-%u", ip, i);
-    char *ip_modified = (char *)malloc( strlen(buffer) );
-    strncpy(ip_modified, buffer, strlen(buffer));
-    
-    ring_element_t *e = hashring_addserver(r, ip_modified, port, 0);
+    return (e == NULL) ? NULL : *e;
+}
 
-    if( e != NULL) {
-        e->element.server->isvirtualnode = true;
-    }
 
-    free(ip_modified);
 
+/**
+ * @brief Orders tokens by position, ties (two servers hashing to the same token) by the server's first token and port so
+ * every coordinator breaks them the same way.
+ */
+static int hashring_tokencmp(const void *a, const void *b) {
+
+    const ring_token_t *x = (const ring_token_t *)a;
+    const ring_token_t *y = (const ring_token_t *)b;
+
+    if(x->token != y->token) {
+        return (x->token < y->token) ? -1 : 1;
+    }
+    if(x->owner->hash != y->owner->hash) {
+        return (x->owner->hash < y->owner->hash) ? -1 : 1;
+    }
+    return x->owner->element.server->port - y->owner->element.server->port;
 }
 
 
 
 /**
- * @brief Iteratively updating ranges for the nodes to account for inserted and deleted nodes/servers.
+ * @brief Copies sorted tokens into Eytzinger order by an in order walk of the implicit tree rooted at k.
  * 
  * @param r 
- * @return uint32_t 
+ * @param sorted 
+ * @param i next sorted token to place
+ * @param k 
+ * @return size_t the next sorted token after the subtree of k
  */
-uint32_t hashring_updateranges(hashring_t *r) {
+static size_t hashring_eytzinger(hashring_t *r, ring_token_t *sorted, size_t i, size_t k) {
 
-    if(r->numberofservers <= 0) {
-        return EXIT_FAILURE;
+    if(k <= r->numberoftokens) {
+        i = hashring_eytzinger(r, sorted, i, 2 * k);
+        r->tokens[k] = sorted[i].token;
+        r->owners[k] = sorted[i].owner;
+        i++;
+        i = hashring_eytzinger(r, sorted, i, 2 * k + 1);
     }
+    return i;
+}
 
-    for(uint32_t x = 0; x < r->numberofservers; x++) {
 
-        ring_element_t *e = r->elements[ r->servers[x] ];
-        uint32_t start = e->hash;
-        uint32_t i = start + 1;
 
-        while(true) {
+/**
+ * @brief Rebuilds the token arrays from the servers after a membership change, and how much of the ring every server owns.
+ * A multiprobe ring gets one token per server.
+ * 
+ * @param r 
+ * @return uint32_t 
+ */
+static uint32_t hashring_buildtokens(hashring_t *r) {
 
-            if(i > r->size) {
-                /* Loop around */
-                i = 0;
-                continue;
-            }
+    bool multiprobe = (r->placement == HASHRING_PLACEMENT_MULTIPROBE);
+    size_t n = 0;
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        n += (multiprobe) ? 1 : 1 + r->servers[i]->element.server->numberofvirtualnodes;
+    }
 
-            if(i == start) {
-                break;
-            }
+    ring_token_t *sorted = (ring_token_t *)malloc(sizeof(ring_token_t) * (n + 1));
+    uint64_t *tokens = NULL;
+    ring_element_t **owners = (ring_element_t **)malloc(sizeof(ring_element_t *) * (n + 1));
+    if(sorted == NULL || owners == NULL || posix_memalign((void **)&tokens, 64, sizeof(uint64_t) * (n + 1)) != 0) {
+        perror("malloc\n");
+        free(sorted);
+        free(owners);
+        return EXIT_FAILURE;
+    }
 
-            if( r->elements[i] != NULL) {
-                if(r->elements[i]->type == ELEMENT_SERVER) {
-                    break;
-                }
-            }
-            i++;
+    size_t x = 0;
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        ring_element_t *s = r->servers[i];
+        s->element.server->owned = 0;
+        uint32_t count = (multiprobe) ? 1 : 1 + s->element.server->numberofvirtualnodes;
+        for(uint32_t j = 0; j < count; j++) {
+            sorted[x].token = s->element.server->tokens[j];
+            sorted[x].owner = s;
+            x++;
         }
+    }
+    qsort(sorted, n, sizeof(ring_token_t), hashring_tokencmp);
 
-        e->element.server->rangeend = i - 1;
-
+    /* Every token owns the arc from the token before it, the smallest one the arc wrapping around from the largest */
+    for(size_t i = 0; i < n; i++) {
+        uint64_t previous = sorted[(i == 0) ? n - 1 : i - 1].token;
+        sorted[i].owner->element.server->owned += sorted[i].token - previous;
     }
 
+    free(r->tokens);
+    free(r->owners);
+    r->tokens = tokens;
+    r->owners = owners;
+    r->numberoftokens = n;
+    r->tokens[0] = (n > 0) ? sorted[0].token : 0;
+    r->owners[0] = (n > 0) ? sorted[0].owner : NULL;
+    hashring_eytzinger(r, sorted, 0, 1);
+
+    free(sorted);
 
+    return EXIT_SUCCESS;
 }
 
 
+
 /**
- * @brief Iteratively remap stores for keys upon insertion and or deletion of a node.
+ * @brief Rebuilds the Maglev table. Each server walks its own permutation of the slots, from an offset by a skip both derived
+ * from its first token, and in turn claims the next slot of its permutation that is still empty. Shares end up within a
+ * percent of each other and a membership change moves little more than the slots of the server that changed.
  * 
  * @param r 
- * @param e 
  * @return uint32_t 
  */
-uint32_t hashring_remapkeys_add(hashring_t *r, ring_element_t *e) {
-   
-    if(r->numberofservers <= 0) {
+static uint32_t hashring_buildmaglev(hashring_t *r) {
+
+    size_t n = r->numberofservers;
+    uint16_t *table = (uint16_t *)malloc(sizeof(uint16_t) * HASHRING_MAGLEV_SIZE);
+    uint64_t *next = (uint64_t *)malloc(sizeof(uint64_t) * (n + 1));
+    if(table == NULL || next == NULL) {
+        perror("malloc\n");
+        free(table);
+        free(next);
         return EXIT_FAILURE;
     }
 
-    uint32_t i = e->hash + 1;
-    while(true) {
+    memset(table, 0xff, sizeof(uint16_t) * HASHRING_MAGLEV_SIZE);
+    for(size_t i = 0; i < n; i++) {
+        next[i] = 0;
+        r->servers[i]->element.server->owned = 0;
+    }
 
-        if( i > r->size) {
-            i = 0;
-            continue;
-        }
+    size_t filled = 0;
+    while(filled < HASHRING_MAGLEV_SIZE && n > 0) {
+        for(size_t i = 0; i < n && filled < HASHRING_MAGLEV_SIZE; i++) {
 
-        if(i == e->element.server->rangeend + 1) {
-            break;
-        }
+            ring_element_t *s = r->servers[i];
+            uint64_t offset = hashring_mix(s->hash) % HASHRING_MAGLEV_SIZE;
+            uint64_t skip = hashring_mix(s->hash ^ 0x9e3779b97f4a7c15ull) % (HASHRING_MAGLEV_SIZE - 1) + 1;
 
-        if(r->elements[i] != NULL) {
-            
-            if(r->elements[i]->type == ELEMENT_SERVER) {
-                /* Should not hit */
-                break;
+            for(uint32_t turn = 0; turn <= s->element.server->numberofvirtualnodes && filled < HASHRING_MAGLEV_SIZE; turn++) {
+                uint64_t c = (offset + next[i] * skip) % HASHRING_MAGLEV_SIZE;
+                while(table[c] != HASHRING_MAGLEV_EMPTY) {
+                    next[i]++;
+                    c = (offset + next[i] * skip) % HASHRING_MAGLEV_SIZE;
+                }
+                table[c] = (uint16_t)i;
+                next[i]++;
+                filled++;
+                s->element.server->owned += UINT64_MAX / HASHRING_MAGLEV_SIZE;
             }
-        
-            free(r->elements[i]->element.data->store);
-            r->elements[i]->element.data->store = strdup(e->element.server->ip);
-            r->elements[i]->element.data->port = e->element.server->port;
-
         }
-        i++;
-    }   
+    }
+
+    free(next);
+    free(r->maglev);
+    r->maglev = table;
 
+    return EXIT_SUCCESS;
 }
 
 
-uint32_t hashring_remapkeys_del(hashring_t *r, ring_element_t *e) {
 
-    if(r->numberofservers <= 0) {
-        return EXIT_FAILURE;
-    }
+/**
+ * @brief Rebuilds what the placement looks servers up in after a membership change.
+ * 
+ * @param r 
+ * @return uint32_t 
+ */
+uint32_t hashring_build(hashring_t *r) {
 
-    ring_element_t *new = NULL;
-    int32_t i = e->hash - 1;
-    while(true) {
+    switch(r->placement) {
 
-        if(i < 0) {
-            i = r->size;
-            continue;
-        }
+        case HASHRING_PLACEMENT_RING:
+        case HASHRING_PLACEMENT_MULTIPROBE:
+            return hashring_buildtokens(r);
 
-        if(i == e->hash) {
-            printf("Error\n");
-            break;
-        }
+        case HASHRING_PLACEMENT_MAGLEV:
+            return hashring_buildmaglev(r);
 
-        if( r->elements[i] != NULL) {
-            if(r->elements[i]->type == ELEMENT_SERVER) {
-                new = r->elements[i];
-                break;
+        default:
+            /* Jump and rendezvous only need the servers, every one gets an even share */
+            for(size_t i = 0; i < r->numberofservers; i++) {
+                r->servers[i]->element.server->owned = UINT64_MAX / r->numberofservers;
             }
-        }
-        i--;
+            return EXIT_SUCCESS;
     }
+}
 
-    i = e->hash + 1;
-    while(true) {
 
-        if(i > r->size) {
-            i = 0;
-            continue;
-        }
 
-        if(r->elements[i] != NULL) {
+/**
+ * @brief Bytes used by the placement: the servers and the tokens or table lookups go through. The key directory isn't counted.
+ * 
+ * @param r 
+ * @return size_t 
+ */
+size_t hashring_memory(hashring_t *r) {
 
-            if(r->elements[i]->type == ELEMENT_SERVER) {
-                // Shouldn't happend.
-                break;
-            }
+    size_t bytes = sizeof(hashring_t) + sizeof(ring_element_t *) * r->serverscapacity;
+
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        ring_element_server_t *server = r->servers[i]->element.server;
+        bytes += sizeof(ring_element_t) + sizeof(ring_element_server_t) + strlen(server->ip) + 1;
+        bytes += sizeof(uint64_t) * (server->numberofvirtualnodes + 1);
+    }
+    if(r->tokens != NULL) {
+        bytes += (sizeof(uint64_t) + sizeof(ring_element_t *)) * (r->numberoftokens + 1);
+    }
+    if(r->maglev != NULL) {
+        bytes += sizeof(uint16_t) * HASHRING_MAGLEV_SIZE;
+    }
+
+    return bytes;
+}
+
+
+
+/**
+ * @brief Points every key at its owner after a membership change.
+ * 
+ * @param r 
+ * @return uint32_t the number of keys that moved
+ */
+uint32_t hashring_remapkeys(hashring_t *r) {
 
-            char *old = r->elements[i]->element.data->store;
-            r->elements[i]->element.data->store = strdup(new->element.server->ip);
-            e->element.data->port = new->element.server->port;
+    uint32_t moved = 0;
 
-            printf("[*]: Update key (%s) from store: %s to store %s\n",
-            r->elements[i]->element.data->key,
-            old,
-            r->elements[i]->element.data->store);
+    for(uint32_t i = 0; i < r->keys->capacity; i++) {
+
+        if(r->keys->states[i] != HASHMAP_SLOT_FULL) {
+            continue;
         }
-        i++;
+
+        ring_element_key_t *k = r->keys->values[i]->element.data;
+        ring_element_t *s = hashring_owner(r, r->keys->values[i]->hash);
+        if(s == NULL) {
+            /* No servers left, keys keep their last store until one is added */
+            break;
+        }
+        if(k->port == s->element.server->port && strcmp(k->store, s->element.server->ip) == 0) {
+            continue;
+        }
+
+        free(k->store);
+        k->store = strdup(s->element.server->ip);
+        k->port = s->element.server->port;
+        moved++;
     }
-}
 
+    return moved;
+}
 
 
 
 /**
- * @brief Adds a node/store/server to the hash ring and creates a specified amount of virtualnodes
+ * @brief Adds a node/store/server to the hash ring along with a token per virtual node.
  * 
  * @param r 
  * @param ip 
+ * @param port 
  * @param virtualNodes 
- * @return ring_element_t* 
+ * @return ring_element_t* NULL if the server is already in the ring
  */
 ring_element_t * hashring_addserver(hashring_t *r, char *ip, int port, uint32_t virtualNodes) {
 
-    if(r == NULL || ip == NULL) {
+    if(r == NULL || ip == NULL || virtualNodes > HASHRING_MAXVIRTUALNODES) {
         return NULL;
     }
 
-    char buffer[4096] = { 0 };
-    snprintf(buffer, ((size_t)4096), "%s-%u", ip, port);
-    uint32_t hash = r->fn(buffer);
+    if(hashring_lookupserver(r, ip, port) != NULL) {
+        return NULL;
+    }
+
+    /* Maglev slots hold 16 bit server indexes */
+    if(r->placement == HASHRING_PLACEMENT_MAGLEV && r->numberofservers >= HASHRING_MAGLEV_EMPTY) {
+        return NULL;
+    }
+
+    if(r->numberofservers == r->serverscapacity) {
+        size_t capacity = (r->serverscapacity == 0) ? 8 : r->serverscapacity * 2;
+        ring_element_t **servers = (ring_element_t **)realloc(r->servers, sizeof(ring_element_t *) * capacity);
+        if(servers == NULL) {
+            perror("malloc\n");
+            return NULL;
+        }
+        r->servers = servers;
+        r->serverscapacity = capacity;
+    }
 
     ring_element_t *e = (ring_element_t *)malloc(sizeof(struct ring_element_t));
     if(e == NULL) {
@@ -657,13 +839,10 @@ ring_element_t * hashring_addserver(hashring_t *r, char *ip, int port, uint32_t
     }
 
     /* Intiailize ring_element_t */
-    e->hash = hash;
-    e->left = NULL;
-    e->right = NULL;
     e->type = ELEMENT_SERVER;
 
     /* Intialize ring_element_server_t */
-    e->element.server = (ring_element_server_t *)malloc( sizeof(ring_element_server_t));
+    e->element.server = (ring_element_server_t *)calloc(1, sizeof(ring_element_server_t));
     if(e->element.server == NULL) {
         perror("malloc\n");
         free(e);
@@ -671,90 +850,42 @@ ring_element_t * hashring_addserver(hashring_t *r, char *ip, int port, uint32_t
     }
     e->element.server->ip = strdup(ip);
     e->element.server->port = port;
-    e->element.server->rangestart = hash;
     e->element.server->numberofvirtualnodes = virtualNodes;
-
-    /* Add hash to ring */
-    if(r->elements[hash] != NULL) {
-        perror("collision\n");
+    e->element.server->tokens = (uint64_t *)malloc(sizeof(uint64_t) * (virtualNodes + 1));
+    if(e->element.server->tokens == NULL) {
+        perror("malloc\n");
         hashring_deleteelement(e);
         return NULL;
     }
-    r->elements[hash] = e;
-    r->numberofservers++;
-    r->count++;
-
-    /* Add virtual nodes */
-    for(uint32_t i = 0; i < virtualNodes; i++) {
-        hashring_addvirtualnodes(r, ip, port, i);
+    for(uint32_t i = 0; i <= virtualNodes; i++) {
+        e->element.server->tokens[i] = hashring_token(r, e, i);
     }
+    e->hash = e->element.server->tokens[0];
 
-    /* Update binary search tree */
-    bst_insert(r, e);
-
-    /* Generate linear sorted array of nodes*/
-    hashring_generatenodesarray(r);
-
-    /* Update server ranges to account for inserted server*/
-    hashring_updateranges(r);
-
-    if(r->numberofservers > 1) {
+    r->servers[r->numberofservers] = e;
+    r->numberofservers++;
+    r->dirty = true;
 
-        /* Remap keys */
-        hashring_remapkeys_add(r, e);
+    printf("[*]: Inserted server IP: %s \tPORT: %u\t TOKENS: %u\n", ip, port, virtualNodes + 1);
 
+    if(r->batch == false && hashring_commit(r) != EXIT_SUCCESS) {
+        r->numberofservers--;
+        hashring_deleteelement(e);
+        return NULL;
     }
 
-    printf("[*]: Inserted server IP: %s \tPORT: %u\t INDEX: %d\n", ip, port, hash);
-
     return e;
 
 }
 
 
 
-uint32_t hashring_removevirtualnodes(hashring_t *r, ring_element_t *e) {
-
-    /* Suffix: 127.0.0.1 -> 127.0.0.1-1 */
-
-    char buffer[4096] = { 0 };
-    char buffertwo[4096] = { 0 };
-
-    ring_element_t *v = NULL;
-
-    for(uint32_t i = 0; i < e->element.server->numberofvirtualnodes; i++) {
-
-        snprintf(buffer, ((size_t)4096), "%s-%u-%u", e->element.server->ip, i, e->element.server->port);
-        char *ip_modified = (char *)malloc( strlen(buffer) );
-        strncpy(ip_modified, buffer, strlen(buffer));
-
-        snprintf(buffertwo, ((size_t)4096), "%s-%u", e->element.server->ip, i);
-        char *ip_noport = (char *)malloc( strlen(buffertwo) );
-        strncpy(ip_noport, buffertwo, strlen(buffertwo));
-
-        uint32_t hash = r->fn(ip_modified);
-        v = r->elements[hash];
-
-        if(v != NULL) {
-            hashring_removeserver(r, ip_noport, e->element.server->port);
-        }
-
-        v = NULL;
-
-        free(ip_modified);
-        free(ip_noport);
-
-    }
-
-
-
-}
-
 /**
- * @brief Removes a server from the hash ring and deletes the appropiate virtual nodes.
+ * @brief Removes a server from the hash ring along with the tokens of its virtual nodes.
  * 
  * @param r 
  * @param ip 
+ * @param port 
  * @return uint32_t 
  */
 uint32_t hashring_removeserver(hashring_t *r, char *ip, int port) {
@@ -765,193 +896,138 @@ uint32_t hashring_removeserver(hashring_t *r, char *ip, int port) {
     }
 
     ring_element_t *e = hashring_lookupserver(r, ip, port);
-    
+
     if(e == NULL) {
         return EXIT_FAILURE;
     }
-    
-    r->elements[e->hash] = NULL;
-    r->count--;
-    r->numberofservers--;
-    printf("[*]: Removing server: %s\n", e->element.server->ip);
 
-    /* Remove virtual nodes */
-    if(e->element.server->isvirtualnode == false) {
-        hashring_removevirtualnodes(r, e);
+    /* The tokens may still point at the server, it is freed by the commit that rebuilds them */
+    if(r->numberofremoved == r->removedcapacity) {
+        size_t capacity = (r->removedcapacity == 0) ? 8 : r->removedcapacity * 2;
+        ring_element_t **removed = (ring_element_t **)realloc(r->removed, sizeof(ring_element_t *) * capacity);
+        if(removed == NULL) {
+            perror("malloc\n");
+            return EXIT_FAILURE;
+        }
+        r->removed = removed;
+        r->removedcapacity = capacity;
     }
 
-    /* Generate linear sorted array of nodes*/
-    hashring_generatenodesarray(r);
-
-    // Remove from tree
-    bst_remove(r, e);
-    
-    /* Update server ranges to account for inserted server*/
-    hashring_updateranges(r);
-
-    /* Remap keys */
-    hashring_remapkeys_del(r, e);
-
-    hashring_deleteelement(e);
-
-    return EXIT_SUCCESS;
-}
-
-
-
-/**
- * @brief Returns the server structure element for a given ip
- * 
- * @param r 
- * @param ip 
- * @return ring_element_server_t* 
- */
-ring_element_t *hashring_lookupserver(hashring_t *r, char *ip, int port) {
-
-    if(ip == NULL) {
-        return NULL;
+    size_t i = 0;
+    while(r->servers[i] != e) {
+        i++;
     }
 
-    char buffer[4096] = { 0 };
-    snprintf(buffer, ((size_t)4096), "%s-%u", ip, port);
-
-    uint32_t hash = r->fn(buffer);
-
-    if( r->elements[hash] == NULL) {
-        return NULL;
+    /* Jump numbers servers by position, the last one takes over the number of the leaving one. Elsewhere the order is kept */
+    bool jump = (r->placement == HASHRING_PLACEMENT_JUMP);
+    if(jump) {
+        r->servers[i] = r->servers[r->numberofservers - 1];
     }
-
-    if( r->elements[hash]->type != ELEMENT_SERVER ) {
-        return NULL;
+    else {
+        memmove(&r->servers[i], &r->servers[i + 1], sizeof(ring_element_t *) * (r->numberofservers - i - 1));
     }
+    r->numberofservers--;
+    r->removed[r->numberofremoved] = e;
+    r->numberofremoved++;
+    r->dirty = true;
+    printf("[*]: Removing server: %s\n", e->element.server->ip);
 
+    /* Keys of the server move to the servers of the tokens after its own. On failure the slot past the end still holds the
+       last server, putting the leaving one back restores the array */
+    if(r->batch == false && hashring_commit(r) != EXIT_SUCCESS) {
+        if(jump == false) {
+            memmove(&r->servers[i + 1], &r->servers[i], sizeof(ring_element_t *) * (r->numberofservers - i));
+        }
+        r->servers[i] = e;
+        r->numberofservers++;
+        r->numberofremoved--;
+        return EXIT_FAILURE;
+    }
 
-    return r->elements[hash];
-
+    return EXIT_SUCCESS;
 }
 
 
 
 /**
- * @brief Checks if a hashring object exists at a given index.
+ * @brief Starts a batch of membership changes. Servers added or removed until hashring_commit only change the list of
+ * servers, the tokens and the Maglev table stay as they were and keep pointing at servers that left.
  * 
  * @param r 
- * @param index 
- * @param type 
- * @return true 
- * @return false 
  */
-bool hashring_objectexists(hashring_t *r, uint32_t index, uint8_t type) {
-
-    if( r->elements[index] != NULL ) {
-        if( r->elements[index]->type == type) {
-            return true;
-        }
-    }
-
-    return false;
+void hashring_begin(hashring_t *r) {
+    r->batch = true;
 }
 
 
 
 /**
- * @brief Finds the store responsible for holding the key by interatively walking the hash ring.
+ * @brief Applies the membership changes since hashring_begin, or of a single add or remove outside a batch: the tokens or
+ * table are rebuilt once, every key is pointed at its owner once and the servers that left are freed. A commit that fails
+ * to allocate leaves the ring as it was, and the next one tries again.
  * 
  * @param r 
- * @param e 
  * @return uint32_t 
  */
-uint32_t hashring_addstore_iterative(hashring_t *r, ring_element_t *e) {
+uint32_t hashring_commit(hashring_t *r) {
 
-    ring_element_t *current = e;
-    ring_element_t *s = NULL;
+    r->batch = false;
+    if(r->dirty == false) {
+        return EXIT_SUCCESS;
+    }
 
-    int32_t i = e->hash;
+    if(hashring_build(r) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    uint32_t moved = hashring_remapkeys(r);
 
-    /* Find the store responsible for holding the key by walking the hash ring in counter clockwise direction */
-    while(true) {
+    for(size_t i = 0; i < r->numberofremoved; i++) {
+        hashring_deleteelement(r->removed[i]);
+    }
+    r->numberofremoved = 0;
+    r->dirty = false;
 
-        if(i < 0) {
-            /* Loop around */
-            i = r->size;
-            continue;
-        }
+    printf("[*]: Ring rebuilt: %zu servers, %zu tokens, %u keys moved\n", r->numberofservers, r->numberoftokens, moved);
 
-        if(r->elements[i] != NULL) {
-            if(r->elements[i]->type == ELEMENT_SERVER) {
-                s = r->elements[i];
-                break;
-            }
-        }
-        i--;
-        
-    }
-    
-    e->element.data->store = strdup(s->element.server->ip);
-    e->element.data->port = s->element.server->port;
-    
     return EXIT_SUCCESS;
-
 }
 
 
 
 /**
- * @brief Finds the store responsible for holding the key by walking the binary search tree
+ * @brief Returns the server structure element for a given ip
  * 
  * @param r 
- * @param e 
- * @return uint32_t 
+ * @param ip 
+ * @param port 
+ * @return ring_element_t* 
  */
-uint32_t hashring_addstore_bst(hashring_t *r, ring_element_t *e) {
-    
-    if(r->numberofservers == 0 || r->servers == NULL) {
-        return EXIT_FAILURE;
-    }
-
-    /* Transform tree to array */
-    uint32_t servers[r->numberofservers];
-
-    /* Walk the array to find store for hash value, using two indices approach */
-    uint32_t hashofstore = 0;
-
-    uint32_t x = 0;
-
-    while(true) {
-
-        uint32_t y = x + 1;
-        if(y > r->numberofservers) {
-            hashofstore = servers[0];
-            break;
-        }
+ring_element_t *hashring_lookupserver(hashring_t *r, char *ip, int port) {
 
-        if(e->hash > servers[y]) {
-            x++;
-            continue;
-        }
+    if(ip == NULL) {
+        return NULL;
+    }
 
-        if(e->hash < servers[y] && e->hash > servers[x]) {
-            hashofstore = servers[y];
-            break;
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        ring_element_server_t *s = r->servers[i]->element.server;
+        if(s->port == port && strcmp(s->ip, ip) == 0) {
+            return r->servers[i];
         }
-
-        x++;   
     }
 
-    e->element.data->store = strdup(r->elements[hashofstore]->element.server->ip);
-
-    return EXIT_SUCCESS;
+    return NULL;
 
 }
 
 
 
 /**
- * @brief Adds a key to the hash ring
+ * @brief Adds a key to the hash ring and assigns it the store that owns its position. Adding a key that is already in the
+ * ring returns its element.
  * 
  * @param r 
  * @param key 
- * @return uint32_t 
+ * @return ring_element_t* NULL if the ring has no servers
  */
 ring_element_t * hashring_addkey(hashring_t *r, char *key) {
 
@@ -959,16 +1035,18 @@ ring_element_t * hashring_addkey(hashring_t *r, char *key) {
         return NULL;
     }
 
-    uint32_t hash = r->fn(key);
-
-    /* Collisionen, an entry already exists on calculated element. */
+    ring_element_t *e = hashring_lookupkey(r, key);
+    if(e != NULL) {
+        return e;
+    }
 
-    /* TODO: Handle when a key matches the hash value of a node(server) */
-    if(hashring_objectexists(r, hash, ELEMENT_KEY) != false) {
+    uint64_t hash = hashring_position(r, key);
+    ring_element_t *s = hashring_owner(r, hash);
+    if(s == NULL) {
         return NULL;
     }
-    
-    ring_element_t *e = (ring_element_t *)malloc(sizeof(struct ring_element_t));
+
+    e = (ring_element_t *)malloc(sizeof(struct ring_element_t));
     if(e == NULL) {
         perror("malloc\n");
         return NULL;
@@ -976,8 +1054,6 @@ ring_element_t * hashring_addkey(hashring_t *r, char *key) {
 
     /* Intiailize ring_element_t */
     e->hash = hash;
-    e->left = NULL;
-    e->right = NULL;
     e->type = ELEMENT_KEY;
 
     /* Intialize ring_element_key_t */
@@ -988,15 +1064,15 @@ ring_element_t * hashring_addkey(hashring_t *r, char *key) {
         return NULL;
     }
     e->element.data->key = strdup(key);
-    e->element.data->store = NULL;
-
-    /* Add to hash ring */
-    r->elements[hash] = e;
-
-    /* Update store linkage */
-    hashring_addstore_iterative(r, e);
+    e->element.data->store = strdup(s->element.server->ip);
+    e->element.data->port = s->element.server->port;
 
-    printf("[*]: Inserted Key %s at index %d in server %s\n", e->element.data->key, e->hash, e->element.data->store);
+    /* Add to key directory */
+    hashmap_str_t name = { e->element.data->key, (uint32_t)strlen(key) };
+    if(ringkeymap_put(r->keys, name, e) == false) {
+        hashring_deleteelement(e);
+        return NULL;
+    }
 
     r->count++;
 
@@ -1015,27 +1091,16 @@ ring_element_t * hashring_addkey(hashring_t *r, char *key) {
  */
 uint32_t hashring_removekey(hashring_t *r, char *key) {
 
-
-      if( r == NULL || key == NULL) {
-        return EXIT_FAILURE;
-    }
-
-    uint32_t hash = r->fn(key);
-
-    ring_element_t *e = hashring_lookupkey(r, key);
-
-    if( e == NULL) {
+    if( r == NULL || key == NULL) {
         return EXIT_FAILURE;
     }
 
-    if( e->type != ELEMENT_KEY) {
+    hashmap_str_t name = { key, (uint32_t)strlen(key) };
+    ring_element_t *e = NULL;
+    if(ringkeymap_remove(r->keys, name, &e) == false) {
         return EXIT_FAILURE;
     }
 
-    r->elements[hash] = NULL;
-
-    printf("[*]: Removing key %s from server %s\n", key, e->element.data->store);
-
     hashring_deleteelement(e);
 
     r->count--;
@@ -1049,20 +1114,20 @@ uint32_t hashring_removekey(hashring_t *r, char *key) {
  * @brief DJB2 Hashing method.
  * 
  * @param key 
- * @return uint32_t 
+ * @param len 
+ * @param seed 
+ * @return uint64_t 
  */
-uint32_t hashring_hash_djb2(char *key) {
+uint64_t hashring_hash_djb2(const void *key, size_t len, uint64_t seed) {
 
-    uint32_t hash = 5381;
-    int c;
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 5381 ^ (uint32_t)seed;
 
-    while ((c = *key++)) {
-        hash = ((hash << 5) + hash) + c;
+    for(size_t i = 0; i < len; i++) {
+        hash = ((hash << 5) + hash) + p[i];
     }
 
-    uint32_t val = hash % 4000000; 
-
-    return val;
+    return hash;
 }
 
 
@@ -1071,15 +1136,17 @@ uint32_t hashring_hash_djb2(char *key) {
  * @brief Jenkisn Hashing Method
  * 
  * @param key 
- * @return uint32_t 
+ * @param len 
+ * @param seed 
+ * @return uint64_t 
  */
-uint32_t hashring_hash_jenkins(char *key) {
+uint64_t hashring_hash_jenkins(const void *key, size_t len, uint64_t seed) {
 
-    size_t len = strlen(key);
+    const char *p = (const char *)key;
 
-    uint32_t hash = 1;
+    uint32_t hash = 1 ^ (uint32_t)seed;
     for (uint32_t i = 0; i < len; ++i) {
-        hash += key[i];
+        hash += p[i];
         hash += (hash << 10);
         hash ^= (hash >> 6);
     }
@@ -1088,29 +1155,25 @@ uint32_t hashring_hash_jenkins(char *key) {
     hash ^= (hash >> 11);
     hash += (hash << 15);
 
-    uint32_t val = (hash % 4000000) + 1;
-    
-
-    printf("%s->%d\n", key, val);
-
-    return val;
+    return hash;
 
 }
 
 
 
 /**
- * @brief Shows the reponsible key range for the nodes in the hash ring.
+ * @brief Shows the tokens of every server in the hash ring and the share of the ring they own.
  * 
  * @param r 
  */
 void hashring_showranges(hashring_t *r) {
-            
-    for(uint32_t i = 0; i < r->numberofservers; i++) {
-        ring_element_t *e = r->elements[r->servers[i]];
-        printf("%s (%d) | %d -> %d\n", r->elements[ r->servers[i] ]->element.server->ip, e->hash, e->element.server->rangestart, e->element.server->rangeend);
+
+    for(size_t i = 0; i < r->numberofservers; i++) {
+        ring_element_server_t *s = r->servers[i]->element.server;
+        printf("%s:%d | tokens: %u | owns %.2f%%\n", s->ip, s->port, s->numberofvirtualnodes + 1,
+        (r->numberofservers == 1) ? 100.0 : (double)s->owned / 18446744073709551616.0 * 100.0);
     }
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -9,11 +9,80 @@
  * 
  */
 
-#ifndef HASTABLE_H
+#ifndef HASHTABLE_H
 #define HASHTABLE_H
 
 #include "common-defines.h"
-
+#include "hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Hint to the CPU that we are spinning */
+#if defined(__x86_64__) || defined(__i386__)
+#define HASHTABLE_CPU_RELAX()       __builtin_ia32_pause()
+#else
+#define HASHTABLE_CPU_RELAX()       __asm__ __volatile__("" ::: "memory")
+#endif
+
+
+#define HASHTABLE_TYPE_CHAINED      0x0     /*      Buckets of linked lists                                             */
+#define HASHTABLE_TYPE_SWISS        0x1     /*      Open addressing with SIMD probed control bytes                      */
+
+#define HASHTABLE_MIN_SIZE          4       /*      Smallest number of buckets a table will shrink to                   */
+#define HASHTABLE_MAX_LOADFACTOR    1       /*      Grow when count / size reaches this load factor                     */
+#define HASHTABLE_MIN_FILL          10      /*      Shrink when less than 1 / HASHTABLE_MIN_FILL of the buckets are used */
+#define HASHTABLE_REHASH_STEPS      1       /*      Number of buckets migrated per operation while rehashing            */
+#define HASHTABLE_REHASH_EMPTYVISITS 10     /*      Maximum number of empty buckets visited per migrated bucket         */
+
+#define HASHTABLE_GROUP_WIDTH       16      /*      SWISS: Number of control bytes matched at once                      */
+#define HASHTABLE_CTRL_EMPTY        0x80    /*      SWISS: Slot has never been used                                     */
+#define HASHTABLE_CTRL_DELETED      0xFE    /*      SWISS: Slot held an entry that was removed (tombstone)              */
+#define HASHTABLE_SWISS_MAXLOAD(c)  (((c) / 8) * 7)     /* SWISS: Grow when used slots reach 7/8 of the capacity       */
+
+#define HASHTABLE_INLINE_KEY        24      /*      Keys shorter than this ...                                          */
+#define HASHTABLE_INLINE_VALUE      64      /*      ... with values shorter than this get a fixed size small entry      */
+#define HASHTABLE_ITEM_SMALLSIZE    (sizeof(hashtable_bucket_item) + HASHTABLE_INLINE_KEY + HASHTABLE_INLINE_VALUE)
+
+#define HASHTABLE_SLAB_PAGESIZE     (1024 * 1024)   /* Bytes carved into chunks at a time                           */
+#define HASHTABLE_SLAB_MINCHUNK     64              /* Chunk size of the smallest size class                        */
+#define HASHTABLE_SLAB_GROWTH       1.25            /* Each size class is this much larger than the previous        */
+#define HASHTABLE_SLAB_MAXCLASSES   64
+
+#define HASHTABLE_EPOCH_MAXTHREADS  128             /* Threads that can be registered with an epoch domain          */
+#define HASHTABLE_EPOCH_OFFLINE     UINT64_MAX      /* Epoch of a thread that holds no references into any table    */
+#define HASHTABLE_RETIRE_BATCH      64              /* Retired allocations a table collects before it tries to reclaim */
+#define HASHTABLE_RETIRED_ITEM      0x0             /* Retired allocation is an entry                               */
+#define HASHTABLE_RETIRED_MEMORY    0x1             /* Retired allocation is a plain malloc (bucket, ctrl or slot array) */
+#define HASHTABLE_RETIRED_TABLE     0x2             /* Retired allocation is a whole table, swapped out by a flush  */
+#define HASHTABLE_LAZYFREE_MINSIZE  (64 * 1024)     /* Entries at least this big are freed by the lazy free thread  */
+#define HASHTABLE_LAZYFREE_WAIT     1000            /* Microseconds the lazy free thread waits for readers before it looks again */
+
+#define HASHTABLE_UPSERT_UPDATED    0       /*      hashtable_upsert overwrote the value of an existing key             */
+#define HASHTABLE_UPSERT_INSERTED   1       /*      hashtable_upsert inserted a new key                                 */
+#define HASHTABLE_UPSERT_FULL       -2      /*      hashtable_sharded_upsert refused, over the memory limit and nothing to evict */
+#define HASHTABLE_UPSERT_EXISTS     -3      /*      hashtable_sharded_insert left the value of an existing key as it was */
+
+#define HASHTABLE_EVICT_NONE        0x0     /*      Never evict, writes are refused once the memory limit is reached    */
+#define HASHTABLE_EVICT_LRU         0x1     /*      Evict the least recently used of a few sampled entries              */
+#define HASHTABLE_EVICT_LFU         0x2     /*      Evict the least frequently used of a few sampled entries            */
+#define HASHTABLE_EVICT_SAMPLES     5       /*      Entries sampled per eviction                                        */
+#define HASHTABLE_EVICT_MAXVISITS   10      /*      Buckets (or slots) visited per wanted sample before giving up       */
+#define HASHTABLE_SCAN_MAXVISITS    10      /*      Cursor positions a scan visits per wanted entry before it returns   */
+#define HASHTABLE_LRU_RESOLUTION    100     /*      Milliseconds per tick of the LRU clock                              */
+#define HASHTABLE_LFU_INIT          5       /*      Counter of a new entry, so it isn't evicted before it had a chance  */
+#define HASHTABLE_LFU_LOGFACTOR     10      /*      Higher makes the counter saturate after more accesses               */
+#define HASHTABLE_LFU_DECAYTIME     1       /*      Minutes it takes an idle counter to drop by one                      */
+
+#define HASHTABLE_WHEEL_BITS        6                                   /* Slots per level of the timing wheel, as a power of two */
+#define HASHTABLE_WHEEL_SLOTS       (1 << HASHTABLE_WHEEL_BITS)
+#define HASHTABLE_WHEEL_LEVELS      4                                   /* Levels of the timing wheel, every level ticks 64 times slower */
+#define HASHTABLE_WHEEL_RANGE       (1u << (HASHTABLE_WHEEL_BITS * HASHTABLE_WHEEL_LEVELS))  /* Seconds the wheel covers (194 days) */
+#define HASHTABLE_WHEEL_MAXTICKS    3600                                /* Ticks a single hashtable_expire call catches up at most */
+
+/* Value bytes of an entry, stored right after the NUL terminated key */
+#define HASHTABLE_ITEM_VALUE(n)     (&(n)->key[(n)->keylen + 1])
 
 
 /* 
@@ -23,27 +92,68 @@
 */
 
 /**
- * @brief Function protoype for hashing methods
+ * @brief Function protoype for hashing methods, see hash_method_t. Entries keep the low 32 bits of the hash.
+ * 
+ */
+typedef hash_method_t hashtable_hashmethod;
+
+
+/**
+ * @brief Function prototype of a key hook, called under the table's write lock whenever a key is linked into or removed from the
+ * table, but not when an existing key only has its value replaced. Lets the store keep secondary indexes in step with the table.
+ * 
+ */
+typedef void (*hashtable_keyhook)(void *data, char *key, uint32_t keylen, bool linked);
+
+
+/**
+ * @brief Function prototype of a flush hook, called while every shard of a sharded table is write locked, right after a flush
+ * swapped in empty tables. Lets the store reset its secondary indexes together with the table, the key hook isn't called for
+ * the keys a flush drops.
  * 
  */
-typedef uint32_t (*hashtable_hashmethod)(char *key);
+typedef void (*hashtable_flushhook)(void *data);
+
 
+/**
+ * @brief Function prototype of a method releasing an allocation handed to the lazy free thread.
+ * 
+ */
+typedef void (*hashtable_freefn)(void *ptr);
 
 
 /**
- * @brief Describes the linked list entry.
+ * @brief Describes the linked list entry. An entry is a single allocation holding the header followed by the key and the value:
+ * 
+ * [ HEADER | KEY \0 | VALUE \0 | spare value capacity ]
  * 
+ * Small entries (key < HASHTABLE_INLINE_KEY, value < HASHTABLE_INLINE_VALUE) are always allocated as HASHTABLE_ITEM_SMALLSIZE
+ * bytes so a value can later change size without a new allocation. Larger entries are allocated to fit exactly.
  */
 typedef struct hashtable_bucket_item {
 
-    char *key;
-    char *value;
     LIST_ENTRY(hashtable_bucket_item) entries;
+    uint32_t hash;                          /*      Cached hash of key, saves rehashing the key when migrating buckets */
+    uint32_t keylen;                        /*      Length of key, excluding the NUL terminator     */
+    uint32_t valuelen;                      /*      Length of value, excluding the NUL terminator   */
+    uint32_t valuecap;                      /*      Bytes available for the value, including the NUL terminator */
+    uint32_t access;                        /*      LRU: clock of the last access. LFU: minutes of the last decrement << 8 | counter */
+    uint32_t expire;                        /*      Unix time in seconds the entry expires at, 0 if it never does */
+    struct hashtable_timer_t *timer;        /*      Pending timer of the entry in the timing wheel, NULL if none */
+    char key[];                             /*      Key, followed by the value. Use HASHTABLE_ITEM_VALUE */
 
 } hashtable_bucket_item;
 
 
 
+/**
+ * @brief Function prototype of a scan callback, called for every entry a scan visits while the table can't change.
+ * 
+ */
+typedef void (*hashtable_scanfn)(void *data, hashtable_bucket_item *n1);
+
+
+
 /**
  * @brief Describes the bucket in a hash table. Each bucket holds a linked list.
  * 
@@ -57,6 +167,184 @@ typedef struct hashtable_bucket_t {
 
 
 
+/**
+ * @brief Describes a single slab size class. Chunks are carved from pages on demand and recycled through a free list.
+ * 
+ */
+typedef struct hashtable_slabclass_t {
+
+    uint32_t chunksize;                     /*      Size of every chunk in this class               */
+    uint32_t perpage;                       /*      Chunks carved from a single page                */
+    void *freelist;                         /*      Free chunks, linked through their first bytes   */
+    char *current;                          /*      Page currently being carved                     */
+    uint32_t currentleft;                   /*      Chunks left to carve from the current page      */
+    uint64_t pages;                         /*      Pages owned by this class                       */
+    uint64_t used;                          /*      Chunks handed out                               */
+
+} hashtable_slabclass_t;
+
+
+
+/**
+ * @brief Header in front of an allocation too large for any size class.
+ * 
+ */
+typedef struct hashtable_slablarge_t {
+
+    LIST_ENTRY(hashtable_slablarge_t) entries;
+    size_t size;
+
+} hashtable_slablarge_t;
+
+
+
+/**
+ * @brief Describes a slab allocator owned by a single hash table (memcached style). Entries are rounded up to the nearest size
+ * class and served from per class free lists, so a churning table reuses its own memory instead of going through malloc/free and
+ * fragmenting the heap. Pages are never returned while the table lives; hashtable_delete releases them all at once.
+ * 
+ * SLAB:
+ *      CLASS (64 B)   -> PAGE, PAGE        FREE -> CHUNK -> CHUNK
+ *      CLASS (80 B)   -> PAGE              FREE -> CHUNK
+ *      ...
+ *      LARGE          -> ALLOCATION, ALLOCATION
+ */
+typedef struct hashtable_slab_t {
+
+    hashtable_slabclass_t classes[HASHTABLE_SLAB_MAXCLASSES];
+    uint32_t numberofclasses;
+    void **pages;                           /*      Every page, for bulk release                    */
+    size_t numberofpages;
+    size_t pagescapacity;
+    LIST_HEAD(hashtable_slablarge_list, hashtable_slablarge_t) large;   /* Allocations above the largest class */
+    uint64_t largecount;
+    uint64_t largebytes;
+
+} hashtable_slab_t;
+
+
+
+/**
+ * @brief Describes a thread registered with an epoch domain. Every thread gets a cache line of its own, the only shared writes
+ * a reader makes are to its own slot.
+ */
+typedef struct hashtable_epoch_thread_t {
+
+    uint64_t epoch;                         /*      Global epoch seen at the last quiescent state, HASHTABLE_EPOCH_OFFLINE while offline */
+    bool used;                              /*      Slot belongs to a registered thread             */
+
+} __attribute__((aligned(64))) hashtable_epoch_thread_t;
+
+
+
+/**
+ * @brief Describes an epoch domain for quiescent state based reclamation (QSBR).
+ * 
+ * Readers look entries up without taking any lock. A writer that unlinks an entry (or replaces a bucket array) can therefore not
+ * free it straight away, a reader may still be looking at it. Instead the allocation is retired, tagged with the current global
+ * epoch. Registered threads announce a quiescent state between requests by copying the global epoch into their slot, a thread in
+ * a quiescent state holds no references into any table. Once every online thread has announced an epoch newer than the tag, no
+ * reader can still see the allocation and it is freed.
+ */
+typedef struct hashtable_epoch_t {
+
+    uint64_t global __attribute__((aligned(64)));       /*  Advanced by writers when they try to reclaim        */
+    pthread_mutex_t lock;                               /*  Protects registration                               */
+    hashtable_epoch_thread_t threads[HASHTABLE_EPOCH_MAXTHREADS];
+
+} hashtable_epoch_t;
+
+
+
+/**
+ * @brief Describes an allocation waiting for every reader to pass a quiescent state.
+ */
+typedef struct hashtable_retired_t {
+
+    void *ptr;                              /*      The retired allocation                          */
+    uint64_t epoch;                         /*      Global epoch when it was retired                */
+    uint8_t type;                           /*      HASHTABLE_RETIRED_ITEM, HASHTABLE_RETIRED_MEMORY or HASHTABLE_RETIRED_TABLE */
+
+} hashtable_retired_t;
+
+
+
+/**
+ * @brief Describes an allocation waiting in the queue of the lazy free thread.
+ */
+typedef struct hashtable_lazyjob_t {
+
+    TAILQ_ENTRY(hashtable_lazyjob_t) entries;
+    void *ptr;
+    hashtable_freefn fn;                    /*      Releases the allocation                         */
+    hashtable_epoch_t *epoch;               /*      Epoch domain of its readers, NULL if it has none */
+    uint64_t retired;                       /*      Global epoch when it was queued                 */
+    uint64_t bytes;
+
+} hashtable_lazyjob_t;
+
+
+
+/**
+ * @brief Describes a lazy free thread. Releasing a large value (munmap of its pages) or a whole table (a walk over every entry)
+ * takes time in proportion to its size. A writer only queues the allocation instead and the thread releases it in the
+ * background, once no reader of its epoch domain can reference it anymore.
+ */
+typedef struct hashtable_lazyfree_t {
+
+    pthread_mutex_t lock;                   /*      Guards everything below                         */
+    pthread_cond_t pending;                 /*      Signals the thread that the queue isn't empty   */
+    TAILQ_HEAD(hashtable_lazyjob_queue, hashtable_lazyjob_t) queue;     /* Oldest first                     */
+    uint64_t pendingcount;                  /*      Stats: Allocations queued and not yet released  */
+    uint64_t pendingbytes;                  /*      Stats: Bytes queued and not yet released        */
+    uint64_t freed;                         /*      Stats: Allocations released                     */
+    uint64_t freedbytes;                    /*      Stats: Bytes released                           */
+    bool stop;
+    pthread_t thread;
+
+} hashtable_lazyfree_t;
+
+
+
+/**
+ * @brief Describes a pending expiry. A timer holds a copy of the key instead of a pointer to the entry, entries are replaced and
+ * moved around while the timer waits. An entry has at most one timer, due at or before its expiry, which is cancelled when the
+ * entry is removed and placed again when it fires for an entry whose expiry was moved later.
+ */
+typedef struct hashtable_timer_t {
+
+    LIST_ENTRY(hashtable_timer_t) entries;
+    uint32_t expire;                        /*      Unix time in seconds the key expires at         */
+    uint32_t hash;                          /*      Hash of the key in the table                    */
+    uint32_t keylen;
+    char key[];
+
+} hashtable_timer_t;
+
+
+
+/**
+ * @brief Describes a hierarchical timing wheel with a tick of one second.
+ * 
+ * WHEEL:
+ *      LEVEL 0 -> 64 SLOTS OF 1 s          Timers due within 64 s, one slot is run every tick
+ *      LEVEL 1 -> 64 SLOTS OF 64 s         Timers due within 68 min
+ *      LEVEL 2 -> 64 SLOTS OF 4096 s       Timers due within 73 h
+ *      LEVEL 3 -> 64 SLOTS OF 262144 s     Timers due within 194 days, later ones wait in the last slot
+ * 
+ * Adding a timer is O(1). Whenever the slots of a level wrap around, the next slot of the level above is emptied into the levels
+ * below it (cascade), so a timer is moved at most HASHTABLE_WHEEL_LEVELS times before it fires and nothing ever scans the table.
+ */
+typedef struct hashtable_wheel_t {
+
+    uint32_t now;                           /*      Last tick that was run (unix time in seconds)   */
+    uint64_t timers;                        /*      Number of pending timers                        */
+    LIST_HEAD(hashtable_timer_list, hashtable_timer_t) slots[HASHTABLE_WHEEL_LEVELS][HASHTABLE_WHEEL_SLOTS];
+
+} hashtable_wheel_t;
+
+
+
 /**
  * @brief Describes the hash table. The hash table holds buckets with linked lists.
  * 
@@ -68,19 +356,150 @@ typedef struct hashtable_bucket_t {
  *      BUCKET -> LINKED LIST -> ENTRY 1, ENTRY 2
  *      BUCKET -> LINKED LIST -> ENTRY 1, ENTRY 2
  *      BUCKET -> LINKED LIST -> ENTRY 1, ENTRY 2
+ * 
+ * The number of buckets is always a power of two. When the load factor crosses HASHTABLE_MAX_LOADFACTOR (or drops below
+ * 1 / HASHTABLE_MIN_FILL) a second bucket array is allocated and the table is rehashed incrementally: every lookup, insert
+ * and remove migrates HASHTABLE_REHASH_STEPS buckets from the old array into the new one. While rehashing, lookups check
+ * both arrays and new entries always go into the new array.
+ * 
+ * A table created with HASHTABLE_TYPE_SWISS uses open addressing instead (Swiss table layout):
+ * 
+ * CTRL:    [h2 h2 EMPTY h2 | DELETED h2 ... ]      One control byte per slot, matched HASHTABLE_GROUP_WIDTH at a time
+ * SLOTS:   [ENTRY ENTRY NULL ENTRY | NULL ... ]    One entry pointer per slot
+ * 
+ * The high bits of the hash (h1) pick the group to start probing at, the low 7 bits (h2) are stored in the control byte of a
+ * full slot. A lookup compares h2 against a whole group with a single SSE2 compare and only touches entries whose fingerprint
+ * matches, so a miss usually costs one cache line. Resizing reuses the same incremental scheme, migrating a group per step.
  */
 
 typedef struct hashtable_t {
 
     uint32_t size;                          /*      Holds the size of the hash table                */
     uint32_t count;                         /*      Holds the number of current elements            */
-    hashtable_bucket_t **buckets;           /*      Array of hashtable buckets                      */
+    hashtable_bucket_t *buckets;            /*      Array of hashtable buckets                      */
     hashtable_hashmethod hashmethod;        /*      Pointer to the method responsible for hashing   */
+    uint64_t seed;                          /*      Seed passed to the hash method                  */
+    uint32_t minsize;                       /*      The table never shrinks below its initial size  */
+    uint32_t rehash_size;                   /*      Size of the bucket array being rehashed into    */
+    hashtable_bucket_t *rehash_buckets;     /*      Bucket array being rehashed into, NULL if not rehashing */
+    int64_t rehashidx;                      /*      Next bucket in the old array to migrate, -1 if not rehashing */
+
+    uint8_t type;                           /*      HASHTABLE_TYPE_CHAINED or HASHTABLE_TYPE_SWISS  */
+    uint8_t *ctrl;                          /*      SWISS: Control bytes, one per slot              */
+    hashtable_bucket_item **slots;          /*      SWISS: Entries, one per slot                    */
+    uint8_t *rehash_ctrl;                   /*      SWISS: Control bytes of the array being rehashed into */
+    hashtable_bucket_item **rehash_slots;   /*      SWISS: Entries of the array being rehashed into */
+    uint32_t tombstones;                    /*      SWISS: Deleted slots in the array receiving inserts */
+
+    hashtable_slab_t *slab;                 /*      Slab allocator for entries, NULL to use malloc  */
+
+    uint8_t policy;                         /*      HASHTABLE_EVICT_*, decides what an access records in an entry */
+    uint64_t keybytes;                      /*      Bytes of every key, excluding terminators       */
+    uint64_t valuebytes;                    /*      Bytes of every value, excluding terminators     */
+    uint64_t itembytes;                     /*      Bytes of every entry allocation (header, key, value and spare capacity) */
+
+    hashtable_wheel_t *wheel;               /*      Timers of entries with an expiry, NULL until the first one */
+    uint64_t timerbytes;                    /*      Bytes of every pending timer                    */
+    uint32_t expires;                       /*      Entries with an expiry                          */
+    uint64_t expired;                       /*      Entries removed because they expired            */
+
+    hashtable_keyhook keyhook;              /*      Called when a key is linked or removed, NULL for none */
+    void *keyhookdata;                      /*      Passed to the key hook                          */
+
+    hashtable_epoch_t *epoch;               /*      Epoch domain of lock free readers, NULL frees unlinked memory at once */
+    hashtable_retired_t *retired;           /*      Allocations waiting for readers, oldest first   */
+    uint32_t nretired;                      /*      Number of retired allocations                   */
+    uint32_t retiredcap;                    /*      Capacity of the retired array                   */
+    hashtable_lazyfree_t *lazyfree;         /*      Frees large entries and flushed tables off the write path, NULL for none */
 
 } hashtable_t;
 
 
 
+/**
+ * @brief Describes a single shard of a sharded hash table. Shards are aligned to a cache line so two threads working on
+ * neighbouring shards don't bounce the same line between them.
+ */
+typedef struct hashtable_shard_t {
+
+    pthread_rwlock_t lock;                  /*      Writers own the shard, lookups don't take it    */
+    uint32_t seq;                           /*      Odd while a writer is changing the table        */
+    hashtable_t *table;                     /*      Table holding the keys of this shard            */
+
+} __attribute__((aligned(64))) hashtable_shard_t;
+
+
+
+/**
+ * @brief Describes a sharded hash table for use from multiple threads (lock striping).
+ * 
+ * SHARDS:
+ *      SHARD 0 -> LOCK, TABLE
+ *      SHARD 1 -> LOCK, TABLE
+ *      ...
+ * 
+ * The key is hashed once, the high 32 bits of the 64 bit hash pick the shard and the table in the shard indexes with the low
+ * 32 bits, so the two choices don't correlate. Every shard is an independent hashtable_t with its own lock, its own incremental
+ * rehashing and its own slab, so writers only contend when they touch the same shard.
+ * 
+ * Lookups take no lock and write nothing shared. A writer makes the shard's sequence count odd while it changes the table and
+ * even again when done, a lookup that saw the count change under it retries (seqlock). Memory a lookup could still be reading
+ * is retired to the epoch domain instead of freed, so a lookup racing a writer reads stale but valid memory and then retries.
+ * 
+ * Every write adds the change in memory of its shard to a shared total. With a memory limit set, a write that finds the total
+ * above the limit first evicts entries: a random shard is sampled for HASHTABLE_EVICT_SAMPLES entries and the least recently
+ * (or least frequently) used of them is removed, until the total is below the limit again (Redis style approximated LRU/LFU).
+ */
+typedef struct hashtable_sharded_t {
+
+    uint32_t nshards;                       /*      Number of shards, a power of two                */
+    uint32_t shift;                         /*      32 - log2(nshards), shifts the hash down to a shard index */
+    hashtable_shard_t *shards;              /*      Array of shards                                 */
+    hashtable_hashmethod hashmethod;        /*      Pointer to the method responsible for hashing   */
+    uint64_t seed;                          /*      Seed passed to the hash method, shared by every shard */
+    hashtable_epoch_t *epoch;               /*      Epoch domain shared by every shard              */
+    bool sharedepoch;                       /*      The epoch domain belongs to another table       */
+
+    uint64_t memory;                        /*      Bytes used by every shard, see hashtable_memory  */
+    uint64_t maxmemory;                     /*      Writes evict (or are refused) above this, 0 for no limit */
+    uint8_t policy;                         /*      HASHTABLE_EVICT_*                                */
+    uint64_t evicted;                       /*      Keys evicted to stay below maxmemory             */
+
+    hashtable_lazyfree_t *lazyfree;         /*      Shared by every shard, NULL for none             */
+    hashtable_flushhook flushhook;          /*      Called by hashtable_sharded_flush, NULL for none */
+    void *flushhookdata;                    /*      Passed to the flush hook                         */
+
+} hashtable_sharded_t;
+
+
+
+/**
+ * @brief Describes the memory accounting of a sharded table, summed over its shards.
+ */
+typedef struct hashtable_stats_t {
+
+    uint64_t keys;
+    uint64_t keybytes;
+    uint64_t valuebytes;
+    uint64_t itembytes;
+    uint64_t expires;
+    uint64_t expired;
+    uint64_t memory;                        /*      See hashtable_memory                            */
+    uint64_t maxmemory;
+    uint8_t policy;
+    uint64_t evicted;
+
+} hashtable_stats_t;
+
+
+
+bool hashtable_remove_hashed(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash);
+void hashtable_delete(hashtable_t *table);
+uint64_t hashtable_memory(hashtable_t *table);
+bool hashtable_retire_lazy(hashtable_t *table, void **ptr, uint8_t *type);
+
+
+
 /* 
 [**************************************************************************************************************************************************]
                                                             METHODS / FUNCTIONS
@@ -89,272 +508,3391 @@ typedef struct hashtable_t {
 
 
 
+/* 
+[**************************************************************************************************************************************************]
+                                                            SLAB ALLOCATOR
+[**************************************************************************************************************************************************]
+*/
+
+
+
 /**
- * @brief Creates a hash bucket initializing the linked list in the bucket.
+ * @brief Creates a slab allocator with size classes growing by HASHTABLE_SLAB_GROWTH up to half a page.
  * 
- * @return hashtable_bucket_t* 
+ * @return hashtable_slab_t* 
  */
-hashtable_bucket_t *hashbucket_create() {
+hashtable_slab_t *hashtable_slab_create(void) {
 
-    hashtable_bucket_t *bucket = (hashtable_bucket_t *) malloc (sizeof(hashtable_bucket_t ));
-    
-    if(bucket == NULL) {
-        // printf("[ERROR]: Failed to create bucket in hash table\n");
+    hashtable_slab_t *slab = (hashtable_slab_t *)calloc(1, sizeof(hashtable_slab_t));
+    if(slab == NULL) {
+        return NULL;
+    }
+
+    double size = HASHTABLE_SLAB_MINCHUNK;
+    uint32_t i = 0;
+    while(i < HASHTABLE_SLAB_MAXCLASSES - 1 && size <= HASHTABLE_SLAB_PAGESIZE / 2) {
+
+        /* Chunks are 8 byte aligned */
+        uint32_t chunksize = ((uint32_t)size + 7) & ~7u;
+        if(i > 0 && chunksize == slab->classes[i - 1].chunksize) {
+            chunksize += 8;
+        }
+        slab->classes[i].chunksize = chunksize;
+        slab->classes[i].perpage = HASHTABLE_SLAB_PAGESIZE / chunksize;
+        size = chunksize * HASHTABLE_SLAB_GROWTH;
+        i++;
     }
 
-    LIST_INIT(&bucket->list);
-    return bucket;
+    /* The last class holds exactly one chunk per page */
+    slab->classes[i].chunksize = HASHTABLE_SLAB_PAGESIZE;
+    slab->classes[i].perpage = 1;
+    slab->numberofclasses = i + 1;
 
+    LIST_INIT(&slab->large);
+
+    return slab;
 }
 
 
 
 /**
- * @brief Deletes the contents of the linked list in the hash bucket.
+ * @brief Returns the index of the smallest size class a given size fits in, or -1 if it is larger than every class.
  * 
- * @param bucket 
+ * @param slab 
+ * @param size 
+ * @return int32_t 
  */
-void hashbucket_delete(hashtable_bucket_t *bucket) {
+int32_t hashtable_slab_classfor(hashtable_slab_t *slab, size_t size) {
 
-    hashtable_bucket_item *h1, *h2;
-    h1 = LIST_FIRST(&bucket->list);
-    while( h1 != NULL ) {
-        h2 = LIST_NEXT(h1, entries);
-        free(h1);
-        h1 = h2;
+    int32_t low = 0;
+    int32_t high = slab->numberofclasses - 1;
+
+    if(size > slab->classes[high].chunksize) {
+        return -1;
+    }
+
+    while(low < high) {
+        int32_t mid = (low + high) / 2;
+        if(slab->classes[mid].chunksize < size) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
     }
+    return low;
 }
 
 
 
 /**
- * @brief Creates a hash table by allocating memory for a specified number of buckets.
+ * @brief Allocates a chunk of at least size bytes. The usable size of the chunk is returned in chunksize.
  * 
+ * @param slab 
  * @param size 
- * @param hashmethod 
- * @return hashtable_t* 
+ * @param chunksize 
+ * @return void* 
  */
-hashtable_t * hashtable_create(uint32_t size, hashtable_hashmethod hashmethod) {
+void *hashtable_slab_alloc(hashtable_slab_t *slab, size_t size, size_t *chunksize) {
 
-    hashtable_t *table = NULL;
+    int32_t id = hashtable_slab_classfor(slab, size);
 
-    table = (hashtable_t *) malloc (sizeof(hashtable_t));
-    
-    /* Failed to allocate new hash table */
-    if(table == NULL) {
-        exit(EXIT_FAILURE);
+    /* Too large for a slab, keep track of it so it is still released together with the table */
+    if(id < 0) {
+        hashtable_slablarge_t *l = malloc(sizeof(hashtable_slablarge_t) + size);
+        if(l == NULL) {
+            return NULL;
+        }
+        l->size = size;
+        LIST_INSERT_HEAD(&slab->large, l, entries);
+        slab->largecount++;
+        slab->largebytes += size;
+        *chunksize = size;
+        return (void *)(l + 1);
     }
 
-    table->size = size;
-    table->count = 0;
+    hashtable_slabclass_t *c = &slab->classes[id];
+    void *chunk = NULL;
 
-    table->buckets = malloc(table->size * sizeof(hashtable_bucket_t *));
-
-    for(uint32_t i = 0; i < size; i++) {
-        table->buckets[i] = hashbucket_create();
+    if(c->freelist != NULL) {
+        chunk = c->freelist;
+        c->freelist = *(void **)chunk;
     }
+    else {
 
-    table->hashmethod = hashmethod;
+        /* Carve a new page */
+        if(c->currentleft == 0) {
 
-    return table;
+            if(slab->numberofpages == slab->pagescapacity) {
+                size_t capacity = (slab->pagescapacity == 0) ? 16 : slab->pagescapacity * 2;
+                void **pages = realloc(slab->pages, capacity * sizeof(void *));
+                if(pages == NULL) {
+                    return NULL;
+                }
+                slab->pages = pages;
+                slab->pagescapacity = capacity;
+            }
 
+            char *page = malloc(HASHTABLE_SLAB_PAGESIZE);
+            if(page == NULL) {
+                return NULL;
+            }
+            slab->pages[slab->numberofpages] = page;
+            slab->numberofpages++;
+
+            c->current = page;
+            c->currentleft = c->perpage;
+            c->pages++;
+        }
+
+        chunk = c->current;
+        c->current += c->chunksize;
+        c->currentleft--;
+    }
+
+    c->used++;
+    *chunksize = c->chunksize;
+    return chunk;
 }
 
 
 
 /**
- * @brief Deletes a hash table by freeing allocated buckets and finally the table itself.
+ * @brief Returns a chunk to the free list of its size class. The size must be the chunk size given by hashtable_slab_alloc.
  * 
- * @param table 
+ * @param slab 
+ * @param chunk 
+ * @param size 
  */
-void hashtable_delete(hashtable_t *table) {
+void hashtable_slab_free(hashtable_slab_t *slab, void *chunk, size_t size) {
 
-    /* Iterate over all buckets, then over each entry in the nested list */
-    for(uint32_t i = 0; i < table->size; i++) {
-        if(table->buckets[i] != NULL) {
-            hashbucket_delete(table->buckets[i]);
-            free(table->buckets[i]);
-        }   
+    int32_t id = hashtable_slab_classfor(slab, size);
+
+    if(id < 0) {
+        hashtable_slablarge_t *l = ((hashtable_slablarge_t *)chunk) - 1;
+        LIST_REMOVE(l, entries);
+        slab->largecount--;
+        slab->largebytes -= l->size;
+        free(l);
+        return;
     }
-    free(table->buckets);
-    free(table);
+
+    hashtable_slabclass_t *c = &slab->classes[id];
+    *(void **)chunk = c->freelist;
+    c->freelist = chunk;
+    c->used--;
 }
 
 
 
 /**
- * @brief Implements a simple DJB2_HASH algorithm for use in this hash table. See resource at: https://stackoverflow.com/questions/7666509/hash-function-for-string
+ * @brief Takes an allocation too large for any size class off the slab, so it can be released without the slab.
  * 
- * @param key 
- * @return uint32_t 
+ * @param slab 
+ * @param chunk 
+ * @param size the chunk size given by hashtable_slab_alloc
+ * @return void* the allocation to pass to free, NULL if the chunk belongs to a size class
  */
-uint32_t hashtable_hash(char *key) {    
-
-    uint32_t hash = 5381;
-    int c;
-    while (c = *key++)
-        hash = ((hash << 5) + hash) + c; 
-    return hash;
+void *hashtable_slab_detach(hashtable_slab_t *slab, void *chunk, size_t size) {
 
+    if(hashtable_slab_classfor(slab, size) >= 0) {
+        return NULL;
+    }
 
+    hashtable_slablarge_t *l = ((hashtable_slablarge_t *)chunk) - 1;
+    LIST_REMOVE(l, entries);
+    slab->largecount--;
+    slab->largebytes -= l->size;
+    return l;
 }
 
 
 
 /**
- * @brief Performs a lookup in the hash table
+ * @brief Releases every page and large allocation at once.
  * 
- * @param table 
- * @param key 
- * @return hashtable_bucket_item* 
+ * @param slab 
  */
-hashtable_bucket_item *hashtable_lookup(hashtable_t *table, char *key) {
-
-    hashtable_bucket_item *result = NULL;
-
-    /* Calculate hash/index  */
-    uint32_t hash = table->hashmethod(key);
-
-    /* Get bucket at index */
-    uint32_t index = hash % table->size;
-    hashtable_bucket_t *bucket = table->buckets[index];
+void hashtable_slab_destroy(hashtable_slab_t *slab) {
 
-    /* Check if list in bucket is empty or not */
-    if(LIST_EMPTY(&bucket->list)) {
-        return result;
+    for(size_t i = 0; i < slab->numberofpages; i++) {
+        free(slab->pages[i]);
     }
+    free(slab->pages);
 
-    /* If list in bucket is not empty, it may have multiple entries due to collisions, thus we iterate over each list entry to find our entry */
-    hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
-    while (n1 != NULL) {
-        if( strcmp(key, n1->key) == 0) {
-            result = n1;
-            return result;
-        }
-        n1 = LIST_NEXT(n1, entries);
+    hashtable_slablarge_t *l = LIST_FIRST(&slab->large);
+    while(l != NULL) {
+        hashtable_slablarge_t *next = LIST_NEXT(l, entries);
+        free(l);
+        l = next;
     }
-    
 
-    return result;
+    free(slab);
 }
 
 
 
 /**
- * @brief Inserts a key, value pair into a bucket placed the hash table. In case of collision the new kvp is stored as a linked list entry.
+ * @brief Prints utilization of every size class in use.
  * 
- * @param table 
- * @param key 
- * @param value 
- * @return true 
- * @return false 
+ * @param slab 
+ * @param fd 
  */
-bool hashtable_insert(hashtable_t *table, char *key, char *value) {
-
-    /* Check if key already exists */
-    if(hashtable_lookup(table, key) != NULL) {
-        // perror("[ERROR]: Key already exists in hash table\n");
-        return false;
-    }
-
-    /* TODO: Check if our hash table will overspill, if so perform resizing*/
-
-    /* Calculate hash/index  */
-    uint32_t hash = table->hashmethod(key);
+void hashtable_slab_stats(hashtable_slab_t *slab, FILE *fd) {
 
-    /* Get bucket at index */
-    uint32_t index = hash % table->size;
-    hashtable_bucket_t *bucket = table->buckets[index];
+    fprintf(fd, "%-6s %10s %10s %12s %12s %8s\n", "class", "chunksize", "pages", "chunks", "used", "util");
 
-    /* Insert new item into list in bucket */
-    hashtable_bucket_item *n1 = malloc(sizeof(struct hashtable_bucket_item));
-    if(n1 == NULL) {
-        return false;
+    for(uint32_t i = 0; i < slab->numberofclasses; i++) {
+        hashtable_slabclass_t *c = &slab->classes[i];
+        if(c->pages == 0) {
+            continue;
+        }
+        uint64_t chunks = c->pages * c->perpage;
+        fprintf(fd, "%-6u %10u %10lu %12lu %12lu %7.1f%%\n", i, c->chunksize, c->pages, chunks, c->used, (100.0 * c->used) / chunks);
     }
 
-    /* DEBUG: Check if for a collision in bucket */
-    if(LIST_EMPTY(&bucket->list)) {
-        // perror("[DEBUG]: Collision\n");
-    }
+    fprintf(fd, "large: %lu allocation(s), %lu byte(s). total slab pages: %zu (%zu MB)\n",
+        slab->largecount, slab->largebytes, slab->numberofpages, (slab->numberofpages * HASHTABLE_SLAB_PAGESIZE) / (1024 * 1024));
+}
 
-    n1->key = strdup(key);
-    n1->value = strdup(value);
-    LIST_INSERT_HEAD(&bucket->list, n1, entries);
 
-    //printf("[*]: Inserted key %s at index: %d\n", key, index);
 
-    table->count++;
-    
-    return true;
+/* 
+[**************************************************************************************************************************************************]
+                                                            ENTRIES
+[**************************************************************************************************************************************************]
+*/
 
-}
 
 
 /**
- * @brief Removes a key, value pair from the hash table.
+ * @brief Deletes the contents of the linked list in the hash bucket.
  * 
- * @param table 
- * @param key 
- * @return true 
- * @return false 
+ * @param bucket 
  */
-bool hashtable_remove(hashtable_t *table, char *key) {
+void hashbucket_delete(hashtable_bucket_t *bucket) {
 
-     /* Check if key  exists */
-    if(hashtable_lookup(table, key) == NULL) {
-        // perror("[ERROR]: Key doesn't exists in hash table\n");
-        return false;
+    hashtable_bucket_item *h1, *h2;
+    h1 = LIST_FIRST(&bucket->list);
+    while( h1 != NULL ) {
+        h2 = LIST_NEXT(h1, entries);
+        free(h1);
+        h1 = h2;
     }
+}
 
-    /* Calculate hash/index  */
-    uint32_t hash = table->hashmethod(key);
 
-    /* Get bucket at index */
-    uint32_t index = hash % table->size;
-    hashtable_bucket_t *bucket = table->buckets[index];
 
-    /* If list in bucket is not empty we iterate over each list entry */
-    hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
-    while (n1 != NULL) {
-        if( strcmp(key, n1->key) == 0) {
-            LIST_REMOVE(n1, entries);
-            free(n1);
-            break;
-        }
-        n1 = LIST_NEXT(n1, entries);
-    }
+/**
+ * @brief Rounds a requested size up to the next power of two.
+ * 
+ * @param size 
+ * @return uint32_t 
+ */
+uint32_t hashtable_nextpower(uint32_t size) {
 
-    table->count--;
-    return true;
-    
+    uint32_t power = HASHTABLE_MIN_SIZE;
+
+    while(power < size && power < (UINT32_MAX / 2) + 1) {
+        power <<= 1;
+    }
+    return power;
 }
 
 
 
-void hashtable_display(hashtable_t *table) {
-    
+/* State of hashtable_random, one per thread so lock free readers don't share it */
+static __thread uint64_t hashtable_rngstate = 0;
 
-    for(uint32_t i = 0; i < table->size + 1; i++) {
 
-        /* Get bucket */
-        hashtable_bucket_t *bucket = table->buckets[i];
-        if(bucket != NULL) {
-            /* Check if list in bucket is empty or not */
-            if(LIST_EMPTY(&bucket->list)) {
+
+/**
+ * @brief Returns a pseudo random number (xorshift64*). The per thread state is seeded from the kernel on first use.
+ * 
+ * @return uint64_t 
+ */
+uint64_t hashtable_random(void) {
+
+    if(hashtable_rngstate == 0) {
+        hashtable_rngstate = hash_randomseed() | 1;
+    }
+    hashtable_rngstate ^= hashtable_rngstate >> 12;
+    hashtable_rngstate ^= hashtable_rngstate << 25;
+    hashtable_rngstate ^= hashtable_rngstate >> 27;
+    return hashtable_rngstate * 0x2545F4914F6CDD1Dull;
+}
+
+
+
+/**
+ * @brief Returns the LRU clock, which ticks every HASHTABLE_LRU_RESOLUTION milliseconds. Read from the coarse clock, it is
+ * called on every access.
+ * 
+ * @return uint32_t 
+ */
+uint32_t hashtable_lruclock(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / HASHTABLE_LRU_RESOLUTION);
+}
+
+
+
+/**
+ * @brief Returns the LFU time in minutes, truncated to the 24 bits kept in an entry.
+ * 
+ * @return uint32_t 
+ */
+uint32_t hashtable_lfutime(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec / 60) & 0xFFFFFF;
+}
+
+
+
+/**
+ * @brief Returns the LFU counter of an entry, decremented by one for every HASHTABLE_LFU_DECAYTIME minutes since it was
+ * last decremented.
+ * 
+ * @param access 
+ * @param now LFU time, see hashtable_lfutime
+ * @return uint32_t 
+ */
+uint32_t hashtable_lfu_counter(uint32_t access, uint32_t now) {
+
+    uint32_t periods = ((now - (access >> 8)) & 0xFFFFFF) / HASHTABLE_LFU_DECAYTIME;
+    uint32_t counter = access & 0xFF;
+    return (periods > counter) ? 0 : counter - periods;
+}
+
+
+
+/**
+ * @brief Returns the unix time in seconds that expiries are measured in, read from the coarse clock.
+ * 
+ * @return uint32_t 
+ */
+uint32_t hashtable_time(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+
+
+/**
+ * @brief Returns true if an entry has an expiry that has passed. Expired entries are treated as missing until they are removed.
+ * 
+ * @param n1 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_item_expired(hashtable_bucket_item *n1) {
+
+    uint32_t expire = __atomic_load_n(&n1->expire, __ATOMIC_RELAXED);
+    return expire != 0 && expire <= hashtable_time();
+}
+
+
+
+/**
+ * @brief Returns the access field of a new entry.
+ * 
+ * @param policy HASHTABLE_EVICT_*
+ * @return uint32_t 
+ */
+uint32_t hashtable_access_init(uint8_t policy) {
+
+    if(policy == HASHTABLE_EVICT_LRU) {
+        return hashtable_lruclock();
+    }
+    if(policy == HASHTABLE_EVICT_LFU) {
+        return (hashtable_lfutime() << 8) | HASHTABLE_LFU_INIT;
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Records an access to an entry. Lock free readers call this as well, so two accesses racing each other may count as
+ * one, which only costs the eviction a little accuracy.
+ * 
+ * @param policy HASHTABLE_EVICT_*
+ * @param n1 
+ */
+void hashtable_item_touch(uint8_t policy, hashtable_bucket_item *n1) {
+
+    uint32_t access = __atomic_load_n(&n1->access, __ATOMIC_RELAXED);
+    uint32_t update = access;
+
+    if(policy == HASHTABLE_EVICT_LRU) {
+        update = hashtable_lruclock();
+    }
+    else if(policy == HASHTABLE_EVICT_LFU) {
+
+        uint32_t now = hashtable_lfutime();
+        uint32_t counter = hashtable_lfu_counter(access, now);
+
+        /* Logarithmic counter, the more accesses it already counts the less likely another one increments it */
+        if(counter < 255) {
+            uint32_t base = (counter > HASHTABLE_LFU_INIT) ? counter - HASHTABLE_LFU_INIT : 0;
+            if((hashtable_random() >> 12) * (base * HASHTABLE_LFU_LOGFACTOR + 1) < (1ull << 52)) {
+                counter++;
+            }
+        }
+        update = (now << 8) | counter;
+    }
+
+    /* Hot entries are read far more often than the clock ticks, don't dirty their cache line for nothing */
+    if(update != access) {
+        __atomic_store_n(&n1->access, update, __ATOMIC_RELAXED);
+    }
+}
+
+
+
+/**
+ * @brief Returns how good a candidate for eviction an entry is, higher is better.
+ * 
+ * @param policy HASHTABLE_EVICT_*
+ * @param n1 
+ * @return uint32_t 
+ */
+uint32_t hashtable_item_evictscore(uint8_t policy, hashtable_bucket_item *n1) {
+
+    /* Expired entries are gone already as far as clients can tell */
+    if(hashtable_item_expired(n1)) {
+        return UINT32_MAX;
+    }
+    if(policy == HASHTABLE_EVICT_LFU) {
+        return 255 - hashtable_lfu_counter(n1->access, hashtable_lfutime());
+    }
+    return hashtable_lruclock() - n1->access;
+}
+
+
+
+/**
+ * @brief Allocates an entry from the table's slab (or malloc) and copies key and value into it. Any spare room in the chunk
+ * becomes value capacity.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param hash 
+ * @return hashtable_bucket_item* 
+ */
+hashtable_bucket_item *hashtable_item_create(hashtable_t *table, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t hash) {
+
+    size_t size = sizeof(hashtable_bucket_item) + keylen + 1 + valuelen + 1;
+
+    /* Small-string path, round up to the fixed small entry size */
+    if(keylen < HASHTABLE_INLINE_KEY && valuelen < HASHTABLE_INLINE_VALUE) {
+        size = HASHTABLE_ITEM_SMALLSIZE;
+    }
+
+    hashtable_bucket_item *n1 = NULL;
+    if(table->slab != NULL) {
+        n1 = hashtable_slab_alloc(table->slab, size, &size);
+    }
+    else {
+        n1 = malloc(size);
+    }
+    if(n1 == NULL) {
+        return NULL;
+    }
+
+    n1->hash = hash;
+    n1->keylen = keylen;
+    n1->valuelen = valuelen;
+    n1->valuecap = size - sizeof(hashtable_bucket_item) - (keylen + 1);
+    n1->access = hashtable_access_init(table->policy);
+    n1->expire = 0;
+    n1->timer = NULL;
+
+    memcpy(n1->key, key, keylen);
+    n1->key[keylen] = '\x00';
+    memcpy(HASHTABLE_ITEM_VALUE(n1), value, valuelen);
+    HASHTABLE_ITEM_VALUE(n1)[valuelen] = '\x00';
+
+    return n1;
+}
+
+
+
+/**
+ * @brief Returns the size of the allocation backing an entry.
+ * 
+ * @param n1 
+ * @return size_t 
+ */
+size_t hashtable_item_size(hashtable_bucket_item *n1) {
+    return sizeof(hashtable_bucket_item) + n1->keylen + 1 + n1->valuecap;
+}
+
+
+
+/**
+ * @brief Frees an entry.
+ * 
+ * @param table 
+ * @param n1 
+ */
+void hashtable_item_free(hashtable_t *table, hashtable_bucket_item *n1) {
+
+    if(table->slab != NULL) {
+        hashtable_slab_free(table->slab, n1, hashtable_item_size(n1));
+    }
+    else {
+        free(n1);
+    }
+}
+
+
+
+/**
+ * @brief Adds an entry that was linked into the table to its memory accounting, or takes one that was unlinked out of it.
+ * 
+ * @param table 
+ * @param n1 
+ * @param linked true if the entry was linked, false if it was unlinked
+ */
+void hashtable_item_account(hashtable_t *table, hashtable_bucket_item *n1, bool linked) {
+
+    if(linked) {
+        table->keybytes += n1->keylen;
+        table->valuebytes += n1->valuelen;
+        table->itembytes += hashtable_item_size(n1);
+        table->expires += (n1->expire != 0);
+    }
+    else {
+        table->keybytes -= n1->keylen;
+        table->valuebytes -= n1->valuelen;
+        table->itembytes -= hashtable_item_size(n1);
+        table->expires -= (n1->expire != 0);
+    }
+}
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            EPOCH RECLAMATION
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Creates an epoch domain without any registered threads.
+ * 
+ * @return hashtable_epoch_t* 
+ */
+hashtable_epoch_t *hashtable_epoch_create(void) {
+
+    hashtable_epoch_t *ep = (hashtable_epoch_t *)aligned_alloc(64, sizeof(hashtable_epoch_t));
+    if(ep == NULL) {
+        return NULL;
+    }
+    memset(ep, '\x00', sizeof(hashtable_epoch_t));
+    pthread_mutex_init(&ep->lock, NULL);
+    ep->global = 1;
+
+    return ep;
+}
+
+
+
+/**
+ * @brief Destroys an epoch domain.
+ * 
+ * @param ep 
+ */
+void hashtable_epoch_destroy(hashtable_epoch_t *ep) {
+
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+}
+
+
+
+/**
+ * @brief Registers the calling thread. The thread starts online and must announce quiescent states until it unregisters or
+ * goes offline.
+ * 
+ * @param ep 
+ * @return int32_t the thread's slot or -1 if every slot is taken
+ */
+int32_t hashtable_epoch_register(hashtable_epoch_t *ep) {
+
+    int32_t id = -1;
+
+    pthread_mutex_lock(&ep->lock);
+    for(uint32_t i = 0; i < HASHTABLE_EPOCH_MAXTHREADS; i++) {
+        if(ep->threads[i].used == false) {
+            ep->threads[i].used = true;
+            __atomic_store_n(&ep->threads[i].epoch, __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+            id = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ep->lock);
+
+    return id;
+}
+
+
+
+/**
+ * @brief Unregisters a thread. It must not hold references into any table.
+ * 
+ * @param ep 
+ * @param id 
+ */
+void hashtable_epoch_unregister(hashtable_epoch_t *ep, int32_t id) {
+
+    pthread_mutex_lock(&ep->lock);
+    __atomic_store_n(&ep->threads[id].epoch, HASHTABLE_EPOCH_OFFLINE, __ATOMIC_RELEASE);
+    ep->threads[id].used = false;
+    pthread_mutex_unlock(&ep->lock);
+}
+
+
+
+/**
+ * @brief Announces a quiescent state, the calling thread holds no references from lookups made before this call.
+ * 
+ * @param ep 
+ * @param id 
+ */
+void hashtable_epoch_quiescent(hashtable_epoch_t *ep, int32_t id) {
+    __atomic_store_n(&ep->threads[id].epoch, __atomic_load_n(&ep->global, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * @brief Takes a thread offline before it blocks, so an idle thread doesn't hold up reclamation.
+ * 
+ * @param ep 
+ * @param id 
+ */
+void hashtable_epoch_offline(hashtable_epoch_t *ep, int32_t id) {
+    __atomic_store_n(&ep->threads[id].epoch, HASHTABLE_EPOCH_OFFLINE, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * @brief Brings a thread back online. The store must be visible to writers before the thread reads any table, or a writer
+ * could see the thread offline and free memory the thread is about to read.
+ * 
+ * @param ep 
+ * @param id 
+ */
+void hashtable_epoch_online(hashtable_epoch_t *ep, int32_t id) {
+    __atomic_store_n(&ep->threads[id].epoch, __atomic_load_n(&ep->global, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+
+/**
+ * @brief Advances the global epoch and returns the oldest epoch an online thread has announced. Everything retired before that
+ * epoch can no longer be referenced.
+ * 
+ * @param ep 
+ * @return uint64_t 
+ */
+uint64_t hashtable_epoch_synchronize(hashtable_epoch_t *ep) {
+
+    uint64_t min = __atomic_add_fetch(&ep->global, 1, __ATOMIC_SEQ_CST);
+
+    for(uint32_t i = 0; i < HASHTABLE_EPOCH_MAXTHREADS; i++) {
+        uint64_t epoch = __atomic_load_n(&ep->threads[i].epoch, __ATOMIC_ACQUIRE);
+        if(epoch < min && ep->threads[i].used) {
+            min = epoch;
+        }
+    }
+    return min;
+}
+
+
+
+/**
+ * @brief Frees every retired allocation of a table that no reader can reference anymore.
+ * 
+ * @param table 
+ */
+void hashtable_reclaim(hashtable_t *table) {
+
+    if(table->nretired == 0) {
+        return;
+    }
+
+    uint64_t safe = (table->epoch != NULL) ? hashtable_epoch_synchronize(table->epoch) : HASHTABLE_EPOCH_OFFLINE;
+
+    /* Epochs only grow, so the allocations that can be freed are a prefix of the array */
+    uint32_t n = 0;
+    while(n < table->nretired && table->retired[n].epoch < safe) {
+        if(table->retired[n].type == HASHTABLE_RETIRED_ITEM) {
+            hashtable_item_free(table, table->retired[n].ptr);
+        }
+        else if(table->retired[n].type == HASHTABLE_RETIRED_TABLE) {
+            hashtable_delete(table->retired[n].ptr);
+        }
+        else {
+            free(table->retired[n].ptr);
+        }
+        n++;
+    }
+
+    table->nretired -= n;
+    memmove(table->retired, &table->retired[n], table->nretired * sizeof(hashtable_retired_t));
+}
+
+
+
+/**
+ * @brief Frees an allocation that has been unlinked from the table. With lock free readers the allocation is kept until every
+ * reader has passed a quiescent state. A table with a lazy free thread hands large entries and whole tables to it instead.
+ * 
+ * @param table 
+ * @param ptr 
+ * @param type HASHTABLE_RETIRED_ITEM, HASHTABLE_RETIRED_MEMORY or HASHTABLE_RETIRED_TABLE
+ */
+void hashtable_retire(hashtable_t *table, void *ptr, uint8_t type) {
+
+    if(table->lazyfree != NULL && hashtable_retire_lazy(table, &ptr, &type)) {
+        return;
+    }
+
+    if(table->epoch == NULL) {
+        if(type == HASHTABLE_RETIRED_ITEM) {
+            hashtable_item_free(table, ptr);
+        }
+        else if(type == HASHTABLE_RETIRED_TABLE) {
+            hashtable_delete(ptr);
+        }
+        else {
+            free(ptr);
+        }
+        return;
+    }
+
+    if(table->nretired == table->retiredcap) {
+        uint32_t cap = (table->retiredcap == 0) ? HASHTABLE_RETIRE_BATCH : table->retiredcap * 2;
+        hashtable_retired_t *retired = realloc(table->retired, cap * sizeof(hashtable_retired_t));
+        if(retired == NULL) {
+            /* Leaking is the only safe option left, a reader may still hold the allocation */
+            perror("[!]: Failed to retire allocation\n");
+            return;
+        }
+        table->retired = retired;
+        table->retiredcap = cap;
+    }
+
+    /* The unlink must be visible before the epoch is read, or a reader announcing this epoch could still find the allocation */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    table->retired[table->nretired].ptr = ptr;
+    table->retired[table->nretired].epoch = __atomic_load_n(&table->epoch->global, __ATOMIC_SEQ_CST);
+    table->retired[table->nretired].type = type;
+    table->nretired++;
+}
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            LAZY FREE
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Releases the queued allocations oldest first. An allocation with readers waits until every reader of its epoch domain
+ * has passed a quiescent state, like a retired allocation. Once stopped the thread empties the queue without waiting, nothing
+ * reads the tables anymore.
+ * 
+ * @param data hashtable_lazyfree_t
+ * @return void* 
+ */
+void *hashtable_lazyfree_worker(void *data) {
+
+    hashtable_lazyfree_t *lf = (hashtable_lazyfree_t *)data;
+
+    pthread_mutex_lock(&lf->lock);
+    while(true) {
+
+        while(TAILQ_EMPTY(&lf->queue) && lf->stop == false) {
+            pthread_cond_wait(&lf->pending, &lf->lock);
+        }
+        hashtable_lazyjob_t *job = TAILQ_FIRST(&lf->queue);
+        if(job == NULL) {
+            break;
+        }
+        bool stop = lf->stop;
+        pthread_mutex_unlock(&lf->lock);
+
+        /* Only this thread removes jobs, the first one stays first while writers queue more behind it */
+        if(stop == false && job->epoch != NULL && hashtable_epoch_synchronize(job->epoch) <= job->retired) {
+            usleep(HASHTABLE_LAZYFREE_WAIT);
+            pthread_mutex_lock(&lf->lock);
+            continue;
+        }
+        job->fn(job->ptr);
+
+        pthread_mutex_lock(&lf->lock);
+        TAILQ_REMOVE(&lf->queue, job, entries);
+        lf->pendingcount--;
+        lf->pendingbytes -= job->bytes;
+        lf->freed++;
+        lf->freedbytes += job->bytes;
+        free(job);
+    }
+    pthread_mutex_unlock(&lf->lock);
+
+    return NULL;
+}
+
+
+
+/**
+ * @brief Creates a lazy free thread with an empty queue.
+ * 
+ * @return hashtable_lazyfree_t* NULL if the thread couldn't be started
+ */
+hashtable_lazyfree_t *hashtable_lazyfree_create(void) {
+
+    hashtable_lazyfree_t *lf = (hashtable_lazyfree_t *)calloc(1, sizeof(hashtable_lazyfree_t));
+    if(lf == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&lf->lock, NULL);
+    pthread_cond_init(&lf->pending, NULL);
+    TAILQ_INIT(&lf->queue);
+
+    if(pthread_create(&lf->thread, NULL, hashtable_lazyfree_worker, lf) != 0) {
+        pthread_mutex_destroy(&lf->lock);
+        pthread_cond_destroy(&lf->pending);
+        free(lf);
+        return NULL;
+    }
+    return lf;
+}
+
+
+
+/**
+ * @brief Releases whatever is still queued and stops the thread. No thread may read the tables using it anymore.
+ * 
+ * @param lf 
+ */
+void hashtable_lazyfree_destroy(hashtable_lazyfree_t *lf) {
+
+    pthread_mutex_lock(&lf->lock);
+    lf->stop = true;
+    pthread_cond_signal(&lf->pending);
+    pthread_mutex_unlock(&lf->lock);
+    pthread_join(lf->thread, NULL);
+
+    pthread_mutex_destroy(&lf->lock);
+    pthread_cond_destroy(&lf->pending);
+    free(lf);
+}
+
+
+
+/**
+ * @brief Queues an allocation for the lazy free thread. Takes a lock for a few pointer stores, however large the allocation.
+ * 
+ * @param lf 
+ * @param epoch epoch domain of the readers that may still reference the allocation, NULL if there are none
+ * @param ptr 
+ * @param fn releases the allocation
+ * @param bytes size of the allocation, for the stats
+ * @return true 
+ * @return false if the allocation couldn't be queued, the caller still owns it
+ */
+bool hashtable_lazyfree_push(hashtable_lazyfree_t *lf, hashtable_epoch_t *epoch, void *ptr, hashtable_freefn fn, uint64_t bytes) {
+
+    hashtable_lazyjob_t *job = (hashtable_lazyjob_t *)malloc(sizeof(hashtable_lazyjob_t));
+    if(job == NULL) {
+        return false;
+    }
+    job->ptr = ptr;
+    job->fn = fn;
+    job->epoch = epoch;
+    job->bytes = bytes;
+
+    /* The unlink must be visible before the epoch is read, see hashtable_retire */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    job->retired = (epoch != NULL) ? __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST) : 0;
+
+    pthread_mutex_lock(&lf->lock);
+    TAILQ_INSERT_TAIL(&lf->queue, job, entries);
+    lf->pendingcount++;
+    lf->pendingbytes += bytes;
+    pthread_cond_signal(&lf->pending);
+    pthread_mutex_unlock(&lf->lock);
+
+    return true;
+}
+
+
+
+/**
+ * @brief Release method of a table handed to the lazy free thread.
+ * 
+ * @param table hashtable_t
+ */
+void hashtable_lazyfree_table(void *table) {
+    hashtable_delete((hashtable_t *)table);
+}
+
+
+
+/**
+ * @brief Hands a retired allocation to the table's lazy free thread if releasing it on the write path would take long: a whole
+ * table, or an entry of at least HASHTABLE_LAZYFREE_MINSIZE with an allocation of its own. An entry in a slab chunk goes back
+ * to its free list in O(1) and is left to hashtable_reclaim, so is a bucket array.
+ * 
+ * @param table 
+ * @param ptr may be changed to the allocation the table has to release itself
+ * @param type may be changed to the type of that allocation
+ * @return true if the lazy free thread took the allocation
+ */
+bool hashtable_retire_lazy(hashtable_t *table, void **ptr, uint8_t *type) {
+
+    if(*type == HASHTABLE_RETIRED_TABLE) {
+        return hashtable_lazyfree_push(table->lazyfree, table->epoch, *ptr, hashtable_lazyfree_table, hashtable_memory(*ptr));
+    }
+
+    size_t size = (*type == HASHTABLE_RETIRED_ITEM) ? hashtable_item_size(*ptr) : 0;
+    if(size < HASHTABLE_LAZYFREE_MINSIZE) {
+        return false;
+    }
+
+    void *allocation = *ptr;
+    if(table->slab != NULL && (allocation = hashtable_slab_detach(table->slab, *ptr, size)) == NULL) {
+        return false;
+    }
+    if(hashtable_lazyfree_push(table->lazyfree, table->epoch, allocation, free, size)) {
+        return true;
+    }
+
+    /* Off the slab already, the table releases it as a plain allocation */
+    *ptr = allocation;
+    *type = HASHTABLE_RETIRED_MEMORY;
+    return false;
+}
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            SWISS TABLE GROUPS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Returns a bitmask of the slots in a group whose control byte equals a given value.
+ * 
+ * @param group 
+ * @param c 
+ * @return uint32_t 
+ */
+uint32_t hashtable_group_match(const uint8_t *group, uint8_t c) {
+
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < HASHTABLE_GROUP_WIDTH; i++) {
+        if(group[i] == c) {
+            mask |= (1u << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+
+
+/**
+ * @brief Returns a bitmask of the slots in a group that are empty or deleted, i.e. free for an insert. Both have the high bit set.
+ * 
+ * @param group 
+ * @return uint32_t 
+ */
+uint32_t hashtable_group_matchfree(const uint8_t *group) {
+
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < HASHTABLE_GROUP_WIDTH; i++) {
+        if(group[i] & 0x80) {
+            mask |= (1u << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+
+
+/**
+ * @brief Allocates a control byte array and an entry array for a swiss table of a given capacity.
+ * 
+ * @param capacity 
+ * @param ctrl 
+ * @param slots 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_swiss_alloc(uint32_t capacity, uint8_t **ctrl, hashtable_bucket_item ***slots) {
+
+    /* Groups are loaded with aligned SSE2 loads */
+    if(posix_memalign((void **)ctrl, HASHTABLE_GROUP_WIDTH, capacity) != 0) {
+        return false;
+    }
+    memset(*ctrl, HASHTABLE_CTRL_EMPTY, capacity);
+
+    *slots = calloc(capacity, sizeof(hashtable_bucket_item *));
+    if(*slots == NULL) {
+        free(*ctrl);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * @brief Probes a swiss table array for a key. Groups are visited in triangular order which covers every group when the
+ * number of groups is a power of two. A group holding an empty slot ends the probe.
+ * 
+ * @param ctrl 
+ * @param slots 
+ * @param capacity 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @return int64_t slot index or -1 if not found
+ */
+int64_t hashtable_swiss_probe(uint8_t *ctrl, hashtable_bucket_item **slots, uint32_t capacity, char *key, uint32_t keylen, uint32_t hash) {
+
+    uint32_t groupmask = (capacity / HASHTABLE_GROUP_WIDTH) - 1;
+    uint32_t group = (hash >> 7) & groupmask;
+    uint8_t h2 = hash & 0x7F;
+
+    for(uint32_t i = 0; i <= groupmask; i++) {
+
+        uint8_t *g = &ctrl[group * HASHTABLE_GROUP_WIDTH];
+
+        /* Only entries with a matching fingerprint are dereferenced */
+        uint32_t match = hashtable_group_match(g, h2);
+        while(match != 0) {
+            uint32_t slot = (group * HASHTABLE_GROUP_WIDTH) + __builtin_ctz(match);
+            hashtable_bucket_item *n1 = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE);
+
+            /* A lock free reader racing a writer can see a control byte before its slot, the retry will sort it out */
+            if(n1 != NULL && n1->hash == hash && n1->keylen == keylen && memcmp(key, n1->key, keylen) == 0) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+
+        if(hashtable_group_match(g, HASHTABLE_CTRL_EMPTY) != 0) {
+            return -1;
+        }
+
+        group = (group + i + 1) & groupmask;
+    }
+
+    return -1;
+}
+
+
+
+/**
+ * @brief Places an entry in the first free slot along its probe sequence. Does not check for duplicates.
+ * 
+ * @param ctrl 
+ * @param slots 
+ * @param capacity 
+ * @param n1 
+ * @return int8_t 1 if a tombstone was reused, 0 if an empty slot was used, -1 if the array is full
+ */
+int8_t hashtable_swiss_place(uint8_t *ctrl, hashtable_bucket_item **slots, uint32_t capacity, hashtable_bucket_item *n1) {
+
+    uint32_t groupmask = (capacity / HASHTABLE_GROUP_WIDTH) - 1;
+    uint32_t group = (n1->hash >> 7) & groupmask;
+
+    for(uint32_t i = 0; i <= groupmask; i++) {
+
+        uint32_t match = hashtable_group_matchfree(&ctrl[group * HASHTABLE_GROUP_WIDTH]);
+        if(match != 0) {
+            uint32_t slot = (group * HASHTABLE_GROUP_WIDTH) + __builtin_ctz(match);
+            int8_t reused = (ctrl[slot] == HASHTABLE_CTRL_DELETED);
+            slots[slot] = n1;
+            ctrl[slot] = n1->hash & 0x7F;
+            return reused;
+        }
+
+        group = (group + i + 1) & groupmask;
+    }
+
+    return -1;
+}
+
+
+
+/**
+ * @brief Clears a slot. If the group still has an empty slot no probe sequence has ever continued past it, so the slot can be
+ * marked empty again instead of leaving a tombstone.
+ * 
+ * @param ctrl 
+ * @param slots 
+ * @param slot 
+ * @return true if a tombstone was left
+ * @return false 
+ */
+bool hashtable_swiss_clear(uint8_t *ctrl, hashtable_bucket_item **slots, uint32_t slot) {
+
+    uint8_t *g = &ctrl[slot & ~(HASHTABLE_GROUP_WIDTH - 1)];
+    slots[slot] = NULL;
+
+    if(hashtable_group_match(g, HASHTABLE_CTRL_EMPTY) != 0) {
+        ctrl[slot] = HASHTABLE_CTRL_EMPTY;
+        return false;
+    }
+
+    ctrl[slot] = HASHTABLE_CTRL_DELETED;
+    return true;
+}
+
+
+
+/**
+ * @brief Frees a swiss table array, along with every entry in it when freeentries is set.
+ * 
+ * @param ctrl 
+ * @param slots 
+ * @param capacity 
+ * @param freeentries 
+ */
+void hashtable_swiss_free(uint8_t *ctrl, hashtable_bucket_item **slots, uint32_t capacity, bool freeentries) {
+
+    for(uint32_t i = 0; freeentries && i < capacity; i++) {
+        if(slots[i] != NULL) {
+            free(slots[i]);
+        }
+    }
+    free(ctrl);
+    free(slots);
+}
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            TIMING WHEEL
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Creates an empty timing wheel whose last tick was now.
+ * 
+ * @param now unix time in seconds
+ * @return hashtable_wheel_t* 
+ */
+hashtable_wheel_t *hashtable_wheel_create(uint32_t now) {
+
+    /* An all zero list head is an empty list */
+    hashtable_wheel_t *wheel = (hashtable_wheel_t *)calloc(1, sizeof(hashtable_wheel_t));
+    if(wheel == NULL) {
+        return NULL;
+    }
+    wheel->now = now;
+    return wheel;
+}
+
+
+
+/**
+ * @brief Frees every pending timer and the wheel itself.
+ * 
+ * @param wheel 
+ */
+void hashtable_wheel_destroy(hashtable_wheel_t *wheel) {
+
+    for(uint32_t level = 0; level < HASHTABLE_WHEEL_LEVELS; level++) {
+        for(uint32_t slot = 0; slot < HASHTABLE_WHEEL_SLOTS; slot++) {
+            hashtable_timer_t *t1 = LIST_FIRST(&wheel->slots[level][slot]);
+            while(t1 != NULL) {
+                hashtable_timer_t *t2 = LIST_NEXT(t1, entries);
+                free(t1);
+                t1 = t2;
+            }
+        }
+    }
+    free(wheel);
+}
+
+
+
+/**
+ * @brief Places a timer in the slot of the lowest level whose range covers it. A timer that is already due fires on the next tick.
+ * 
+ * @param wheel 
+ * @param timer 
+ */
+void hashtable_wheel_place(hashtable_wheel_t *wheel, hashtable_timer_t *timer) {
+
+    uint32_t expire = (timer->expire > wheel->now) ? timer->expire : wheel->now + 1;
+
+    /* Beyond the range of the wheel, wait in the furthest slot and get placed again when it cascades */
+    if(expire - wheel->now >= HASHTABLE_WHEEL_RANGE) {
+        expire = wheel->now + HASHTABLE_WHEEL_RANGE - 1;
+    }
+
+    uint32_t delta = expire - wheel->now;
+    uint32_t level = 0;
+    while(level < HASHTABLE_WHEEL_LEVELS - 1 && delta >= (1u << (HASHTABLE_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    uint32_t slot = (expire >> (HASHTABLE_WHEEL_BITS * level)) & (HASHTABLE_WHEEL_SLOTS - 1);
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entries);
+}
+
+
+
+/**
+ * @brief Adds a timer for a key of the table, creating the table's wheel on first use.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @param expire unix time in seconds
+ * @return hashtable_timer_t* the timer, NULL on failure
+ */
+hashtable_timer_t *hashtable_wheel_add(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash, uint32_t expire) {
+
+    if(table->wheel == NULL) {
+        table->wheel = hashtable_wheel_create(hashtable_time());
+        if(table->wheel == NULL) {
+            return NULL;
+        }
+    }
+
+    hashtable_timer_t *timer = (hashtable_timer_t *)malloc(sizeof(hashtable_timer_t) + keylen);
+    if(timer == NULL) {
+        return NULL;
+    }
+    timer->expire = expire;
+    timer->hash = hash;
+    timer->keylen = keylen;
+    memcpy(timer->key, key, keylen);
+
+    hashtable_wheel_place(table->wheel, timer);
+    table->wheel->timers++;
+    table->timerbytes += sizeof(hashtable_timer_t) + keylen;
+
+    return timer;
+}
+
+
+
+/**
+ * @brief Frees a timer that fired or was taken out of the wheel.
+ * 
+ * @param table 
+ * @param timer 
+ */
+void hashtable_wheel_free(hashtable_t *table, hashtable_timer_t *timer) {
+
+    table->wheel->timers--;
+    table->timerbytes -= sizeof(hashtable_timer_t) + timer->keylen;
+    free(timer);
+}
+
+
+
+/**
+ * @brief Makes sure the timer of an entry fires by the time the entry expires. An entry without a timer gets one, a timer due
+ * after the expiry is moved up. A timer due before it is left alone, it is placed again for the expiry when it fires.
+ * 
+ * @param table 
+ * @param n1 
+ * @param expire unix time in seconds the entry expires at, 0 if it never does
+ * @return true 
+ * @return false if the timer couldn't be added
+ */
+bool hashtable_wheel_schedule(hashtable_t *table, hashtable_bucket_item *n1, uint32_t expire) {
+
+    if(expire == 0 || (n1->timer != NULL && n1->timer->expire <= expire)) {
+        return true;
+    }
+
+    if(n1->timer != NULL) {
+        LIST_REMOVE(n1->timer, entries);
+        n1->timer->expire = expire;
+        hashtable_wheel_place(table->wheel, n1->timer);
+        return true;
+    }
+
+    n1->timer = hashtable_wheel_add(table, n1->key, n1->keylen, n1->hash, expire);
+    return n1->timer != NULL;
+}
+
+
+
+/**
+ * @brief Advances the wheel by one tick. Cascades the levels whose slots wrapped around and takes the timers due at the new tick
+ * out of the wheel, the caller owns them and walks them with LIST_NEXT.
+ * 
+ * @param wheel 
+ * @return hashtable_timer_t* the first timer due, NULL if none
+ */
+hashtable_timer_t *hashtable_wheel_tick(hashtable_wheel_t *wheel) {
+
+    wheel->now++;
+    uint32_t now = wheel->now;
+
+    for(uint32_t level = 1; level < HASHTABLE_WHEEL_LEVELS; level++) {
+
+        /* A level only cascades when every level below it wrapped around */
+        if((now & ((1u << (HASHTABLE_WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+
+        struct hashtable_timer_list *list = &wheel->slots[level][(now >> (HASHTABLE_WHEEL_BITS * level)) & (HASHTABLE_WHEEL_SLOTS - 1)];
+        hashtable_timer_t *t1 = LIST_FIRST(list);
+        LIST_INIT(list);
+        while(t1 != NULL) {
+            hashtable_timer_t *t2 = LIST_NEXT(t1, entries);
+            /* Due right now, the slot of this tick is run next */
+            if(t1->expire <= now) {
+                LIST_INSERT_HEAD(&wheel->slots[0][now & (HASHTABLE_WHEEL_SLOTS - 1)], t1, entries);
+            }
+            else {
+                hashtable_wheel_place(wheel, t1);
+            }
+            t1 = t2;
+        }
+    }
+
+    struct hashtable_timer_list *slot = &wheel->slots[0][now & (HASHTABLE_WHEEL_SLOTS - 1)];
+    hashtable_timer_t *due = LIST_FIRST(slot);
+    LIST_INIT(slot);
+    return due;
+}
+
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            TABLE
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Creates a hash table of a given type (HASHTABLE_TYPE_CHAINED or HASHTABLE_TYPE_SWISS). The size is rounded up to a power of two.
+ * 
+ * @param size 
+ * @param hashmethod 
+ * @param type 
+ * @return hashtable_t* 
+ */
+hashtable_t * hashtable_create_type(uint32_t size, hashtable_hashmethod hashmethod, uint8_t type) {
+
+    hashtable_t *table = NULL;
+
+    table = (hashtable_t *) calloc (1, sizeof(hashtable_t));
+
+    /* Failed to allocate new hash table */
+    if(table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    table->type = type;
+    table->size = hashtable_nextpower(size);
+    table->count = 0;
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+
+        /* A swiss table holds at least one full group */
+        if(table->size < HASHTABLE_GROUP_WIDTH) {
+            table->size = HASHTABLE_GROUP_WIDTH;
+        }
+        if(hashtable_swiss_alloc(table->size, &table->ctrl, &table->slots) == false) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+
+        /* An all zero bucket is an empty list, so calloc initializes every bucket */
+        table->buckets = calloc(table->size, sizeof(hashtable_bucket_t));
+        if(table->buckets == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    table->minsize = table->size;
+    table->rehash_size = 0;
+    table->rehash_buckets = NULL;
+    table->rehashidx = -1;
+
+    table->hashmethod = hashmethod;
+
+    return table;
+
+}
+
+
+
+/**
+ * @brief Creates a hash table by allocating memory for a specified number of buckets. The size is rounded up to a power of two.
+ * 
+ * @param size 
+ * @param hashmethod 
+ * @return hashtable_t* 
+ */
+hashtable_t * hashtable_create(uint32_t size, hashtable_hashmethod hashmethod) {
+
+    return hashtable_create_type(size, hashmethod, HASHTABLE_TYPE_CHAINED);
+
+}
+
+
+
+/**
+ * @brief Sets the seed passed to the table's hash method. Must be called before the first insert.
+ * 
+ * @param table 
+ * @param seed 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_setseed(hashtable_t *table, uint64_t seed) {
+
+    if(table->count != 0) {
+        return false;
+    }
+
+    table->seed = seed;
+    return true;
+}
+
+
+
+/**
+ * @brief Makes the table allocate its entries from its own slab allocator. Must be called before the first insert.
+ * 
+ * @param table 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_enableslab(hashtable_t *table) {
+
+    if(table->count != 0 || table->slab != NULL) {
+        return false;
+    }
+
+    table->slab = hashtable_slab_create();
+    return table->slab != NULL;
+}
+
+
+
+/**
+ * @brief Sets what an access records in an entry, the recency (HASHTABLE_EVICT_LRU) or the frequency (HASHTABLE_EVICT_LFU) used
+ * to pick entries to evict. Must be called before the first insert.
+ * 
+ * @param table 
+ * @param policy HASHTABLE_EVICT_*
+ * @return true 
+ * @return false 
+ */
+bool hashtable_setpolicy(hashtable_t *table, uint8_t policy) {
+
+    if(table->count != 0 || policy > HASHTABLE_EVICT_LFU) {
+        return false;
+    }
+
+    table->policy = policy;
+    return true;
+}
+
+
+
+/**
+ * @brief Installs a hook called whenever a key is linked into or removed from the table. Must be called before the first insert,
+ * keys already in the table are never passed to the hook.
+ * 
+ * @param table 
+ * @param hook NULL to remove the hook
+ * @param data passed to the hook
+ * @return true 
+ * @return false 
+ */
+bool hashtable_setkeyhook(hashtable_t *table, hashtable_keyhook hook, void *data) {
+
+    if(table->count != 0) {
+        return false;
+    }
+
+    table->keyhook = hook;
+    table->keyhookdata = data;
+    return true;
+}
+
+
+
+/**
+ * @brief Returns the bytes used by a table: every entry allocation along with the bucket (or control byte and slot) arrays,
+ * including the one being rehashed into, and the timing wheel with its timers. Retired allocations waiting for readers are not
+ * counted.
+ * 
+ * @param table 
+ * @return uint64_t 
+ */
+uint64_t hashtable_memory(hashtable_t *table) {
+
+    uint64_t slots = (uint64_t)table->size + table->rehash_size;
+    uint64_t arrays = 0;
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        arrays = slots * (sizeof(uint8_t) + sizeof(hashtable_bucket_item *));
+    }
+    else {
+        arrays = slots * sizeof(hashtable_bucket_t);
+    }
+
+    if(table->wheel != NULL) {
+        arrays += sizeof(hashtable_wheel_t);
+    }
+
+    return sizeof(hashtable_t) + arrays + table->itembytes + table->timerbytes;
+}
+
+
+
+/**
+ * @brief Deletes a hash table by freeing allocated buckets and finally the table itself.
+ * 
+ * @param table 
+ */
+void hashtable_delete(hashtable_t *table) {
+
+    /* Entries from a slab are released in bulk with their pages, no need to visit them */
+    bool freeentries = (table->slab == NULL);
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        hashtable_swiss_free(table->ctrl, table->slots, table->size, freeentries);
+        if(table->rehash_ctrl != NULL) {
+            hashtable_swiss_free(table->rehash_ctrl, table->rehash_slots, table->rehash_size, freeentries);
+        }
+    }
+    else {
+
+        /* Iterate over all buckets, then over each entry in the nested list */
+        for(uint32_t i = 0; freeentries && i < table->size; i++) {
+            hashbucket_delete(&table->buckets[i]);
+        }
+        free(table->buckets);
+
+        if(table->rehash_buckets != NULL) {
+            for(uint32_t i = 0; freeentries && i < table->rehash_size; i++) {
+                hashbucket_delete(&table->rehash_buckets[i]);
+            }
+            free(table->rehash_buckets);
+        }
+    }
+
+    if(table->wheel != NULL) {
+        hashtable_wheel_destroy(table->wheel);
+    }
+
+    /* Nobody may use the table anymore, so retired allocations can go straight away */
+    table->epoch = NULL;
+    hashtable_reclaim(table);
+    free(table->retired);
+
+    if(table->slab != NULL) {
+        hashtable_slab_destroy(table->slab);
+    }
+
+    free(table);
+}
+
+
+
+/**
+ * @brief Returns true if the table is in the middle of an incremental rehash.
+ * 
+ * @param table 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_isrehashing(hashtable_t *table) {
+    return table->rehashidx != -1;
+}
+
+
+
+/**
+ * @brief Starts an incremental rehash into a new bucket array of the given size. The entries are moved over by hashtable_rehashstep.
+ * A swiss table may be rehashed into an array of the same size to get rid of tombstones.
+ * 
+ * @param table 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_resize(hashtable_t *table, uint32_t size) {
+
+    if(hashtable_isrehashing(table)) {
+        return false;
+    }
+
+    size = hashtable_nextpower(size);
+    if(size < table->minsize) {
+        size = table->minsize;
+    }
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        if(hashtable_swiss_alloc(size, &table->rehash_ctrl, &table->rehash_slots) == false) {
+            return false;
+        }
+        table->tombstones = 0;
+        table->rehash_size = size;
+        table->rehashidx = 0;
+        return true;
+    }
+
+    if(size == table->size) {
+        return false;
+    }
+
+    hashtable_bucket_t *buckets = calloc(size, sizeof(hashtable_bucket_t));
+    if(buckets == NULL) {
+        /* Keep running on the current bucket array, the chains just get longer */
+        return false;
+    }
+
+    table->rehash_buckets = buckets;
+    table->rehash_size = size;
+    table->rehashidx = 0;
+
+    return true;
+}
+
+
+
+/**
+ * @brief Sizes an empty table for count entries up front, so filling it doesn't rehash along the way. The table may still shrink
+ * back to its initial size once entries are removed.
+ * 
+ * @param table 
+ * @param count 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_reserve(hashtable_t *table, uint32_t count) {
+
+    if(table->count != 0 || hashtable_isrehashing(table)) {
+        return false;
+    }
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+
+        /* Stay below the maximum load with a group to spare */
+        uint32_t size = hashtable_nextpower(((uint64_t)count * 8) / 7 + HASHTABLE_GROUP_WIDTH);
+        if(size <= table->size) {
+            return true;
+        }
+
+        uint8_t *ctrl = NULL;
+        hashtable_bucket_item **slots = NULL;
+        if(hashtable_swiss_alloc(size, &ctrl, &slots) == false) {
+            return false;
+        }
+        hashtable_retire(table, table->ctrl, HASHTABLE_RETIRED_MEMORY);
+        hashtable_retire(table, table->slots, HASHTABLE_RETIRED_MEMORY);
+        table->ctrl = ctrl;
+        table->slots = slots;
+        table->size = size;
+        table->tombstones = 0;
+        return true;
+    }
+
+    /* A chained table grows once count reaches the number of buckets */
+    uint32_t size = hashtable_nextpower((count < UINT32_MAX) ? count + 1 : count);
+    if(size <= table->size) {
+        return true;
+    }
+
+    hashtable_bucket_t *buckets = calloc(size, sizeof(hashtable_bucket_t));
+    if(buckets == NULL) {
+        return false;
+    }
+    hashtable_retire(table, table->buckets, HASHTABLE_RETIRED_MEMORY);
+    table->buckets = buckets;
+    table->size = size;
+    return true;
+}
+
+
+
+/**
+ * @brief Migrates n groups of a swiss table into the new array. Migrated slots are left as tombstones so probes in the old array
+ * still walk past them to entries that have not been migrated yet.
+ * 
+ * @param table 
+ * @param n 
+ * @return true if there is still more to rehash
+ * @return false 
+ */
+bool hashtable_swiss_rehashstep(hashtable_t *table, uint32_t n) {
+
+    while(n > 0 && table->rehashidx < table->size) {
+
+        for(uint32_t i = 0; i < HASHTABLE_GROUP_WIDTH; i++) {
+            uint32_t slot = table->rehashidx + i;
+            if(table->slots[slot] != NULL) {
+                hashtable_swiss_place(table->rehash_ctrl, table->rehash_slots, table->rehash_size, table->slots[slot]);
+                table->slots[slot] = NULL;
+                table->ctrl[slot] = HASHTABLE_CTRL_DELETED;
+            }
+        }
+
+        table->rehashidx += HASHTABLE_GROUP_WIDTH;
+        n--;
+    }
+
+    /* Old array is drained, swap in the new one */
+    if(table->rehashidx >= table->size) {
+        hashtable_retire(table, table->ctrl, HASHTABLE_RETIRED_MEMORY);
+        hashtable_retire(table, table->slots, HASHTABLE_RETIRED_MEMORY);
+        table->ctrl = table->rehash_ctrl;
+        table->slots = table->rehash_slots;
+        table->size = table->rehash_size;
+        table->rehash_ctrl = NULL;
+        table->rehash_slots = NULL;
+        table->rehash_size = 0;
+        table->rehashidx = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * @brief Migrates up to n buckets from the old bucket array into the new one. Visits at most n * HASHTABLE_REHASH_EMPTYVISITS empty
+ * buckets so a sparse old array can't turn a single operation into a long scan. Finishes the rehash once the old array is drained.
+ * 
+ * @param table 
+ * @param n 
+ * @return true if there is still more to rehash
+ * @return false 
+ */
+bool hashtable_rehashstep(hashtable_t *table, uint32_t n) {
+
+    if(!hashtable_isrehashing(table)) {
+        return false;
+    }
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        return hashtable_swiss_rehashstep(table, n);
+    }
+
+    uint32_t emptyvisits = n * HASHTABLE_REHASH_EMPTYVISITS;
+    uint32_t mask = table->rehash_size - 1;
+
+    while(n > 0 && table->rehashidx < table->size) {
+
+        hashtable_bucket_t *bucket = &table->buckets[table->rehashidx];
+
+        if(LIST_EMPTY(&bucket->list)) {
+            table->rehashidx++;
+            if(--emptyvisits == 0) {
+                return true;
+            }
+            continue;
+        }
+
+        /* Move every entry in the bucket over to its bucket in the new array */
+        hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
+        while(n1 != NULL) {
+            hashtable_bucket_item *next = LIST_NEXT(n1, entries);
+            LIST_REMOVE(n1, entries);
+            LIST_INSERT_HEAD(&table->rehash_buckets[n1->hash & mask].list, n1, entries);
+            n1 = next;
+        }
+
+        table->rehashidx++;
+        n--;
+    }
+
+    /* Old bucket array is drained, swap in the new one */
+    if(table->rehashidx >= table->size) {
+        hashtable_retire(table, table->buckets, HASHTABLE_RETIRED_MEMORY);
+        table->buckets = table->rehash_buckets;
+        table->size = table->rehash_size;
+        table->rehash_buckets = NULL;
+        table->rehash_size = 0;
+        table->rehashidx = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * @brief Checks the load factor and starts growing or shrinking the table if it is out of bounds.
+ * 
+ * @param table 
+ */
+void hashtable_checkresize(hashtable_t *table) {
+
+    if(hashtable_isrehashing(table)) {
+        return;
+    }
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+
+        if(table->count + table->tombstones >= HASHTABLE_SWISS_MAXLOAD(table->size)) {
+            /* Mostly tombstones, rebuild at the same size. Otherwise double. */
+            if(table->count * 2 < HASHTABLE_SWISS_MAXLOAD(table->size)) {
+                hashtable_resize(table, table->size);
+            }
+            else {
+                hashtable_resize(table, table->size * 2);
+            }
+        }
+        else if(table->size > table->minsize && (uint64_t)table->count * HASHTABLE_MIN_FILL < table->size) {
+            /* Leave room for the inserts that can happen while the old array is migrated, one per group */
+            hashtable_resize(table, (table->count + (table->size / HASHTABLE_GROUP_WIDTH)) * 2);
+        }
+        return;
+    }
+
+    if(table->count >= (uint64_t)table->size * HASHTABLE_MAX_LOADFACTOR) {
+        hashtable_resize(table, table->size * 2);
+    }
+    else if(table->size > table->minsize && (uint64_t)table->count * HASHTABLE_MIN_FILL < table->size) {
+        hashtable_resize(table, table->count);
+    }
+}
+
+
+
+/**
+ * @brief Default hash method of the hash table, wyhash. See hash.h.
+ * 
+ * @param key 
+ * @param len 
+ * @param seed 
+ * @return uint64_t 
+ */
+uint64_t hashtable_hash(const void *key, size_t len, uint64_t seed) {
+    return hash_wyhash(key, len, seed);
+}
+
+
+
+/**
+ * @brief Finds the slot holding the entry for a key in a swiss table, checking the array receiving inserts last.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @return hashtable_bucket_item** the slot or NULL
+ */
+hashtable_bucket_item **hashtable_swiss_ref(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash) {
+
+    int64_t slot = hashtable_swiss_probe(table->ctrl, table->slots, table->size, key, keylen, hash);
+    if(slot >= 0) {
+        return &table->slots[slot];
+    }
+
+    if(hashtable_isrehashing(table)) {
+        slot = hashtable_swiss_probe(table->rehash_ctrl, table->rehash_slots, table->rehash_size, key, keylen, hash);
+        if(slot >= 0) {
+            return &table->rehash_slots[slot];
+        }
+    }
+    return NULL;
+}
+
+
+
+/**
+ * @brief Finds the entry for a key given its precalculated hash.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @return hashtable_bucket_item* 
+ */
+hashtable_bucket_item *hashtable_find(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash) {
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        hashtable_bucket_item **ref = hashtable_swiss_ref(table, key, keylen, hash);
+        return (ref != NULL) ? *ref : NULL;
+    }
+
+    /* While rehashing the key is either in a bucket of the old array that hasn't been migrated yet or in the new array */
+    for(uint32_t i = 0; i < 2; i++) {
+
+        hashtable_bucket_t *bucket = NULL;
+        if(i == 0) {
+            uint32_t index = hash & (table->size - 1);
+            if(hashtable_isrehashing(table) && index < table->rehashidx) {
+                continue;
+            }
+            bucket = &table->buckets[index];
+        }
+        else {
+            if(!hashtable_isrehashing(table)) {
+                break;
+            }
+            bucket = &table->rehash_buckets[hash & (table->rehash_size - 1)];
+        }
+
+        /* The list in the bucket may have multiple entries due to collisions, thus we iterate over each list entry to find our entry */
+        hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
+        while (n1 != NULL) {
+            if( n1->hash == hash && n1->keylen == keylen && memcmp(key, n1->key, keylen) == 0) {
+                return n1;
+            }
+            n1 = LIST_NEXT(n1, entries);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/**
+ * @brief Performs a lookup in the hash table
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @return hashtable_bucket_item* 
+ */
+hashtable_bucket_item *hashtable_lookup(hashtable_t *table, char *key, uint32_t keylen) {
+
+    /* Perform a step of incremental rehashing */
+    hashtable_rehashstep(table, HASHTABLE_REHASH_STEPS);
+
+    /* Calculate hash  */
+    uint32_t hash = table->hashmethod(key, keylen, table->seed);
+
+    hashtable_bucket_item *n1 = hashtable_find(table, key, keylen, hash);
+    if(n1 == NULL) {
+        return NULL;
+    }
+
+    /* Expired keys are removed when they are found */
+    if(hashtable_item_expired(n1)) {
+        hashtable_remove_hashed(table, key, keylen, hash);
+        return NULL;
+    }
+
+    if(table->policy != HASHTABLE_EVICT_NONE) {
+        hashtable_item_touch(table->policy, n1);
+    }
+    return n1;
+}
+
+
+
+/**
+ * @brief Links a new entry into the table. The caller must have checked that the key doesn't exist.
+ * 
+ * @param table 
+ * @param n1 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_link(hashtable_t *table, hashtable_bucket_item *n1) {
+
+    /* The entry must be fully written before a lock free reader can reach it */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+
+        /* While rehashing new entries always go into the new array */
+        int8_t r = -1;
+        if(hashtable_isrehashing(table)) {
+            r = hashtable_swiss_place(table->rehash_ctrl, table->rehash_slots, table->rehash_size, n1);
+        }
+        else {
+            r = hashtable_swiss_place(table->ctrl, table->slots, table->size, n1);
+        }
+
+        if(r < 0) {
+            return false;
+        }
+        if(r == 1) {
+            table->tombstones--;
+        }
+    }
+    else {
+
+        /* Get bucket, while rehashing new entries always go into the new bucket array */
+        hashtable_bucket_t *bucket = NULL;
+        if(hashtable_isrehashing(table)) {
+            bucket = &table->rehash_buckets[n1->hash & (table->rehash_size - 1)];
+        }
+        else {
+            bucket = &table->buckets[n1->hash & (table->size - 1)];
+        }
+        LIST_INSERT_HEAD(&bucket->list, n1, entries);
+    }
+
+    table->count++;
+    hashtable_item_account(table, n1, true);
+    if(table->keyhook != NULL) {
+        table->keyhook(table->keyhookdata, n1->key, n1->keylen, true);
+    }
+
+    /* Grow the table if we are overspilling */
+    hashtable_checkresize(table);
+
+    return true;
+}
+
+
+
+/**
+ * @brief Inserts a key, value pair into a bucket placed the hash table. In case of collision the new kvp is stored as a linked list entry.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_insert(hashtable_t *table, char *key, uint32_t keylen, char *value, uint32_t valuelen) {
+
+    /* Perform a step of incremental rehashing */
+    hashtable_rehashstep(table, HASHTABLE_REHASH_STEPS);
+
+    /* Calculate hash  */
+    uint32_t hash = table->hashmethod(key, keylen, table->seed);
+
+    /* Check if key already exists, an expired key is removed to make way */
+    hashtable_bucket_item *n0 = hashtable_find(table, key, keylen, hash);
+    if(n0 != NULL) {
+        if(!hashtable_item_expired(n0)) {
+            // perror("[ERROR]: Key already exists in hash table\n");
+            return false;
+        }
+        hashtable_remove_hashed(table, key, keylen, hash);
+    }
+
+    /* Insert new item into list in bucket, key and value are stored in the same allocation */
+    hashtable_bucket_item *n1 = hashtable_item_create(table, key, keylen, value, valuelen, hash);
+    if(n1 == NULL) {
+        return false;
+    }
+
+    if(hashtable_link(table, n1) == false) {
+        hashtable_item_free(table, n1);
+        return false;
+    }
+
+    //printf("[*]: Inserted key %s at index: %d\n", key, index);
+
+    return true;
+
+}
+
+
+
+/**
+ * @brief Upserts a key, value pair given the key's precalculated hash. See hashtable_upsert.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param hash 
+ * @param expire unix time in seconds the key expires at, 0 if it never does
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_UPDATED or -1 on failure
+ */
+int8_t hashtable_upsert_hashed(hashtable_t *table, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t hash, uint32_t expire) {
+
+    /* Perform a step of incremental rehashing */
+    hashtable_rehashstep(table, HASHTABLE_REHASH_STEPS);
+
+    hashtable_bucket_item **ref = NULL;
+    hashtable_bucket_item *n1 = NULL;
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        ref = hashtable_swiss_ref(table, key, keylen, hash);
+        n1 = (ref != NULL) ? *ref : NULL;
+    }
+    else {
+        n1 = hashtable_find(table, key, keylen, hash);
+    }
+
+    /* New key, the entry is only reachable through the timing wheel once it has a timer */
+    if(n1 == NULL) {
+        n1 = hashtable_item_create(table, key, keylen, value, valuelen, hash);
+        if(n1 == NULL) {
+            return -1;
+        }
+        n1->expire = expire;
+        if(hashtable_link(table, n1) == false) {
+            hashtable_item_free(table, n1);
+            return -1;
+        }
+        hashtable_wheel_schedule(table, n1, expire);
+        return HASHTABLE_UPSERT_INSERTED;
+    }
+
+    /* Existing key, overwrite the value in place if it fits along with its terminator */
+    if(valuelen < n1->valuecap) {
+        memcpy(HASHTABLE_ITEM_VALUE(n1), value, valuelen);
+        HASHTABLE_ITEM_VALUE(n1)[valuelen] = '\x00';
+        table->valuebytes = table->valuebytes - n1->valuelen + valuelen;
+        table->expires = table->expires - (n1->expire != 0) + (expire != 0);
+        n1->valuelen = valuelen;
+        __atomic_store_n(&n1->expire, expire, __ATOMIC_RELAXED);
+        hashtable_wheel_schedule(table, n1, expire);
+        hashtable_item_touch(table->policy, n1);
+        return HASHTABLE_UPSERT_UPDATED;
+    }
+
+    /* Otherwise swap in a larger entry where the old one was */
+    hashtable_bucket_item *n2 = hashtable_item_create(table, key, keylen, value, valuelen, hash);
+    if(n2 == NULL) {
+        return -1;
+    }
+    n2->access = n1->access;
+    n2->expire = expire;
+    n2->timer = n1->timer;
+    n1->timer = NULL;
+    hashtable_wheel_schedule(table, n2, expire);
+    hashtable_item_touch(table->policy, n2);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        __atomic_store_n(ref, n2, __ATOMIC_RELEASE);
+    }
+    else {
+        LIST_INSERT_AFTER(n1, n2, entries);
+        LIST_REMOVE(n1, entries);
+    }
+    hashtable_item_account(table, n1, false);
+    hashtable_item_account(table, n2, true);
+    hashtable_retire(table, n1, HASHTABLE_RETIRED_ITEM);
+
+    return HASHTABLE_UPSERT_UPDATED;
+}
+
+
+
+/**
+ * @brief Inserts a key, value pair or overwrites the value if the key already exists. The key is hashed once and looked up once,
+ * an existing value is overwritten in place when the new value fits in the entry and otherwise the entry is swapped for a larger
+ * one at the same position.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_UPDATED or -1 on failure
+ */
+int8_t hashtable_upsert(hashtable_t *table, char *key, uint32_t keylen, char *value, uint32_t valuelen) {
+    return hashtable_upsert_hashed(table, key, keylen, value, valuelen, table->hashmethod(key, keylen, table->seed), 0);
+}
+
+
+
+/**
+ * @brief Removes an entry from a swiss table.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @return hashtable_bucket_item* the unlinked entry or NULL
+ */
+hashtable_bucket_item *hashtable_swiss_unlink(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash) {
+
+    hashtable_bucket_item *n1 = NULL;
+
+    int64_t slot = hashtable_swiss_probe(table->ctrl, table->slots, table->size, key, keylen, hash);
+    if(slot >= 0) {
+        n1 = table->slots[slot];
+        bool tombstone = hashtable_swiss_clear(table->ctrl, table->slots, slot);
+        /* Tombstones are only counted for the array that receives inserts */
+        if(tombstone && !hashtable_isrehashing(table)) {
+            table->tombstones++;
+        }
+        return n1;
+    }
+
+    if(hashtable_isrehashing(table)) {
+        slot = hashtable_swiss_probe(table->rehash_ctrl, table->rehash_slots, table->rehash_size, key, keylen, hash);
+        if(slot >= 0) {
+            n1 = table->rehash_slots[slot];
+            if(hashtable_swiss_clear(table->rehash_ctrl, table->rehash_slots, slot)) {
+                table->tombstones++;
+            }
+        }
+    }
+
+    return n1;
+}
+
+
+
+/**
+ * @brief Removes a key, value pair from the hash table given the key's precalculated hash. Returns false for a key that had
+ * expired, after removing it.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @param hash 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_remove_hashed(hashtable_t *table, char *key, uint32_t keylen, uint32_t hash) {
+
+    /* Perform a step of incremental rehashing */
+    hashtable_rehashstep(table, HASHTABLE_REHASH_STEPS);
+
+    hashtable_bucket_item *n1 = NULL;
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        n1 = hashtable_swiss_unlink(table, key, keylen, hash);
+    }
+    else {
+        n1 = hashtable_find(table, key, keylen, hash);
+        if(n1 != NULL) {
+            LIST_REMOVE(n1, entries);
+        }
+    }
+
+    /* Check if key exists */
+    if(n1 == NULL) {
+        // perror("[ERROR]: Key doesn't exists in hash table\n");
+        return false;
+    }
+
+    /* An expired key is removed all the same, but as far as the caller can tell it was already gone */
+    bool expired = hashtable_item_expired(n1);
+    if(expired) {
+        table->expired++;
+    }
+
+    hashtable_item_account(table, n1, false);
+    if(n1->timer != NULL) {
+        LIST_REMOVE(n1->timer, entries);
+        hashtable_wheel_free(table, n1->timer);
+        n1->timer = NULL;
+    }
+    if(table->keyhook != NULL) {
+        table->keyhook(table->keyhookdata, n1->key, n1->keylen, false);
+    }
+    hashtable_retire(table, n1, HASHTABLE_RETIRED_ITEM);
+
+    table->count--;
+
+    /* Shrink the table if it has become sparse */
+    hashtable_checkresize(table);
+
+    return !expired;
+
+}
+
+
+
+/**
+ * @brief Removes a key, value pair from the hash table.
+ * 
+ * @param table 
+ * @param key 
+ * @param keylen 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_remove(hashtable_t *table, char *key, uint32_t keylen) {
+    return hashtable_remove_hashed(table, key, keylen, table->hashmethod(key, keylen, table->seed));
+}
+
+
+
+/**
+ * @brief Collects up to n entries close to a random position of the table. Visits at most n * HASHTABLE_EVICT_MAXVISITS buckets
+ * (or slots), so a sparse table may return fewer. While rehashing both arrays are sampled, they are walked as if they were one.
+ * 
+ * @param table 
+ * @param samples receives the entries
+ * @param n 
+ * @return uint32_t number of entries collected
+ */
+uint32_t hashtable_sample(hashtable_t *table, hashtable_bucket_item **samples, uint32_t n) {
+
+    if(table->count == 0) {
+        return 0;
+    }
+
+    uint64_t total = (uint64_t)table->size + table->rehash_size;
+    uint64_t index = hashtable_random() % total;
+    uint32_t visits = n * HASHTABLE_EVICT_MAXVISITS;
+    uint32_t found = 0;
+
+    while(found < n && visits > 0) {
+
+        /* Positions past the end of the old array belong to the array being rehashed into */
+        bool old = (index < table->size);
+        uint32_t i = old ? index : index - table->size;
+
+        if(table->type == HASHTABLE_TYPE_SWISS) {
+            hashtable_bucket_item *n1 = old ? table->slots[i] : table->rehash_slots[i];
+            if(n1 != NULL) {
+                samples[found++] = n1;
+            }
+        }
+        else {
+            hashtable_bucket_t *bucket = old ? &table->buckets[i] : &table->rehash_buckets[i];
+            hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
+            while(n1 != NULL && found < n) {
+                samples[found++] = n1;
+                n1 = LIST_NEXT(n1, entries);
+            }
+        }
+
+        index = (index + 1) % total;
+        visits--;
+    }
+
+    return found;
+}
+
+
+
+/**
+ * @brief Runs the timing wheel up to now and removes the keys whose timers fired and that have really expired. A timer whose
+ * key lost its expiry since is dropped, one whose key was given a later expiry is placed again for it. Catches up at most
+ * HASHTABLE_WHEEL_MAXTICKS ticks per call.
+ * 
+ * @param table 
+ * @param now unix time in seconds
+ * @return uint32_t number of keys removed
+ */
+uint32_t hashtable_expire(hashtable_t *table, uint32_t now) {
+
+    if(table->wheel == NULL) {
+        return 0;
+    }
+
+    uint32_t removed = 0;
+    for(uint32_t ticks = 0; table->wheel->now < now && ticks < HASHTABLE_WHEEL_MAXTICKS; ticks++) {
+
+        hashtable_timer_t *t1 = hashtable_wheel_tick(table->wheel);
+        while(t1 != NULL) {
+            hashtable_timer_t *t2 = LIST_NEXT(t1, entries);
+
+            /* Every timer belongs to a live entry, removing an entry cancels its timer */
+            hashtable_bucket_item *n1 = hashtable_find(table, t1->key, t1->keylen, t1->hash);
+            if(n1 != NULL && n1->timer == t1 && n1->expire > table->wheel->now) {
+                t1->expire = n1->expire;
+                hashtable_wheel_place(table->wheel, t1);
+                t1 = t2;
                 continue;
             }
-            else {
-                hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
-                while (n1 != NULL) {
-                    printf("%s -> %s\n", n1->key, n1->value);
-                    n1 = LIST_NEXT(n1, entries);
+            if(n1 != NULL && n1->timer == t1) {
+                n1->timer = NULL;
+                if(n1->expire != 0) {
+                    hashtable_remove_hashed(table, t1->key, t1->keylen, t1->hash);
+                    removed++;
+                }
+            }
+
+            hashtable_wheel_free(table, t1);
+            t1 = t2;
+        }
+    }
+
+    return removed;
+}
+
+
+
+/**
+ * @brief Reverses the bits of a scan cursor.
+ * 
+ * @param v 
+ * @return uint32_t 
+ */
+uint32_t hashtable_scan_reverse(uint32_t v) {
+
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+    return __builtin_bswap32(v);
+}
+
+
+
+/**
+ * @brief Returns the number of cursor positions of an array: buckets of a chained table, groups of a swiss table.
+ * 
+ * @param table 
+ * @param size 
+ * @return uint32_t 
+ */
+uint32_t hashtable_scan_positions(hashtable_t *table, uint32_t size) {
+    return (table->type == HASHTABLE_TYPE_SWISS) ? size / HASHTABLE_GROUP_WIDTH : size;
+}
+
+
+
+/**
+ * @brief Passes every live entry whose home position in one of the arrays is index to the callback. In a swiss table those entries
+ * lie along the probe sequence of the group, which ends at the first group with an empty slot, just like a lookup.
+ * 
+ * @param table 
+ * @param rehash true for the array being rehashed into
+ * @param index 
+ * @param fn 
+ * @param data 
+ * @return uint32_t number of entries passed to the callback
+ */
+uint32_t hashtable_scan_visit(hashtable_t *table, bool rehash, uint32_t index, hashtable_scanfn fn, void *data) {
+
+    uint32_t found = 0;
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+
+        uint8_t *ctrl = rehash ? table->rehash_ctrl : table->ctrl;
+        hashtable_bucket_item **slots = rehash ? table->rehash_slots : table->slots;
+        uint32_t groupmask = hashtable_scan_positions(table, rehash ? table->rehash_size : table->size) - 1;
+        uint32_t group = index;
+
+        for(uint32_t i = 0; i <= groupmask; i++) {
+
+            for(uint32_t j = 0; j < HASHTABLE_GROUP_WIDTH; j++) {
+                hashtable_bucket_item *n1 = slots[(group * HASHTABLE_GROUP_WIDTH) + j];
+                if(n1 != NULL && ((n1->hash >> 7) & groupmask) == index && !hashtable_item_expired(n1)) {
+                    fn(data, n1);
+                    found++;
+                }
+            }
+
+            if(hashtable_group_match(&ctrl[group * HASHTABLE_GROUP_WIDTH], HASHTABLE_CTRL_EMPTY) != 0) {
+                break;
+            }
+            group = (group + i + 1) & groupmask;
+        }
+    }
+    else {
+
+        hashtable_bucket_t *bucket = rehash ? &table->rehash_buckets[index] : &table->buckets[index];
+        hashtable_bucket_item *n1 = NULL;
+        LIST_FOREACH(n1, &bucket->list, entries) {
+            if(!hashtable_item_expired(n1)) {
+                fn(data, n1);
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+
+/**
+ * @brief Visits a single cursor position of the table and returns the cursor of the next one, 0 once the whole table has been
+ * visited. Start with cursor 0.
+ * 
+ * The cursor is incremented from its high bit down (reverse binary), the way Redis scans its dictionary. Growing the table only
+ * splits every position into positions that come later in that order, and shrinking merges positions that were all visited
+ * already, so every entry present for the whole scan is returned at least once, however often the table is resized between
+ * calls. Entries may be returned more than once. While rehashing, the position of the smaller array is visited together with
+ * every position of the larger array it splits into.
+ * 
+ * @param table 
+ * @param cursor 
+ * @param fn 
+ * @param data 
+ * @param found incremented by the number of entries passed to the callback
+ * @return uint32_t 
+ */
+uint32_t hashtable_scan(hashtable_t *table, uint32_t cursor, hashtable_scanfn fn, void *data, uint32_t *found) {
+
+    uint32_t m0 = hashtable_scan_positions(table, table->size) - 1;
+
+    if(!hashtable_isrehashing(table)) {
+        *found += hashtable_scan_visit(table, false, cursor & m0, fn, data);
+    }
+    else {
+
+        /* Index 0 is the smaller of the two arrays */
+        uint32_t m1 = hashtable_scan_positions(table, table->rehash_size) - 1;
+        bool rehash0 = false;
+        if(m1 < m0) {
+            uint32_t m = m0;
+            m0 = m1;
+            m1 = m;
+            rehash0 = true;
+        }
+
+        *found += hashtable_scan_visit(table, rehash0, cursor & m0, fn, data);
+
+        /* Every position of the larger array that ends in the bits of the cursor */
+        uint32_t v = cursor;
+        do {
+            *found += hashtable_scan_visit(table, !rehash0, v & m1, fn, data);
+            v = (((v | m0) + 1) & ~m0) | (v & m0);
+        } while(v & (m0 ^ m1));
+    }
+
+    /* Set the bits above the mask so the increment carries out of them, then increment the reversed cursor */
+    cursor |= ~m0;
+    cursor = hashtable_scan_reverse(cursor);
+    cursor++;
+    return hashtable_scan_reverse(cursor);
+}
+
+
+
+/**
+ * @brief Prints the contents of a bucket array.
+ * 
+ * @param buckets 
+ * @param size 
+ */
+void hashtable_displaybuckets(hashtable_bucket_t *buckets, uint32_t size) {
+
+    for(uint32_t i = 0; i < size; i++) {
+
+        /* Get bucket */
+        hashtable_bucket_t *bucket = &buckets[i];
+
+        /* Check if list in bucket is empty or not */
+        if(LIST_EMPTY(&bucket->list)) {
+            continue;
+        }
+
+        hashtable_bucket_item *n1 = LIST_FIRST(&bucket->list);
+        while (n1 != NULL) {
+            printf("%s -> %s\n", n1->key, HASHTABLE_ITEM_VALUE(n1));
+            n1 = LIST_NEXT(n1, entries);
+        }
+    }
+}
+
+
+
+/**
+ * @brief Prints the contents of a swiss table array.
+ * 
+ * @param slots 
+ * @param capacity 
+ */
+void hashtable_displayslots(hashtable_bucket_item **slots, uint32_t capacity) {
+
+    for(uint32_t i = 0; i < capacity; i++) {
+        if(slots[i] != NULL) {
+            printf("%s -> %s\n", slots[i]->key, HASHTABLE_ITEM_VALUE(slots[i]));
+        }
+    }
+}
+
+
+
+void hashtable_display(hashtable_t *table) {
+
+    if(table->type == HASHTABLE_TYPE_SWISS) {
+        hashtable_displayslots(table->slots, table->size);
+        if(hashtable_isrehashing(table)) {
+            hashtable_displayslots(table->rehash_slots, table->rehash_size);
+        }
+        return;
+    }
+
+    hashtable_displaybuckets(table->buckets, table->size);
+
+    if(hashtable_isrehashing(table)) {
+        hashtable_displaybuckets(table->rehash_buckets, table->rehash_size);
+    }
+}
+
+
+
+
+/* 
+[**************************************************************************************************************************************************]
+                                                            SHARDED TABLE
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Creates a sharded hash table. Both the number of shards and the total initial size are rounded up to a power of two.
+ * 
+ * @param nshards 
+ * @param size 
+ * @param hashmethod 
+ * @param type 
+ * @return hashtable_sharded_t* 
+ */
+hashtable_sharded_t *hashtable_sharded_create(uint32_t nshards, uint32_t size, hashtable_hashmethod hashmethod, uint8_t type) {
+
+    hashtable_sharded_t *st = (hashtable_sharded_t *)malloc(sizeof(hashtable_sharded_t));
+    if(st == NULL) {
+        return NULL;
+    }
+
+    st->nshards = hashtable_nextpower(nshards);
+    st->shift = 32;
+    for(uint32_t n = st->nshards; n > 1; n >>= 1) {
+        st->shift--;
+    }
+    st->hashmethod = hashmethod;
+    st->seed = 0;
+    st->memory = sizeof(hashtable_sharded_t);
+    st->maxmemory = 0;
+    st->policy = HASHTABLE_EVICT_NONE;
+    st->evicted = 0;
+    st->sharedepoch = false;
+    st->lazyfree = NULL;
+    st->flushhook = NULL;
+    st->flushhookdata = NULL;
+
+    st->epoch = hashtable_epoch_create();
+    st->shards = (hashtable_shard_t *)aligned_alloc(sizeof(hashtable_shard_t), sizeof(hashtable_shard_t) * st->nshards);
+    if(st->shards == NULL || st->epoch == NULL) {
+        free(st->shards);
+        free(st->epoch);
+        free(st);
+        return NULL;
+    }
+
+    /* Split the initial size evenly between the shards */
+    uint32_t shardsize = hashtable_nextpower(size) / st->nshards;
+    if(shardsize < HASHTABLE_MIN_SIZE) {
+        shardsize = HASHTABLE_MIN_SIZE;
+    }
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        pthread_rwlock_init(&st->shards[i].lock, NULL);
+        st->shards[i].seq = 0;
+        st->shards[i].table = hashtable_create_type(shardsize, hashmethod, type);
+        if(st->shards[i].table == NULL) {
+            return NULL;
+        }
+        st->shards[i].table->epoch = st->epoch;
+        st->memory += hashtable_memory(st->shards[i].table);
+    }
+
+    return st;
+}
+
+
+
+/**
+ * @brief Sets the seed of the sharded table. The shard tables use the same seed, the low half of the hash that picked the shard
+ * is reused as their hash. Must be called before the first insert.
+ * 
+ * @param st 
+ * @param seed 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_setseed(hashtable_sharded_t *st, uint64_t seed) {
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        if(hashtable_setseed(st->shards[i].table, seed) == false) {
+            return false;
+        }
+    }
+    st->seed = seed;
+    return true;
+}
+
+
+
+/**
+ * @brief Makes every shard allocate its entries from its own slab allocator. Must be called before the first insert.
+ * 
+ * @param st 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_enableslab(hashtable_sharded_t *st) {
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        if(hashtable_enableslab(st->shards[i].table) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Limits the memory of the table, see hashtable_memory. Writes above the limit evict entries picked by the policy, or with
+ * HASHTABLE_EVICT_NONE are refused. Must be called before the first insert.
+ * 
+ * @param st 
+ * @param maxmemory bytes, 0 for no limit
+ * @param policy HASHTABLE_EVICT_*
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_setmaxmemory(hashtable_sharded_t *st, uint64_t maxmemory, uint8_t policy) {
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        if(hashtable_setpolicy(st->shards[i].table, policy) == false) {
+            return false;
+        }
+    }
+    st->policy = policy;
+    st->maxmemory = maxmemory;
+    return true;
+}
+
+
+
+/**
+ * @brief Installs the same key hook in every shard, see hashtable_setkeyhook. The hook runs with the shard's write lock held and
+ * may be called from several shards at once. Must be called before the first insert.
+ * 
+ * @param st 
+ * @param hook 
+ * @param data 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_setkeyhook(hashtable_sharded_t *st, hashtable_keyhook hook, void *data) {
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        if(hashtable_setkeyhook(st->shards[i].table, hook, data) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Makes the table use the epoch domain of another, so a thread registered with that table can read both without locks.
+ * The other table must outlive this one. Must be called before the first insert.
+ * 
+ * @param st 
+ * @param other 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_shareepoch(hashtable_sharded_t *st, hashtable_sharded_t *other) {
+
+    if(st->sharedepoch || st == other) {
+        return false;
+    }
+    hashtable_epoch_destroy(st->epoch);
+    st->epoch = other->epoch;
+    st->sharedepoch = true;
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        st->shards[i].table->epoch = other->epoch;
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Makes every shard hand large entries and flushed tables to a lazy free thread instead of releasing them on the write
+ * path. The thread must outlive the table. Must be called before any other thread uses the table.
+ * 
+ * @param st 
+ * @param lf NULL to release everything on the write path again
+ */
+void hashtable_sharded_setlazyfree(hashtable_sharded_t *st, hashtable_lazyfree_t *lf) {
+
+    st->lazyfree = lf;
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        st->shards[i].table->lazyfree = lf;
+    }
+}
+
+
+
+/**
+ * @brief Installs a hook called by every flush, see hashtable_flushhook. Must be called before any other thread uses the table.
+ * 
+ * @param st 
+ * @param hook NULL to remove the hook
+ * @param data passed to the hook
+ */
+void hashtable_sharded_setflushhook(hashtable_sharded_t *st, hashtable_flushhook hook, void *data) {
+
+    st->flushhook = hook;
+    st->flushhookdata = data;
+}
+
+
+
+/**
+ * @brief Deletes every shard and the sharded table itself. No other thread may use the table.
+ * 
+ * @param st 
+ */
+void hashtable_sharded_delete(hashtable_sharded_t *st) {
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        hashtable_delete(st->shards[i].table);
+        pthread_rwlock_destroy(&st->shards[i].lock);
+    }
+    if(st->sharedepoch == false) {
+        hashtable_epoch_destroy(st->epoch);
+    }
+    free(st->shards);
+    free(st);
+}
+
+
+
+/**
+ * @brief Returns the shard a 64 bit hash belongs to, picked by its high 32 bits.
+ * 
+ * @param st 
+ * @param hash 
+ * @return hashtable_shard_t* 
+ */
+hashtable_shard_t *hashtable_sharded_shard(hashtable_sharded_t *st, uint64_t hash) {
+
+    if(st->nshards == 1) {
+        return &st->shards[0];
+    }
+    return &st->shards[(uint32_t)(hash >> 32) >> st->shift];
+}
+
+
+
+/**
+ * @brief Locks a shard for writing and makes its sequence count odd, so lock free readers retry instead of trusting what they
+ * read while the table changes.
+ * 
+ * @param shard 
+ */
+void hashtable_shard_writebegin(hashtable_shard_t *shard) {
+
+    pthread_rwlock_wrlock(&shard->lock);
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * @brief Makes the sequence count of a shard even again, reclaims retired memory once enough has piled up and unlocks.
+ * 
+ * @param shard 
+ */
+void hashtable_shard_writeend(hashtable_shard_t *shard) {
+
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+
+    if(shard->table->nretired >= HASHTABLE_RETIRE_BATCH) {
+        hashtable_reclaim(shard->table);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+
+
+/**
+ * @brief Looks up a key without taking any lock and returns a copy of its value. The calling thread must be registered with the
+ * table's epoch domain and online. The copy must be freed by the caller.
+ * 
+ * @param st 
+ * @param key 
+ * @param keylen 
+ * @param valuelen set to the length of the value
+ * @return char* the value or NULL if the key doesn't exist
+ */
+char *hashtable_sharded_get(hashtable_sharded_t *st, char *key, uint32_t keylen, uint32_t *valuelen) {
+
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+    char *value = NULL;
+    uint32_t valuecap = 0;
+
+    while(true) {
+
+        uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            HASHTABLE_CPU_RELAX();
+            continue;
+        }
+
+        /* Work on a copy of the table header so sizes and arrays are read together, readers don't step the rehash */
+        hashtable_t table = *shard->table;
+        hashtable_bucket_item *n1 = hashtable_find(&table, key, keylen, (uint32_t)hash);
+
+        uint32_t len = 0;
+        bool expired = false;
+        if(n1 != NULL) {
+            expired = hashtable_item_expired(n1);
+            len = __atomic_load_n(&n1->valuelen, __ATOMIC_RELAXED);
+            if(len + 1 > valuecap) {
+                char *v = (char *)realloc(value, len + 1);
+                if(v == NULL) {
+                    free(value);
+                    return NULL;
                 }
+                value = v;
+                valuecap = len + 1;
+            }
+            memcpy(value, HASHTABLE_ITEM_VALUE(n1), len);
+        }
+
+        /* A writer got in the way, what was read may be torn */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        if(n1 == NULL) {
+            free(value);
+            return NULL;
+        }
+
+        /* Lookups can't remove, take the shard for a moment to get rid of the expired key */
+        if(expired) {
+            free(value);
+            hashtable_shard_writebegin(shard);
+            uint64_t before = hashtable_memory(shard->table);
+            n1 = hashtable_find(shard->table, key, keylen, (uint32_t)hash);
+            if(n1 != NULL && hashtable_item_expired(n1)) {
+                hashtable_remove_hashed(shard->table, key, keylen, (uint32_t)hash);
+            }
+            __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+            hashtable_shard_writeend(shard);
+            return NULL;
+        }
+
+        /* The entry may have been replaced since, but it can't have been freed while this thread is online */
+        if(st->policy != HASHTABLE_EVICT_NONE) {
+            hashtable_item_touch(st->policy, n1);
+        }
+
+        value[len] = '\x00';
+        *valuelen = len;
+        return value;
+    }
+}
+
+
+
+/**
+ * @brief Evicts a single entry: samples HASHTABLE_EVICT_SAMPLES entries of a random shard and removes the one the policy
+ * considers the best candidate. Shards that are empty or too sparse to sample are skipped for another random one.
+ * 
+ * @param st 
+ * @return true 
+ * @return false if no entry could be found
+ */
+bool hashtable_sharded_evict(hashtable_sharded_t *st) {
+
+    hashtable_bucket_item *samples[HASHTABLE_EVICT_SAMPLES];
+
+    for(uint32_t attempt = 0; attempt < st->nshards; attempt++) {
+
+        hashtable_shard_t *shard = &st->shards[hashtable_random() & (st->nshards - 1)];
+        bool evicted = false;
+
+        hashtable_shard_writebegin(shard);
+        uint64_t before = hashtable_memory(shard->table);
+
+        uint32_t n = hashtable_sample(shard->table, samples, HASHTABLE_EVICT_SAMPLES);
+        hashtable_bucket_item *victim = NULL;
+        uint32_t best = 0;
+        for(uint32_t i = 0; i < n; i++) {
+            uint32_t score = hashtable_item_evictscore(st->policy, samples[i]);
+            if(victim == NULL || score > best) {
+                victim = samples[i];
+                best = score;
             }
         }
+        if(victim != NULL) {
+            evicted = hashtable_remove_hashed(shard->table, victim->key, victim->keylen, victim->hash);
+        }
+
+        __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+        hashtable_shard_writeend(shard);
+
+        if(evicted) {
+            __atomic_add_fetch(&st->evicted, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/**
+ * @brief Evicts entries until the table is below its memory limit.
+ * 
+ * @param st 
+ * @return true if there is room for a write
+ * @return false if the table is over the limit and the policy doesn't evict or nothing is left to evict
+ */
+bool hashtable_sharded_makeroom(hashtable_sharded_t *st) {
+
+    while(st->maxmemory != 0 && __atomic_load_n(&st->memory, __ATOMIC_RELAXED) > st->maxmemory) {
+        if(st->policy == HASHTABLE_EVICT_NONE || hashtable_sharded_evict(st) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Inserts a key, value pair or overwrites the value if the key already exists. See hashtable_upsert.
+ * 
+ * @param st 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire unix time in seconds the key expires at, 0 if it never does
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_UPDATED, HASHTABLE_UPSERT_FULL or -1 on failure
+ */
+int8_t hashtable_sharded_upsert(hashtable_sharded_t *st, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+
+    /* Make room first, eviction takes the locks of other shards */
+    if(hashtable_sharded_makeroom(st) == false) {
+        return HASHTABLE_UPSERT_FULL;
+    }
+
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+
+    hashtable_shard_writebegin(shard);
+    uint64_t before = hashtable_memory(shard->table);
+    int8_t r = hashtable_upsert_hashed(shard->table, key, keylen, value, valuelen, (uint32_t)hash, expire);
+    __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+    hashtable_shard_writeend(shard);
+
+    return r;
+}
+
+
+
+/**
+ * @brief Inserts a key, value pair only if the key doesn't exist or has expired. The check and the insert happen under the
+ * shard's write lock, a concurrent upsert of the key is either seen or comes after.
+ * 
+ * @param st 
+ * @param key 
+ * @param keylen 
+ * @param value 
+ * @param valuelen 
+ * @param expire unix time in seconds the key expires at, 0 if it never does
+ * @return int8_t HASHTABLE_UPSERT_INSERTED, HASHTABLE_UPSERT_EXISTS, HASHTABLE_UPSERT_FULL or -1 on failure
+ */
+int8_t hashtable_sharded_insert(hashtable_sharded_t *st, char *key, uint32_t keylen, char *value, uint32_t valuelen, uint32_t expire) {
+
+    if(hashtable_sharded_makeroom(st) == false) {
+        return HASHTABLE_UPSERT_FULL;
+    }
+
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+
+    hashtable_shard_writebegin(shard);
+    int8_t r = HASHTABLE_UPSERT_EXISTS;
+    hashtable_bucket_item *n1 = hashtable_find(shard->table, key, keylen, (uint32_t)hash);
+    if(n1 == NULL || hashtable_item_expired(n1)) {
+        uint64_t before = hashtable_memory(shard->table);
+        r = hashtable_upsert_hashed(shard->table, key, keylen, value, valuelen, (uint32_t)hash, expire);
+        __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+
+        /* An expired entry was overwritten, to the caller the key is new */
+        r = (r >= 0) ? HASHTABLE_UPSERT_INSERTED : r;
+    }
+    hashtable_shard_writeend(shard);
+
+    return r;
+}
+
+
+
+/**
+ * @brief Removes a key, value pair.
+ * 
+ * @param st 
+ * @param key 
+ * @param keylen 
+ * @return true 
+ * @return false 
+ */
+bool hashtable_sharded_remove(hashtable_sharded_t *st, char *key, uint32_t keylen) {
+
+    uint64_t hash = st->hashmethod(key, keylen, st->seed);
+    hashtable_shard_t *shard = hashtable_sharded_shard(st, hash);
+
+    hashtable_shard_writebegin(shard);
+    uint64_t before = hashtable_memory(shard->table);
+    bool r = hashtable_remove_hashed(shard->table, key, keylen, (uint32_t)hash);
+    __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+    hashtable_shard_writeend(shard);
+
+    return r;
+}
+
+
+/**
+ * @brief Removes every key. Every shard gets a new empty table configured like its old one and the old tables are retired as a
+ * whole, to the lazy free thread if there is one (see hashtable_sharded_setlazyfree) or otherwise into the new tables, where a
+ * later write to the shard frees them. The shards are only write locked for the swap itself, lookups and writes wait for a few
+ * pointer stores instead of for every entry to be freed. The key hook isn't called for the removed keys, the flush hook is.
+ * 
+ * @param st 
+ * @return true 
+ * @return false if the new tables couldn't be created, the keys are left as they are
+ */
+bool hashtable_sharded_flush(hashtable_sharded_t *st) {
+
+    hashtable_t **tables = (hashtable_t **)calloc(st->nshards, sizeof(hashtable_t *));
+    if(tables == NULL) {
+        return false;
+    }
+
+    /* Create the new tables before any shard is write locked, the read lock only keeps a concurrent flush from freeing the old one */
+    bool ok = true;
+    for(uint32_t i = 0; ok && i < st->nshards; i++) {
+        pthread_rwlock_rdlock(&st->shards[i].lock);
+        hashtable_t *old = st->shards[i].table;
+        tables[i] = hashtable_create_type(old->minsize, st->hashmethod, old->type);
+        if(tables[i] == NULL) {
+            ok = false;
+            pthread_rwlock_unlock(&st->shards[i].lock);
+            break;
+        }
+        tables[i]->seed = old->seed;
+        tables[i]->policy = old->policy;
+        tables[i]->keyhook = old->keyhook;
+        tables[i]->keyhookdata = old->keyhookdata;
+        tables[i]->epoch = old->epoch;
+        tables[i]->lazyfree = old->lazyfree;
+        ok = (old->slab == NULL) || hashtable_enableslab(tables[i]);
+        pthread_rwlock_unlock(&st->shards[i].lock);
+    }
+    if(ok == false) {
+        for(uint32_t i = 0; i < st->nshards && tables[i] != NULL; i++) {
+            hashtable_delete(tables[i]);
+        }
+        free(tables);
+        return false;
+    }
+
+    /* In shard order like every other writer that holds more than one shard */
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        hashtable_shard_writebegin(&st->shards[i]);
+    }
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        hashtable_t *old = st->shards[i].table;
+        tables[i]->expired = old->expired;
+        __atomic_add_fetch(&st->memory, hashtable_memory(tables[i]) - hashtable_memory(old), __ATOMIC_RELAXED);
+        __atomic_store_n(&st->shards[i].table, tables[i], __ATOMIC_RELEASE);
+        tables[i] = old;
+    }
+    if(st->flushhook != NULL) {
+        st->flushhook(st->flushhookdata);
+    }
+
+    /* Lookups that started before the swap may still be walking the old tables */
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        hashtable_retire(st->shards[i].table, tables[i], HASHTABLE_RETIRED_TABLE);
+        hashtable_shard_writeend(&st->shards[i]);
+    }
+
+    free(tables);
+    return true;
+}
+
+
+
+/**
+ * @brief Returns the number of keys in all shards. Shards are counted one at a time, so the total is only exact when no
+ * other thread is writing.
+ * 
+ * @param st 
+ * @return uint64_t 
+ */
+uint64_t hashtable_sharded_count(hashtable_sharded_t *st) {
+
+    uint64_t count = 0;
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        pthread_rwlock_rdlock(&st->shards[i].lock);
+        count += st->shards[i].table->count;
+        pthread_rwlock_unlock(&st->shards[i].lock);
+    }
+    return count;
+}
+
+
+
+/**
+ * @brief Runs the timing wheel of every shard up to now, see hashtable_expire. Shards are locked one at a time, so lookups and
+ * writes on the other shards carry on while one shard expires its keys. Shards are peeked at without their lock, a table that
+ * can be flushed meanwhile must only be expired by a thread registered with its epoch domain and online.
+ * 
+ * @param st 
+ * @param now unix time in seconds
+ * @return uint64_t number of keys removed
+ */
+uint64_t hashtable_sharded_expire(hashtable_sharded_t *st, uint32_t now) {
+
+    uint64_t removed = 0;
+    for(uint32_t i = 0; i < st->nshards; i++) {
+
+        hashtable_shard_t *shard = &st->shards[i];
+
+        /* Peek without the lock first, most shards have nothing due most of the time */
+        hashtable_wheel_t *wheel = __atomic_load_n(&shard->table->wheel, __ATOMIC_RELAXED);
+        if(wheel == NULL || __atomic_load_n(&wheel->now, __ATOMIC_RELAXED) >= now) {
+            continue;
+        }
+
+        hashtable_shard_writebegin(shard);
+        uint64_t before = hashtable_memory(shard->table);
+        removed += hashtable_expire(shard->table, now);
+        __atomic_add_fetch(&st->memory, hashtable_memory(shard->table) - before, __ATOMIC_RELAXED);
+        hashtable_shard_writeend(shard);
+    }
+    return removed;
+}
+
+
+
+/**
+ * @brief Collects the memory accounting of every shard. Shards are read one at a time, like hashtable_sharded_count.
+ * 
+ * @param st 
+ * @param stats 
+ */
+void hashtable_sharded_stats(hashtable_sharded_t *st, hashtable_stats_t *stats) {
+
+    memset(stats, '\x00', sizeof(hashtable_stats_t));
+
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        pthread_rwlock_rdlock(&st->shards[i].lock);
+        stats->keys += st->shards[i].table->count;
+        stats->keybytes += st->shards[i].table->keybytes;
+        stats->valuebytes += st->shards[i].table->valuebytes;
+        stats->itembytes += st->shards[i].table->itembytes;
+        stats->expires += st->shards[i].table->expires;
+        stats->expired += st->shards[i].table->expired;
+        pthread_rwlock_unlock(&st->shards[i].lock);
+    }
+
+    stats->memory = __atomic_load_n(&st->memory, __ATOMIC_RELAXED);
+    stats->maxmemory = st->maxmemory;
+    stats->policy = st->policy;
+    stats->evicted = __atomic_load_n(&st->evicted, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * @brief Scans the table in batches, see hashtable_scan. Returns after the callback got at least count entries (a position is
+ * never split, so it may get a few more), after count * HASHTABLE_SCAN_MAXVISITS positions or at the end of the table. Only one
+ * shard is read locked at a time and only for a single batch, so writers wait for at most a batch and never for a whole scan.
+ * 
+ * The cursor holds the shard in its high 32 bits and the position within the shard in its low 32 bits.
+ * 
+ * @param st 
+ * @param cursor 0 to start a scan, otherwise the cursor returned by the previous call
+ * @param count 
+ * @param fn called with the shard's read lock held
+ * @param data 
+ * @return uint64_t the cursor of the next call, 0 once the whole table has been scanned
+ */
+uint64_t hashtable_sharded_scan(hashtable_sharded_t *st, uint64_t cursor, uint32_t count, hashtable_scanfn fn, void *data) {
+
+    uint32_t index = cursor >> 32;
+    uint32_t position = (uint32_t)cursor;
+    uint32_t visits = count * HASHTABLE_SCAN_MAXVISITS;
+    uint32_t found = 0;
+
+    while(index < st->nshards && found < count && visits > 0) {
+
+        hashtable_shard_t *shard = &st->shards[index];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        do {
+            position = hashtable_scan(shard->table, position, fn, data, &found);
+            visits--;
+        } while(position != 0 && found < count && visits > 0);
+        pthread_rwlock_unlock(&shard->lock);
+
+        if(position == 0) {
+            index++;
+        }
+    }
 
+    if(index >= st->nshards) {
+        return 0;
     }
+    return ((uint64_t)index << 32) | position;
 }
 
-   
 
-#endif
\ No newline at end of file
+
+#endif
@@ -15,6 +15,7 @@
 
 #include "common-defines.h"
 #include "hashtable.h"
+#include "hashmap.h"
 #include <regex.h>
 
 /* 
@@ -25,6 +26,12 @@
 
 #define MAX_NUMBER_HEADERS 36
 
+/* Forwarder address (IPv4 address << 16 | port, see forwarderaddr) to its index in the forwarder array */
+HASHMAP_DECLARE(addrmap, uint64_t, uint32_t, hashmap_hash_u64, hashmap_eq_int)
+
+/* Client descriptor to the connection being served on it */
+HASHMAP_DECLARE(fdmap, uint32_t, struct connection_t *, hashmap_hash_u32, hashmap_eq_int)
+
 /**
  * @brief Describes an instance of a server that the load balancer can forward to.
  * 
@@ -46,8 +53,9 @@ typedef struct forwarder_t {
 typedef struct servers_t {
     struct forwarder_t **forwarders;    /* An array of possible servers to forward to  */  
     size_t numberofservers;             /* Number of servers in the previous array      */
-    hashtable_t *ip_to_fd;              /* Hash table mapping IP to descriptor          */
-    hashtable_t *fd_to_ip;              /* Hash table mapping descriptor to IP          */
+    addrmap_t *addr_to_index;           /* Maps a forwarder address to its index        */
+    fdmap_t *fd_to_connection;          /* Maps a client descriptor to its connection, for connections in flight */
+    pthread_mutex_t lock;               /* Guards fd_to_connection                      */
 } servers_t;
 
 
@@ -92,8 +100,8 @@ typedef struct http_response_header_t {
 
 typedef struct http_response_t {
 
-    struct http_response_header_t **headers;          /* Maximum support of MAX_NUMBER_HEADERS headers */ // Replace with hash table instead 
-    hashtable_t *headers_table;
+    struct http_response_header_t **headers;          /* Maximum support of MAX_NUMBER_HEADERS headers */
+    headermap_t headers_table;                        /* Header name -> value, pointing into headers */
     size_t numberofheaders;
     size_t response_size;
 
@@ -116,5 +124,8 @@ int32_t sendHTTPError500(struct connection_t *connection, char *requestBuffer);
 int32_t pickforwarder(void);
 void * consumerForwardSingleRequest(void *data);
 size_t buffered_sr(struct connection_t *connection, struct forwarder_t *forwarder, int forwarderfd);
+uint64_t forwarderaddr(struct sockaddr_in *address);
+void connectionTrack(struct connection_t *connection);
+void connectionUntrack(struct connection_t *connection);
 
 #endif /* LOADBALANCER_H */
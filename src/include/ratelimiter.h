@@ -1,7 +1,7 @@
 /**
  * @file ratelimiter.h
  * @author Fruerlund
- * @brief 
+ * @brief Token bucket limiting how fast work, e.g. bytes sent over the network, is done.
  * @version 0.1
  * @date 2024-08-03
  * 
@@ -13,12 +13,140 @@
 #define RATELIMITER_H
 
 #include "common-defines.h"
+#include <time.h>
 
 
-/* 
+/*
 [**************************************************************************************************************************************************]
                                                             STRUCTUES AND PROTOTYPES
 [**************************************************************************************************************************************************]
 */
-#endif
 
+
+/**
+ * @brief A token bucket: tokens flow in at rate per second up to burst, and work of n units takes n tokens. Taking more tokens
+ * than the bucket holds is allowed and leaves a debt the caller waits out, so units larger than the burst still pass, at the
+ * rate. Safe to share between threads.
+ */
+typedef struct ratelimiter_bucket_t {
+
+    double rate;                            /*      Tokens per second, 0 for no limit               */
+    double burst;                           /*      Most tokens the bucket holds                    */
+    double tokens;                          /*      Tokens in the bucket, negative while in debt    */
+    uint64_t last;                          /*      Monotonic time in ns tokens were last added     */
+    uint64_t waited;                        /*      Nanoseconds callers were told to wait in total  */
+    pthread_mutex_t lock;
+
+} ratelimiter_bucket_t;
+
+
+static inline void ratelimiter_init(ratelimiter_bucket_t *b, double rate, double burst);
+static inline void ratelimiter_destroy(ratelimiter_bucket_t *b);
+static inline uint64_t ratelimiter_reserve(ratelimiter_bucket_t *b, double n);
+static inline void ratelimiter_wait(ratelimiter_bucket_t *b, double n);
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ * 
+ * @return uint64_t 
+ */
+static inline uint64_t ratelimiter_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+
+/**
+ * @brief Initializes a bucket that starts full.
+ * 
+ * @param b 
+ * @param rate tokens per second, 0 for no limit
+ * @param burst most tokens the bucket holds, at least 1
+ */
+static inline void ratelimiter_init(ratelimiter_bucket_t *b, double rate, double burst) {
+
+    b->rate = rate;
+    b->burst = (burst < 1) ? 1 : burst;
+    b->tokens = b->burst;
+    b->last = ratelimiter_now();
+    b->waited = 0;
+    pthread_mutex_init(&b->lock, NULL);
+}
+
+
+
+/**
+ * @brief Releases the resources of a bucket.
+ * 
+ * @param b 
+ */
+static inline void ratelimiter_destroy(ratelimiter_bucket_t *b) {
+    pthread_mutex_destroy(&b->lock);
+}
+
+
+
+/**
+ * @brief Takes n tokens and returns how long the caller has to wait before doing the work they pay for.
+ * 
+ * @param b 
+ * @param n 
+ * @return uint64_t nanoseconds to wait, 0 if the bucket had the tokens
+ */
+static inline uint64_t ratelimiter_reserve(ratelimiter_bucket_t *b, double n) {
+
+    if(b->rate <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    uint64_t now = ratelimiter_now();
+    b->tokens += (double)(now - b->last) * b->rate / 1e9;
+    if(b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+    b->last = now;
+    b->tokens -= n;
+
+    /* In debt, the caller waits until the rate has paid it back */
+    uint64_t wait = (b->tokens < 0) ? (uint64_t)(-b->tokens / b->rate * 1e9) : 0;
+    b->waited += wait;
+
+    pthread_mutex_unlock(&b->lock);
+    return wait;
+}
+
+
+
+/**
+ * @brief Takes n tokens and sleeps as long as the bucket says.
+ * 
+ * @param b 
+ * @param n 
+ */
+static inline void ratelimiter_wait(ratelimiter_bucket_t *b, double n) {
+
+    uint64_t wait = ratelimiter_reserve(b, n);
+    if(wait != 0) {
+        struct timespec ts = { wait / 1000000000ull, wait % 1000000000ull };
+        /* A signal cuts the sleep short, sleep the rest */
+        while(nanosleep(&ts, &ts) != 0) {
+            continue;
+        }
+    }
+}
+
+
+#endif
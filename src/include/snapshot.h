@@ -0,0 +1,494 @@
+/**
+ * @file snapshot.h
+ * @author Fruerlund
+ * @brief On disk snapshots of a sharded store table, laid out to be mapped into memory and imported with sequential reads.
+ * @version 0.1
+ * @date 2024-08-03
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "common-defines.h"
+#include "hashtable.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+#define SNAPSHOT_MAGIC              "DKVSNAP"   /*      First bytes of every snapshot, NUL included                         */
+#define SNAPSHOT_VERSION            1
+#define SNAPSHOT_BYTEORDER          0x01020304  /*      Reads back differently on a machine of the other byte order         */
+#define SNAPSHOT_BLOCKSIZE          (1024 * 1024)   /* Records are written in checksummed blocks of about this many bytes    */
+#define SNAPSHOT_CHECKSUMSEED       0x736e617073686f74ull   /* Seed of the wyhash checksums                             */
+
+/* Records are padded so the next record header is aligned */
+#define SNAPSHOT_ALIGN(n)           (((n) + 7) & ~(size_t)7)
+
+/*
+[**************************************************************************************************************************************************]
+                                                            STRUCTUES AND PROTOTYPES
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Describes a snapshot file. All integers are in the byte order of the machine that wrote it:
+ * 
+ * [ HEADER | BLOCK HEADER | RECORD | RECORD ... | BLOCK HEADER | RECORD ... ]
+ * 
+ * Every block holds records of a single shard. A record is a snapshot_record_t followed by the key and the value, padded to 8
+ * bytes. Records keep the hash of their key under the table's seed, so a table with the same seed and number of shards takes
+ * them back without hashing a single key.
+ */
+typedef struct snapshot_header_t {
+
+    char magic[8];                          /*      SNAPSHOT_MAGIC                                  */
+    uint32_t version;                       /*      SNAPSHOT_VERSION                                */
+    uint32_t byteorder;                     /*      SNAPSHOT_BYTEORDER                              */
+    uint64_t seed;                          /*      Hash seed of the table the records were hashed with */
+    uint32_t nshards;                       /*      Shards of the table the records were taken from */
+    uint32_t reserved;
+    uint64_t entries;                       /*      Records in the file                             */
+    uint64_t blocks;                        /*      Blocks in the file                              */
+    uint64_t bytes;                         /*      Size of the file                                */
+    uint64_t created;                       /*      Unix time the snapshot was taken                */
+    uint64_t checksum;                      /*      Of the header, with this field set to zero      */
+
+} snapshot_header_t;
+
+
+/**
+ * @brief Describes a block of records.
+ */
+typedef struct snapshot_block_t {
+
+    uint32_t shard;                         /*      Shard every record in the block belongs to      */
+    uint32_t entries;                       /*      Records in the block                            */
+    uint64_t bytes;                         /*      Bytes of records following the block header     */
+    uint64_t checksum;                      /*      Of the records                                  */
+
+} snapshot_block_t;
+
+
+/**
+ * @brief Describes a record, followed by keylen bytes of key and valuelen bytes of value.
+ */
+typedef struct snapshot_record_t {
+
+    uint32_t hash;                          /*      Low 32 bits of the hash of the key, as kept in the entry */
+    uint32_t keylen;
+    uint32_t valuelen;
+    uint32_t expire;                        /*      Unix time in seconds the key expires at, 0 if it never does */
+
+} snapshot_record_t;
+
+
+/**
+ * @brief Describes a snapshot while it is written. Records of a shard are serialized into the buffer with the shard locked and
+ * written to the file once it is unlocked, so writers never wait on the disk.
+ */
+typedef struct snapshot_writer_t {
+
+    int fd;
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    size_t block;                           /*      Offset of the block header being filled         */
+    uint32_t shard;
+    uint32_t now;                           /*      Expired keys are left out                       */
+    bool failed;                            /*      Set if the buffer couldn't grow                 */
+    snapshot_header_t header;
+
+} snapshot_writer_t;
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+
+/**
+ * @brief Computes the checksum of a header.
+ * 
+ * @param header 
+ * @return uint64_t 
+ */
+uint64_t snapshot_header_checksum(snapshot_header_t *header) {
+
+    snapshot_header_t copy = *header;
+    copy.checksum = 0;
+    return hash_wyhash(&copy, sizeof(snapshot_header_t), SNAPSHOT_CHECKSUMSEED);
+}
+
+
+
+/**
+ * @brief Makes sure the writer's buffer has room for size more bytes.
+ * 
+ * @param w 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool snapshot_reserve(snapshot_writer_t *w, size_t size) {
+
+    if(w->used + size <= w->capacity) {
+        return true;
+    }
+
+    size_t capacity = (w->capacity == 0) ? SNAPSHOT_BLOCKSIZE * 2 : w->capacity * 2;
+    while(capacity < w->used + size) {
+        capacity *= 2;
+    }
+    char *buffer = realloc(w->buffer, capacity);
+    if(buffer == NULL) {
+        w->failed = true;
+        return false;
+    }
+    w->buffer = buffer;
+    w->capacity = capacity;
+    return true;
+}
+
+
+
+/**
+ * @brief Starts a new block at the end of the buffer.
+ * 
+ * @param w 
+ * @return true 
+ * @return false 
+ */
+bool snapshot_block_begin(snapshot_writer_t *w) {
+
+    if(snapshot_reserve(w, sizeof(snapshot_block_t)) == false) {
+        return false;
+    }
+
+    w->block = w->used;
+    snapshot_block_t *block = (snapshot_block_t *)(w->buffer + w->block);
+    memset(block, '\x00', sizeof(snapshot_block_t));
+    block->shard = w->shard;
+    w->used += sizeof(snapshot_block_t);
+    return true;
+}
+
+
+
+/**
+ * @brief Scan callback, appends an entry to the current block and starts a new one once the block is full.
+ * 
+ * @param data 
+ * @param n1 
+ */
+void snapshot_collect(void *data, hashtable_bucket_item *n1) {
+
+    snapshot_writer_t *w = (snapshot_writer_t *)data;
+    size_t size = SNAPSHOT_ALIGN(sizeof(snapshot_record_t) + n1->keylen + n1->valuelen);
+
+    if(w->failed || (n1->expire != 0 && n1->expire <= w->now)) {
+        return;
+    }
+    if(snapshot_reserve(w, size + sizeof(snapshot_block_t)) == false) {
+        return;
+    }
+
+    snapshot_record_t *record = (snapshot_record_t *)(w->buffer + w->used);
+    record->hash = n1->hash;
+    record->keylen = n1->keylen;
+    record->valuelen = n1->valuelen;
+    record->expire = n1->expire;
+    memcpy((char *)(record + 1), n1->key, n1->keylen);
+    memcpy((char *)(record + 1) + n1->keylen, HASHTABLE_ITEM_VALUE(n1), n1->valuelen);
+    memset((char *)(record + 1) + n1->keylen + n1->valuelen, '\x00', size - sizeof(snapshot_record_t) - n1->keylen - n1->valuelen);
+    w->used += size;
+
+    snapshot_block_t *block = (snapshot_block_t *)(w->buffer + w->block);
+    block->entries++;
+    block->bytes += size;
+
+    if(block->bytes >= SNAPSHOT_BLOCKSIZE) {
+        snapshot_block_begin(w);
+    }
+}
+
+
+
+/**
+ * @brief Writes a whole buffer to a file.
+ * 
+ * @param fd 
+ * @param buffer 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool snapshot_writeall(int fd, char *buffer, size_t size) {
+
+    while(size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if(n < 0) {
+            return false;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+
+/**
+ * @brief Checksums the blocks in the buffer and writes them to the file, leaving an empty buffer. Empty blocks are dropped.
+ * 
+ * @param w 
+ * @return true 
+ * @return false 
+ */
+bool snapshot_flush(snapshot_writer_t *w) {
+
+    size_t offset = 0, out = 0;
+    while(offset < w->used) {
+
+        snapshot_block_t *block = (snapshot_block_t *)(w->buffer + offset);
+        size_t size = sizeof(snapshot_block_t) + block->bytes;
+
+        if(block->entries != 0) {
+            block->checksum = hash_wyhash(block + 1, block->bytes, SNAPSHOT_CHECKSUMSEED);
+            w->header.entries += block->entries;
+            w->header.blocks++;
+
+            /* Blocks are moved down over the empty ones so the buffer goes out in a single write */
+            if(out != offset) {
+                memmove(w->buffer + out, block, size);
+            }
+            out += size;
+        }
+        offset += size;
+    }
+
+    w->used = 0;
+    w->header.bytes += out;
+    return snapshot_writeall(w->fd, w->buffer, out);
+}
+
+
+
+/**
+ * @brief Writes a snapshot of the table. The file is written next to path and renamed over it once it is complete and synced,
+ * so a crash never leaves a partial snapshot behind. Shards are read locked one at a time while their entries are copied.
+ * The snapshot is consistent per shard, not across shards.
+ * 
+ * @param st 
+ * @param path 
+ * @param lock false if nothing else can change the table, e.g. in a child forked with every shard locked
+ * @param bytes set to the size of the file, may be NULL
+ * @return int64_t number of keys written, -1 on failure
+ */
+int64_t snapshot_save(hashtable_sharded_t *st, char *path, bool lock, uint64_t *bytes) {
+
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    snapshot_writer_t w;
+    memset(&w, '\x00', sizeof(snapshot_writer_t));
+    w.now = hashtable_time();
+    w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(w.fd < 0) {
+        return -1;
+    }
+
+    memcpy(w.header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    w.header.version = SNAPSHOT_VERSION;
+    w.header.byteorder = SNAPSHOT_BYTEORDER;
+    w.header.seed = st->seed;
+    w.header.nshards = st->nshards;
+    w.header.created = time(NULL);
+    w.header.bytes = sizeof(snapshot_header_t);
+
+    /* Leave room for the header, it is written last once the counts are known */
+    bool ok = (lseek(w.fd, sizeof(snapshot_header_t), SEEK_SET) == sizeof(snapshot_header_t));
+
+    for(uint32_t i = 0; ok && i < st->nshards; i++) {
+
+        w.shard = i;
+        if(snapshot_block_begin(&w) == false) {
+            ok = false;
+            break;
+        }
+
+        /* The shard can't resize while it is locked, so the scan returns every entry exactly once */
+        if(lock) {
+            pthread_rwlock_rdlock(&st->shards[i].lock);
+        }
+        uint32_t cursor = 0, found = 0;
+        do {
+            cursor = hashtable_scan(st->shards[i].table, cursor, snapshot_collect, &w, &found);
+        } while(cursor != 0);
+        if(lock) {
+            pthread_rwlock_unlock(&st->shards[i].lock);
+        }
+
+        ok = (w.failed == false) && snapshot_flush(&w);
+    }
+
+    if(ok) {
+        w.header.checksum = snapshot_header_checksum(&w.header);
+        ok = (pwrite(w.fd, &w.header, sizeof(snapshot_header_t), 0) == sizeof(snapshot_header_t)) && (fsync(w.fd) == 0);
+    }
+
+    close(w.fd);
+    free(w.buffer);
+
+    if(!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    if(bytes != NULL) {
+        *bytes = w.header.bytes;
+    }
+    return w.header.entries;
+}
+
+
+
+/**
+ * @brief Loads a snapshot into an empty table. The file is mapped and read front to back. Every block is checked against its
+ * checksum before any of its records is used. Each shard is sized for its keys up front and the entries come from the table's
+ * allocator, so loading does no per key malloc and never rehashes. If the table has the same number of shards the snapshot's seed
+ * is adopted and the stored hashes are used as they are, otherwise every key is hashed again. Keys that expired in the meantime
+ * are skipped. Must be called before any other thread uses the table.
+ * 
+ * @param st 
+ * @param path 
+ * @return int64_t number of keys loaded, -1 if the file is missing, damaged or of another version
+ */
+int64_t snapshot_load(hashtable_sharded_t *st, char *path) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct stat sb;
+    if(fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    /* Advice values are not flags, each needs its own call */
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    madvise(map, sb.st_size, MADV_WILLNEED);
+
+    snapshot_header_t *header = (snapshot_header_t *)map;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+       header->byteorder != SNAPSHOT_BYTEORDER || header->checksum != snapshot_header_checksum(header) ||
+       header->bytes != (uint64_t)sb.st_size) {
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    /* The stored hashes are only any good to a table that places keys the same way */
+    bool rehash = (header->nshards != st->nshards) || (hashtable_sharded_setseed(st, header->seed) == false);
+
+    /* First pass checks every block and counts the keys of every shard */
+    uint32_t *counts = calloc(header->nshards, sizeof(uint32_t));
+    if(counts == NULL) {
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    bool ok = true;
+    size_t offset = sizeof(snapshot_header_t);
+    for(uint64_t b = 0; ok && b < header->blocks; b++) {
+        snapshot_block_t *block = (snapshot_block_t *)(map + offset);
+        ok = (offset + sizeof(snapshot_block_t) <= (size_t)sb.st_size) && (block->bytes <= sb.st_size - offset - sizeof(snapshot_block_t)) &&
+             (block->shard < header->nshards) && (block->checksum == hash_wyhash(block + 1, block->bytes, SNAPSHOT_CHECKSUMSEED));
+        if(ok) {
+            counts[block->shard] += block->entries;
+            offset += sizeof(snapshot_block_t) + block->bytes;
+        }
+    }
+    if(!ok || offset != (size_t)sb.st_size) {
+        free(counts);
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    if(!rehash) {
+        for(uint32_t i = 0; i < st->nshards; i++) {
+            hashtable_reserve(st->shards[i].table, counts[i]);
+        }
+    }
+    free(counts);
+
+    /* Second pass imports the records */
+    uint32_t now = hashtable_time();
+    int64_t loaded = 0;
+    offset = sizeof(snapshot_header_t);
+    for(uint64_t b = 0; b < header->blocks; b++) {
+
+        snapshot_block_t *block = (snapshot_block_t *)(map + offset);
+        char *p = (char *)(block + 1);
+        char *end = p + block->bytes;
+        offset += sizeof(snapshot_block_t) + block->bytes;
+
+        while(p + sizeof(snapshot_record_t) <= end) {
+
+            snapshot_record_t *record = (snapshot_record_t *)p;
+            char *key = (char *)(record + 1);
+            size_t size = SNAPSHOT_ALIGN(sizeof(snapshot_record_t) + (size_t)record->keylen + record->valuelen);
+            if(size > (size_t)(end - p)) {
+                break;
+            }
+            p += size;
+
+            if(record->expire != 0 && record->expire <= now) {
+                continue;
+            }
+
+            hashtable_t *table = NULL;
+            uint32_t hash = record->hash;
+            if(rehash) {
+                uint64_t full = st->hashmethod(key, record->keylen, st->seed);
+                table = hashtable_sharded_shard(st, full)->table;
+                hash = (uint32_t)full;
+            }
+            else {
+                table = st->shards[block->shard].table;
+            }
+            if(hashtable_upsert_hashed(table, key, record->keylen, key + record->keylen, record->valuelen, hash, record->expire) >= 0) {
+                loaded++;
+            }
+        }
+    }
+
+    munmap(map, sb.st_size);
+
+    /* Nothing else runs yet, the memory of the table can be recounted from scratch */
+    uint64_t memory = 0;
+    for(uint32_t i = 0; i < st->nshards; i++) {
+        memory += hashtable_memory(st->shards[i].table);
+    }
+    __atomic_store_n(&st->memory, memory, __ATOMIC_RELAXED);
+
+    return loaded;
+}
+
+
+
+#endif
@@ -47,7 +47,7 @@ size_t readparseHTTPHeader(http_response_t *headers, int forwarderfd) {
     char endofheaderspattern[4] = {0x0d, 0x0a, 0x0d, 0x0a};
     size_t headerSize = 0;
 
-    headers->headers_table = hashtable_create(MAX_NUMBER_HEADERS, hashtable_hash);
+    headermap_init(&headers->headers_table);
     headers->numberofheaders = 0;
 
     while(true) {
@@ -91,16 +91,9 @@ size_t readparseHTTPHeader(http_response_t *headers, int forwarderfd) {
 
     }
 
-    /* Add headers to hash table for easy retrieval This is breaking code */
-    for(uint32_t i = 0; i < headers->numberofheaders; i++) {
-
-        char *h = strdup(headers->headers[i]->header);
-        char *field = strtok(h, ":");
-        char *value = strtok(NULL, ":");
-
-        if(field != NULL && value != NULL) {
-            hashtable_insert(headers->headers_table, field, value);
-        }
+    /* Add headers to hash table for easy retrieval, the status line isn't a header */
+    for(uint32_t i = 1; i < headers->numberofheaders; i++) {
+        headermap_putline(&headers->headers_table, headers->headers[i]->header, headers->headers[i]->header_size);
     }
 
     return headerSize;
@@ -210,6 +203,7 @@ size_t buffered_sr(struct connection_t *connection, struct forwarder_t *forwarde
 
     /* Close used sockets */
     close(forwarderfd);
+    connectionUntrack(connection);
     close(clientfd);
 
     /* Free allocated memory */
@@ -281,6 +275,49 @@ int32_t pickforwarder(void) {
 }
 
 
+/**
+ * @brief Packs the IPv4 address and port of a forwarder into the key of the address map.
+ * 
+ * @param address 
+ * @return uint64_t 
+ */
+uint64_t forwarderaddr(struct sockaddr_in *address) {
+    return ((uint64_t)ntohl(address->sin_addr.s_addr) << 16) | ntohs(address->sin_port);
+}
+
+
+/**
+ * @brief Remembers a connection as in flight, from the moment it is queued until its client descriptor is closed.
+ * 
+ * @param connection 
+ */
+void connectionTrack(struct connection_t *connection) {
+
+    pthread_mutex_lock(&servers.lock);
+    if(fdmap_put(servers.fd_to_connection, connection->clientfd, connection) == false) {
+        perror("[-]: Failed to track connection\n");
+    }
+    pthread_mutex_unlock(&servers.lock);
+}
+
+
+/**
+ * @brief Forgets an in flight connection. Must be called before its client descriptor is closed, the descriptor can be handed
+ * to a new connection right after.
+ * 
+ * @param connection 
+ */
+void connectionUntrack(struct connection_t *connection) {
+
+    pthread_mutex_lock(&servers.lock);
+    struct connection_t **tracked = fdmap_get(servers.fd_to_connection, connection->clientfd);
+    if(tracked != NULL && *tracked == connection) {
+        fdmap_remove(servers.fd_to_connection, connection->clientfd, NULL);
+    }
+    pthread_mutex_unlock(&servers.lock);
+}
+
+
 /**
  * @brief Returns a HTTP Reply with status code 500. Used to indicate internal server error in the case of application error.
  * 
@@ -302,6 +339,7 @@ int32_t sendHTTPError500(struct connection_t *connection, char *requestBuffer) {
     int len = strlen(reply);
 
     write(connection->clientfd, reply, len);
+    connectionUntrack(connection);
     close(connection->clientfd);
 
     free(requestBuffer);
@@ -402,6 +440,7 @@ void * producerHandleAccept(void *data) {
     }
 
     /* If request is a HTTP GET Request, obtain lock for request queue and enqueue the request for forwarding */
+    connectionTrack(connection);
     pthread_mutex_lock(&requests.write_lock);
     TAILQ_INSERT_HEAD(&requests.queue, connection, entries);
     requests.queue_size++;
@@ -560,6 +599,12 @@ bool setupForwardServers(struct servers_t *servers, char *serverData) {
         return false;
     }
 
+    /* A server given twice would get twice the share of requests */
+    if(addrmap_get(servers->addr_to_index, forwarderaddr(&address)) != NULL) {
+        printf("[-]: Server %s:%s is already added\n", ip, port);
+        return false;
+    }
+
     /* Create a socket descriptor */
     if ((socketfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         printf("[-]: Socket creation error \n");
@@ -598,8 +643,10 @@ bool setupForwardServers(struct servers_t *servers, char *serverData) {
     memcpy(&forwarder->address, &address, sizeof(struct sockaddr_in));
     
     servers->forwarders[servers->numberofservers] = forwarder;
+    addrmap_put(servers->addr_to_index, forwarderaddr(&address), servers->numberofservers);
     servers->numberofservers++;
 
+    return true;
 }
 
 
@@ -616,6 +663,18 @@ void teardown(void) {
 
     free(servers.forwarders);
 
+    /* Close the connections still in flight */
+    pthread_mutex_lock(&servers.lock);
+    for(uint32_t i = 0; i < servers.fd_to_connection->capacity; i++) {
+        if(servers.fd_to_connection->states[i] == HASHMAP_SLOT_FULL) {
+            close(servers.fd_to_connection->keys[i]);
+        }
+    }
+    pthread_mutex_unlock(&servers.lock);
+    fdmap_destroy(servers.fd_to_connection);
+    addrmap_destroy(servers.addr_to_index);
+    pthread_mutex_destroy(&servers.lock);
+
     /* Destroy mutexes */
     pthread_mutex_destroy(&requests.write_lock);
     pthread_mutex_destroy(&requests.write_lock);
@@ -662,8 +721,14 @@ int main(int argc, char **argv) {
     }
 
     /* Setup data structures for servers and open connections to the servers */
-    servers.forwarders = calloc( (size_t) (argc - 2), sizeof(struct forwarder_t *));
+    servers.forwarders = calloc( (size_t) (argc - 1), sizeof(struct forwarder_t *));
     servers.numberofservers = 0;
+    servers.addr_to_index = addrmap_create(argc - 1);
+    servers.fd_to_connection = fdmap_create(64);
+    if(servers.addr_to_index == NULL || servers.fd_to_connection == NULL || pthread_mutex_init(&servers.lock, NULL) != 0) {
+        perror("Failed to allocate server tables");
+        exit(EXIT_FAILURE);
+    }
 
     struct forwarder_t **forwarders = calloc( (size_t) (argc - 2), sizeof(struct forwarder_t *));
     for(uint32_t i = 1; i < argc; i++) {
@@ -0,0 +1,141 @@
+/**
+ * @file test-bitcask.c
+ * @author Fruerlund
+ * @brief Checks that the segments of a bitcask store come back as they were written after compaction and a restart.
+ * @version 0.1
+ * @date 2024-08-17
+ * 
+ * @copyright Copyright (c) 2024
+ * 
+ * 
+ * 
+*/
+
+#include "bitcask.h"
+
+/*
+[**************************************************************************************************************************************************]
+                                                            GLOBAL VARIABLES AND DEFINES
+[**************************************************************************************************************************************************]
+*/
+
+#define TEST_SHARDS         16
+#define TEST_TABLESIZE      1024
+#define TEST_FILLERSIZE     4096            /* Value keeping the first segment mostly live, so only the tombstone is compacted */
+#define TEST_WAIT           50              /* Compactor passes waited for at most */
+
+
+/*
+[**************************************************************************************************************************************************]
+                                                            METHODS / FUNCTIONS
+[**************************************************************************************************************************************************]
+*/
+
+
+/**
+ * @brief Opens the segments in dir with a new key directory, like a store that was just started.
+ * 
+ * @param dir 
+ * @param keydir set to the key directory
+ * @return bitcask_t* NULL on failure
+ */
+bitcask_t *test_open(char *dir, hashtable_sharded_t **keydir) {
+
+    int64_t replayed = 0;
+    uint64_t dropped = 0;
+    *keydir = hashtable_sharded_create(TEST_SHARDS, TEST_TABLESIZE, hashtable_hash, HASHTABLE_TYPE_CHAINED);
+    if(*keydir == NULL) {
+        return NULL;
+    }
+    return bitcask_open(*keydir, dir, 0, &replayed, &dropped);
+}
+
+
+
+/**
+ * @brief Closes the segments and the key directory, like a store that is stopped.
+ * 
+ * @param bc 
+ * @param keydir 
+ */
+void test_close(bitcask_t *bc, hashtable_sharded_t *keydir) {
+
+    bitcask_close(bc);
+    hashtable_sharded_delete(keydir);
+}
+
+
+
+/**
+ * @brief A key set, removed and set again in three segments. Compacting the segment with the tombstone carries it over to the
+ * active segment while the first segment is left, where it must not hide the value written after it when the segments are
+ * replayed.
+ * 
+ * @param dir 
+ * @return true 
+ * @return false 
+ */
+bool test_compact_tombstone(char *dir) {
+
+    hashtable_sharded_t *keydir = NULL;
+    bitcask_locator_t loc;
+    char filler[TEST_FILLERSIZE];
+    memset(filler, 'f', sizeof(filler));
+
+    /* Segment 0: the key and a large value that keeps the segment from being compacted */
+    bitcask_t *bc = test_open(dir, &keydir);
+    if(bc == NULL || bitcask_put(bc, "key", 3, "v1", 2, 0) < 0 || bitcask_put(bc, "filler", 6, filler, sizeof(filler), 0) < 0) {
+        return false;
+    }
+    test_close(bc, keydir);
+
+    /* Segment 1: only the tombstone */
+    bc = test_open(dir, &keydir);
+    if(bc == NULL || bitcask_remove(bc, "key", 3) == false) {
+        return false;
+    }
+    test_close(bc, keydir);
+
+    /* Segment 2: the key again, then wait for the compactor to take segment 1 */
+    bc = test_open(dir, &keydir);
+    if(bc == NULL || bitcask_put(bc, "key", 3, "v2", 2, 0) < 0) {
+        return false;
+    }
+    for(uint32_t i = 0; i < TEST_WAIT && __atomic_load_n(&bc->compactions, __ATOMIC_RELAXED) == 0; i++) {
+        usleep(BITCASK_COMPACTINTERVAL * 1000 / 10);
+    }
+    bool compacted = (__atomic_load_n(&bc->compactions, __ATOMIC_RELAXED) != 0);
+    test_close(bc, keydir);
+    if(compacted == false) {
+        printf("[!]: The segment with the tombstone was never compacted\n");
+        return false;
+    }
+
+    bc = test_open(dir, &keydir);
+    if(bc == NULL) {
+        return false;
+    }
+    bool found = bitcask_locate(bc, "key", 3, &loc) && loc.valuelen == 2;
+    test_close(bc, keydir);
+    return found;
+}
+
+
+
+int main(int argc, char *argv[]) {
+
+    char dir[] = "/tmp/test-bitcask-XXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        printf("[!]: Failed to create a directory for the segments\n");
+        return EXIT_FAILURE;
+    }
+
+    bool ok = test_compact_tombstone(dir);
+    printf("[%s]: A compacted tombstone doesn't hide a later value after a restart\n", ok ? "+" : "!");
+
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}